@@ -0,0 +1,39 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "batchnorm.h"
+
+#include <cmath>
+
+void InitBatchNormParams(float *params, int channels)
+{
+    for (int c = 0; c < channels; ++c)
+    {
+        params[BN_GAMMA * channels + c] = 1.0f;
+        params[BN_BETA * channels + c] = 0.0f;
+        params[BN_RUNNING_MEAN * channels + c] = 0.0f;
+        params[BN_RUNNING_VAR * channels + c] = 1.0f;
+    }
+}
+
+void FoldBatchNorm(float *weights, float *bias, int outputs, size_t fan_in, const float *params)
+{
+    for (int o = 0; o < outputs; ++o)
+    {
+        const float scale = params[BN_GAMMA * outputs + o] /
+                            sqrtf(params[BN_RUNNING_VAR * outputs + o] + BATCHNORM_EPSILON);
+        float *w = weights + (size_t)o * fan_in;
+        for (size_t k = 0; k < fan_in; ++k)
+            w[k] *= scale;
+        bias[o] = (bias[o] - params[BN_RUNNING_MEAN * outputs + o]) * scale + params[BN_BETA * outputs + o];
+    }
+}
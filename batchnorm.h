@@ -0,0 +1,57 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_BATCHNORM_H
+#define __CUDNN_TRAINING_BATCHNORM_H
+
+#include <cstddef>
+
+// Added to the variance before taking its inverse square root
+#define BATCHNORM_EPSILON 1e-5f
+
+/**
+ * Layout of a batch-normalization parameter buffer: BN_NUM_PARAMS consecutive
+ * arrays of one value per channel. The learned scale and shift are followed by
+ * the running statistics, so that one buffer holds the whole layer state.
+ */
+enum BatchNormParam
+{
+    BN_GAMMA = 0,
+    BN_BETA = 1,
+    BN_RUNNING_MEAN = 2,
+    BN_RUNNING_VAR = 3,
+    BN_NUM_PARAMS = 4,
+};
+
+/**
+ * Initializes a parameter buffer to the identity transform (gamma = 1,
+ * beta = 0) with zero-mean, unit-variance running statistics.
+ *
+ * @param params BN_NUM_PARAMS * channels values.
+ * @param channels The number of channels.
+ */
+void InitBatchNormParams(float *params, int channels);
+
+/**
+ * Folds an inference-mode batch normalization into the layer that precedes
+ * it, so that the normalized output comes straight out of that layer.
+ *
+ * @param weights Weights of the preceding layer, [outputs][fan_in] (the layout
+ *                of both FullyConnectedLayer and ConvBiasLayer).
+ * @param bias Bias of the preceding layer, one value per output.
+ * @param outputs The number of outputs (batch-normalization channels).
+ * @param fan_in Number of weights per output.
+ * @param params Parameter buffer.
+ */
+void FoldBatchNorm(float *weights, float *bias, int outputs, size_t fan_in, const float *params);
+
+#endif  // __CUDNN_TRAINING_BATCHNORM_H
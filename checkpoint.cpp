@@ -0,0 +1,252 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
+#ifdef _WIN32
+    #include <direct.h>
+    #define MakeDirectory(path) _mkdir(path)
+#else
+    #include <sys/stat.h>
+    #define MakeDirectory(path) mkdir(path, 0755)
+#endif
+
+#define CHECKPOINT_MANIFEST_MAGIC "LENETCKPT"
+#define CHECKPOINT_MANIFEST_VERSION 1
+
+/**
+ * 64-bit hash of a chunk, processing eight bytes per step with a
+ * multiply-rotate mix and a MurmurHash3 finalizer.
+ */
+static uint64_t HashChunk(const uint8_t *data, size_t size)
+{
+    const uint64_t k1 = 0x9E3779B185EBCA87ULL, k2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t h = size * k1;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        w *= k2;
+        w = (w << 31) | (w >> 33);
+        h ^= w * k1;
+        h = ((h << 27) | (h >> 37)) * k1 + 0x52DCE729;
+    }
+    for (; i < size; ++i)
+        h = (h ^ data[i]) * k1;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+CheckpointStore::CheckpointStore(const std::string& directory_, size_t chunk_size_) :
+    directory(directory_), chunk_size(chunk_size_)
+{
+    MakeDirectory(directory.c_str());
+    MakeDirectory((directory + "/chunks").c_str());
+}
+
+std::string CheckpointStore::ChunkPath(uint64_t hash) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    return directory + "/chunks/" + name;
+}
+
+std::string CheckpointStore::ManifestPath(const std::string& name) const
+{
+    return directory + "/" + name + ".manifest";
+}
+
+bool CheckpointStore::Save(const std::string& name, const std::vector<CheckpointTensor>& tensors,
+                           size_t *chunks_written, size_t *chunks_total)
+{
+    // Flatten the parameters
+    size_t total = 0;
+    for (const CheckpointTensor& tensor : tensors)
+        total += tensor.count * sizeof(float);
+    std::vector<uint8_t> flat(total);
+    size_t pos = 0;
+    for (const CheckpointTensor& tensor : tensors)
+    {
+        memcpy(&flat[pos], tensor.data, tensor.count * sizeof(float));
+        pos += tensor.count * sizeof(float);
+    }
+
+    // Write new chunks
+    std::vector<uint64_t> hashes;
+    size_t written = 0;
+    for (size_t offset = 0; offset < total; offset += chunk_size)
+    {
+        const size_t bytes = std::min(chunk_size, total - offset);
+        const uint64_t hash = HashChunk(&flat[offset], bytes);
+        hashes.push_back(hash);
+
+        // The chunk may exist from an earlier checkpoint or run. A 64-bit hash may
+        // collide, and a crash may have left a damaged file, so a stored chunk is
+        // only reused if it holds exactly these bytes
+        const std::string path = ChunkPath(hash);
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp)
+        {
+            std::vector<uint8_t> stored(bytes + 1);
+            stored.resize(fread(&stored[0], 1, stored.size(), fp));
+            fclose(fp);
+            if (stored.size() == bytes && memcmp(&stored[0], &flat[offset], bytes) == 0)
+                continue;
+            if (!stored.empty() && HashChunk(&stored[0], stored.size()) == hash)
+            {
+                printf("ERROR: Checkpoint chunk %s has the hash of different data\n", path.c_str());
+                return false;
+            }
+
+            // A damaged chunk (e.g., truncated) is written again below
+            printf("Replacing corrupt checkpoint chunk %s\n", path.c_str());
+            remove(path.c_str());
+        }
+
+        // Write to a temporary file first, so that a chunk is never seen half-written
+        const std::string tmppath = path + ".tmp";
+        fp = fopen(tmppath.c_str(), "wb");
+        if (!fp)
+        {
+            printf("ERROR: Cannot open file %s\n", tmppath.c_str());
+            return false;
+        }
+        bool ok = fwrite(&flat[offset], 1, bytes, fp) == bytes;
+        ok &= fclose(fp) == 0;
+        if (!ok || rename(tmppath.c_str(), path.c_str()) != 0)
+        {
+            printf("ERROR: Cannot write file %s\n", path.c_str());
+            return false;
+        }
+        ++written;
+    }
+
+    // Write the manifest
+    const std::string manifest = ManifestPath(name);
+    const std::string tmpmanifest = manifest + ".tmp";
+    FILE *fp = fopen(tmpmanifest.c_str(), "w");
+    if (!fp)
+    {
+        printf("ERROR: Cannot open file %s\n", tmpmanifest.c_str());
+        return false;
+    }
+    fprintf(fp, "%s %d\n", CHECKPOINT_MANIFEST_MAGIC, CHECKPOINT_MANIFEST_VERSION);
+    fprintf(fp, "chunk_size %llu\n", (unsigned long long)chunk_size);
+    fprintf(fp, "tensors %llu\n", (unsigned long long)tensors.size());
+    for (const CheckpointTensor& tensor : tensors)
+        fprintf(fp, "%s %llu\n", tensor.name.c_str(), (unsigned long long)tensor.count);
+    fprintf(fp, "chunks %llu\n", (unsigned long long)hashes.size());
+    for (uint64_t hash : hashes)
+        fprintf(fp, "%016llx\n", (unsigned long long)hash);
+    bool ok = fclose(fp) == 0;
+    if (!ok || rename(tmpmanifest.c_str(), manifest.c_str()) != 0)
+    {
+        printf("ERROR: Cannot write file %s\n", manifest.c_str());
+        return false;
+    }
+
+    if (chunks_written)
+        *chunks_written = written;
+    if (chunks_total)
+        *chunks_total = hashes.size();
+    return true;
+}
+
+bool CheckpointStore::Load(const std::string& name, const std::vector<CheckpointTensor>& tensors)
+{
+    const std::string manifest = ManifestPath(name);
+    FILE *fp = fopen(manifest.c_str(), "r");
+    if (!fp)
+    {
+        printf("ERROR: Cannot open file %s\n", manifest.c_str());
+        return false;
+    }
+
+    // Read and verify the manifest against the expected tensors
+    char magic[32], tensor_name[256];
+    int version = 0;
+    unsigned long long stored_chunk_size = 0, num_tensors = 0, num_chunks = 0;
+    bool ok = fscanf(fp, "%31s %d", magic, &version) == 2 &&
+              !strcmp(magic, CHECKPOINT_MANIFEST_MAGIC) && version == CHECKPOINT_MANIFEST_VERSION &&
+              fscanf(fp, " chunk_size %llu tensors %llu", &stored_chunk_size, &num_tensors) == 2 &&
+              stored_chunk_size > 0 && num_tensors == tensors.size();
+
+    size_t total = 0;
+    for (size_t i = 0; ok && i < tensors.size(); ++i)
+    {
+        unsigned long long count = 0;
+        ok = fscanf(fp, "%255s %llu", tensor_name, &count) == 2 &&
+             tensors[i].name == tensor_name && count == tensors[i].count;
+        total += tensors[i].count * sizeof(float);
+    }
+
+    std::vector<uint64_t> hashes;
+    ok = ok && fscanf(fp, " chunks %llu", &num_chunks) == 1 &&
+         num_chunks == (total + stored_chunk_size - 1) / stored_chunk_size;
+    for (unsigned long long i = 0; ok && i < num_chunks; ++i)
+    {
+        unsigned long long hash;
+        ok = fscanf(fp, "%llx", &hash) == 1;
+        hashes.push_back(hash);
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        printf("ERROR: Invalid checkpoint manifest %s\n", manifest.c_str());
+        return false;
+    }
+
+    // Read and verify chunks
+    std::vector<uint8_t> flat(total);
+    for (size_t c = 0; c < hashes.size(); ++c)
+    {
+        const size_t offset = c * stored_chunk_size;
+        const size_t bytes = std::min((size_t)stored_chunk_size, total - offset);
+        const std::string path = ChunkPath(hashes[c]);
+
+        fp = fopen(path.c_str(), "rb");
+        if (!fp)
+        {
+            printf("ERROR: Cannot open file %s\n", path.c_str());
+            return false;
+        }
+        ok = fread(&flat[offset], 1, bytes, fp) == bytes;
+        fclose(fp);
+        if (!ok || HashChunk(&flat[offset], bytes) != hashes[c])
+        {
+            printf("ERROR: Corrupt checkpoint chunk %s\n", path.c_str());
+            return false;
+        }
+    }
+
+    // Unflatten the parameters
+    size_t pos = 0;
+    for (const CheckpointTensor& tensor : tensors)
+    {
+        memcpy(tensor.data, &flat[pos], tensor.count * sizeof(float));
+        pos += tensor.count * sizeof(float);
+    }
+    return true;
+}
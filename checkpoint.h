@@ -0,0 +1,72 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_CHECKPOINT_H
+#define __CUDNN_TRAINING_CHECKPOINT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * A named tensor that takes part in a checkpoint.
+ */
+struct CheckpointTensor
+{
+    std::string name;
+    float *data;
+    size_t count;
+};
+
+/**
+ * Content-addressed checkpoint storage. The tensors of a checkpoint are
+ * concatenated into one flat buffer that is split into fixed-size chunks, and
+ * each chunk is stored once under the hash of its contents
+ * (<dir>/chunks/<hash>). A checkpoint is a manifest (<dir>/<name>.manifest)
+ * listing the tensors and chunk hashes, so chunks that did not change since an
+ * earlier checkpoint (or that repeat within one) are never written again.
+ */
+struct CheckpointStore
+{
+    std::string directory;
+    size_t chunk_size;
+
+    CheckpointStore(const std::string& directory_, size_t chunk_size_);
+
+    /**
+     * Saves a checkpoint, writing only chunks that are not yet in the store.
+     * A stored chunk is reused only if its contents match byte for byte.
+     *
+     * @param name The checkpoint name.
+     * @param tensors The tensors to save.
+     * @param chunks_written Optional output: number of chunks that were written.
+     * @param chunks_total Optional output: number of chunks in the checkpoint.
+     * @return True on success.
+     */
+    bool Save(const std::string& name, const std::vector<CheckpointTensor>& tensors,
+              size_t *chunks_written = nullptr, size_t *chunks_total = nullptr);
+
+    /**
+     * Loads a checkpoint into tensors of matching names and sizes.
+     *
+     * @param name The checkpoint name.
+     * @param tensors The tensors to fill.
+     * @return True on success.
+     */
+    bool Load(const std::string& name, const std::vector<CheckpointTensor>& tensors);
+
+    std::string ChunkPath(uint64_t hash) const;
+    std::string ManifestPath(const std::string& name) const;
+};
+
+#endif  // __CUDNN_TRAINING_CHECKPOINT_H
@@ -0,0 +1,165 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "cpudispatch.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+    #define HAVE_CPUID 1
+
+    static void Cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+    {
+        int r[4];
+        __cpuidex(r, (int)leaf, (int)subleaf);
+        for (int i = 0; i < 4; ++i)
+            regs[i] = (unsigned int)r[i];
+    }
+
+    static uint64_t Xgetbv(unsigned int index) { return _xgetbv(index); }
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #include <cpuid.h>
+    #define HAVE_CPUID 1
+
+    static void Cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+    {
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+    }
+
+    static uint64_t Xgetbv(unsigned int index)
+    {
+        uint32_t lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+        return ((uint64_t)hi << 32) | lo;
+    }
+#endif
+
+// CPUID feature bits
+#define CPUID1_ECX_FMA       (1u << 12)
+#define CPUID1_ECX_OSXSAVE   (1u << 27)
+#define CPUID1_ECX_AVX       (1u << 28)
+#define CPUID7_EBX_AVX2      (1u << 5)
+#define CPUID7_EBX_AVX512F   (1u << 16)
+#define CPUID7_EBX_AVX512DQ  (1u << 17)
+#define CPUID7_EBX_AVX512BW  (1u << 30)
+#define CPUID7_EBX_AVX512VL  (1u << 31)
+
+// XCR0 state components the OS must save: SSE and AVX, then opmask and ZMM registers
+#define XCR0_AVX_STATE       0x06
+#define XCR0_AVX512_STATE    0xE0
+
+// ActiveCpuIsa() before the first call (not yet resolved)
+#define CPU_ISA_UNRESOLVED   -1
+
+static std::atomic<int> g_active_isa(CPU_ISA_UNRESOLVED);
+
+CpuIsa DetectCpuIsa()
+{
+#ifdef HAVE_CPUID
+    unsigned int regs[4];
+    Cpuid(0, 0, regs);
+    const unsigned int max_leaf = regs[0];
+
+    Cpuid(1, 0, regs);
+    const unsigned int ecx1 = regs[2];
+    if (max_leaf < 7 || !(ecx1 & CPUID1_ECX_OSXSAVE) || !(ecx1 & CPUID1_ECX_AVX) || !(ecx1 & CPUID1_ECX_FMA))
+        return CPU_ISA_GENERIC;
+
+    // The OS must preserve the wider registers across context switches
+    const uint64_t xcr0 = Xgetbv(0);
+    if ((xcr0 & XCR0_AVX_STATE) != XCR0_AVX_STATE)
+        return CPU_ISA_GENERIC;
+
+    Cpuid(7, 0, regs);
+    const unsigned int ebx7 = regs[1];
+    if (!(ebx7 & CPUID7_EBX_AVX2))
+        return CPU_ISA_GENERIC;
+
+    const unsigned int avx512 = CPUID7_EBX_AVX512F | CPUID7_EBX_AVX512DQ | CPUID7_EBX_AVX512BW | CPUID7_EBX_AVX512VL;
+    if ((ebx7 & avx512) == avx512 && (xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE)
+        return CPU_ISA_AVX512;
+    return CPU_ISA_AVX2;
+#else
+    return CPU_ISA_GENERIC;
+#endif
+}
+
+CpuIsa ActiveCpuIsa()
+{
+    int isa = g_active_isa.load(std::memory_order_relaxed);
+    if (isa != CPU_ISA_UNRESOLVED)
+        return static_cast<CpuIsa>(isa);
+
+    CpuIsa detected = DetectCpuIsa(), chosen = detected;
+    const char *env = getenv(CPU_ISA_ENV);
+    if (env && *env)
+    {
+        CpuIsa requested;
+        if (!ParseCpuIsa(env, requested))
+            printf("ERROR: Unknown instruction set %s in %s\n", env, CPU_ISA_ENV);
+        else if (requested > detected)
+            printf("ERROR: Instruction set %s is not supported by this host (best: %s)\n",
+                   CpuIsaName(requested), CpuIsaName(detected));
+        else
+            chosen = requested;
+    }
+
+    // Concurrent first calls resolve to the same value
+    int expected = CPU_ISA_UNRESOLVED;
+    g_active_isa.compare_exchange_strong(expected, static_cast<int>(chosen));
+    return static_cast<CpuIsa>(g_active_isa.load());
+}
+
+bool SetCpuIsa(CpuIsa isa)
+{
+    CpuIsa detected = DetectCpuIsa();
+    if (isa > detected)
+    {
+        printf("ERROR: Instruction set %s is not supported by this host (best: %s)\n",
+               CpuIsaName(isa), CpuIsaName(detected));
+        return false;
+    }
+    g_active_isa.store(static_cast<int>(isa));
+    return true;
+}
+
+bool ParseCpuIsa(const char *name, CpuIsa& isa)
+{
+    if (!strcmp(name, "generic"))
+        isa = CPU_ISA_GENERIC;
+    else if (!strcmp(name, "avx2"))
+        isa = CPU_ISA_AVX2;
+    else if (!strcmp(name, "avx512"))
+        isa = CPU_ISA_AVX512;
+    else
+        return false;
+    return true;
+}
+
+const char *CpuIsaName(CpuIsa isa)
+{
+    switch (isa)
+    {
+    case CPU_ISA_AVX2:
+        return "avx2";
+    case CPU_ISA_AVX512:
+        return "avx512";
+    default:
+        return "generic";
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_CPUDISPATCH_H
+#define __CUDNN_TRAINING_CPUDISPATCH_H
+
+/**
+ * Instruction sets that host kernels are compiled for, in increasing order.
+ */
+enum CpuIsa
+{
+    CPU_ISA_GENERIC = 0,   // Whatever the build targets (SSE2 on x86-64)
+    CPU_ISA_AVX2 = 1,      // AVX2 + FMA
+    CPU_ISA_AVX512 = 2,    // AVX-512 F/VL/BW/DQ
+};
+
+// Environment variable that overrides the detected instruction set
+#define CPU_ISA_ENV "LENET_CPU_ISA"
+
+/**
+ * Returns the best instruction set supported by both the CPU (CPUID) and the
+ * operating system (XGETBV), regardless of any override.
+ */
+CpuIsa DetectCpuIsa();
+
+/**
+ * Returns the instruction set that dispatched kernels use: the detected one,
+ * unless overridden by SetCpuIsa or the CPU_ISA_ENV environment variable.
+ */
+CpuIsa ActiveCpuIsa();
+
+/**
+ * Overrides the instruction set of dispatched kernels (e.g., for benchmarking).
+ *
+ * @param isa The instruction set to use.
+ * @return False (leaving the choice unchanged) if the host does not support it.
+ */
+bool SetCpuIsa(CpuIsa isa);
+
+/**
+ * Parses an instruction set name ("generic", "avx2" or "avx512").
+ *
+ * @param name The name.
+ * @param isa The parsed instruction set.
+ * @return True if the name was recognized.
+ */
+bool ParseCpuIsa(const char *name, CpuIsa& isa);
+
+const char *CpuIsaName(CpuIsa isa);
+
+/*
+ * Multi-versioning. A kernel is written once as a CPU_INLINE function, and
+ * CPU_MULTIVERSION compiles a copy of it for each instruction set (the body is
+ * inlined into a function with the matching target attribute, so the compiler
+ * vectorizes it for that target). CPU_DISPATCH calls the copy for
+ * ActiveCpuIsa(). The rest of the build keeps its generic target flags.
+ * Compilers without target attributes get three identical generic copies.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #define CPU_INLINE inline __attribute__((always_inline))
+    #define CPU_TARGET_AVX2 __attribute__((target("avx2,fma")))
+    #define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma")))
+#else
+    #define CPU_INLINE inline
+    #define CPU_TARGET_AVX2
+    #define CPU_TARGET_AVX512
+#endif
+
+/**
+ * Defines static void functions nameGeneric, nameAvx2 and nameAvx512 taking
+ * "params" (a parenthesized parameter list), each running the statement "call".
+ */
+#define CPU_MULTIVERSION(name, params, call)          \
+    static void name##Generic params { call; }        \
+    CPU_TARGET_AVX2 static void name##Avx2 params { call; } \
+    CPU_TARGET_AVX512 static void name##Avx512 params { call; }
+
+/**
+ * Calls the variant of a CPU_MULTIVERSION function for ActiveCpuIsa() with
+ * "args" (a parenthesized argument list).
+ */
+#define CPU_DISPATCH(name, args) do {                 \
+    switch (ActiveCpuIsa())                           \
+    {                                                 \
+    case CPU_ISA_AVX512: name##Avx512 args; break;    \
+    case CPU_ISA_AVX2:   name##Avx2 args; break;      \
+    default:             name##Generic args; break;   \
+    }                                                 \
+} while(0)
+
+#endif  // __CUDNN_TRAINING_CPUDISPATCH_H
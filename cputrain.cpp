@@ -0,0 +1,697 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Multithreaded host training, for CPU nodes without GPUs.
+ *
+ * Usage: cputrain [--mode=hogwild|easgd|multi|pbt] [--threads=T] [--iterations=N] [--scaling]
+ *                 [--models=K] [--learning_rates=LIST] [--export_model=FILE]
+ *
+ * T threads train LeNet on the host, each drawing its own mini-batches.
+ * With Hogwild, every thread computes gradients against the one shared
+ * parameter buffer and applies them to it without any locking. With EASGD,
+ * every thread trains its own replica and, every "easgd_period" steps, moves
+ * it and a shared center variable towards each other; the center is the
+ * trained model. "iterations" counts the SGD
+ * steps of all threads together, so runs with different thread counts do the
+ * same amount of work. With "scaling", the same training (from the same
+ * initial weights) is run with 1, 2, 4, ... up to T threads, and the
+ * throughput and convergence of each run are compared.
+ *
+ * The "multi" mode instead trains K independent models (e.g., a learning
+ * rate sweep) in lockstep on the same mini-batches, with their conv1 layers
+ * fused into one convolution and the other layers spread over the T threads.
+ * With "scaling", the sweep is also run as K separate trainings at once (one
+ * thread per model, each drawing its own batches) for comparison.
+ *
+ * The "pbt" mode trains K models the same way as a population: every
+ * "pbt_interval" steps, the members are scored on a validation split of the
+ * training set, and the worst are replaced by perturbed copies of the best.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpudispatch.h"
+#include "hostlenet.h"
+#include "inference.h"
+#include "pbt.h"
+#include "readubyte.h"
+
+#ifdef USE_GFLAGS
+    #include <gflags/gflags.h>
+
+    #ifndef _WIN32
+        #define gflags google
+    #endif
+#else
+    // Constant versions of gflags
+    #define DEFINE_int32(flag, default_value, description) const int FLAGS_##flag = (default_value)
+    #define DEFINE_bool(flag, default_value, description) const bool FLAGS_##flag = (default_value)
+    #define DEFINE_double(flag, default_value, description) const double FLAGS_##flag = (default_value)
+    #define DEFINE_string(flag, default_value, description) const std::string FLAGS_##flag ((default_value))
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Command-line flags
+
+// Training
+DEFINE_string(mode, "hogwild", "Training mode: hogwild (one shared buffer), easgd (replicas and a center) "
+                                "multi (independent models on shared batches) or pbt (population-based training)");
+DEFINE_int32(threads, 0, "Number of training threads (0 uses all hardware threads)");
+DEFINE_int32(iterations, 2000, "Number of SGD steps, summed over all threads");
+DEFINE_int32(batch_size, 64, "Batch size of each thread's SGD steps");
+DEFINE_int32(random_seed, 0, "Seed of the initial weights and of the mini-batch draws");
+DEFINE_double(learning_rate, 0.01, "Base learning rate");
+DEFINE_double(lr_gamma, 0.0001, "Learning rate policy gamma");
+DEFINE_double(lr_power, 0.75, "Learning rate policy power");
+
+// EASGD
+DEFINE_int32(easgd_period, 4, "Number of a thread's SGD steps between elastic updates");
+DEFINE_double(moving_rate, 0.0, "Elastic moving rate (0 uses 0.9 / threads, as suggested for EASGD)");
+
+// Multiple models
+DEFINE_int32(models, 4, "Number of models trained together in multi mode");
+DEFINE_string(learning_rates, "", "Comma-separated base learning rates of the models, cycled (empty uses learning_rate)");
+
+// Population-based training
+DEFINE_int32(pbt_interval, 100, "Number of SGD steps between exploit/explore rounds");
+DEFINE_double(pbt_fraction, 0.25, "Fraction of the population replaced by copies of the best members in each round");
+DEFINE_double(pbt_perturb, 0.2, "Relative perturbation of the copied hyperparameters");
+DEFINE_int32(validation_size, 1000, "Number of training images held out to score the population");
+
+// Benchmark and convergence tracking
+DEFINE_bool(scaling, false, "Train with 1, 2, 4, ... up to \"threads\" threads and compare the runs");
+DEFINE_int32(log_interval, 100, "Number of SGD steps per point of the loss curve");
+DEFINE_double(target_loss, 0.2, "Training loss whose time-to-reach is reported for each run");
+DEFINE_int32(classify, -1, "Number of test images to compute the error rate on (default uses entire test set)");
+
+// Filenames
+DEFINE_string(train_images, "train-images-idx3-ubyte", "Training images filename");
+DEFINE_string(train_labels, "train-labels-idx1-ubyte", "Training labels filename");
+DEFINE_string(test_images, "t10k-images-idx3-ubyte", "Test images filename");
+DEFINE_string(test_labels, "t10k-labels-idx1-ubyte", "Test labels filename");
+DEFINE_string(export_model, "", "Export the trained model to a packed inference file (empty to disable)");
+
+typedef std::chrono::high_resolution_clock Clock;
+
+struct Dataset
+{
+    std::vector<float> images;
+    std::vector<uint8_t> labels;
+    size_t size, channels, width, height;
+
+    size_t ImageSize() const { return channels * width * height; }
+};
+
+/// Loss curve and timing of one training run.
+struct RunResult
+{
+    int threads;
+    double seconds;
+    std::vector<double> interval_loss;     // Mean training loss of each log_interval steps
+    std::vector<double> interval_seconds;  // Time at which each interval was completed
+    size_t test_errors;
+};
+
+/// Training curve and test error of one model of a multi-model run.
+struct ModelResult
+{
+    double learning_rate;
+    std::vector<double> interval_loss;
+    size_t test_errors;
+};
+
+/// Learning rate of SGD step "step" (trainlenet's "inv" policy).
+static float LearningRate(const PbtHyperparameters& hyper, int step)
+{
+    return static_cast<float>(hyper.learning_rate * pow(1.0 + hyper.lr_gamma * step, -hyper.lr_power));
+}
+
+static float LearningRate(double base_rate, int step)
+{
+    return LearningRate({ base_rate, FLAGS_lr_gamma, FLAGS_lr_power, FLAGS_batch_size }, step);
+}
+
+/**
+ * Trains "params" in place for FLAGS_iterations steps with "num_threads"
+ * threads. Steps are numbered by a shared atomic counter; besides it, Hogwild
+ * threads share only "params", and EASGD threads only the center variable
+ * (initialized from, and finally copied to, "params").
+ */
+static RunResult Train(const HostLeNet& net, float *params, const Dataset& train, const Dataset& test,
+                              int num_threads)
+{
+    const int intervals = (FLAGS_iterations + FLAGS_log_interval - 1) / FLAGS_log_interval;
+    const int batch_size = (int)std::min((size_t)FLAGS_batch_size, train.size);
+
+    const bool easgd = (FLAGS_mode == "easgd");
+    const float moving_rate = static_cast<float>(FLAGS_moving_rate > 0.0 ? FLAGS_moving_rate : 0.9 / num_threads);
+    std::vector<float> initial(params, params + net.NumParams());
+    HostElasticCenter center(initial);
+
+    std::atomic<int> next_step(0);
+
+    // Each thread sums its own losses per interval; the sums are merged after the run
+    std::vector<std::vector<double>> thread_loss(num_threads, std::vector<double>(intervals, 0.0));
+    std::vector<std::atomic<int>> interval_steps(intervals);
+    std::vector<double> interval_seconds(intervals, 0.0);
+    for (auto&& steps : interval_steps)
+        steps = 0;
+
+    auto t1 = Clock::now();
+    auto worker = [&](int thread_index)
+    {
+        HostLeNetBuffers buffers(net, batch_size);
+        std::mt19937 gen(FLAGS_random_seed * 7919 + thread_index);
+        std::uniform_int_distribution<size_t> dist(0, train.size - batch_size);
+
+        // EASGD threads train a private replica
+        std::vector<float> replica;
+        float *weights = params;
+        if (easgd)
+        {
+            replica = initial;
+            weights = &replica[0];
+        }
+
+        for (int step = next_step++, local_steps = 1; step < FLAGS_iterations; step = next_step++, ++local_steps)
+        {
+            // A random contiguous block of the training set, as trainlenet draws by default
+            const size_t first = dist(gen);
+            const float loss = HostLeNetGradients(net, weights, &train.images[first * train.ImageSize()],
+                                                  &train.labels[first], batch_size, buffers);
+            HostLeNetSgdStep(net, weights, LearningRate(FLAGS_learning_rate, step), buffers);
+            if (easgd && local_steps % FLAGS_easgd_period == 0)
+                center.ElasticUpdate(weights, moving_rate, thread_index * HOST_ELASTIC_STRIPES / num_threads);
+
+            // The thread completing an interval's last step timestamps it
+            const int interval = step / FLAGS_log_interval;
+            thread_loss[thread_index][interval] += loss;
+            const int interval_size = std::min(FLAGS_log_interval, FLAGS_iterations - interval * FLAGS_log_interval);
+            if (++interval_steps[interval] == interval_size)
+                interval_seconds[interval] = std::chrono::duration<double>(Clock::now() - t1).count();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t)
+        threads.emplace_back(worker, t);
+    for (auto&& thread : threads)
+        thread.join();
+    auto t2 = Clock::now();
+    if (easgd)
+        center.CopyTo(params);
+
+    RunResult result;
+    result.threads = num_threads;
+    result.seconds = std::chrono::duration<double>(t2 - t1).count();
+    result.interval_seconds = interval_seconds;
+    result.interval_loss.assign(intervals, 0.0);
+    for (int i = 0; i < intervals; ++i)
+    {
+        for (int t = 0; t < num_threads; ++t)
+            result.interval_loss[i] += thread_loss[t][i];
+        result.interval_loss[i] /= std::min(FLAGS_log_interval, FLAGS_iterations - i * FLAGS_log_interval);
+    }
+
+    HostLeNetBuffers buffers(net, batch_size);
+    result.test_errors = HostLeNetErrors(net, params, &test.images[0], &test.labels[0], test.size, buffers);
+    return result;
+}
+
+/// Time at which the interval loss first fell to "target" (negative if it never did).
+static double TimeToLoss(const RunResult& result, double target)
+{
+    for (size_t i = 0; i < result.interval_loss.size(); ++i)
+        if (result.interval_loss[i] <= target)
+            return result.interval_seconds[i];
+    return -1.0;
+}
+
+static void PrintLossCurve(const RunResult& result)
+{
+    printf("%8s %10s %10s\n", "step", "seconds", "loss");
+    for (size_t i = 0; i < result.interval_loss.size(); ++i)
+    {
+        const int step = std::min((int)(i + 1) * FLAGS_log_interval, FLAGS_iterations);
+        printf("%8d %10.3f %10.4f\n", step, result.interval_seconds[i], result.interval_loss[i]);
+    }
+}
+
+/**
+ * Trains "models" (flat parameter buffers) in lockstep for FLAGS_iterations
+ * steps: every step draws one mini-batch, runs all models on it as a
+ * HostLeNetGroup, and applies each model's own learning rate.
+ *
+ * @return The training time in seconds.
+ */
+static double TrainGroup(const HostLeNet& net, std::vector<std::vector<float>>& models, const Dataset& train,
+                         int threads, std::vector<ModelResult>& results)
+{
+    const int num_models = (int)models.size();
+    const int intervals = (FLAGS_iterations + FLAGS_log_interval - 1) / FLAGS_log_interval;
+    const int batch_size = (int)std::min((size_t)FLAGS_batch_size, train.size);
+
+    HostLeNetGroup group(net, num_models, batch_size);
+    std::vector<const float *> params(num_models);
+    for (int k = 0; k < num_models; ++k)
+    {
+        params[k] = &models[k][0];
+        results[k].interval_loss.assign(intervals, 0.0);
+    }
+    std::vector<float> losses(num_models);
+
+    std::mt19937 gen(FLAGS_random_seed * 7919);
+    std::uniform_int_distribution<size_t> dist(0, train.size - batch_size);
+
+    auto t1 = Clock::now();
+    for (int step = 0; step < FLAGS_iterations; ++step)
+    {
+        const size_t first = dist(gen);
+        HostLeNetGroupGradients(net, &params[0], &train.images[first * train.ImageSize()], &train.labels[first],
+                                batch_size, nullptr, group, threads, &losses[0]);
+        for (int k = 0; k < num_models; ++k)
+        {
+            HostLeNetSgdStep(net, &models[k][0], LearningRate(results[k].learning_rate, step), group.buffers[k]);
+            results[k].interval_loss[step / FLAGS_log_interval] += losses[k];
+        }
+    }
+    return std::chrono::duration<double>(Clock::now() - t1).count();
+}
+
+/**
+ * Trains "models" as separate, concurrent trainings: one thread per model
+ * (up to "threads" at once), each drawing its own mini-batches.
+ *
+ * @return The training time in seconds.
+ */
+static double TrainIndependently(const HostLeNet& net, std::vector<std::vector<float>>& models, const Dataset& train,
+                                 int threads, std::vector<ModelResult>& results)
+{
+    const int num_models = (int)models.size();
+    const int intervals = (FLAGS_iterations + FLAGS_log_interval - 1) / FLAGS_log_interval;
+    const int batch_size = (int)std::min((size_t)FLAGS_batch_size, train.size);
+    std::atomic<int> next_model(0);
+
+    auto worker = [&]()
+    {
+        HostLeNetBuffers buffers(net, batch_size);
+        for (int k = next_model++; k < num_models; k = next_model++)
+        {
+            std::mt19937 gen(FLAGS_random_seed * 7919 + k);
+            std::uniform_int_distribution<size_t> dist(0, train.size - batch_size);
+            results[k].interval_loss.assign(intervals, 0.0);
+            for (int step = 0; step < FLAGS_iterations; ++step)
+            {
+                const size_t first = dist(gen);
+                const float loss = HostLeNetGradients(net, &models[k][0], &train.images[first * train.ImageSize()],
+                                                      &train.labels[first], batch_size, buffers);
+                HostLeNetSgdStep(net, &models[k][0], LearningRate(results[k].learning_rate, step), buffers);
+                results[k].interval_loss[step / FLAGS_log_interval] += loss;
+            }
+        }
+    };
+
+    auto t1 = Clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < std::min(threads, num_models); ++t)
+        workers.emplace_back(worker);
+    for (auto&& thread : workers)
+        thread.join();
+    return std::chrono::duration<double>(Clock::now() - t1).count();
+}
+
+/// Averages the summed interval losses, and tests every model.
+static void FinishModels(const HostLeNet& net, const std::vector<std::vector<float>>& models, const Dataset& test,
+                         std::vector<ModelResult>& results)
+{
+    HostLeNetBuffers buffers(net, FLAGS_batch_size);
+    for (size_t k = 0; k < models.size(); ++k)
+    {
+        for (size_t i = 0; i < results[k].interval_loss.size(); ++i)
+            results[k].interval_loss[i] /= std::min(FLAGS_log_interval, FLAGS_iterations - (int)i * FLAGS_log_interval);
+        results[k].test_errors = HostLeNetErrors(net, &models[k][0], &test.images[0], &test.labels[0], test.size,
+                                                 buffers);
+    }
+}
+
+static void PrintModelResults(const std::vector<ModelResult>& results, size_t test_size)
+{
+    printf("%8s", "step");
+    for (size_t k = 0; k < results.size(); ++k)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "model %d", (int)k);
+        printf(" %10s", name);
+    }
+    printf("\n");
+    for (size_t i = 0; i < results[0].interval_loss.size(); ++i)
+    {
+        printf("%8d", std::min((int)(i + 1) * FLAGS_log_interval, FLAGS_iterations));
+        for (const ModelResult& result : results)
+            printf(" %10.4f", result.interval_loss[i]);
+        printf("\n");
+    }
+    printf("%8s", "lr");
+    for (const ModelResult& result : results)
+        printf(" %10g", result.learning_rate);
+    printf("\n%8s", "error");
+    for (const ModelResult& result : results)
+        printf(" %9.2f%%", 100.0 * result.test_errors / std::max(test_size, (size_t)1));
+    printf("\n");
+}
+
+/// Parses a comma-separated list of numbers (empty entries are skipped).
+static std::vector<double> ParseList(const std::string& list)
+{
+    std::vector<double> values;
+    size_t begin = 0;
+    while (begin <= list.size())
+    {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos)
+            end = list.size();
+        if (end > begin)
+            values.push_back(atof(list.substr(begin, end - begin).c_str()));
+        begin = end + 1;
+    }
+    return values;
+}
+
+static bool ExportModel(const HostLeNet& net, const float *p)
+{
+    const size_t *o = net.offsets;
+    PackedLayerSource layers[PACKED_LENET_LAYERS] = {
+        { net.conv1.in_channels, net.conv1.out_channels, net.conv1.kernel_size, net.conv1.in_width,
+          net.conv1.in_height, p + o[HOST_CONV1_WEIGHTS], p + o[HOST_CONV1_BIAS] },
+        { net.conv2.in_channels, net.conv2.out_channels, net.conv2.kernel_size, net.conv2.in_width,
+          net.conv2.in_height, p + o[HOST_CONV2_WEIGHTS], p + o[HOST_CONV2_BIAS] },
+        { net.fc1.in_channels, net.fc1.out_channels, 1, 1, 1, p + o[HOST_FC1_WEIGHTS], p + o[HOST_FC1_BIAS] },
+        { net.fc2.in_channels, net.fc2.out_channels, 1, 1, 1, p + o[HOST_FC2_WEIGHTS], p + o[HOST_FC2_BIAS] },
+    };
+
+    printf("Exporting inference model to %s\n", FLAGS_export_model.c_str());
+    return ExportPackedLeNet(FLAGS_export_model.c_str(), PACKED_FLOAT32, net.channels, net.width, net.height,
+                             HOST_LENET_POOL, HOST_LENET_POOL, layers);
+}
+
+/**
+ * Multi mode: trains FLAGS_models models, differing in initial weights and
+ * (with "learning_rates") in learning rate, and exports the best of them.
+ */
+static int TrainModels(const HostLeNet& net, const Dataset& train, const Dataset& test, int threads)
+{
+    std::vector<double> rates = ParseList(FLAGS_learning_rates);
+    if (rates.empty())
+        rates.push_back(FLAGS_learning_rate);
+
+    std::vector<std::vector<float>> initial(FLAGS_models, std::vector<float>(net.NumParams()));
+    std::vector<ModelResult> results(FLAGS_models);
+    std::mt19937 gen(FLAGS_random_seed);
+    for (int k = 0; k < FLAGS_models; ++k)
+    {
+        net.Randomize(&initial[k][0], gen);
+        results[k].learning_rate = rates[k % rates.size()];
+    }
+
+    printf("Multi-model training: %d models, %d steps of %d images, %d threads, instruction set %s\n",
+           FLAGS_models, FLAGS_iterations, (int)std::min((size_t)FLAGS_batch_size, train.size), threads,
+           CpuIsaName(ActiveCpuIsa()));
+
+    std::vector<std::vector<float>> models = initial;
+    const double grouped_seconds = TrainGroup(net, models, train, threads, results);
+    FinishModels(net, models, test, results);
+    printf("\nGrouped (shared batches, fused conv1):\n");
+    PrintModelResults(results, test.size);
+    printf("%.3f seconds, %.1f model-steps/s\n", grouped_seconds, FLAGS_models * FLAGS_iterations / grouped_seconds);
+
+    if (FLAGS_scaling)
+    {
+        std::vector<std::vector<float>> separate = initial;
+        std::vector<ModelResult> separate_results = results;
+        const double separate_seconds = TrainIndependently(net, separate, train, threads, separate_results);
+        FinishModels(net, separate, test, separate_results);
+        printf("\nIndependent (one thread per model):\n");
+        PrintModelResults(separate_results, test.size);
+        printf("%.3f seconds, %.1f model-steps/s (grouped training is %.2fx faster)\n", separate_seconds,
+               FLAGS_models * FLAGS_iterations / separate_seconds, separate_seconds / grouped_seconds);
+    }
+
+    if (!FLAGS_export_model.empty())
+    {
+        size_t best = 0;
+        for (size_t k = 1; k < results.size(); ++k)
+            if (results[k].test_errors < results[best].test_errors)
+                best = k;
+        printf("Best model: %d (learning rate %g)\n", (int)best, results[best].learning_rate);
+        if (!ExportModel(net, &models[best][0]))
+            return 4;
+    }
+    return 0;
+}
+
+/// Scores every member by its mean loss on "count" validation images, on up to "threads" threads.
+static void ScoreMembers(const HostLeNet& net, std::vector<PbtMember>& members, const float *images,
+                         const uint8_t *labels, size_t count, HostLeNetGroup& group, int threads)
+{
+    std::atomic<int> next_member(0);
+    auto worker = [&]()
+    {
+        for (int k = next_member++; k < (int)members.size(); k = next_member++)
+            HostLeNetErrors(net, &members[k].params[0], images, labels, count, group.buffers[k], &members[k].score);
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < std::min(threads, (int)members.size()); ++t)
+        workers.emplace_back(worker);
+    worker();
+    for (auto&& thread : workers)
+        thread.join();
+}
+
+static void PrintMember(int k, const PbtMember& member)
+{
+    printf("  member %2d: score %.4f, lr %.5f, gamma %.6f, power %.3f, batch %3d, generation %d\n", k,
+           member.score, member.hyper.learning_rate, member.hyper.lr_gamma, member.hyper.lr_power,
+           member.hyper.batch_size, member.generation);
+}
+
+/**
+ * PBT mode: trains a population of FLAGS_models members as a HostLeNetGroup
+ * (each member on a prefix of the shared mini-batch of its own size), and
+ * runs an exploit/explore round every FLAGS_pbt_interval steps. The last
+ * FLAGS_validation_size training images are only used to score members.
+ */
+static int TrainPopulation(const HostLeNet& net, const Dataset& train, const Dataset& test, int threads)
+{
+    const size_t validation = (size_t)std::max(FLAGS_validation_size, 1);
+    const int max_batch = 2 * FLAGS_batch_size;
+    if (train.size < validation + max_batch || FLAGS_pbt_interval <= 0)
+    {
+        printf("ERROR: PBT needs pbt_interval > 0 and at least validation_size + 2 * batch_size training images\n");
+        return 3;
+    }
+    const size_t train_size = train.size - validation;
+    const float *validation_images = &train.images[train_size * train.ImageSize()];
+    const uint8_t *validation_labels = &train.labels[train_size];
+
+    const PbtConfig config = { FLAGS_pbt_fraction, FLAGS_pbt_perturb, std::max(1, FLAGS_batch_size / 4), max_batch };
+    const PbtHyperparameters base = { FLAGS_learning_rate, FLAGS_lr_gamma, FLAGS_lr_power, FLAGS_batch_size };
+
+    std::mt19937 gen(FLAGS_random_seed);
+    std::vector<PbtMember> members(FLAGS_models);
+    for (PbtMember& member : members)
+    {
+        member.params.resize(net.NumParams());
+        net.Randomize(&member.params[0], gen);
+        member.hyper = PbtSample(base, config, gen);
+        member.score = 0.0;
+        member.generation = 0;
+    }
+
+    printf("Population-based training: %d members, %d steps, rounds every %d steps, instruction set %s\n",
+           FLAGS_models, FLAGS_iterations, FLAGS_pbt_interval, CpuIsaName(ActiveCpuIsa()));
+
+    HostLeNetGroup group(net, FLAGS_models, max_batch);
+    std::vector<const float *> params(FLAGS_models);
+    std::vector<int> counts(FLAGS_models);
+    std::vector<float> losses(FLAGS_models);
+    std::uniform_int_distribution<size_t> dist(0, train_size - max_batch);
+
+    auto t1 = Clock::now();
+    for (int step = 0; step < FLAGS_iterations; ++step)
+    {
+        // Every member trains on the first hyper.batch_size images of one shared batch
+        for (int k = 0; k < FLAGS_models; ++k)
+        {
+            params[k] = &members[k].params[0];
+            counts[k] = members[k].hyper.batch_size;
+        }
+        const size_t first = dist(gen);
+        HostLeNetGroupGradients(net, &params[0], &train.images[first * train.ImageSize()], &train.labels[first],
+                                max_batch, &counts[0], group, threads, &losses[0]);
+        for (int k = 0; k < FLAGS_models; ++k)
+            HostLeNetSgdStep(net, &members[k].params[0], LearningRate(members[k].hyper, step), group.buffers[k]);
+
+        if ((step + 1) % FLAGS_pbt_interval == 0 && step + 1 < FLAGS_iterations)
+        {
+            ScoreMembers(net, members, validation_images, validation_labels, validation, group, threads);
+            double best = members[0].score;
+            for (const PbtMember& member : members)
+                best = std::min(best, member.score);
+
+            printf("Step %d (%.3f seconds): best validation loss %.4f\n", step + 1,
+                   std::chrono::duration<double>(Clock::now() - t1).count(), best);
+            for (const PbtReplacement& r : PbtExploitExplore(members, config, gen))
+                printf("  member %2d <- member %2d: lr %.5f, gamma %.6f, power %.3f, batch %d\n", r.member, r.source,
+                       members[r.member].hyper.learning_rate, members[r.member].hyper.lr_gamma,
+                       members[r.member].hyper.lr_power, members[r.member].hyper.batch_size);
+        }
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - t1).count();
+
+    ScoreMembers(net, members, validation_images, validation_labels, validation, group, threads);
+    size_t best = 0;
+    printf("\nFinal population (%.3f seconds, %.1f member-steps/s):\n", seconds,
+           FLAGS_models * FLAGS_iterations / seconds);
+    for (size_t k = 0; k < members.size(); ++k)
+    {
+        PrintMember((int)k, members[k]);
+        if (members[k].score < members[best].score)
+            best = k;
+    }
+
+    const size_t errors = HostLeNetErrors(net, &members[best].params[0], &test.images[0], &test.labels[0], test.size,
+                                          group.buffers[best]);
+    printf("Best member: %d, test error: %.2f%%\n", (int)best, 100.0 * errors / std::max(test.size, (size_t)1));
+
+    if (!FLAGS_export_model.empty() && !ExportModel(net, &members[best].params[0]))
+        return 4;
+    return 0;
+}
+
+static bool LoadDataset(const std::string& images, const std::string& labels, Dataset& dataset)
+{
+    dataset.size = ReadIdxDataset(images.c_str(), labels.c_str(), dataset.images, dataset.labels,
+                                  dataset.channels, dataset.width, dataset.height);
+    return dataset.size > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Main function
+
+int main(int argc, char **argv)
+{
+#ifdef USE_GFLAGS
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+
+    Dataset train, test;
+    printf("Reading input data\n");
+    if (!LoadDataset(FLAGS_train_images, FLAGS_train_labels, train) ||
+        !LoadDataset(FLAGS_test_images, FLAGS_test_labels, test))
+    {
+        printf("ERROR: Cannot read the training or test set\n");
+        return 1;
+    }
+    if (test.ImageSize() != train.ImageSize())
+    {
+        printf("ERROR: Training and test images differ in size\n");
+        return 2;
+    }
+    if (FLAGS_classify >= 0)
+        test.size = std::min(test.size, (size_t)FLAGS_classify);
+    printf("Done. Training dataset size: %d, Test dataset size: %d\n", (int)train.size, (int)test.size);
+
+    if (FLAGS_iterations <= 0 || FLAGS_log_interval <= 0 || FLAGS_batch_size <= 0 || FLAGS_easgd_period <= 0 ||
+        FLAGS_models <= 0)
+    {
+        printf("ERROR: iterations, log_interval, batch_size, easgd_period and models must be positive\n");
+        return 3;
+    }
+    if (FLAGS_mode != "hogwild" && FLAGS_mode != "easgd" && FLAGS_mode != "multi" && FLAGS_mode != "pbt")
+    {
+        printf("ERROR: Unknown training mode \"%s\" (use hogwild, easgd, multi or pbt)\n", FLAGS_mode.c_str());
+        return 3;
+    }
+
+    int max_threads = FLAGS_threads;
+    if (max_threads <= 0)
+        max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    // IDX labels may be of any integer type up to 255, so the classes are 0 to the largest
+    // label of either set (HostLeNetErrors looks up the probability of each test label)
+    const int classes = std::max(*std::max_element(train.labels.begin(), train.labels.end()),
+                                 *std::max_element(test.labels.begin(), test.labels.end())) + 1;
+    HostLeNet net((int)train.channels, (int)train.width, (int)train.height, classes);
+    const int batch_size = (int)std::min((size_t)FLAGS_batch_size, train.size);
+    net.Prepare(batch_size);
+
+    if (FLAGS_mode == "multi")
+        return TrainModels(net, train, test, max_threads);
+    if (FLAGS_mode == "pbt")
+        return TrainPopulation(net, train, test, max_threads);
+
+    std::vector<float> initial(net.NumParams()), params;
+    std::mt19937 gen(FLAGS_random_seed);
+    net.Randomize(&initial[0], gen);
+
+    std::vector<int> thread_counts;
+    if (FLAGS_scaling)
+    {
+        for (int t = 1; t < max_threads; t *= 2)
+            thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    printf("%s training: %d steps of %d images, instruction set %s\n",
+           FLAGS_mode == "easgd" ? "EASGD" : "Hogwild", FLAGS_iterations, batch_size,
+           CpuIsaName(ActiveCpuIsa()));
+
+    std::vector<RunResult> results;
+    for (int num_threads : thread_counts)
+    {
+        params = initial;
+        printf("\n%d thread(s):\n", num_threads);
+        results.push_back(Train(net, &params[0], train, test, num_threads));
+        PrintLossCurve(results.back());
+    }
+
+    printf("\n%8s %10s %10s %10s %8s %10s %12s %10s\n", "threads", "seconds", "steps/s", "images/s", "speedup",
+           "final loss", "time to loss", "test error");
+    for (const RunResult& result : results)
+    {
+        const double time_to_loss = TimeToLoss(result, FLAGS_target_loss);
+        char time_text[32] = "-";
+        if (time_to_loss >= 0.0)
+            snprintf(time_text, sizeof(time_text), "%.3f", time_to_loss);
+        printf("%8d %10.3f %10.1f %10.0f %7.2fx %10.4f %12s %9.2f%%\n", result.threads, result.seconds,
+               FLAGS_iterations / result.seconds, (double)FLAGS_iterations * batch_size / result.seconds,
+               results[0].seconds / result.seconds, result.interval_loss.back(), time_text,
+               100.0 * result.test_errors / std::max(test.size, (size_t)1));
+    }
+
+    if (!FLAGS_export_model.empty() && !ExportModel(net, &params[0]))
+        return 4;
+
+    return 0;
+}
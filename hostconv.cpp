@@ -0,0 +1,351 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hostconv.h"
+#include "cpudispatch.h"
+#include "jit.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+
+static_assert(HOSTCONV_PANEL_WIDTH % 8 == 0, "panel width must be a multiple of 8");
+static_assert(sizeof(size_t) <= 2 * sizeof(float) && sizeof(int) == sizeof(float),
+              "pixel offsets and coordinates must fit the workspace");
+
+#define NC HOSTCONV_PANEL_WIDTH
+#define KC HOSTCONV_PANEL_DEPTH
+
+size_t HostConvShape::WorkspaceSize() const
+{
+    // One patch panel, one output tile and the per-pixel offsets and coordinates
+    return (size_t)KC * NC + (size_t)std::max(in_channels, out_channels) * NC + 4 * NC;
+}
+
+/**
+ * Micro-kernel: tile[m][0..NC) += sum_k A(m,k) * panel[k][0..NC), where
+ * A(m,k) = a[m * a_row + k]. Four rows share each load of a panel row, and
+ * the fixed panel width lets the inner loop vectorize fully.
+ */
+static CPU_INLINE void PanelMultiply(int rows, int depth, const float *a, size_t a_row, const float *panel, float *tile)
+{
+    int m = 0;
+    for (; m + 4 <= rows; m += 4)
+    {
+        float *t0 = tile + (size_t)m * NC, *t1 = t0 + NC, *t2 = t1 + NC, *t3 = t2 + NC;
+        const float *a0 = a + m * a_row, *a1 = a0 + a_row, *a2 = a1 + a_row, *a3 = a2 + a_row;
+        for (int k = 0; k < depth; ++k)
+        {
+            const float *b = panel + (size_t)k * NC;
+            const float w0 = a0[k], w1 = a1[k], w2 = a2[k], w3 = a3[k];
+            for (int j = 0; j < NC; ++j)
+            {
+                t0[j] += w0 * b[j];
+                t1[j] += w1 * b[j];
+                t2[j] += w2 * b[j];
+                t3[j] += w3 * b[j];
+            }
+        }
+    }
+    for (; m < rows; ++m)
+    {
+        float *t = tile + (size_t)m * NC;
+        const float *am = a + m * a_row;
+        for (int k = 0; k < depth; ++k)
+        {
+            const float *b = panel + (size_t)k * NC;
+            for (int j = 0; j < NC; ++j)
+                t[j] += am[k] * b[j];
+        }
+    }
+}
+
+/**
+ * Gathers the input patches of output pixels [p0, p0 + nc) for reduction
+ * steps [k0, k0 + kc) into panel[kc][NC], zero-filling unused columns.
+ * "offsets" holds the input offset of each pixel's top-left patch element.
+ */
+static CPU_INLINE void PackPatches(const float *in, const HostConvShape& s, const size_t *offsets, int nc,
+                        int k0, int kc, float *panel)
+{
+    const int K = s.kernel_size;
+    const size_t plane = (size_t)s.in_height * s.in_width;
+    for (int k = 0; k < kc; ++k)
+    {
+        const int c = (k0 + k) / (K * K), ky = (k0 + k) / K % K, kx = (k0 + k) % K;
+        const float *src = in + c * plane + ky * s.in_width + kx;
+        float *dst = panel + (size_t)k * NC;
+        for (int j = 0; j < nc; ++j)
+            dst[j] = src[offsets[j]];
+        for (int j = nc; j < NC; ++j)
+            dst[j] = 0.0f;
+    }
+}
+
+/**
+ * Computes the offset of each output pixel's patch origin in the input, for
+ * pixels [p0, p0 + nc) in (image, y, x) order.
+ */
+static CPU_INLINE void PatchOffsets(const HostConvShape& s, size_t p0, int nc, size_t *offsets)
+{
+    const int OW = s.OutWidth(), OH = s.OutHeight();
+    for (int j = 0; j < nc; ++j)
+    {
+        const size_t p = p0 + j;
+        const size_t n = p / ((size_t)OH * OW);
+        const int y = (int)(p / OW % OH), x = (int)(p % OW);
+        offsets[j] = (n * s.in_channels * s.in_height + y) * s.in_width + x;
+    }
+}
+
+/// Panel multiplication of the forward pass, for panels of "kc" reduction steps.
+static JitPanelShape ForwardPanelShape(const HostConvShape& s, int kc)
+{
+    JitPanelShape shape;
+    shape.rows = s.out_channels;
+    shape.depth = kc;
+    shape.a_row = s.in_channels * s.kernel_size * s.kernel_size;
+    shape.width = NC;
+    return shape;
+}
+
+/// Panel multiplication of the data-gradient pass (one output channel per call).
+static JitPanelShape BackwardDataPanelShape(const HostConvShape& s)
+{
+    JitPanelShape shape;
+    shape.rows = s.in_channels;
+    shape.depth = shape.a_row = s.kernel_size * s.kernel_size;
+    shape.width = NC;
+    return shape;
+}
+
+int HostConvPrepare(const HostConvShape& s)
+{
+    const int depth = s.in_channels * s.kernel_size * s.kernel_size;
+    std::vector<JitPanelShape> shapes;
+    if (depth >= KC)
+        shapes.push_back(ForwardPanelShape(s, KC));
+    if (depth % KC)
+        shapes.push_back(ForwardPanelShape(s, depth % KC));
+    shapes.push_back(BackwardDataPanelShape(s));
+
+    int generated = 0;
+    for (auto&& shape : shapes)
+    {
+        if (JitCompilePanelKernel(shape))
+            ++generated;
+    }
+    return generated;
+}
+
+// The entry points are compiled once per instruction set (see cpudispatch.h)
+
+static CPU_INLINE void ConvForward(const HostConvShape& s, const float *in, const float *weights, const float *bias,
+                                   float *out, float *workspace)
+{
+    const int O = s.out_channels, OH = s.OutHeight(), OW = s.OutWidth();
+    const int depth = s.in_channels * s.kernel_size * s.kernel_size;
+    const size_t pixels = (size_t)s.batch_size * OH * OW;
+
+    float *panel = workspace;
+    float *tile = panel + (size_t)KC * NC;
+    size_t *offsets = reinterpret_cast<size_t *>(tile + (size_t)std::max(s.in_channels, O) * NC);
+
+    // Kernels generated for this shape by HostConvPrepare, if any
+    const JitPanelKernel jit_full = JitFindPanelKernel(ForwardPanelShape(s, KC));
+    const JitPanelKernel jit_tail = JitFindPanelKernel(ForwardPanelShape(s, depth % KC));
+
+    for (size_t p0 = 0; p0 < pixels; p0 += NC)
+    {
+        const int nc = (int)std::min((size_t)NC, pixels - p0);
+        PatchOffsets(s, p0, nc, offsets);
+
+        memset(tile, 0, sizeof(float) * O * NC);
+        for (int k0 = 0; k0 < depth; k0 += KC)
+        {
+            const int kc = std::min(KC, depth - k0);
+            PackPatches(in, s, offsets, nc, k0, kc, panel);
+            JitPanelKernel jit = (kc == KC) ? jit_full : jit_tail;
+            if (jit)
+                jit(weights + k0, panel, tile);
+            else
+                PanelMultiply(O, kc, weights + k0, depth, panel, tile);
+        }
+
+        // Scatter the tile back to NCHW
+        for (int j = 0; j < nc; ++j)
+        {
+            const size_t p = p0 + j;
+            const size_t n = p / ((size_t)OH * OW), yx = p % ((size_t)OH * OW);
+            for (int o = 0; o < O; ++o)
+                out[(n * O + o) * OH * OW + yx] = tile[(size_t)o * NC + j] + bias[o];
+        }
+    }
+}
+
+static CPU_INLINE void ConvBackwardData(const HostConvShape& s, const float *dout, const float *weights,
+                                        float *din, float *workspace)
+{
+    const int C = s.in_channels, O = s.out_channels, K = s.kernel_size;
+    const int IH = s.in_height, IW = s.in_width, OH = s.OutHeight(), OW = s.OutWidth();
+    const size_t pixels = (size_t)s.batch_size * IH * IW;
+
+    // The reduction runs over (o, ky, kx); a panel holds whole output channels,
+    // so that the weights of each one are a contiguous C x (K*K) matrix
+    const int kk = K * K;
+    const int channels_per_panel = std::max(1, KC / kk);
+
+    float *panel = workspace;
+    float *tile = panel + (size_t)KC * NC;
+    size_t *bases = reinterpret_cast<size_t *>(tile + (size_t)std::max(C, O) * NC);
+    int *ys = reinterpret_cast<int *>(bases + NC), *xs = ys + NC;
+
+    const JitPanelKernel jit = JitFindPanelKernel(BackwardDataPanelShape(s));
+
+    for (size_t p0 = 0; p0 < pixels; p0 += NC)
+    {
+        // Image offset in dout and input coordinates of every pixel
+        const int nc = (int)std::min((size_t)NC, pixels - p0);
+        for (int j = 0; j < nc; ++j)
+        {
+            const size_t p = p0 + j;
+            bases[j] = p / ((size_t)IH * IW) * O * OH * OW;
+            ys[j] = (int)(p / IW % IH);
+            xs[j] = (int)(p % IW);
+        }
+
+        memset(tile, 0, sizeof(float) * C * NC);
+        for (int o0 = 0; o0 < O; o0 += channels_per_panel)
+        {
+            const int oc = std::min(channels_per_panel, O - o0);
+
+            // Gather dout[n][o][iy - ky][ix - kx], zero outside the output
+            for (int k = 0; k < oc * kk; ++k)
+            {
+                const int o = o0 + k / kk, ky = k % kk / K, kx = k % K;
+                const float *src = dout + (size_t)o * OH * OW;
+                float *dst = panel + (size_t)k * NC;
+                for (int j = 0; j < nc; ++j)
+                {
+                    const int y = ys[j] - ky, x = xs[j] - kx;
+                    dst[j] = (y >= 0 && y < OH && x >= 0 && x < OW) ? src[bases[j] + y * OW + x] : 0.0f;
+                }
+                for (int j = nc; j < NC; ++j)
+                    dst[j] = 0.0f;
+            }
+
+            for (int o = 0; o < oc; ++o)
+            {
+                const float *w = weights + (size_t)(o0 + o) * C * kk, *b = panel + (size_t)o * kk * NC;
+                if (jit)
+                    jit(w, b, tile);
+                else
+                    PanelMultiply(C, kk, w, kk, b, tile);
+            }
+        }
+
+        for (int j = 0; j < nc; ++j)
+        {
+            const size_t p = p0 + j;
+            const size_t n = p / ((size_t)IH * IW), yx = p % ((size_t)IH * IW);
+            for (int c = 0; c < C; ++c)
+                din[(n * C + c) * IH * IW + yx] = tile[(size_t)c * NC + j];
+        }
+    }
+}
+
+static CPU_INLINE void ConvBackwardFilter(const HostConvShape& s, const float *in, const float *dout,
+                                          float *dweights, float *dbias, float *workspace)
+{
+    const int O = s.out_channels, OH = s.OutHeight(), OW = s.OutWidth();
+    const int depth = s.in_channels * s.kernel_size * s.kernel_size;
+    const size_t pixels = (size_t)s.batch_size * OH * OW;
+
+    float *panel = workspace;
+    float *dout_panel = panel + (size_t)KC * NC;
+    size_t *offsets = reinterpret_cast<size_t *>(dout_panel + (size_t)std::max(s.in_channels, O) * NC);
+
+    memset(dweights, 0, sizeof(float) * O * depth);
+    memset(dbias, 0, sizeof(float) * O);
+
+    for (size_t p0 = 0; p0 < pixels; p0 += NC)
+    {
+        const int nc = (int)std::min((size_t)NC, pixels - p0);
+        PatchOffsets(s, p0, nc, offsets);
+
+        // Gather the output gradients of the pixels, zero-padded to the panel width
+        for (int o = 0; o < O; ++o)
+        {
+            float *dst = dout_panel + (size_t)o * NC;
+            for (int j = 0; j < nc; ++j)
+            {
+                const size_t p = p0 + j;
+                const size_t n = p / ((size_t)OH * OW), yx = p % ((size_t)OH * OW);
+                dst[j] = dout[(n * O + o) * OH * OW + yx];
+                dbias[o] += dst[j];
+            }
+            for (int j = nc; j < NC; ++j)
+                dst[j] = 0.0f;
+        }
+
+        // dW[o][k] += dot(dout_panel[o], panel[k])
+        for (int k0 = 0; k0 < depth; k0 += KC)
+        {
+            const int kc = std::min(KC, depth - k0);
+            PackPatches(in, s, offsets, nc, k0, kc, panel);
+            for (int o = 0; o < O; ++o)
+            {
+                const float *g = dout_panel + (size_t)o * NC;
+                float *dw = dweights + (size_t)o * depth + k0;
+                for (int k = 0; k < kc; ++k)
+                {
+                    // Eight independent partial sums, so that the reduction vectorizes
+                    const float *b = panel + (size_t)k * NC;
+                    float sum[8] = { 0 };
+                    for (int j = 0; j < NC; j += 8)
+                        for (int l = 0; l < 8; ++l)
+                            sum[l] += g[j + l] * b[j + l];
+                    dw[k] += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+                }
+            }
+        }
+    }
+}
+
+CPU_MULTIVERSION(ConvForwardIsa,
+                 (const HostConvShape& s, const float *in, const float *weights, const float *bias, float *out, float *workspace),
+                 ConvForward(s, in, weights, bias, out, workspace))
+CPU_MULTIVERSION(ConvBackwardDataIsa,
+                 (const HostConvShape& s, const float *dout, const float *weights, float *din, float *workspace),
+                 ConvBackwardData(s, dout, weights, din, workspace))
+CPU_MULTIVERSION(ConvBackwardFilterIsa,
+                 (const HostConvShape& s, const float *in, const float *dout, float *dweights, float *dbias, float *workspace),
+                 ConvBackwardFilter(s, in, dout, dweights, dbias, workspace))
+
+void HostConvForward(const HostConvShape& s, const float *in, const float *weights, const float *bias,
+                     float *out, float *workspace)
+{
+    CPU_DISPATCH(ConvForwardIsa, (s, in, weights, bias, out, workspace));
+}
+
+void HostConvBackwardData(const HostConvShape& s, const float *dout, const float *weights,
+                          float *din, float *workspace)
+{
+    CPU_DISPATCH(ConvBackwardDataIsa, (s, dout, weights, din, workspace));
+}
+
+void HostConvBackwardFilter(const HostConvShape& s, const float *in, const float *dout,
+                            float *dweights, float *dbias, float *workspace)
+{
+    CPU_DISPATCH(ConvBackwardFilterIsa, (s, in, dout, dweights, dbias, workspace));
+}
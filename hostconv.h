@@ -0,0 +1,72 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_HOSTCONV_H
+#define __CUDNN_TRAINING_HOSTCONV_H
+
+#include <cstddef>
+
+// Number of output pixels (GEMM columns) per packed patch panel
+#define HOSTCONV_PANEL_WIDTH 64
+
+// Number of GEMM reduction steps per packed patch panel
+#define HOSTCONV_PANEL_DEPTH 128
+
+/**
+ * Shape of a valid (unpadded), unit-stride convolution on NCHW tensors, with
+ * weights laid out as [out_channels][in_channels][kernel_size][kernel_size].
+ */
+struct HostConvShape
+{
+    int batch_size;
+    int in_channels, in_height, in_width;
+    int out_channels, kernel_size;
+
+    int OutHeight() const { return in_height - kernel_size + 1; }
+    int OutWidth() const { return in_width - kernel_size + 1; }
+
+    /// Number of floats the workspace of every HostConv function must hold.
+    size_t WorkspaceSize() const;
+};
+
+/*
+ * Implicit-GEMM convolution. Each pass views the convolution as a GEMM over
+ * (channel, ky, kx) x (image, y, x), but instead of materializing the whole
+ * im2col matrix, the patches of HOSTCONV_PANEL_WIDTH pixels are gathered into
+ * one HOSTCONV_PANEL_DEPTH-deep panel at a time, right before the panel is
+ * multiplied. The workspace is a single panel plus one output tile.
+ */
+
+/**
+ * Generates (see jit.h) the micro-kernels of the forward and data-gradient
+ * passes for this exact shape, so that later calls with the same shape run
+ * them instead of the generic micro-kernel. Kernels are cached per shape, so
+ * preparing the same shape again is cheap.
+ *
+ * @return The number of kernels available for the shape (0 if the host does
+ *         not support generated code).
+ */
+int HostConvPrepare(const HostConvShape& shape);
+
+/// Forward pass: out = conv(in, weights) + bias.
+void HostConvForward(const HostConvShape& shape, const float *in, const float *weights, const float *bias,
+                     float *out, float *workspace);
+
+/// Gradient with respect to the input: din = full correlation of dout with the flipped weights.
+void HostConvBackwardData(const HostConvShape& shape, const float *dout, const float *weights,
+                          float *din, float *workspace);
+
+/// Gradients with respect to the weights and bias (overwritten, not accumulated).
+void HostConvBackwardFilter(const HostConvShape& shape, const float *in, const float *dout,
+                            float *dweights, float *dbias, float *workspace);
+
+#endif  // __CUDNN_TRAINING_HOSTCONV_H
@@ -0,0 +1,513 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hostlenet.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <thread>
+
+#include "cpudispatch.h"
+
+HostLeNet::HostLeNet(int channels_, int width_, int height_, int classes_) :
+    channels(channels_), width(width_), height(height_), classes(classes_)
+{
+    conv1 = { 1, channels, height, width, 20, 5 };
+    conv2 = { 1, conv1.out_channels, conv1.OutHeight() / HOST_LENET_POOL, conv1.OutWidth() / HOST_LENET_POOL, 50, 5 };
+    fc1 = { 1, conv2.out_channels * (conv2.OutHeight() / HOST_LENET_POOL) * (conv2.OutWidth() / HOST_LENET_POOL),
+            1, 1, 500, 1 };
+    fc2 = { 1, fc1.out_channels, 1, 1, classes, 1 };
+
+    if (conv2.OutHeight() < HOST_LENET_POOL || conv2.OutWidth() < HOST_LENET_POOL)
+    {
+        printf("ERROR: %dx%d images are too small for LeNet\n", width, height);
+        exit(1);
+    }
+
+    const HostConvShape *layers[] = { &conv1, &conv2, &fc1, &fc2 };
+    size_t offset = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        const HostConvShape& s = *layers[i];
+        offsets[2 * i] = offset;
+        offset += (size_t)s.out_channels * s.in_channels * s.kernel_size * s.kernel_size;
+        offsets[2 * i + 1] = offset;
+        offset += s.out_channels;
+    }
+    offsets[HOST_LENET_NUM_PARAMS] = offset;
+}
+
+void HostLeNet::Randomize(float *params, std::mt19937& gen) const
+{
+    // Xavier weight filling, with the same ranges as trainlenet (biases included)
+    const float ranges[] =
+    {
+        sqrtf(3.0f / (conv1.kernel_size * conv1.kernel_size * conv1.in_channels)),
+        sqrtf(3.0f / (conv2.kernel_size * conv2.kernel_size * conv2.in_channels)),
+        sqrtf(3.0f / (fc1.in_channels * fc1.out_channels)),
+        sqrtf(3.0f / (fc2.in_channels * fc2.out_channels)),
+    };
+    for (int p = 0; p < HOST_LENET_NUM_PARAMS; ++p)
+    {
+        std::uniform_real_distribution<> dist(-ranges[p / 2], ranges[p / 2]);
+        for (size_t i = offsets[p]; i < offsets[p + 1]; ++i)
+            params[i] = static_cast<float>(dist(gen));
+    }
+}
+
+void HostLeNet::Prepare(int batch_size) const
+{
+    for (HostConvShape s : { conv1, conv2, fc1, fc2 })
+    {
+        s.batch_size = batch_size;
+        HostConvPrepare(s);
+    }
+}
+
+static size_t OutputSize(const HostConvShape& s, int batch_size)
+{
+    return (size_t)batch_size * s.out_channels * s.OutHeight() * s.OutWidth();
+}
+
+HostLeNetBuffers::HostLeNetBuffers(const HostLeNet& net, int batch_size_) : batch_size(batch_size_)
+{
+    const size_t pooled1 = OutputSize(net.conv1, batch_size) / (HOST_LENET_POOL * HOST_LENET_POOL);
+    const size_t pooled2 = OutputSize(net.conv2, batch_size) / (HOST_LENET_POOL * HOST_LENET_POOL);
+
+    conv1.resize(OutputSize(net.conv1, batch_size));
+    dconv1.resize(conv1.size());
+    pool1.resize(pooled1);
+    dpool1.resize(pooled1);
+    pool1_argmax.resize(pooled1);
+    conv2.resize(OutputSize(net.conv2, batch_size));
+    dconv2.resize(conv2.size());
+    pool2.resize(pooled2);
+    dpool2.resize(pooled2);
+    pool2_argmax.resize(pooled2);
+    fc1.resize(OutputSize(net.fc1, batch_size));
+    dfc1.resize(fc1.size());
+    fc2.resize(OutputSize(net.fc2, batch_size));
+    dfc2.resize(fc2.size());
+    fc1_active.resize(net.fc1.out_channels);
+    grads.resize(net.NumParams());
+
+    size_t workspace_size = 0;
+    for (HostConvShape s : { net.conv1, net.conv2, net.fc1, net.fc2 })
+    {
+        s.batch_size = batch_size;
+        workspace_size = std::max(workspace_size, s.WorkspaceSize());
+    }
+    workspace.resize(workspace_size);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Layers without parameters
+
+/**
+ * HOST_LENET_POOL-wide max-pooling of "planes" HxW planes. Records the index of
+ * each maximum within its plane, for the backward pass.
+ */
+static void MaxPoolForward(const float *in, int planes, int in_height, int in_width, float *out, uint32_t *argmax)
+{
+    const int out_height = in_height / HOST_LENET_POOL, out_width = in_width / HOST_LENET_POOL;
+    for (int p = 0; p < planes; ++p)
+    {
+        const float *plane = in + (size_t)p * in_height * in_width;
+        for (int y = 0; y < out_height; ++y)
+        {
+            for (int x = 0; x < out_width; ++x)
+            {
+                float best = -FLT_MAX;
+                uint32_t best_index = 0;
+                for (int dy = 0; dy < HOST_LENET_POOL; ++dy)
+                {
+                    for (int dx = 0; dx < HOST_LENET_POOL; ++dx)
+                    {
+                        const uint32_t index = (y * HOST_LENET_POOL + dy) * in_width + x * HOST_LENET_POOL + dx;
+                        if (plane[index] > best)
+                        {
+                            best = plane[index];
+                            best_index = index;
+                        }
+                    }
+                }
+                *out++ = best;
+                *argmax++ = best_index;
+            }
+        }
+    }
+}
+
+/// Routes each output gradient to the input that was the maximum of its window.
+static void MaxPoolBackward(const float *dout, const uint32_t *argmax, int planes, int in_height, int in_width,
+                            float *din)
+{
+    const size_t in_plane = (size_t)in_height * in_width;
+    const size_t out_plane = (size_t)(in_height / HOST_LENET_POOL) * (in_width / HOST_LENET_POOL);
+    memset(din, 0, planes * in_plane * sizeof(float));
+    for (int p = 0; p < planes; ++p)
+        for (size_t i = 0; i < out_plane; ++i)
+            din[p * in_plane + argmax[p * out_plane + i]] = dout[p * out_plane + i];
+}
+
+/// In-place softmax over each row of a [count][classes] array.
+static void Softmax(float *values, int count, int classes)
+{
+    for (int n = 0; n < count; ++n, values += classes)
+    {
+        const float max_value = *std::max_element(values, values + classes);
+        float sum = 0.0f;
+        for (int c = 0; c < classes; ++c)
+        {
+            values[c] = expf(values[c] - max_value);
+            sum += values[c];
+        }
+        for (int c = 0; c < classes; ++c)
+            values[c] /= sum;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Training
+
+static HostConvShape Batched(HostConvShape s, int batch_size)
+{
+    s.batch_size = batch_size;
+    return s;
+}
+
+static void CheckBatch(int count, const HostLeNetBuffers& b)
+{
+    if (count > b.batch_size)
+    {
+        printf("ERROR: Batch of %d images exceeds buffers for %d\n", count, b.batch_size);
+        exit(1);
+    }
+}
+
+/// The layers after pool1 (conv2 to the softmax), reading b.pool1.
+static void ForwardFromPool1(const HostLeNet& net, const float *p, int count, HostLeNetBuffers& b)
+{
+    const size_t *o = net.offsets;
+    const HostConvShape conv2 = Batched(net.conv2, count), fc1 = Batched(net.fc1, count);
+    const HostConvShape fc2 = Batched(net.fc2, count);
+
+    HostConvForward(conv2, &b.pool1[0], p + o[HOST_CONV2_WEIGHTS], p + o[HOST_CONV2_BIAS], &b.conv2[0], &b.workspace[0]);
+    MaxPoolForward(&b.conv2[0], count * conv2.out_channels, conv2.OutHeight(), conv2.OutWidth(),
+                   &b.pool2[0], &b.pool2_argmax[0]);
+    HostConvForward(fc1, &b.pool2[0], p + o[HOST_FC1_WEIGHTS], p + o[HOST_FC1_BIAS], &b.fc1[0], &b.workspace[0]);
+    for (size_t i = 0; i < (size_t)count * fc1.out_channels; ++i)
+        b.fc1[i] = std::max(b.fc1[i], 0.0f);
+    HostConvForward(fc2, &b.fc1[0], p + o[HOST_FC2_WEIGHTS], p + o[HOST_FC2_BIAS], &b.fc2[0], &b.workspace[0]);
+    Softmax(&b.fc2[0], count, net.classes);
+}
+
+/**
+ * Loss of a forward pass, and the gradients of every layer after pool1, back
+ * to b.dpool1 (the gradient of pool1's output).
+ *
+ * @return The mean loss of the batch.
+ */
+static float BackwardToPool1(const HostLeNet& net, const float *p, const uint8_t *labels, int count,
+                             HostLeNetBuffers& b)
+{
+    float *g = &b.grads[0];
+    const size_t *o = net.offsets;
+    const HostConvShape conv2 = Batched(net.conv2, count), fc1 = Batched(net.fc1, count);
+    const HostConvShape fc2 = Batched(net.fc2, count);
+
+    // Softmax cross-entropy: dloss/dfc2 = (probabilities - one-hot label) / batch size
+    double loss = 0.0;
+    const float scale = 1.0f / count;
+    for (int n = 0; n < count; ++n)
+    {
+        const float *probs = &b.fc2[(size_t)n * net.classes];
+        float *dprobs = &b.dfc2[(size_t)n * net.classes];
+        loss -= log(std::max(probs[labels[n]], FLT_MIN));
+        for (int c = 0; c < net.classes; ++c)
+            dprobs[c] = (probs[c] - (c == labels[n] ? 1.0f : 0.0f)) * scale;
+    }
+
+    HostConvBackwardFilter(fc2, &b.fc1[0], &b.dfc2[0], g + o[HOST_FC2_WEIGHTS], g + o[HOST_FC2_BIAS], &b.workspace[0]);
+    HostConvBackwardData(fc2, &b.dfc2[0], p + o[HOST_FC2_WEIGHTS], &b.dfc1[0], &b.workspace[0]);
+
+    // ReLU, noting which units pass any gradient back (the others' FC1 rows get none)
+    std::fill(b.fc1_active.begin(), b.fc1_active.end(), 0);
+    for (int n = 0; n < count; ++n)
+    {
+        for (int u = 0; u < fc1.out_channels; ++u)
+        {
+            const size_t i = (size_t)n * fc1.out_channels + u;
+            if (b.fc1[i] > 0.0f)
+                b.fc1_active[u] = 1;
+            else
+                b.dfc1[i] = 0.0f;
+        }
+    }
+
+    HostConvBackwardFilter(fc1, &b.pool2[0], &b.dfc1[0], g + o[HOST_FC1_WEIGHTS], g + o[HOST_FC1_BIAS], &b.workspace[0]);
+    HostConvBackwardData(fc1, &b.dfc1[0], p + o[HOST_FC1_WEIGHTS], &b.dpool2[0], &b.workspace[0]);
+    MaxPoolBackward(&b.dpool2[0], &b.pool2_argmax[0], count * conv2.out_channels, conv2.OutHeight(), conv2.OutWidth(),
+                    &b.dconv2[0]);
+
+    HostConvBackwardFilter(conv2, &b.pool1[0], &b.dconv2[0], g + o[HOST_CONV2_WEIGHTS], g + o[HOST_CONV2_BIAS],
+                           &b.workspace[0]);
+    HostConvBackwardData(conv2, &b.dconv2[0], p + o[HOST_CONV2_WEIGHTS], &b.dpool1[0], &b.workspace[0]);
+
+    return static_cast<float>(loss / count);
+}
+
+void HostLeNetForward(const HostLeNet& net, const float *params, const float *images, int count,
+                      HostLeNetBuffers& b)
+{
+    CheckBatch(count, b);
+    const float *p = params;
+    const size_t *o = net.offsets;
+    const HostConvShape conv1 = Batched(net.conv1, count);
+
+    HostConvForward(conv1, images, p + o[HOST_CONV1_WEIGHTS], p + o[HOST_CONV1_BIAS], &b.conv1[0], &b.workspace[0]);
+    MaxPoolForward(&b.conv1[0], count * conv1.out_channels, conv1.OutHeight(), conv1.OutWidth(),
+                   &b.pool1[0], &b.pool1_argmax[0]);
+    ForwardFromPool1(net, p, count, b);
+}
+
+float HostLeNetGradients(const HostLeNet& net, const float *params, const float *images, const uint8_t *labels,
+                         int count, HostLeNetBuffers& b)
+{
+    HostLeNetForward(net, params, images, count, b);
+    const float loss = BackwardToPool1(net, params, labels, count, b);
+
+    float *g = &b.grads[0];
+    const size_t *o = net.offsets;
+    const HostConvShape conv1 = Batched(net.conv1, count);
+    MaxPoolBackward(&b.dpool1[0], &b.pool1_argmax[0], count * conv1.out_channels, conv1.OutHeight(), conv1.OutWidth(),
+                    &b.dconv1[0]);
+    HostConvBackwardFilter(conv1, images, &b.dconv1[0], g + o[HOST_CONV1_WEIGHTS], g + o[HOST_CONV1_BIAS],
+                           &b.workspace[0]);
+    return loss;
+}
+
+/// y += a * x
+static CPU_INLINE void Axpy(size_t n, float a, const float *x, float *y)
+{
+    for (size_t i = 0; i < n; ++i)
+        y[i] += a * x[i];
+}
+
+CPU_MULTIVERSION(AxpyIsa, (size_t n, float a, const float *x, float *y), Axpy(n, a, x, y))
+
+static void HostAxpy(size_t n, float a, const float *x, float *y)
+{
+    CPU_DISPATCH(AxpyIsa, (n, a, x, y));
+}
+
+/// delta = moving_rate * (local - center); local -= delta; center += delta
+static CPU_INLINE void Elastic(size_t n, float moving_rate, float *local, float *center)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        const float delta = moving_rate * (local[i] - center[i]);
+        local[i] -= delta;
+        center[i] += delta;
+    }
+}
+
+CPU_MULTIVERSION(ElasticIsa, (size_t n, float moving_rate, float *local, float *center),
+                 Elastic(n, moving_rate, local, center))
+
+void HostLeNetSgdStep(const HostLeNet& net, float *params, float learning_rate, const HostLeNetBuffers& b)
+{
+    const float *g = &b.grads[0];
+    const size_t *o = net.offsets;
+
+    // Everything before FC1 is small and dense
+    HostAxpy(o[HOST_FC1_WEIGHTS], -learning_rate, g, params);
+
+    // FC1 row by row, leaving the rows of inactive units (and their cache lines) untouched
+    const size_t inputs = net.fc1.in_channels;
+    for (int u = 0; u < net.fc1.out_channels; ++u)
+    {
+        if (!b.fc1_active[u])
+            continue;
+        HostAxpy(inputs, -learning_rate, g + o[HOST_FC1_WEIGHTS] + u * inputs, params + o[HOST_FC1_WEIGHTS] + u * inputs);
+        params[o[HOST_FC1_BIAS] + u] -= learning_rate * g[o[HOST_FC1_BIAS] + u];
+    }
+
+    HostAxpy(o[HOST_LENET_NUM_PARAMS] - o[HOST_FC2_WEIGHTS], -learning_rate, g + o[HOST_FC2_WEIGHTS],
+             params + o[HOST_FC2_WEIGHTS]);
+}
+
+size_t HostLeNetErrors(const HostLeNet& net, const float *params, const float *images, const uint8_t *labels,
+                       size_t count, HostLeNetBuffers& b, double *mean_loss)
+{
+    const size_t image_size = (size_t)net.channels * net.width * net.height;
+    size_t errors = 0;
+    double loss = 0.0;
+    for (size_t begin = 0; begin < count; begin += b.batch_size)
+    {
+        const int n = (int)std::min((size_t)b.batch_size, count - begin);
+        HostLeNetForward(net, params, images + begin * image_size, n, b);
+        for (int i = 0; i < n; ++i)
+        {
+            const float *probs = &b.fc2[(size_t)i * net.classes];
+            if (std::max_element(probs, probs + net.classes) - probs != labels[begin + i])
+                ++errors;
+            loss -= log(std::max(probs[labels[begin + i]], FLT_MIN));
+        }
+    }
+    if (mean_loss)
+        *mean_loss = count > 0 ? loss / count : 0.0;
+    return errors;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Elastic averaging
+
+// Stripes are whole cache lines of floats, so that no two locks guard the same line
+#define ELASTIC_STRIPE_ALIGNMENT 16
+
+HostElasticCenter::HostElasticCenter(const std::vector<float>& initial) : params(initial)
+{
+    const size_t stripe = (params.size() + HOST_ELASTIC_STRIPES - 1) / HOST_ELASTIC_STRIPES;
+    m_stripe_size = (stripe + ELASTIC_STRIPE_ALIGNMENT - 1) / ELASTIC_STRIPE_ALIGNMENT * ELASTIC_STRIPE_ALIGNMENT;
+}
+
+void HostElasticCenter::ElasticUpdate(float *local, float moving_rate, int first_stripe)
+{
+    for (int i = 0; i < HOST_ELASTIC_STRIPES; ++i)
+    {
+        const int stripe = (first_stripe + i) % HOST_ELASTIC_STRIPES;
+        const size_t begin = std::min(stripe * m_stripe_size, params.size());
+        const size_t end = std::min(begin + m_stripe_size, params.size());
+        if (begin == end)
+            continue;
+
+        std::lock_guard<std::mutex> lock(m_locks[stripe]);
+        CPU_DISPATCH(ElasticIsa, (end - begin, moving_rate, local + begin, &params[begin]));
+    }
+}
+
+void HostElasticCenter::CopyTo(float *dst)
+{
+    for (int stripe = 0; stripe < HOST_ELASTIC_STRIPES; ++stripe)
+    {
+        const size_t begin = std::min(stripe * m_stripe_size, params.size());
+        const size_t end = std::min(begin + m_stripe_size, params.size());
+
+        std::lock_guard<std::mutex> lock(m_locks[stripe]);
+        std::copy(params.begin() + begin, params.begin() + end, dst + begin);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Model groups
+
+/// Runs fn(i) for every i in [0, count) on up to "threads" threads (the caller's included).
+template<typename Function>
+static void ParallelFor(int count, int threads, Function fn)
+{
+    threads = std::max(1, std::min(threads, count));
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t)
+    {
+        workers.emplace_back([&fn, t, count, threads]()
+        {
+            for (int i = t; i < count; i += threads)
+                fn(i);
+        });
+    }
+    for (int i = 0; i < count; i += threads)
+        fn(i);
+    for (auto&& worker : workers)
+        worker.join();
+}
+
+HostLeNetGroup::HostLeNetGroup(const HostLeNet& net, int models_, int batch_size_) :
+    models(models_), batch_size(batch_size_)
+{
+    conv1 = Batched(net.conv1, batch_size);
+    conv1.out_channels *= models;
+    HostConvPrepare(conv1);
+
+    conv1_weights.resize(net.ParamSize(HOST_CONV1_WEIGHTS) * models);
+    conv1_bias.resize(net.ParamSize(HOST_CONV1_BIAS) * models);
+    conv1_grads.resize(conv1_weights.size());
+    conv1_bias_grads.resize(conv1_bias.size());
+    conv1_out.resize(OutputSize(conv1, batch_size));
+    dconv1.resize(conv1_out.size());
+    workspace.resize(conv1.WorkspaceSize());
+
+    buffers.reserve(models);
+    for (int k = 0; k < models; ++k)
+        buffers.emplace_back(net, batch_size);
+}
+
+void HostLeNetGroupGradients(const HostLeNet& net, const float *const *params, const float *images,
+                             const uint8_t *labels, int count, const int *counts, HostLeNetGroup& group,
+                             int threads, float *losses)
+{
+    CheckBatch(count, group.buffers[0]);
+    const size_t *o = net.offsets;
+    const size_t weights_size = net.ParamSize(HOST_CONV1_WEIGHTS), bias_size = net.ParamSize(HOST_CONV1_BIAS);
+    const HostConvShape conv1 = Batched(group.conv1, count);
+
+    // Stack the models' conv1 filters, and run conv1 of all models at once
+    for (int k = 0; k < group.models; ++k)
+    {
+        std::copy(params[k] + o[HOST_CONV1_WEIGHTS], params[k] + o[HOST_CONV1_WEIGHTS] + weights_size,
+                  &group.conv1_weights[k * weights_size]);
+        std::copy(params[k] + o[HOST_CONV1_BIAS], params[k] + o[HOST_CONV1_BIAS] + bias_size,
+                  &group.conv1_bias[k * bias_size]);
+    }
+    HostConvForward(conv1, images, &group.conv1_weights[0], &group.conv1_bias[0], &group.conv1_out[0],
+                    &group.workspace[0]);
+
+    // Each image's output holds the channels of model 0, then model 1, ...
+    const int channels = net.conv1.out_channels, height = conv1.OutHeight(), width = conv1.OutWidth();
+    const size_t model_out = (size_t)channels * height * width, image_out = model_out * group.models;
+    const size_t model_pooled = model_out / (HOST_LENET_POOL * HOST_LENET_POOL);
+
+    ParallelFor(group.models, threads, [&](int k)
+    {
+        HostLeNetBuffers& b = group.buffers[k];
+        const int model_count = counts ? std::min(counts[k], count) : count;
+        for (int n = 0; n < model_count; ++n)
+            MaxPoolForward(&group.conv1_out[n * image_out + k * model_out], channels, height, width,
+                           &b.pool1[n * model_pooled], &b.pool1_argmax[n * model_pooled]);
+        ForwardFromPool1(net, params[k], model_count, b);
+        losses[k] = BackwardToPool1(net, params[k], labels, model_count, b);
+        for (int n = 0; n < model_count; ++n)
+            MaxPoolBackward(&b.dpool1[n * model_pooled], &b.pool1_argmax[n * model_pooled], channels, height, width,
+                            &group.dconv1[n * image_out + k * model_out]);
+
+        // Images past the model's batch add nothing to its conv1 gradient
+        for (int n = model_count; n < count; ++n)
+            std::fill_n(&group.dconv1[n * image_out + k * model_out], model_out, 0.0f);
+    });
+
+    // One filter-gradient pass for all models, scattered back to each model's gradients
+    HostConvBackwardFilter(conv1, images, &group.dconv1[0], &group.conv1_grads[0], &group.conv1_bias_grads[0],
+                           &group.workspace[0]);
+    for (int k = 0; k < group.models; ++k)
+    {
+        float *g = &group.buffers[k].grads[0];
+        std::copy(&group.conv1_grads[k * weights_size], &group.conv1_grads[k * weights_size] + weights_size,
+                  g + o[HOST_CONV1_WEIGHTS]);
+        std::copy(&group.conv1_bias_grads[k * bias_size], &group.conv1_bias_grads[k * bias_size] + bias_size,
+                  g + o[HOST_CONV1_BIAS]);
+    }
+}
@@ -0,0 +1,220 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_HOSTLENET_H
+#define __CUDNN_TRAINING_HOSTLENET_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "hostconv.h"
+
+/// Max-pooling window size and stride of the host LeNet (as in trainlenet)
+#define HOST_LENET_POOL 2
+
+/// Number of lock stripes of an elastic center variable
+#define HOST_ELASTIC_STRIPES 64
+
+/// Parameters of the host LeNet, in the order they are stored in its flat parameter buffer.
+enum HostLeNetParam
+{
+    HOST_CONV1_WEIGHTS = 0,
+    HOST_CONV1_BIAS,
+    HOST_CONV2_WEIGHTS,
+    HOST_CONV2_BIAS,
+    HOST_FC1_WEIGHTS,
+    HOST_FC1_BIAS,
+    HOST_FC2_WEIGHTS,
+    HOST_FC2_BIAS,
+    HOST_LENET_NUM_PARAMS
+};
+
+/**
+ * LeNet as trained by trainlenet (conv1, pool1, conv2, pool2, fc1, ReLU, fc2,
+ * softmax; without batch normalization or dropout), trained entirely on the
+ * host with the host convolution kernels. FC layers run as 1x1 convolutions
+ * on 1x1 images, whose weight layout ([outputs][inputs]) is the trainer's.
+ *
+ * All parameters live in one flat float buffer, so that a set of weights is a
+ * single array that threads can share, copy or update with one loop; the
+ * struct only holds the layer shapes and the offset of each parameter.
+ */
+struct HostLeNet
+{
+    int channels, width, height, classes;
+
+    /// Layer shapes (for one image; batch_size is set per call).
+    HostConvShape conv1, conv2, fc1, fc2;
+
+    /// Offset of each parameter in the flat buffer; the last entry is the total size.
+    size_t offsets[HOST_LENET_NUM_PARAMS + 1];
+
+    HostLeNet(int channels, int width, int height, int classes);
+
+    size_t NumParams() const { return offsets[HOST_LENET_NUM_PARAMS]; }
+    size_t ParamSize(HostLeNetParam param) const { return offsets[param + 1] - offsets[param]; }
+
+    /// Xavier-initializes a flat parameter buffer, as trainlenet does.
+    void Randomize(float *params, std::mt19937& gen) const;
+
+    /// Generates host convolution kernels for every layer at "batch_size" (see HostConvPrepare).
+    void Prepare(int batch_size) const;
+};
+
+/**
+ * Activations, gradients and scratch space for mini-batches of up to
+ * "batch_size" images. Each training thread owns one set; none of it is
+ * shared.
+ */
+struct HostLeNetBuffers
+{
+    int batch_size;
+    std::vector<float> conv1, pool1, conv2, pool2, fc1, fc2;
+    std::vector<float> dconv1, dpool1, dconv2, dpool2, dfc1, dfc2;
+    std::vector<uint32_t> pool1_argmax, pool2_argmax;
+    std::vector<float> workspace;
+
+    /// Gradient of the mean loss of the last batch, laid out as the flat parameter buffer.
+    std::vector<float> grads;
+
+    /// Per FC1 output: nonzero if any image of the last batch back-propagated through it.
+    std::vector<uint8_t> fc1_active;
+
+    HostLeNetBuffers(const HostLeNet& net, int batch_size);
+};
+
+/**
+ * Runs "count" (at most batch_size) images through the network. Class
+ * probabilities are left in buffers.fc2, as [count][classes].
+ */
+void HostLeNetForward(const HostLeNet& net, const float *params, const float *images, int count,
+                      HostLeNetBuffers& buffers);
+
+/**
+ * Forward and backward pass over a mini-batch. The gradient of the mean
+ * cross-entropy loss is written to buffers.grads (and buffers.fc1_active).
+ *
+ * "params" may be updated by other threads during the call (see
+ * HostLeNetSgdStep); each layer then sees whatever values it reads.
+ *
+ * @return The mean loss of the batch.
+ */
+float HostLeNetGradients(const HostLeNet& net, const float *params, const float *images, const uint8_t *labels,
+                         int count, HostLeNetBuffers& buffers);
+
+/**
+ * Applies params -= learning_rate * buffers.grads, skipping the rows of FC1
+ * that received no gradient from the last batch (ReLU units that were off
+ * for every image), so that threads update disjoint parts of the largest
+ * layer more often than not.
+ *
+ * The update takes no lock and uses plain (vectorized) loads and stores, as
+ * in Hogwild: threads stepping on the same buffer at once may overwrite some
+ * of each other's updates, which SGD tolerates when they rarely collide.
+ */
+void HostLeNetSgdStep(const HostLeNet& net, float *params, float learning_rate, const HostLeNetBuffers& buffers);
+
+/**
+ * Classifies "count" images in batches of buffers.batch_size.
+ *
+ * @param mean_loss If not null, receives the mean cross-entropy loss of the images.
+ * @return The number of misclassified images.
+ */
+size_t HostLeNetErrors(const HostLeNet& net, const float *params, const float *images, const uint8_t *labels,
+                       size_t count, HostLeNetBuffers& buffers, double *mean_loss = nullptr);
+
+/**
+ * Center variable of EASGD between the threads of one process. Each thread
+ * trains its own replica and periodically moves it and the center towards
+ * each other (the elastic update of trainlenet's UpdateLocalWeights and
+ * UpdateGlobalWeights, without MPI).
+ *
+ * The flat buffer is split into HOST_ELASTIC_STRIPES stripes (of whole
+ * 64-byte lines) with one lock each. A thread locks one stripe at a time, so the
+ * update of every stripe is exact, while threads that start on different
+ * stripes rarely wait for each other.
+ */
+struct HostElasticCenter
+{
+    std::vector<float> params;
+
+    explicit HostElasticCenter(const std::vector<float>& initial);
+
+    // Disable copying
+    HostElasticCenter(const HostElasticCenter&) = delete;
+    HostElasticCenter& operator=(const HostElasticCenter&) = delete;
+
+    /**
+     * Elastic update of a replica: delta = moving_rate * (local - center),
+     * then local -= delta and center += delta, stripe by stripe starting at
+     * "first_stripe" (spread threads over the stripes to avoid contention).
+     */
+    void ElasticUpdate(float *local, float moving_rate, int first_stripe);
+
+    /// Copies the center into "dst" (consistent per stripe).
+    void CopyTo(float *dst);
+
+private:
+    size_t m_stripe_size;
+    std::mutex m_locks[HOST_ELASTIC_STRIPES];
+};
+
+/**
+ * Buffers for training several independent LeNets in lockstep on the same
+ * mini-batches (e.g., a hyperparameter sweep). Since every model reads the
+ * same images, conv1 of all models runs as a single convolution with the
+ * models' filters stacked: the image patches are gathered once instead of
+ * once per model, and the GEMM has "models" times as many rows. The layers
+ * after conv1 run per model, spread over threads.
+ *
+ * Each model keeps its own flat parameter buffer; conv1 weights are gathered
+ * into the stacked filters before each pass and their gradients scattered
+ * back into each model's buffers.grads.
+ */
+struct HostLeNetGroup
+{
+    int models, batch_size;
+
+    /// conv1 of all models, with models * conv1.out_channels output channels.
+    HostConvShape conv1;
+
+    std::vector<float> conv1_weights, conv1_bias, conv1_grads, conv1_bias_grads;
+    std::vector<float> conv1_out, dconv1, workspace;
+
+    /// Per-model activations and gradients.
+    std::vector<HostLeNetBuffers> buffers;
+
+    /// Allocates the buffers and generates the stacked conv1 kernels (see HostConvPrepare).
+    HostLeNetGroup(const HostLeNet& net, int models, int batch_size);
+};
+
+/**
+ * Forward and backward pass of every model of a group over the same
+ * mini-batch. Gradients are written to group.buffers[k].grads, as
+ * HostLeNetGradients does for a single model.
+ *
+ * @param params The flat parameter buffer of each model.
+ * @param count Number of images in the batch.
+ * @param counts If not null, the batch size of each model (at most "count"):
+ *               model k trains on the first counts[k] images of the batch.
+ * @param threads Number of threads to run the per-model layers on.
+ * @param losses The mean loss of each model on its batch.
+ */
+void HostLeNetGroupGradients(const HostLeNet& net, const float *const *params, const float *images,
+                             const uint8_t *labels, int count, const int *counts, HostLeNetGroup& group,
+                             int threads, float *losses);
+
+#endif  // __CUDNN_TRAINING_HOSTLENET_H
@@ -0,0 +1,750 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "inference.h"
+#include "cpudispatch.h"
+#include "sparse.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cfloat>
+#include <cstring>
+#include <cmath>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _WIN32
+    #include <malloc.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Packing helpers
+
+static inline size_t AlignUp(size_t value)
+{
+    return (value + PACKED_ALIGNMENT - 1) / PACKED_ALIGNMENT * PACKED_ALIGNMENT;
+}
+
+static CPU_INLINE size_t NumBlocks(size_t outputs)
+{
+    return (outputs + PACKED_BLOCK - 1) / PACKED_BLOCK;
+}
+
+static CPU_INLINE size_t FanIn(const PackedLayerHeader& layer)
+{
+    return (size_t)layer.inputs * layer.kernel_size * layer.kernel_size;
+}
+
+static inline size_t PackedCount(const PackedLayerHeader& layer)
+{
+    if (layer.format == PACKED_CSR)
+        return layer.nnz;
+    return NumBlocks(layer.outputs) * PACKED_BLOCK * FanIn(layer);
+}
+
+// Number of CSR row pointers and column indices
+static inline size_t IndexCount(const PackedLayerHeader& layer)
+{
+    return layer.outputs + 1 + layer.nnz;
+}
+
+static size_t WeightTypeSize(uint32_t type)
+{
+    switch (type)
+    {
+    case PACKED_FLOAT32:  return sizeof(float);
+    case PACKED_BFLOAT16: return sizeof(uint16_t);
+    case PACKED_INT8:     return sizeof(int8_t);
+    default:              return 0;
+    }
+}
+
+/**
+ * Reorders [outputs][fan_in] weights into [outputs/PACKED_BLOCK][fan_in][PACKED_BLOCK]
+ * panels, zero-padding the last panel.
+ */
+static std::vector<float> PackBlocked(const float *src, size_t outputs, size_t fan_in)
+{
+    std::vector<float> packed(NumBlocks(outputs) * PACKED_BLOCK * fan_in, 0.0f);
+    for (size_t o = 0; o < outputs; ++o)
+    {
+        float *panel = &packed[(o / PACKED_BLOCK) * fan_in * PACKED_BLOCK];
+        for (size_t f = 0; f < fan_in; ++f)
+            panel[f * PACKED_BLOCK + (o % PACKED_BLOCK)] = src[o * fan_in + f];
+    }
+    return packed;
+}
+
+static inline uint16_t FloatToBFloat16(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000)
+        return static_cast<uint16_t>((bits >> 16) | 0x40);   // Keep NaNs quiet
+    // Round to nearest even
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+static CPU_INLINE float Dequantize(float w)    { return w; }
+static CPU_INLINE float Dequantize(int8_t w)   { return static_cast<float>(w); }
+static CPU_INLINE float Dequantize(uint16_t w)
+{
+    uint32_t bits = static_cast<uint32_t>(w) << 16;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Export
+
+bool ParsePackedWeightType(const char *name, PackedWeightType& type)
+{
+    if (!strcmp(name, "float"))
+        type = PACKED_FLOAT32;
+    else if (!strcmp(name, "bf16"))
+        type = PACKED_BFLOAT16;
+    else if (!strcmp(name, "int8"))
+        type = PACKED_INT8;
+    else
+        return false;
+    return true;
+}
+
+static bool WriteSection(FILE *fp, size_t offset, const void *data, size_t bytes, size_t& position)
+{
+    static const uint8_t zeros[PACKED_ALIGNMENT] = { 0 };
+    if (fwrite(zeros, 1, offset - position, fp) != offset - position)
+        return false;
+    if (bytes > 0 && fwrite(data, 1, bytes, fp) != bytes)
+        return false;
+    position = offset + bytes;
+    return true;
+}
+
+bool ExportPackedLeNet(const char *filename, PackedWeightType type,
+                       int channels, int width, int height, int pool_size, int pool_stride,
+                       const PackedLayerSource layers[PACKED_LENET_LAYERS])
+{
+    PackedLeNetHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PACKED_LENET_MAGIC;
+    header.version = PACKED_LENET_VERSION;
+    header.weight_type = type;
+    header.channels = channels;
+    header.width = width;
+    header.height = height;
+    header.pool_size = pool_size;
+    header.pool_stride = pool_stride;
+
+    // Lay out the sections
+    std::vector<CsrMatrix> csr(PACKED_LENET_LAYERS);
+    size_t offset = AlignUp(sizeof(PackedLeNetHeader));
+    for (int i = 0; i < PACKED_LENET_LAYERS; ++i)
+    {
+        PackedLayerHeader& layer = header.layers[i];
+        layer.inputs = layers[i].inputs;
+        layer.outputs = layers[i].outputs;
+        layer.kernel_size = layers[i].kernel_size;
+        layer.in_width = layers[i].in_width;
+        layer.in_height = layers[i].in_height;
+        layer.format = PACKED_DENSE;
+
+        // Store sufficiently sparse (e.g., pruned) fully-connected layers as CSR
+        if (layer.kernel_size == 1)
+        {
+            const size_t count = (size_t)layer.inputs * layer.outputs;
+            const size_t zeros = std::count(layers[i].weights, layers[i].weights + count, 0.0f);
+            if (zeros >= PACKED_CSR_MIN_SPARSITY * count)
+            {
+                csr[i].FromDense(layers[i].weights, layer.outputs, layer.inputs);
+                layer.format = PACKED_CSR;
+                layer.nnz = csr[i].nnz();
+            }
+        }
+
+        layer.weights_offset = offset;
+        offset = AlignUp(offset + PackedCount(layer) * WeightTypeSize(type));
+        layer.bias_offset = offset;
+        offset = AlignUp(offset + layer.outputs * sizeof(float));
+        if (type == PACKED_INT8)
+        {
+            layer.scale_offset = offset;
+            offset = AlignUp(offset + NumBlocks(layer.outputs) * PACKED_BLOCK * sizeof(float));
+        }
+        if (layer.format == PACKED_CSR)
+        {
+            layer.index_offset = offset;
+            offset = AlignUp(offset + IndexCount(layer) * sizeof(uint32_t));
+        }
+    }
+    header.file_size = offset;
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        printf("ERROR: Cannot open file %s\n", filename);
+        return false;
+    }
+
+    size_t position = 0;
+    bool ok = WriteSection(fp, 0, &header, sizeof(header), position);
+    for (int i = 0; ok && i < PACKED_LENET_LAYERS; ++i)
+    {
+        const PackedLayerHeader& layer = header.layers[i];
+        const size_t fan_in = FanIn(layer);
+        std::vector<float> packed = (layer.format == PACKED_CSR) ? csr[i].values :
+                                    PackBlocked(layers[i].weights, layer.outputs, fan_in);
+        std::vector<float> scale;
+
+        switch (type)
+        {
+        case PACKED_FLOAT32:
+            ok = WriteSection(fp, layer.weights_offset, packed.data(), packed.size() * sizeof(float), position);
+            break;
+
+        case PACKED_BFLOAT16:
+        {
+            std::vector<uint16_t> bf16(packed.size());
+            for (size_t j = 0; j < packed.size(); ++j)
+                bf16[j] = FloatToBFloat16(packed[j]);
+            ok = WriteSection(fp, layer.weights_offset, bf16.data(), bf16.size() * sizeof(uint16_t), position);
+            break;
+        }
+
+        case PACKED_INT8:
+        {
+            // Symmetric per-output-channel quantization
+            scale.assign(NumBlocks(layer.outputs) * PACKED_BLOCK, 0.0f);
+            for (size_t o = 0; o < layer.outputs; ++o)
+            {
+                float maxabs = 0.0f;
+                for (size_t f = 0; f < fan_in; ++f)
+                    maxabs = std::max(maxabs, fabsf(layers[i].weights[o * fan_in + f]));
+                scale[o] = maxabs / 127.0f;
+            }
+
+            // Output channel of every packed value
+            std::vector<uint32_t> channel(packed.size());
+            if (layer.format == PACKED_CSR)
+            {
+                for (uint32_t r = 0; r < layer.outputs; ++r)
+                    for (uint32_t k = csr[i].row_ptr[r]; k < csr[i].row_ptr[r + 1]; ++k)
+                        channel[k] = r;
+            }
+            else
+            {
+                for (size_t j = 0; j < packed.size(); ++j)
+                    channel[j] = static_cast<uint32_t>((j / (fan_in * PACKED_BLOCK)) * PACKED_BLOCK + j % PACKED_BLOCK);
+            }
+
+            std::vector<int8_t> q(packed.size());
+            for (size_t j = 0; j < packed.size(); ++j)
+            {
+                float s = scale[channel[j]];
+                q[j] = (s > 0.0f) ? static_cast<int8_t>(lrintf(packed[j] / s)) : 0;
+            }
+            ok = WriteSection(fp, layer.weights_offset, q.data(), q.size(), position);
+            break;
+        }
+        }
+
+        ok = ok && WriteSection(fp, layer.bias_offset, layers[i].bias, layer.outputs * sizeof(float), position);
+        if (ok && type == PACKED_INT8)
+            ok = WriteSection(fp, layer.scale_offset, &scale[0], scale.size() * sizeof(float), position);
+        if (ok && layer.format == PACKED_CSR)
+        {
+            ok = WriteSection(fp, layer.index_offset, &csr[i].row_ptr[0], csr[i].row_ptr.size() * sizeof(uint32_t), position) &&
+                 WriteSection(fp, position, csr[i].col_idx.data(), csr[i].col_idx.size() * sizeof(uint32_t), position);
+        }
+    }
+    // Pad the file to its declared size
+    ok = ok && WriteSection(fp, header.file_size, nullptr, 0, position);
+    fclose(fp);
+
+    if (!ok)
+        printf("ERROR: Cannot write file %s\n", filename);
+    return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Loading
+
+// True if "bytes" bytes at "offset" lie within a file of "size" bytes
+static bool SectionFits(uint64_t offset, uint64_t bytes, size_t size)
+{
+    return offset <= size && bytes <= size - offset;
+}
+
+/**
+ * Checks everything the forward pass trusts in a mapped model: the sections
+ * lie within the file, each layer's inputs are the (pooled) outputs of the
+ * previous one, as PackedForward and WorkspaceSize lay them out, and CSR row
+ * pointers and column indices stay within their layer.
+ */
+static bool ValidatePackedLeNet(const uint8_t *mapping, size_t mapping_size)
+{
+    if (mapping_size < sizeof(PackedLeNetHeader))
+    {
+        printf("ERROR: Invalid packed model file (truncated header)\n");
+        return false;
+    }
+    const PackedLeNetHeader *header = reinterpret_cast<const PackedLeNetHeader *>(mapping);
+    if (header->magic != PACKED_LENET_MAGIC || header->version != PACKED_LENET_VERSION)
+    {
+        printf("ERROR: Invalid packed model file (magic number or version)\n");
+        return false;
+    }
+    if (header->file_size != mapping_size || WeightTypeSize(header->weight_type) == 0 ||
+        header->channels == 0 || header->width == 0 || header->height == 0 ||
+        header->pool_size == 0 || header->pool_stride == 0)
+    {
+        printf("ERROR: Invalid packed model file (header)\n");
+        return false;
+    }
+
+    // Shape of the activations entering each layer
+    uint64_t channels = header->channels, width = header->width, height = header->height;
+    for (int i = 0; i < PACKED_LENET_LAYERS; ++i)
+    {
+        const PackedLayerHeader& layer = header->layers[i];
+        bool valid = layer.outputs > 0;
+        if (i < 2)
+        {
+            // Convolutions (dense only), each followed by max pooling
+            valid = valid && layer.format == PACKED_DENSE && layer.inputs == channels &&
+                    layer.in_width == width && layer.in_height == height &&
+                    layer.kernel_size > 0 && layer.kernel_size <= width && layer.kernel_size <= height;
+            channels = layer.outputs;
+            width = (width - layer.kernel_size + 1) / header->pool_stride;
+            height = (height - layer.kernel_size + 1) / header->pool_stride;
+            valid = valid && width > 0 && height > 0;
+        }
+        else
+        {
+            valid = valid && (layer.format == PACKED_DENSE || layer.format == PACKED_CSR) &&
+                    layer.inputs == channels * width * height &&
+                    layer.in_width == 1 && layer.in_height == 1 && layer.kernel_size == 1;
+            channels = layer.outputs;
+            width = height = 1;
+        }
+        if (!valid)
+        {
+            printf("ERROR: Invalid packed model file (layer %d shape)\n", i);
+            return false;
+        }
+
+        valid = layer.nnz <= mapping_size &&
+                SectionFits(layer.weights_offset, PackedCount(layer) * WeightTypeSize(header->weight_type), mapping_size) &&
+                SectionFits(layer.bias_offset, layer.outputs * sizeof(float), mapping_size) &&
+                (header->weight_type != PACKED_INT8 ||
+                 SectionFits(layer.scale_offset, NumBlocks(layer.outputs) * PACKED_BLOCK * sizeof(float), mapping_size)) &&
+                (layer.format == PACKED_DENSE ||
+                 SectionFits(layer.index_offset, IndexCount(layer) * sizeof(uint32_t), mapping_size));
+        if (!valid)
+        {
+            printf("ERROR: Invalid packed model file (layer %d)\n", i);
+            return false;
+        }
+
+        if (layer.format == PACKED_CSR)
+        {
+            const uint32_t *row_ptr = reinterpret_cast<const uint32_t *>(mapping + layer.index_offset);
+            const uint32_t *col_idx = row_ptr + layer.outputs + 1;
+            valid = row_ptr[0] == 0 && row_ptr[layer.outputs] == layer.nnz;
+            for (uint32_t r = 0; valid && r < layer.outputs; ++r)
+                valid = row_ptr[r] <= row_ptr[r + 1];
+            const size_t fan_in = FanIn(layer);
+            for (uint64_t k = 0; valid && k < layer.nnz; ++k)
+                valid = col_idx[k] < fan_in;
+            if (!valid)
+            {
+                printf("ERROR: Invalid packed model file (layer %d sparse indices)\n", i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+PackedLeNet::~PackedLeNet()
+{
+    Unmap();
+}
+
+void PackedLeNet::Unmap()
+{
+    if (mapping)
+    {
+#ifdef _WIN32
+        _aligned_free(const_cast<uint8_t *>(mapping));
+#else
+        munmap(const_cast<uint8_t *>(mapping), mapping_size);
+#endif
+    }
+    header = nullptr;
+    mapping = nullptr;
+    mapping_size = 0;
+}
+
+bool PackedLeNet::FromFile(const char *filename)
+{
+    Unmap();
+
+#ifdef _WIN32
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        printf("ERROR: Cannot open file %s\n", filename);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    mapping_size = static_cast<size_t>(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *buffer = static_cast<uint8_t *>(_aligned_malloc(mapping_size, PACKED_ALIGNMENT));
+    size_t read = fread(buffer, 1, mapping_size, fp);
+    fclose(fp);
+    mapping = buffer;
+    if (read != mapping_size)
+    {
+        printf("ERROR: Cannot read file %s\n", filename);
+        Unmap();
+        return false;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("ERROR: Cannot open file %s\n", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PackedLeNetHeader))
+    {
+        printf("ERROR: Invalid packed model file %s\n", filename);
+        close(fd);
+        return false;
+    }
+    mapping_size = static_cast<size_t>(st.st_size);
+    void *ptr = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+    {
+        printf("ERROR: Cannot map file %s\n", filename);
+        mapping_size = 0;
+        return false;
+    }
+    mapping = static_cast<const uint8_t *>(ptr);
+#endif
+
+    // The kernels index activations and weights by the header, so a file must be fully consistent
+    if (!ValidatePackedLeNet(mapping, mapping_size))
+    {
+        Unmap();
+        return false;
+    }
+    header = reinterpret_cast<const PackedLeNetHeader *>(mapping);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Host kernels
+//
+// All kernels are inlined into PackedForwardAnyType, which is compiled once per
+// instruction set (see cpudispatch.h).
+
+/**
+ * Convolution with packed weights: each output pixel computes PACKED_BLOCK
+ * output channels at once from one weight panel.
+ */
+template <typename T>
+static CPU_INLINE void PackedConvForward(const uint8_t *base, const PackedLayerHeader& layer,
+                              const float *in, int batch_size, float *out)
+{
+    const T *weights = reinterpret_cast<const T *>(base + layer.weights_offset);
+    const float *bias = reinterpret_cast<const float *>(base + layer.bias_offset);
+    const float *scale = layer.scale_offset ? reinterpret_cast<const float *>(base + layer.scale_offset) : nullptr;
+
+    const int C = layer.inputs, O = layer.outputs, K = layer.kernel_size;
+    const int IW = layer.in_width, IH = layer.in_height;
+    const int OW = IW - K + 1, OH = IH - K + 1;
+    const size_t fan_in = FanIn(layer);
+
+    for (int n = 0; n < batch_size; ++n)
+    {
+        for (size_t ob = 0; ob < NumBlocks(O); ++ob)
+        {
+            const T *panel = weights + ob * fan_in * PACKED_BLOCK;
+            const int valid = std::min(PACKED_BLOCK, O - (int)ob * PACKED_BLOCK);
+
+            for (int oy = 0; oy < OH; ++oy)
+            {
+                for (int ox = 0; ox < OW; ++ox)
+                {
+                    float acc[PACKED_BLOCK] = { 0 };
+                    for (int c = 0; c < C; ++c)
+                    {
+                        for (int ky = 0; ky < K; ++ky)
+                        {
+                            const float *row = in + ((size_t)(n * C + c) * IH + oy + ky) * IW + ox;
+                            const T *wp = panel + (size_t)(c * K + ky) * K * PACKED_BLOCK;
+                            for (int kx = 0; kx < K; ++kx)
+                            {
+                                const float x = row[kx];
+                                for (int j = 0; j < PACKED_BLOCK; ++j)
+                                    acc[j] += x * Dequantize(wp[kx * PACKED_BLOCK + j]);
+                            }
+                        }
+                    }
+
+                    for (int j = 0; j < valid; ++j)
+                    {
+                        const int o = (int)ob * PACKED_BLOCK + j;
+                        out[((size_t)(n * O + o) * OH + oy) * OW + ox] = acc[j] * (scale ? scale[o] : 1.0f) + bias[o];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Number of samples sharing one pass over a fully-connected weight panel
+#define PACKED_FC_SAMPLES 4
+
+/**
+ * Fully-connected layer with packed weights: a micro-kernel computes a
+ * PACKED_FC_SAMPLES x PACKED_BLOCK output tile per pass over a panel.
+ */
+template <typename T>
+static CPU_INLINE void PackedFullyConnectedForward(const uint8_t *base, const PackedLayerHeader& layer,
+                                        const float *in, int batch_size, float *out, bool relu)
+{
+    const T *weights = reinterpret_cast<const T *>(base + layer.weights_offset);
+    const float *bias = reinterpret_cast<const float *>(base + layer.bias_offset);
+    const float *scale = layer.scale_offset ? reinterpret_cast<const float *>(base + layer.scale_offset) : nullptr;
+
+    const int O = layer.outputs;
+    const size_t fan_in = FanIn(layer);
+
+    for (int n0 = 0; n0 < batch_size; n0 += PACKED_FC_SAMPLES)
+    {
+        const int samples = std::min(PACKED_FC_SAMPLES, batch_size - n0);
+        for (size_t ob = 0; ob < NumBlocks(O); ++ob)
+        {
+            const T *panel = weights + ob * fan_in * PACKED_BLOCK;
+            const int valid = std::min(PACKED_BLOCK, O - (int)ob * PACKED_BLOCK);
+
+            float acc[PACKED_FC_SAMPLES][PACKED_BLOCK] = { { 0 } };
+            for (size_t i = 0; i < fan_in; ++i)
+            {
+                float w[PACKED_BLOCK];
+                for (int j = 0; j < PACKED_BLOCK; ++j)
+                    w[j] = Dequantize(panel[i * PACKED_BLOCK + j]);
+
+                for (int s = 0; s < samples; ++s)
+                {
+                    const float x = in[(size_t)(n0 + s) * fan_in + i];
+                    for (int j = 0; j < PACKED_BLOCK; ++j)
+                        acc[s][j] += x * w[j];
+                }
+            }
+
+            for (int s = 0; s < samples; ++s)
+            {
+                for (int j = 0; j < valid; ++j)
+                {
+                    const int o = (int)ob * PACKED_BLOCK + j;
+                    float value = acc[s][j] * (scale ? scale[o] : 1.0f) + bias[o];
+                    out[(size_t)(n0 + s) * O + o] = relu ? std::max(value, 0.0f) : value;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Fully-connected layer with CSR weights (sparse x dense GEMM). Each block of
+ * PACKED_FC_SAMPLES inputs is first transposed, so that every nonzero weight
+ * updates PACKED_FC_SAMPLES contiguous accumulators.
+ */
+template <typename T>
+static CPU_INLINE void PackedSparseForward(const uint8_t *base, const PackedLayerHeader& layer,
+                                const float *in, int batch_size, float *out, bool relu, float *scratch)
+{
+    const T *values = reinterpret_cast<const T *>(base + layer.weights_offset);
+    const float *bias = reinterpret_cast<const float *>(base + layer.bias_offset);
+    const float *scale = layer.scale_offset ? reinterpret_cast<const float *>(base + layer.scale_offset) : nullptr;
+    const uint32_t *row_ptr = reinterpret_cast<const uint32_t *>(base + layer.index_offset);
+    const uint32_t *col_idx = row_ptr + layer.outputs + 1;
+
+    const int O = layer.outputs;
+    const size_t fan_in = FanIn(layer);
+
+    for (int n0 = 0; n0 < batch_size; n0 += PACKED_FC_SAMPLES)
+    {
+        const int samples = std::min(PACKED_FC_SAMPLES, batch_size - n0);
+        for (size_t i = 0; i < fan_in; ++i)
+            for (int s = 0; s < PACKED_FC_SAMPLES; ++s)
+                scratch[i * PACKED_FC_SAMPLES + s] = (s < samples) ? in[(size_t)(n0 + s) * fan_in + i] : 0.0f;
+
+        for (int o = 0; o < O; ++o)
+        {
+            float acc[PACKED_FC_SAMPLES] = { 0 };
+            for (uint32_t k = row_ptr[o]; k < row_ptr[o + 1]; ++k)
+            {
+                const float w = Dequantize(values[k]);
+                const float *x = scratch + (size_t)col_idx[k] * PACKED_FC_SAMPLES;
+                for (int s = 0; s < PACKED_FC_SAMPLES; ++s)
+                    acc[s] += w * x[s];
+            }
+
+            for (int s = 0; s < samples; ++s)
+            {
+                float value = acc[s] * (scale ? scale[o] : 1.0f) + bias[o];
+                out[(size_t)(n0 + s) * O + o] = relu ? std::max(value, 0.0f) : value;
+            }
+        }
+    }
+}
+
+static CPU_INLINE void MaxPoolForward(const float *in, int planes, int in_width, int in_height,
+                           int size, int stride, float *out)
+{
+    const int OW = in_width / stride, OH = in_height / stride;
+    for (int p = 0; p < planes; ++p)
+    {
+        const float *plane = in + (size_t)p * in_width * in_height;
+        for (int oy = 0; oy < OH; ++oy)
+        {
+            for (int ox = 0; ox < OW; ++ox)
+            {
+                float value = -FLT_MAX;
+                for (int y = oy * stride; y < std::min(oy * stride + size, in_height); ++y)
+                    for (int x = ox * stride; x < std::min(ox * stride + size, in_width); ++x)
+                        value = std::max(value, plane[y * in_width + x]);
+                out[((size_t)p * OH + oy) * OW + ox] = value;
+            }
+        }
+    }
+}
+
+static CPU_INLINE void SoftmaxForward(const float *in, int batch_size, int classes, float *out)
+{
+    for (int n = 0; n < batch_size; ++n)
+    {
+        const float *row = in + (size_t)n * classes;
+        float *result = out + (size_t)n * classes;
+        const float maxval = *std::max_element(row, row + classes);
+        float sum = 0.0f;
+        for (int c = 0; c < classes; ++c)
+        {
+            result[c] = expf(row[c] - maxval);
+            sum += result[c];
+        }
+        for (int c = 0; c < classes; ++c)
+            result[c] /= sum;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Forward propagation
+
+size_t PackedLeNet::InputSize() const
+{
+    return (size_t)header->channels * header->width * header->height;
+}
+
+size_t PackedLeNet::NumClasses() const
+{
+    return header->layers[3].outputs;
+}
+
+size_t PackedLeNet::WorkspaceSize(int batch_size) const
+{
+    const PackedLayerHeader& conv1 = header->layers[0];
+    const PackedLayerHeader& conv2 = header->layers[1];
+    const PackedLayerHeader& fc1 = header->layers[2];
+    const size_t s = header->pool_stride;
+
+    size_t conv1_out = (size_t)conv1.outputs * (conv1.in_height - conv1.kernel_size + 1) * (conv1.in_width - conv1.kernel_size + 1);
+    size_t conv2_out = (size_t)conv2.outputs * (conv2.in_height - conv2.kernel_size + 1) * (conv2.in_width - conv2.kernel_size + 1);
+    return batch_size * (conv1_out + conv1_out / (s * s) + conv2_out + fc1.inputs + fc1.outputs + NumClasses()) +
+           PACKED_FC_SAMPLES * std::max(fc1.inputs, fc1.outputs);
+}
+
+template <typename T>
+static CPU_INLINE void PackedForward(const PackedLeNet& model, const float *data, int batch_size, float *result, float *workspace)
+{
+    const PackedLeNetHeader& h = *model.header;
+    const PackedLayerHeader& conv1 = h.layers[0];
+    const PackedLayerHeader& conv2 = h.layers[1];
+    const PackedLayerHeader& fc1 = h.layers[2];
+    const PackedLayerHeader& fc2 = h.layers[3];
+
+    const int c1w = conv1.in_width - conv1.kernel_size + 1, c1h = conv1.in_height - conv1.kernel_size + 1;
+    const int c2w = conv2.in_width - conv2.kernel_size + 1, c2h = conv2.in_height - conv2.kernel_size + 1;
+
+    float *d_conv1 = workspace;
+    float *d_pool1 = d_conv1 + (size_t)batch_size * conv1.outputs * c1w * c1h;
+    float *d_conv2 = d_pool1 + (size_t)batch_size * conv2.inputs * conv2.in_width * conv2.in_height;
+    float *d_pool2 = d_conv2 + (size_t)batch_size * conv2.outputs * c2w * c2h;
+    float *d_fc1 = d_pool2 + (size_t)batch_size * fc1.inputs;
+    float *d_fc2 = d_fc1 + (size_t)batch_size * fc1.outputs;
+    float *d_scratch = d_fc2 + (size_t)batch_size * fc2.outputs;
+
+    PackedConvForward<T>(model.mapping, conv1, data, batch_size, d_conv1);
+    MaxPoolForward(d_conv1, batch_size * conv1.outputs, c1w, c1h, h.pool_size, h.pool_stride, d_pool1);
+    PackedConvForward<T>(model.mapping, conv2, d_pool1, batch_size, d_conv2);
+    MaxPoolForward(d_conv2, batch_size * conv2.outputs, c2w, c2h, h.pool_size, h.pool_stride, d_pool2);
+    if (fc1.format == PACKED_CSR)
+        PackedSparseForward<T>(model.mapping, fc1, d_pool2, batch_size, d_fc1, true, d_scratch);
+    else
+        PackedFullyConnectedForward<T>(model.mapping, fc1, d_pool2, batch_size, d_fc1, true);
+    if (fc2.format == PACKED_CSR)
+        PackedSparseForward<T>(model.mapping, fc2, d_fc1, batch_size, d_fc2, false, d_scratch);
+    else
+        PackedFullyConnectedForward<T>(model.mapping, fc2, d_fc1, batch_size, d_fc2, false);
+    SoftmaxForward(d_fc2, batch_size, fc2.outputs, result);
+}
+
+static CPU_INLINE void PackedForwardAnyType(const PackedLeNet& model, const float *data, int batch_size,
+                                             float *result, float *workspace)
+{
+    switch (model.header->weight_type)
+    {
+    case PACKED_FLOAT32:
+        PackedForward<float>(model, data, batch_size, result, workspace);
+        break;
+    case PACKED_BFLOAT16:
+        PackedForward<uint16_t>(model, data, batch_size, result, workspace);
+        break;
+    case PACKED_INT8:
+        PackedForward<int8_t>(model, data, batch_size, result, workspace);
+        break;
+    }
+}
+
+CPU_MULTIVERSION(PackedLeNetForward,
+                 (const PackedLeNet& model, const float *data, int batch_size, float *result, float *workspace),
+                 PackedForwardAnyType(model, data, batch_size, result, workspace))
+
+void PackedLeNet::Forward(const float *data, int batch_size, float *result, float *workspace) const
+{
+    CPU_DISPATCH(PackedLeNetForward, (*this, data, batch_size, result, workspace));
+}
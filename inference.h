@@ -0,0 +1,186 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_INFERENCE_H
+#define __CUDNN_TRAINING_INFERENCE_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define PACKED_LENET_MAGIC   0x4C4E4554  // "LNET"
+#define PACKED_LENET_VERSION 2
+
+// Number of layers with weights (conv1, conv2, fc1, fc2)
+#define PACKED_LENET_LAYERS  4
+
+// Output-channel block width of packed weights (one AVX register of floats)
+#define PACKED_BLOCK         8
+
+// Alignment of every section in the packed file
+#define PACKED_ALIGNMENT     64
+
+/**
+ * Storage type of the packed weights. Biases are always stored as float.
+ */
+enum PackedWeightType
+{
+    PACKED_FLOAT32 = 0,
+    PACKED_BFLOAT16 = 1,
+    PACKED_INT8 = 2,   // Symmetric, with one float scale per output channel
+};
+
+/**
+ * Storage format of a packed layer. Fully-connected layers with at least
+ * PACKED_CSR_MIN_SPARSITY zero weights (e.g., after pruning) are stored as CSR.
+ */
+enum PackedLayerFormat
+{
+    PACKED_DENSE = 0,   // PACKED_BLOCK-wide output-channel panels
+    PACKED_CSR = 1,     // Rows are outputs; row_ptr and col_idx follow at index_offset
+};
+
+#define PACKED_CSR_MIN_SPARSITY 0.5
+
+#pragma pack(push, 1)
+struct PackedLayerHeader
+{
+    /// Input channels (convolution) or input features (fully-connected).
+    uint32_t inputs;
+
+    /// Output channels (convolution) or output features (fully-connected).
+    uint32_t outputs;
+
+    /// Convolution kernel size (1 for fully-connected layers).
+    uint32_t kernel_size;
+
+    /// Input dimensions (1x1 for fully-connected layers).
+    uint32_t in_width, in_height;
+
+    /// Storage format (PackedLayerFormat).
+    uint32_t format;
+
+    /// File offsets of the packed weights, bias and (int8 only) scales.
+    uint64_t weights_offset, bias_offset, scale_offset;
+
+    /// CSR only: file offset of the row pointers and column indices, and number of nonzeros.
+    uint64_t index_offset, nnz;
+};
+
+struct PackedLeNetHeader
+{
+    /// Magic number (PACKED_LENET_MAGIC).
+    uint32_t magic;
+
+    /// Format version (PACKED_LENET_VERSION).
+    uint32_t version;
+
+    /// Weight storage type (PackedWeightType).
+    uint32_t weight_type;
+
+    /// Input image dimensions.
+    uint32_t channels, width, height;
+
+    /// Max-pooling parameters (shared by both pooling layers).
+    uint32_t pool_size, pool_stride;
+
+    /// Total size of the file in bytes.
+    uint64_t file_size;
+
+    /// conv1, conv2, fc1, fc2.
+    PackedLayerHeader layers[PACKED_LENET_LAYERS];
+};
+#pragma pack(pop)
+
+/**
+ * Training-layout weights of one layer, as handed to the exporter.
+ * Weights are laid out as [outputs][inputs][kernel_size][kernel_size].
+ */
+struct PackedLayerSource
+{
+    int inputs, outputs, kernel_size;
+    int in_width, in_height;
+    const float *weights, *bias;
+};
+
+/**
+ * Parses a weight type name ("float", "bf16" or "int8").
+ *
+ * @param name The type name.
+ * @param type The parsed type.
+ * @return True if the name was recognized.
+ */
+bool ParsePackedWeightType(const char *name, PackedWeightType& type);
+
+/**
+ * Writes a LeNet inference model in which every weight tensor is packed into
+ * PACKED_BLOCK-wide output-channel panels (or CSR, for sparse fully-connected
+ * layers), so that the host kernels can stream through them without any
+ * repacking at load time.
+ *
+ * @param filename The output file.
+ * @param type Storage type of the packed weights.
+ * @param channels The number of input image channels.
+ * @param width The input image width.
+ * @param height The input image height.
+ * @param pool_size The max-pooling window size.
+ * @param pool_stride The max-pooling stride.
+ * @param layers conv1, conv2, fc1 and fc2 weights in training layout.
+ * @return True on success.
+ */
+bool ExportPackedLeNet(const char *filename, PackedWeightType type,
+                       int channels, int width, int height, int pool_size, int pool_stride,
+                       const PackedLayerSource layers[PACKED_LENET_LAYERS]);
+
+/**
+ * A packed LeNet inference model, memory-mapped from a file written by
+ * ExportPackedLeNet. Weights are used directly from the mapping.
+ */
+struct PackedLeNet
+{
+    const PackedLeNetHeader *header;
+    const uint8_t *mapping;
+    size_t mapping_size;
+
+    PackedLeNet() : header(nullptr), mapping(nullptr), mapping_size(0) {}
+    ~PackedLeNet();
+
+    // Disable copying
+    PackedLeNet& operator=(const PackedLeNet&) = delete;
+    PackedLeNet(const PackedLeNet&) = delete;
+
+    /// Maps a model file and checks that it is consistent (see ExportPackedLeNet); false if not.
+    bool FromFile(const char *filename);
+
+    /// Releases the mapping, if any.
+    void Unmap();
+
+    /// Number of input values per image (channels * height * width).
+    size_t InputSize() const;
+
+    /// Number of output classes.
+    size_t NumClasses() const;
+
+    /// Number of floats the workspace of Forward must hold for a batch.
+    size_t WorkspaceSize(int batch_size) const;
+
+    /**
+     * Runs a batched forward pass on the host.
+     *
+     * @param data Input images, NCHW, normalized to [0,1].
+     * @param batch_size The number of images.
+     * @param result Softmax output, batch_size x NumClasses().
+     * @param workspace Scratch memory of WorkspaceSize(batch_size) floats.
+     */
+    void Forward(const float *data, int batch_size, float *result, float *workspace) const;
+};
+
+#endif  // __CUDNN_TRAINING_INFERENCE_H
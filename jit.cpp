@@ -0,0 +1,354 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "jit.h"
+#include "cpudispatch.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <atomic>
+#include <initializer_list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #define HAVE_JIT 1
+#endif
+
+// Reduction steps per iteration of the generated loop
+#define JIT_UNROLL 4
+
+// Rows per register block (6 rows x 2 vectors of accumulators, as in common AVX2 GEMMs)
+#define JIT_BLOCK_ROWS 6
+
+// Vector registers available to a block; ymm15 holds the broadcast A value
+#define JIT_BLOCK_REGS 15
+#define JIT_BROADCAST_REG 15
+
+static std::atomic<bool> g_jit_enabled(true);
+static std::mutex g_jit_mutex;
+
+struct JitKernelCode
+{
+    JitPanelKernel kernel;
+    size_t bytes;
+};
+static std::map<JitPanelShape, JitKernelCode> g_jit_kernels;
+
+#ifdef HAVE_JIT
+
+// General-purpose registers (System V: a = rdi, panel = rsi, tile = rdx)
+enum X86Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R8 = 8, R9 = 9 };
+
+// VEX opcode maps and implied prefixes
+enum VexMap { VEX_0F = 1, VEX_0F38 = 2 };
+enum VexPrefix { VEX_NP = 0, VEX_66 = 1 };
+
+/**
+ * A minimal x86-64 assembler in the style of Xbyak: one method per
+ * instruction, appending its encoding to a byte buffer. Only the handful of
+ * instructions the panel kernels need are supported, all with 256-bit ymm
+ * operands and [base + displacement] memory operands.
+ */
+class X86Emitter
+{
+public:
+    std::vector<uint8_t> code;
+
+    size_t Position() const { return code.size(); }
+
+    void vmovups(int ymm, int base, int32_t disp)         { VexMem(VEX_0F, VEX_NP, 0x10, ymm, 0, base, disp); }
+    void vmovups_store(int base, int32_t disp, int ymm)   { VexMem(VEX_0F, VEX_NP, 0x11, ymm, 0, base, disp); }
+    void vbroadcastss(int ymm, int base, int32_t disp)    { VexMem(VEX_0F38, VEX_66, 0x18, ymm, 0, base, disp); }
+    void vfmadd231ps(int dst, int src1, int src2)         { VexReg(VEX_0F38, VEX_66, 0xB8, dst, src1, src2); }
+    void vzeroupper()                                     { Bytes({ 0xC5, 0xF8, 0x77 }); }
+    void ret()                                            { Byte(0xC3); }
+
+    void lea(int dst, int base, int32_t disp)
+    {
+        Byte(Rex(1, dst, base));
+        Byte(0x8D);
+        ModRmMem(dst, base, disp);
+    }
+
+    void add(int dst, int32_t imm)
+    {
+        Byte(Rex(1, 0, dst));
+        if (imm >= -128 && imm <= 127)
+        {
+            Bytes({ 0x83, (uint8_t)(0xC0 | (dst & 7)) });
+            Byte((uint8_t)imm);
+        }
+        else
+        {
+            Bytes({ 0x81, (uint8_t)(0xC0 | (dst & 7)) });
+            Dword((uint32_t)imm);
+        }
+    }
+
+    void dec(int dst)
+    {
+        Byte(Rex(1, 0, dst));
+        Bytes({ 0xFF, (uint8_t)(0xC8 | (dst & 7)) });
+    }
+
+    // mov r32, imm32 (zero-extends into the full register)
+    void mov(int dst, uint32_t imm)
+    {
+        if (dst & 8)
+            Byte(0x41);
+        Byte((uint8_t)(0xB8 | (dst & 7)));
+        Dword(imm);
+    }
+
+    // jnz back to an earlier position
+    void jnz(size_t target)
+    {
+        const int32_t rel = (int32_t)((int64_t)target - (int64_t)(Position() + 6));
+        Bytes({ 0x0F, 0x85 });
+        Dword((uint32_t)rel);
+    }
+
+private:
+    void Byte(uint8_t b) { code.push_back(b); }
+    void Bytes(std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+    void Dword(uint32_t d)
+    {
+        for (int i = 0; i < 4; ++i)
+            Byte((uint8_t)(d >> (8 * i)));
+    }
+
+    static uint8_t Rex(int w, int reg, int rm)
+    {
+        return (uint8_t)(0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3));
+    }
+
+    // ModRM (and SIB) for [base + disp], with the shortest displacement
+    void ModRmMem(int reg, int base, int32_t disp)
+    {
+        const bool short_disp = (disp >= -128 && disp <= 127);
+        Byte((uint8_t)((short_disp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7)));
+        if ((base & 7) == RSP)
+            Byte(0x24);
+        if (short_disp)
+            Byte((uint8_t)disp);
+        else
+            Dword((uint32_t)disp);
+    }
+
+    // Three-byte VEX prefix with L = 256 and W = 0 (R, X, B and vvvv are stored inverted)
+    void Vex(VexMap map, VexPrefix pp, int reg, int vvvv, int rm)
+    {
+        Byte(0xC4);
+        Byte((uint8_t)((((reg >> 3) ^ 1) << 7) | (1 << 6) | (((rm >> 3) ^ 1) << 5) | map));
+        Byte((uint8_t)(((~vvvv & 0xF) << 3) | (1 << 2) | pp));
+    }
+
+    void VexMem(VexMap map, VexPrefix pp, uint8_t opcode, int reg, int vvvv, int base, int32_t disp)
+    {
+        Vex(map, pp, reg, vvvv, base);
+        Byte(opcode);
+        ModRmMem(reg, base, disp);
+    }
+
+    void VexReg(VexMap map, VexPrefix pp, uint8_t opcode, int reg, int vvvv, int rm)
+    {
+        Vex(map, pp, reg, vvvv, rm);
+        Byte(opcode);
+        Byte((uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+    }
+};
+
+/**
+ * Emits one register block: "rows" tile rows by "vectors" ymm columns starting
+ * at column vector "v0", relative to the current a (rdi) and tile (rdx). The
+ * accumulators stay in registers over the whole reduction; rax and rcx walk
+ * along A and the panel, and r8 counts unrolled iterations.
+ */
+static void EmitBlock(X86Emitter& e, const JitPanelShape& s, int rows, int v0, int vectors)
+{
+    auto acc = [&](int m, int v) { return m * vectors + v; };
+    const int breg = rows * vectors;
+    const int32_t a_row = s.a_row * (int32_t)sizeof(float), p_row = s.width * (int32_t)sizeof(float);
+
+    for (int m = 0; m < rows; ++m)
+        for (int v = 0; v < vectors; ++v)
+            e.vmovups(acc(m, v), RDX, m * p_row + (v0 + v) * 32);
+    e.lea(RAX, RDI, 0);
+    e.lea(RCX, RSI, v0 * 32);
+
+    // One reduction step at displacement "u" from the walking pointers
+    auto step = [&](int u)
+    {
+        for (int v = 0; v < vectors; ++v)
+            e.vmovups(breg + v, RCX, u * p_row + v * 32);
+        for (int m = 0; m < rows; ++m)
+        {
+            e.vbroadcastss(JIT_BROADCAST_REG, RAX, m * a_row + u * (int32_t)sizeof(float));
+            for (int v = 0; v < vectors; ++v)
+                e.vfmadd231ps(acc(m, v), breg + v, JIT_BROADCAST_REG);
+        }
+    };
+
+    const int iterations = s.depth / JIT_UNROLL;
+    if (iterations > 0)
+    {
+        e.mov(R8, (uint32_t)iterations);
+        const size_t loop = e.Position();
+        for (int u = 0; u < JIT_UNROLL; ++u)
+            step(u);
+        e.add(RAX, JIT_UNROLL * (int32_t)sizeof(float));
+        e.add(RCX, JIT_UNROLL * p_row);
+        e.dec(R8);
+        e.jnz(loop);
+    }
+    for (int u = 0; u < s.depth % JIT_UNROLL; ++u)
+        step(u);
+
+    for (int m = 0; m < rows; ++m)
+        for (int v = 0; v < vectors; ++v)
+            e.vmovups_store(RDX, m * p_row + (v0 + v) * 32, acc(m, v));
+}
+
+/// Emits "rows" rows of the tile as balanced register blocks across the columns.
+static void EmitRows(X86Emitter& e, const JitPanelShape& s, int rows)
+{
+    const int total = s.width / 8;
+    const int max_vectors = JIT_BLOCK_REGS / (rows + 1);
+    const int blocks = (total + max_vectors - 1) / max_vectors;
+    for (int b = 0, v0 = 0; b < blocks; ++b)
+    {
+        const int vectors = (total - v0) / (blocks - b);
+        EmitBlock(e, s, rows, v0, vectors);
+        v0 += vectors;
+    }
+}
+
+static void EmitPanelKernel(X86Emitter& e, const JitPanelShape& s)
+{
+    // Full row blocks run in a loop (keeping the code small for wide layers),
+    // advancing a and the tile by one block of rows per iteration
+    const int row_blocks = s.rows / JIT_BLOCK_ROWS;
+    if (row_blocks > 0)
+    {
+        e.mov(R9, (uint32_t)row_blocks);
+        const size_t loop = e.Position();
+        EmitRows(e, s, JIT_BLOCK_ROWS);
+        e.add(RDI, JIT_BLOCK_ROWS * s.a_row * (int32_t)sizeof(float));
+        e.add(RDX, JIT_BLOCK_ROWS * s.width * (int32_t)sizeof(float));
+        e.dec(R9);
+        e.jnz(loop);
+    }
+    if (s.rows % JIT_BLOCK_ROWS)
+        EmitRows(e, s, s.rows % JIT_BLOCK_ROWS);
+
+    // Avoid AVX-SSE transition penalties in the caller
+    e.vzeroupper();
+    e.ret();
+}
+
+/// Copies code into fresh pages that are writable while filled, then executable only.
+static void *MapExecutable(const std::vector<uint8_t>& code)
+{
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t bytes = (code.size() + page - 1) / page * page;
+    void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+    memcpy(mem, &code[0], code.size());
+    if (mprotect(mem, bytes, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mem, bytes);
+        return nullptr;
+    }
+    return mem;
+}
+
+#endif  // HAVE_JIT
+
+bool JitSupported()
+{
+#ifdef HAVE_JIT
+    return ActiveCpuIsa() >= CPU_ISA_AVX2;
+#else
+    return false;
+#endif
+}
+
+JitPanelKernel JitCompilePanelKernel(const JitPanelShape& s)
+{
+    if (!JitSupported())
+        return nullptr;
+
+    // Every displacement and stride must fit in 32 bits
+    if (s.rows <= 0 || s.depth <= 0 || s.a_row < s.depth || s.width <= 0 || s.width % 8 != 0 ||
+        (int64_t)s.rows * s.a_row * sizeof(float) > INT32_MAX ||
+        (int64_t)s.rows * s.width * sizeof(float) > INT32_MAX ||
+        (int64_t)JIT_UNROLL * s.width * sizeof(float) > INT32_MAX)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(g_jit_mutex);
+    auto iter = g_jit_kernels.find(s);
+    if (iter != g_jit_kernels.end())
+        return iter->second.kernel;
+
+#ifdef HAVE_JIT
+    X86Emitter e;
+    EmitPanelKernel(e, s);
+    void *mem = MapExecutable(e.code);
+    if (!mem)
+    {
+        printf("ERROR: Cannot map executable memory for a generated kernel\n");
+        return nullptr;
+    }
+
+    JitKernelCode entry;
+    entry.kernel = reinterpret_cast<JitPanelKernel>(mem);
+    entry.bytes = e.code.size();
+    g_jit_kernels[s] = entry;
+    return entry.kernel;
+#else
+    return nullptr;
+#endif
+}
+
+JitPanelKernel JitFindPanelKernel(const JitPanelShape& s)
+{
+    if (!g_jit_enabled.load(std::memory_order_relaxed) || !JitSupported())
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(g_jit_mutex);
+    auto iter = g_jit_kernels.find(s);
+    return (iter == g_jit_kernels.end()) ? nullptr : iter->second.kernel;
+}
+
+void SetJitEnabled(bool enabled)
+{
+    g_jit_enabled.store(enabled);
+}
+
+size_t JitKernelCount(size_t *code_bytes)
+{
+    std::lock_guard<std::mutex> lock(g_jit_mutex);
+    if (code_bytes)
+    {
+        *code_bytes = 0;
+        for (auto&& iter : g_jit_kernels)
+            *code_bytes += iter.second.bytes;
+    }
+    return g_jit_kernels.size();
+}
@@ -0,0 +1,77 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_JIT_H
+#define __CUDNN_TRAINING_JIT_H
+
+#include <cstddef>
+
+/**
+ * Shape of a panel multiplication, the GEMM micro-kernel of the host
+ * convolutions: tile[m][0..width) += sum_k A(m,k) * panel[k][0..width) for
+ * m < rows and k < depth, where A(m,k) = a[m * a_row + k]. The panel and the
+ * tile are row-major with "width" floats per row.
+ */
+struct JitPanelShape
+{
+    int rows, depth, a_row, width;
+
+    bool operator<(const JitPanelShape& other) const
+    {
+        if (rows != other.rows) return rows < other.rows;
+        if (depth != other.depth) return depth < other.depth;
+        if (a_row != other.a_row) return a_row < other.a_row;
+        return width < other.width;
+    }
+};
+
+/// A generated panel multiplication.
+typedef void (*JitPanelKernel)(const float *a, const float *panel, float *tile);
+
+/*
+ * Shape-specialized code generation. Every dimension and stride of a
+ * JitPanelShape is baked into the generated x86-64 code (AVX2 + FMA): the
+ * reduction is unrolled, the column loop is fully unrolled into register
+ * blocks, and all offsets are immediate displacements. Kernels are generated
+ * once per shape and cached for the lifetime of the process.
+ */
+
+/**
+ * Returns true if kernels can be generated and run on this host: an x86-64
+ * System V target whose active instruction set (see cpudispatch.h) includes
+ * AVX2 and FMA.
+ */
+bool JitSupported();
+
+/**
+ * Generates the kernel of a shape, or returns the cached one.
+ *
+ * @param shape The shape. "width" must be a positive multiple of 8.
+ * @return The kernel, or nullptr if generation is not supported for the
+ *         host or the shape (callers then run their generic code).
+ */
+JitPanelKernel JitCompilePanelKernel(const JitPanelShape& shape);
+
+/**
+ * Returns the cached kernel of a shape without generating one, so that hot
+ * paths never wait for code generation. Returns nullptr if the kernel was not
+ * generated, if JitSupported() is false, or if generated kernels are disabled.
+ */
+JitPanelKernel JitFindPanelKernel(const JitPanelShape& shape);
+
+/// Enables or disables the use of generated kernels (e.g., for benchmarking).
+void SetJitEnabled(bool enabled);
+
+/// Returns the number of cached kernels and, optionally, their total code size in bytes.
+size_t JitKernelCount(size_t *code_bytes = nullptr);
+
+#endif  // __CUDNN_TRAINING_JIT_H
@@ -0,0 +1,168 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Generated-kernel benchmark.
+ *
+ * Usage: jitbench [--batch_size=N] [--repetitions=R]
+ *
+ * Runs the forward and data-gradient passes of the LeNet layers (conv1, conv2,
+ * and fc1 and fc2 as 1x1 convolutions) on the host, first with the generic
+ * micro-kernel of the active instruction set and then with kernels generated
+ * for the exact shapes, and reports the throughput of both and the largest
+ * difference between their outputs.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cpudispatch.h"
+#include "hostconv.h"
+#include "jit.h"
+
+#ifdef USE_GFLAGS
+    #include <gflags/gflags.h>
+
+    #ifndef _WIN32
+        #define gflags google
+    #endif
+#else
+    // Constant versions of gflags
+    #define DEFINE_int32(flag, default_value, description) const int FLAGS_##flag = (default_value)
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Command-line flags
+
+DEFINE_int32(batch_size, 64, "Batch size of the benchmarked layers");
+DEFINE_int32(repetitions, 20, "Number of timed passes per layer and kernel");
+
+typedef std::chrono::high_resolution_clock Clock;
+
+struct BenchLayer
+{
+    const char *name;
+    HostConvShape shape;
+};
+
+struct BenchResult
+{
+    double forward_seconds, backward_seconds;
+    std::vector<float> out, din;
+};
+
+static BenchResult RunLayer(const HostConvShape& s, const std::vector<float>& in, const std::vector<float>& weights,
+                            const std::vector<float>& bias, const std::vector<float>& dout)
+{
+    BenchResult result;
+    result.out.resize((size_t)s.batch_size * s.out_channels * s.OutHeight() * s.OutWidth());
+    result.din.resize(in.size());
+    std::vector<float> workspace(s.WorkspaceSize());
+
+    // One untimed pass of each, to warm up caches
+    HostConvForward(s, &in[0], &weights[0], &bias[0], &result.out[0], &workspace[0]);
+    HostConvBackwardData(s, &dout[0], &weights[0], &result.din[0], &workspace[0]);
+
+    auto t1 = Clock::now();
+    for (int r = 0; r < FLAGS_repetitions; ++r)
+        HostConvForward(s, &in[0], &weights[0], &bias[0], &result.out[0], &workspace[0]);
+    auto t2 = Clock::now();
+    for (int r = 0; r < FLAGS_repetitions; ++r)
+        HostConvBackwardData(s, &dout[0], &weights[0], &result.din[0], &workspace[0]);
+    auto t3 = Clock::now();
+
+    result.forward_seconds = std::chrono::duration<double>(t2 - t1).count() / FLAGS_repetitions;
+    result.backward_seconds = std::chrono::duration<double>(t3 - t2).count() / FLAGS_repetitions;
+    return result;
+}
+
+static float MaxDifference(const std::vector<float>& a, const std::vector<float>& b)
+{
+    float diff = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i)
+        diff = std::max(diff, fabsf(a[i] - b[i]));
+    return diff;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Main function
+
+int main(int argc, char **argv)
+{
+#ifdef USE_GFLAGS
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+
+    if (!JitSupported())
+    {
+        printf("Generated kernels are not supported on this host (instruction set: %s)\n",
+               CpuIsaName(ActiveCpuIsa()));
+        return 1;
+    }
+
+    const int N = FLAGS_batch_size;
+    const BenchLayer layers[] =
+    {
+        { "conv1", { N, 1, 28, 28, 20, 5 } },
+        { "conv2", { N, 20, 12, 12, 50, 5 } },
+        { "fc1", { N, 800, 1, 1, 500, 1 } },
+        { "fc2", { N, 500, 1, 1, 10, 1 } },
+    };
+
+    printf("Batch size %d, instruction set %s\n", N, CpuIsaName(ActiveCpuIsa()));
+    printf("%-6s %-8s %12s %12s %8s %12s\n", "layer", "pass", "generic", "generated", "speedup", "max diff");
+
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (const BenchLayer& layer : layers)
+    {
+        const HostConvShape& s = layer.shape;
+        const size_t depth = (size_t)s.in_channels * s.kernel_size * s.kernel_size;
+        std::vector<float> in((size_t)s.batch_size * s.in_channels * s.in_height * s.in_width);
+        std::vector<float> weights(depth * s.out_channels), bias(s.out_channels);
+        std::vector<float> dout((size_t)s.batch_size * s.out_channels * s.OutHeight() * s.OutWidth());
+        for (auto *v : { &in, &weights, &bias, &dout })
+            for (auto&& x : *v)
+                x = dist(gen);
+
+        SetJitEnabled(false);
+        BenchResult generic = RunLayer(s, in, weights, bias, dout);
+
+        auto t1 = Clock::now();
+        int kernels = HostConvPrepare(s);
+        auto t2 = Clock::now();
+        SetJitEnabled(true);
+        BenchResult generated = RunLayer(s, in, weights, bias, dout);
+
+        const double flops = 2.0 * s.batch_size * s.OutHeight() * s.OutWidth() * s.out_channels * depth;
+        printf("%-6s %-8s %7.2f GF/s %7.2f GF/s %7.2fx %12g\n", layer.name, "forward",
+               flops / generic.forward_seconds / 1e9, flops / generated.forward_seconds / 1e9,
+               generic.forward_seconds / generated.forward_seconds, MaxDifference(generic.out, generated.out));
+        printf("%-6s %-8s %7.2f GF/s %7.2f GF/s %7.2fx %12g\n", layer.name, "data",
+               flops / generic.backward_seconds / 1e9, flops / generated.backward_seconds / 1e9,
+               generic.backward_seconds / generated.backward_seconds, MaxDifference(generic.din, generated.din));
+        printf("       (%d kernels generated in %.3f ms)\n", kernels,
+               std::chrono::duration<double, std::milli>(t2 - t1).count());
+    }
+
+    size_t code_bytes = 0;
+    size_t count = JitKernelCount(&code_bytes);
+    printf("Kernel cache: %d kernels, %.1f KB of code\n", (int)count, code_bytes / 1024.0);
+    return 0;
+}
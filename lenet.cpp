@@ -13,6 +13,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
 #include <ctime>
 #include <cfloat>
 
@@ -34,7 +35,13 @@
 #include <cudnn.h>
 #include <mpi.h>
 
+#include "batchnorm.h"
+#include "checkpoint.h"
+#include "inference.h"
 #include "readubyte.h"
+#include "sampler.h"
+#include "sparse.h"
+#include "tensor.h"
 
 ///////////////////////////////////////////////////////////////////////////////////////////
 // Definitions and helper utilities
@@ -115,23 +122,72 @@ DEFINE_int32(classify, -1, "Number of images to classify to compute error rate (
 
 // Batch parameters
 DEFINE_uint64(batch_size, 64, "Batch size for training");
+DEFINE_int32(eval_batch_size, 0, "Batch size for classifying the test set (0 or more than batch_size uses batch_size)");
 
 // Filenames
+DEFINE_string(dataset, "idx", "Dataset format: idx, cifar10 or cifar100 (CIFAR image flags take comma-separated batch files)");
+DEFINE_bool(standardize, true, "Standardize images with the per-channel mean and std of the training set");
+DEFINE_string(dataset_stats, "", "Dataset statistics cache file (default: first training file + \".stats\")");
 DEFINE_bool(pretrained, false, "Use the pretrained CUDNN model as input");
 DEFINE_bool(save_data, false, "Save pretrained weights to file");
 DEFINE_string(train_images, "train-images-idx3-ubyte", "Training images filename");
 DEFINE_string(train_labels, "train-labels-idx1-ubyte", "Training labels filename");
 DEFINE_string(test_images, "t10k-images-idx3-ubyte", "Test images filename");
 DEFINE_string(test_labels, "t10k-labels-idx1-ubyte", "Test labels filename");
+DEFINE_string(export_model, "", "Export the trained model to a packed inference file (empty to disable)");
+DEFINE_string(export_type, "float", "Weight type of the exported model (float, bf16 or int8)");
+
+// Checkpoint parameters
+DEFINE_string(checkpoint_dir, "", "Directory of the deduplicated checkpoint store (empty to disable)");
+DEFINE_int32(checkpoint_interval, 100, "Number of iterations between checkpoints");
+DEFINE_uint64(checkpoint_chunk, 65536, "Checkpoint chunk size in bytes");
+DEFINE_string(resume, "", "Name of a checkpoint in checkpoint_dir to initialize the network from");
+
+// Parameter-server parameters
+DEFINE_bool(rma, false, "Keep the center variable in an MPI window that workers read and update one-sided, "
+                        "without rank 0 taking part (uniform sampling only; no pruning or checkpoints)");
 
 // Solver parameters
 DEFINE_double(learning_rate, 0.01, "Base learning rate");
 DEFINE_double(lr_gamma, 0.0001, "Learning rate policy gamma");
 DEFINE_double(lr_power, 0.75, "Learning rate policy power");
 
+// Sampling parameters
+DEFINE_string(sampling, "uniform", "Mini-batch sampling (uniform, balanced or importance)");
+DEFINE_double(sampling_alpha, 0.6, "Exponent applied to per-sample losses to form importance-sampling priorities");
+DEFINE_double(sampling_floor, 0.01, "Priority floor added to per-sample losses, so easy samples are still revisited");
+
+// Pruning parameters
+DEFINE_double(fc1_sparsity, 0.0, "Target fraction of pruned FC1 weights (0 disables pruning)");
+DEFINE_int32(prune_begin, 100, "Iteration at which FC1 pruning starts");
+DEFINE_int32(prune_end, 600, "Iteration at which FC1 pruning reaches the target sparsity");
+DEFINE_int32(prune_interval, 50, "Number of iterations between FC1 pruning steps");
+
+// Normalization parameters
+DEFINE_bool(batch_norm, false, "Batch-normalize FC1's outputs before its ReLU (folded into FC1 on export)");
+DEFINE_double(bn_momentum, 0.1, "Weight of each batch in the running batch-normalization statistics");
+DEFINE_double(dropout, 0.0, "Fraction of FC1 activations dropped during training (0 disables dropout)");
+
 void launch_FillOnes(int bs, int bw, float *vec);
 
-void launch_SoftmaxLossBackprop(const float *label, int num_labels, int batch_size, float *diff, int bw);
+void launch_SoftmaxLossBackprop(const uint8_t *label, int num_labels, int batch_size, float *diff, int bw);
+
+void launch_ApplyPruningMask(float *weights, const uint8_t *mask, int size, int bw);
+
+void launch_ReluBackwardInPlace(const float *y, float *diff, int size, int bw);
+
+void launch_BatchNormForwardTraining(const float *x, float *y, float *params, float *saved,
+                                     int N, int C, int S, float momentum, float epsilon, int bw);
+
+void launch_BatchNormForwardInference(const float *x, float *y, const float *params,
+                                      int N, int C, int S, float epsilon, int bw);
+
+void launch_BatchNormBackward(const float *x, float *diff, const float *params, float *gparams,
+                              const float *saved, int N, int C, int S, int bw);
+
+void launch_DropoutReluForward(float *x, uint32_t *mask, int size, float rate, uint64_t key, uint64_t offset, int bw);
+
+void launch_DropoutReluBackward(float *diff, const uint32_t *mask, int size, float rate, int bw);
 
 // FLAGS for MPI communication
 // enum Flags{ COMM_XDATA, COMM_XLABEL, COMM_HEIGHT, COMM_WIDTH, COMM_TRAIN_SIZE, COMM_TRAIN_IMAGES_SIZE, 
@@ -160,6 +216,8 @@ void launch_SoftmaxLossBackprop(const float *label, int num_labels, int batch_si
 #define COMM_GDFC1BIAS		19
 #define COMM_GDFC2NEURON	20
 #define COMM_GDFC2BIAS		21
+#define COMM_XLOSS		22
+#define COMM_GDBN1		23
 
 ///////////////////////////////////////////////////////////////////////////////////////////
 // Layer representations
@@ -172,11 +230,13 @@ struct ConvBiasLayer
     int in_channels, out_channels, kernel_size;
     int in_width, in_height, out_width, out_height;
 
-    std::vector<float> pconv, pbias;
+    // Host weights (out x in x kernel x kernel) and biases
+    Tensor pconv, pbias;
     
     ConvBiasLayer(int in_channels_, int out_channels_, int kernel_size_, 
-                  int in_w_, int in_h_) : pconv(in_channels_ * kernel_size_ * kernel_size_ * out_channels_), 
-                  pbias(out_channels_)
+                  int in_w_, int in_h_) :
+                  pconv(TENSOR_HOST, TENSOR_FLOAT, { (size_t)out_channels_, (size_t)in_channels_, (size_t)kernel_size_, (size_t)kernel_size_ }),
+                  pbias(TENSOR_HOST, TENSOR_FLOAT, { (size_t)out_channels_ })
     {
         in_channels = in_channels_;
         out_channels = out_channels_;
@@ -200,7 +260,7 @@ struct ConvBiasLayer
             printf("ERROR: Cannot open file %s\n", ssf.str().c_str());
             return false;
         }
-        fread(&pconv[0], sizeof(float), in_channels * out_channels * kernel_size * kernel_size, fp);
+        fread(pconv.Data<float>(), sizeof(float), pconv.Count(), fp);
         fclose(fp);
 
         // Read bias file
@@ -210,7 +270,7 @@ struct ConvBiasLayer
             printf("ERROR: Cannot open file %s\n", ssbf.str().c_str());
             return false;
         }
-        fread(&pbias[0], sizeof(float), out_channels, fp);
+        fread(pbias.Data<float>(), sizeof(float), pbias.Count(), fp);
         fclose(fp);
         return true;
     }
@@ -228,7 +288,7 @@ struct ConvBiasLayer
             printf("ERROR: Cannot open file %s\n", ssf.str().c_str());
             exit(2);
         }
-        fwrite(&pconv[0], sizeof(float), in_channels * out_channels * kernel_size * kernel_size, fp);
+        fwrite(pconv.Data<float>(), sizeof(float), pconv.Count(), fp);
         fclose(fp);
 
         // Write bias file
@@ -238,7 +298,7 @@ struct ConvBiasLayer
             printf("ERROR: Cannot open file %s\n", ssbf.str().c_str());
             exit(2);
         }
-        fwrite(&pbias[0], sizeof(float), out_channels, fp);
+        fwrite(pbias.Data<float>(), sizeof(float), pbias.Count(), fp);
         fclose(fp);
     }
 };
@@ -258,10 +318,16 @@ struct MaxPoolLayer
 struct FullyConnectedLayer
 {
     int inputs, outputs;
-    std::vector<float> pneurons, pbias;
+
+    // Host weights (outputs x inputs) and biases
+    Tensor pneurons, pbias;
+
+    // Magnitude-pruning mask over pneurons (inactive while the layer is dense)
+    PruningMask mask;
 
     FullyConnectedLayer(int inputs_, int outputs_) : outputs(outputs_), inputs(inputs_),
-        pneurons(inputs_ * outputs_), pbias(outputs_) {}
+        pneurons(TENSOR_HOST, TENSOR_FLOAT, { (size_t)outputs_, (size_t)inputs_ }),
+        pbias(TENSOR_HOST, TENSOR_FLOAT, { (size_t)outputs_ }) {}
 
     bool FromFile(const char *fileprefix)
     {
@@ -276,7 +342,7 @@ struct FullyConnectedLayer
             printf("ERROR: Cannot open file %s\n", ssf.str().c_str());
             return false;
         }
-        fread(&pneurons[0], sizeof(float), inputs * outputs, fp);
+        fread(pneurons.Data<float>(), sizeof(float), pneurons.Count(), fp);
         fclose(fp);
 
         // Read bias file
@@ -286,7 +352,7 @@ struct FullyConnectedLayer
             printf("ERROR: Cannot open file %s\n", ssbf.str().c_str());
             return false;
         }
-        fread(&pbias[0], sizeof(float), outputs, fp);
+        fread(pbias.Data<float>(), sizeof(float), pbias.Count(), fp);
         fclose(fp);
         return true;
     }
@@ -304,7 +370,7 @@ struct FullyConnectedLayer
             printf("ERROR: Cannot open file %s\n", ssf.str().c_str());
             exit(2);
         }
-        fwrite(&pneurons[0], sizeof(float), inputs * outputs, fp);
+        fwrite(pneurons.Data<float>(), sizeof(float), pneurons.Count(), fp);
         fclose(fp);
 
         // Write bias file
@@ -314,34 +380,430 @@ struct FullyConnectedLayer
             printf("ERROR: Cannot open file %s\n", ssbf.str().c_str());
             exit(2);
         }
-        fwrite(&pbias[0], sizeof(float), outputs, fp);
+        fwrite(pbias.Data<float>(), sizeof(float), pbias.Count(), fp);
         fclose(fp);
     }
 };
 
+/**
+ * Represents a batch-normalization layer over "channels" channels of "spatial"
+ * elements each. The learned scale and shift and the running statistics share
+ * one buffer (see BatchNormParam), so the layer is exchanged, checkpointed and
+ * saved as a single tensor. A layer with zero channels is disabled.
+ */
+struct BatchNormLayer
+{
+    int channels, spatial;
+    float momentum;
+    Tensor pparams;
+
+    BatchNormLayer(int channels_, int spatial_, float momentum_) : channels(channels_), spatial(spatial_),
+        momentum(momentum_), pparams(TENSOR_HOST, TENSOR_FLOAT, { (size_t)BN_NUM_PARAMS, (size_t)channels_ })
+    {
+        InitBatchNormParams(pparams.Data<float>(), channels);
+    }
+
+    bool IsActive() const { return channels > 0; }
+
+    bool FromFile(const char *fileprefix)
+    {
+        std::stringstream ssf;
+        ssf << fileprefix << ".bin";
+
+        FILE *fp = fopen(ssf.str().c_str(), "rb");
+        if (!fp)
+        {
+            printf("ERROR: Cannot open file %s\n", ssf.str().c_str());
+            return false;
+        }
+        fread(pparams.Data<float>(), sizeof(float), pparams.Count(), fp);
+        fclose(fp);
+        return true;
+    }
+
+    void ToFile(const char *fileprefix)
+    {
+        std::stringstream ssf;
+        ssf << fileprefix << ".bin";
+
+        FILE *fp = fopen(ssf.str().c_str(), "wb");
+        if (!fp)
+        {
+            printf("ERROR: Cannot open file %s\n", ssf.str().c_str());
+            exit(2);
+        }
+        fwrite(pparams.Data<float>(), sizeof(float), pparams.Count(), fp);
+        fclose(fp);
+    }
+};
+
+/**
+ * Represents an inverted-dropout layer: during training, each activation is
+ * dropped with probability "rate" and the kept ones are scaled by
+ * 1 / (1 - rate), so inference needs no correction. Masks are drawn from a
+ * counter-based generator keyed by "seed"; "offset" advances past every mask,
+ * so each batch gets a fresh one without any generator state on the device.
+ */
+struct DropoutLayer
+{
+    float rate;
+    uint64_t seed, offset;
+
+    DropoutLayer(float rate_, uint64_t seed_) : rate(rate_), seed(seed_), offset(0) {}
+
+    bool IsActive() const { return rate > 0.0f; }
+
+    /// Returns the stream position of the next mask of "size" elements.
+    uint64_t NextOffset(size_t size)
+    {
+        uint64_t result = offset;
+        offset += size;
+        return result;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Parameter and buffer sets
+
+/**
+ * The learned parameters of the network, in a fixed order. Without batch
+ * normalization, the PARAM_BN1 tensor is empty.
+ */
+enum LeNetParam
+{
+    PARAM_CONV1 = 0,
+    PARAM_CONV1BIAS,
+    PARAM_CONV2,
+    PARAM_CONV2BIAS,
+    PARAM_FC1,
+    PARAM_FC1BIAS,
+    PARAM_FC2,
+    PARAM_FC2BIAS,
+    PARAM_BN1,
+    LENET_NUM_PARAMS
+};
+
+// Checkpoint names of the parameters
+static const char *const g_param_names[LENET_NUM_PARAMS] = {
+    "conv1", "conv1.bias", "conv2", "conv2.bias", "ip1", "ip1.bias", "ip2", "ip2.bias", "bn1"
+};
+
+// MPI tags of the elastic differences of the parameters
+static const int g_param_delta_tags[LENET_NUM_PARAMS] = {
+    COMM_GDCONV1, COMM_GDCONV1BIAS, COMM_GDCONV2, COMM_GDCONV2BIAS,
+    COMM_GDFC1NEURON, COMM_GDFC1BIAS, COMM_GDFC2NEURON, COMM_GDFC2BIAS, COMM_GDBN1
+};
+
+/**
+ * One tensor per learned parameter. The local weights, the center variable,
+ * the elastic differences and the gradients are each such a set, so their
+ * shapes always agree and they are allocated, copied and exchanged in one loop.
+ */
+struct LeNetParams
+{
+    Tensor tensors[LENET_NUM_PARAMS];
+
+    LeNetParams() {}
+
+    /// Views of the host weights held by the layers.
+    LeNetParams(ConvBiasLayer& conv1, ConvBiasLayer& conv2, FullyConnectedLayer& fc1, BatchNormLayer& bn1,
+                FullyConnectedLayer& fc2)
+    {
+        tensors[PARAM_CONV1] = conv1.pconv.View();
+        tensors[PARAM_CONV1BIAS] = conv1.pbias.View();
+        tensors[PARAM_CONV2] = conv2.pconv.View();
+        tensors[PARAM_CONV2BIAS] = conv2.pbias.View();
+        tensors[PARAM_FC1] = fc1.pneurons.View();
+        tensors[PARAM_FC1BIAS] = fc1.pbias.View();
+        tensors[PARAM_FC2] = fc2.pneurons.View();
+        tensors[PARAM_FC2BIAS] = fc2.pbias.View();
+        tensors[PARAM_BN1] = bn1.pparams.View();
+    }
+
+    /// Allocates uninitialized parameters of the same shapes on "device".
+    LeNetParams EmptyLike(TensorDevice device) const
+    {
+        LeNetParams result;
+        for (int i = 0; i < LENET_NUM_PARAMS; ++i)
+            result.tensors[i] = tensors[i].EmptyLike(device);
+        return result;
+    }
+
+    /// Allocates a copy of the parameters on "device".
+    LeNetParams Clone(TensorDevice device) const
+    {
+        LeNetParams result;
+        for (int i = 0; i < LENET_NUM_PARAMS; ++i)
+            result.tensors[i] = tensors[i].Clone(device);
+        return result;
+    }
+
+    void CopyFrom(const LeNetParams& src)
+    {
+        for (int i = 0; i < LENET_NUM_PARAMS; ++i)
+            tensors[i].CopyFrom(src.tensors[i]);
+    }
+
+    Tensor& operator[](int param) { return tensors[param]; }
+    const Tensor& operator[](int param) const { return tensors[param]; }
+
+    /// Lists the non-empty parameters, which must be on the host, for a checkpoint.
+    std::vector<CheckpointTensor> CheckpointTensors() const
+    {
+        std::vector<CheckpointTensor> result;
+        for (int i = 0; i < LENET_NUM_PARAMS; ++i)
+            if (!tensors[i].Empty())
+                result.push_back({ g_param_names[i], tensors[i].Data<float>(), tensors[i].Count() });
+        return result;
+    }
+};
+
+/**
+ * Persistent MPI requests for messages that every iteration sends with the
+ * same buffer, size, peer and tag. They are set up once (MPI_Send_init,
+ * MPI_Recv_init) and restarted with one MPI_Startall per iteration, which
+ * skips the per-call argument checking, matching and protocol setup, and
+ * lets the library keep its registration of the (fixed) buffers.
+ *
+ * The buffers must stay in place until Free() is called, which must happen
+ * before the set is re-created for other buffers.
+ */
+struct PersistentRequests
+{
+    std::vector<MPI_Request> requests;
+
+    void Send(const void *buf, size_t count, MPI_Datatype type, int dest, int tag)
+    {
+        requests.push_back(MPI_REQUEST_NULL);
+        MPI_Send_init(buf, (int)count, type, dest, tag, MPI_COMM_WORLD, &requests.back());
+    }
+
+    void Recv(void *buf, size_t count, MPI_Datatype type, int source, int tag)
+    {
+        requests.push_back(MPI_REQUEST_NULL);
+        MPI_Recv_init(buf, (int)count, type, source, tag, MPI_COMM_WORLD, &requests.back());
+    }
+
+#if MPI_VERSION >= 4
+    /// Persistent broadcast from rank 0 (an MPI-4 persistent collective).
+    void Bcast(void *buf, size_t count, MPI_Datatype type)
+    {
+        requests.push_back(MPI_REQUEST_NULL);
+        MPI_Bcast_init(buf, (int)count, type, 0, MPI_COMM_WORLD, MPI_INFO_NULL, &requests.back());
+    }
+
+    /// Starts the requests one by one, in order (collectives must start in the same order on every rank).
+    void StartInOrder()
+    {
+        for (MPI_Request& request : requests)
+            MPI_Start(&request);
+    }
+#endif
+
+    void Start()
+    {
+        if (!requests.empty())
+            MPI_Startall((int)requests.size(), requests.data());
+    }
+
+    /// Waits for "count" requests from "first" (all by default); inactive requests complete at once.
+    void Wait(size_t first = 0, size_t count = (size_t)-1)
+    {
+        count = std::min(count, requests.size() - first);
+        if (count > 0)
+            MPI_Waitall((int)count, &requests[first], MPI_STATUSES_IGNORE);
+    }
+
+    void Free()
+    {
+        for (MPI_Request& request : requests)
+            if (request != MPI_REQUEST_NULL)
+                MPI_Request_free(&request);
+        requests.clear();
+    }
+};
+
+/**
+ * The center variable of EASGD in an MPI window on rank 0, for a parameter
+ * server that takes no part in the exchanges: workers read the weights and
+ * add their elastic differences with one-sided operations under a shared
+ * passive-target lock, so rank 0 handles no messages, and workers wait
+ * neither for rank 0 nor for each other.
+ *
+ * Reads (MPI_Get_accumulate with MPI_NO_OP) and updates (MPI_Accumulate with
+ * MPI_SUM) are atomic per element, so concurrent workers never see torn
+ * values; a read may see another worker's update in some tensors and not yet
+ * in others, as in asynchronous EASGD.
+ */
+struct CenterWindow
+{
+    MPI_Win win = MPI_WIN_NULL;
+    float *base = nullptr;
+
+    /// Offset of each parameter in the window; the last entry is the total size.
+    size_t offsets[LENET_NUM_PARAMS + 1];
+
+    /// Creates the window (collective). Rank 0 allocates it and fills it with "initial".
+    void Create(const LeNetParams& initial, int rank)
+    {
+        offsets[0] = 0;
+        for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+            offsets[p + 1] = offsets[p] + initial[p].Count();
+
+        const size_t count = (rank == 0) ? offsets[LENET_NUM_PARAMS] : 0;
+        MPI_Win_allocate((MPI_Aint)(count * sizeof(float)), sizeof(float), MPI_INFO_NULL, MPI_COMM_WORLD,
+                         &base, &win);
+        if (rank == 0)
+        {
+            MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, win);
+            for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+                if (!initial[p].Empty())
+                    memcpy(base + offsets[p], initial[p].Data<float>(), initial[p].Bytes());
+            MPI_Win_unlock(0, win);
+        }
+
+        // No worker may read the center before it is filled
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+
+    /// Copies the center into "dst" (host tensors).
+    void Read(LeNetParams& dst)
+    {
+        MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, win);
+        for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+        {
+            if (dst[p].Empty())
+                continue;
+            const int count = (int)dst[p].Count();
+            MPI_Get_accumulate(nullptr, 0, MPI_FLOAT, dst[p].Data<float>(), count, MPI_FLOAT,
+                               0, (MPI_Aint)offsets[p], count, MPI_FLOAT, MPI_NO_OP, win);
+        }
+        MPI_Win_unlock(0, win);
+    }
+
+    /// Adds "delta" (host tensors) to the center.
+    void Accumulate(const LeNetParams& delta)
+    {
+        MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, win);
+        for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+        {
+            if (delta[p].Empty())
+                continue;
+            const int count = (int)delta[p].Count();
+            MPI_Accumulate(delta[p].Data<float>(), count, MPI_FLOAT, 0, (MPI_Aint)offsets[p], count, MPI_FLOAT,
+                           MPI_SUM, win);
+        }
+        MPI_Win_unlock(0, win);
+    }
+
+    /// Frees the window (collective).
+    void Free()
+    {
+        if (win != MPI_WIN_NULL)
+            MPI_Win_free(&win);
+        base = nullptr;
+    }
+};
+
+/**
+ * GPU buffers of one batch: the input and labels, every layer's activations,
+ * and the gradients with respect to them. The buffers of disabled layers
+ * (batch normalization, dropout) are empty.
+ */
+struct LeNetBuffers
+{
+    Tensor data, labels, conv1, pool1, conv2, pool2, fc1, fc1bn, fc1drop, fc2, fc2smax;
+    Tensor dlossdata, dpool1, dconv2, dpool2, dfc1, dfc2, bn1saved, onevec;
+
+    LeNetBuffers(size_t batch_size, size_t channels, size_t height, size_t width,
+                 const ConvBiasLayer& lconv1, const MaxPoolLayer& lpool1, const ConvBiasLayer& lconv2,
+                 const MaxPoolLayer& lpool2, const FullyConnectedLayer& lfc1, const BatchNormLayer& lbn1,
+                 const DropoutLayer& ldrop1, const FullyConnectedLayer& lfc2)
+    {
+        const size_t N = batch_size;
+        const size_t pool1_h = lconv1.out_height / lpool1.stride, pool1_w = lconv1.out_width / lpool1.stride;
+        const size_t pool2_h = lconv2.out_height / lpool2.stride, pool2_w = lconv2.out_width / lpool2.stride;
+
+        // Forward propagation data
+        data    = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, channels, height, width });
+        labels  = Tensor(TENSOR_GPU, TENSOR_UINT8, { N });
+        conv1   = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lconv1.out_channels, (size_t)lconv1.out_height, (size_t)lconv1.out_width });
+        pool1   = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lconv1.out_channels, pool1_h, pool1_w });
+        conv2   = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lconv2.out_channels, (size_t)lconv2.out_height, (size_t)lconv2.out_width });
+        pool2   = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lconv2.out_channels, pool2_h, pool2_w });
+        fc1     = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lfc1.outputs });
+        fc2     = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lfc2.outputs });
+        fc2smax = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lfc2.outputs });
+
+        // Differentials w.r.t. data. FC1's ReLU runs in place: fc1 also holds its
+        // output, and dfc2 its input gradient
+        dpool1    = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lconv1.out_channels, (size_t)lconv1.out_height, (size_t)lconv1.out_width });
+        dpool2    = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lconv2.out_channels, (size_t)lconv2.out_height, (size_t)lconv2.out_width });
+        dconv2    = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lconv1.out_channels, pool1_h, pool1_w });
+        dfc1      = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lfc1.inputs });
+        dfc2      = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lfc2.inputs });
+        dlossdata = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lfc2.outputs });
+
+        // Normalized FC1 activations and saved batch statistics
+        if (lbn1.IsActive())
+        {
+            fc1bn    = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N, (size_t)lfc1.outputs });
+            bn1saved = Tensor(TENSOR_GPU, TENSOR_FLOAT, { 2, (size_t)lbn1.channels });
+        }
+
+        // Bit-packed FC1 dropout gates
+        if (ldrop1.IsActive())
+            fc1drop = Tensor(TENSOR_GPU, TENSOR_UINT32, { (N * lfc1.outputs + 31) / 32 });
+
+        onevec = Tensor(TENSOR_GPU, TENSOR_FLOAT, { N });
+    }
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////
 // CUDNN/CUBLAS training context
 
+/**
+ * The batch-size-dependent part of a TrainingContext: descriptors of the
+ * activation tensors, the convolution algorithms chosen for them, and the
+ * workspace those algorithms need.
+ */
+struct BatchPlan
+{
+    cudnnTensorDescriptor_t dataTensor, conv1Tensor, pool1Tensor, conv2Tensor, pool2Tensor, fc1Tensor, fc2Tensor;
+    cudnnConvolutionFwdAlgo_t conv1algo, conv2algo;
+    cudnnConvolutionBwdFilterAlgo_t conv1bwfalgo, conv2bwfalgo;
+    cudnnConvolutionBwdDataAlgo_t conv2bwdalgo;
+    size_t workspaceSize;
+};
+
+/**
+ * Training and inference on the GPU with any batch size. Reshape() switches
+ * batch sizes; the plan of each batch size is created on first use and
+ * cached, and the workspace only ever grows, so later switches (to a partial
+ * final batch, an evaluation batch, or back) cost a lookup.
+ */
 struct TrainingContext
 {
     cudnnHandle_t cudnnHandle;
     cublasHandle_t cublasHandle;
 
-    cudnnTensorDescriptor_t dataTensor, conv1Tensor, conv1BiasTensor, pool1Tensor, 
-                             conv2Tensor, conv2BiasTensor, pool2Tensor, fc1Tensor, fc2Tensor;
+    cudnnTensorDescriptor_t conv1BiasTensor, conv2BiasTensor;
     cudnnFilterDescriptor_t conv1filterDesc, conv2filterDesc;
     cudnnConvolutionDescriptor_t conv1Desc, conv2Desc;
-    cudnnConvolutionFwdAlgo_t conv1algo, conv2algo;
-    cudnnConvolutionBwdFilterAlgo_t conv1bwfalgo, conv2bwfalgo;
-    cudnnConvolutionBwdDataAlgo_t conv2bwdalgo;
     cudnnPoolingDescriptor_t poolDesc;
     cudnnActivationDescriptor_t fc1Activation;
 
     int m_gpuid;
     int m_batchSize;
-    size_t m_workspaceSize;
+    std::map<int, BatchPlan> m_plans;
+    const BatchPlan *m_plan;
+    Tensor m_workspace;
 
+    ConvBiasLayer& ref_conv1, &ref_conv2;
+    MaxPoolLayer& ref_pool1, &ref_pool2;
     FullyConnectedLayer& ref_fc1, &ref_fc2;
+    BatchNormLayer& ref_bn1;
+    DropoutLayer& ref_drop1;
 
     // Disable copying
     TrainingContext& operator=(const TrainingContext&) = delete;
@@ -349,25 +811,18 @@ struct TrainingContext
 
     TrainingContext(int gpuid, int batch_size,
                     ConvBiasLayer& conv1, MaxPoolLayer& pool1, ConvBiasLayer& conv2, MaxPoolLayer& pool2,
-                    FullyConnectedLayer& fc1, FullyConnectedLayer& fc2) : ref_fc1(fc1), ref_fc2(fc2), m_gpuid(gpuid)
+                    FullyConnectedLayer& fc1, BatchNormLayer& bn1, DropoutLayer& drop1, FullyConnectedLayer& fc2) :
+                    ref_conv1(conv1), ref_conv2(conv2), ref_pool1(pool1), ref_pool2(pool2),
+                    ref_fc1(fc1), ref_fc2(fc2), ref_bn1(bn1), ref_drop1(drop1), m_gpuid(gpuid), m_plan(nullptr)
     {
-        m_batchSize = batch_size;
-
         // Create CUBLAS and CUDNN handles
         checkCudaErrors(cudaSetDevice(gpuid));
         checkCudaErrors(cublasCreate(&cublasHandle));
         checkCUDNN(cudnnCreate(&cudnnHandle));
 
-        // Create tensor descriptors
-        checkCUDNN(cudnnCreateTensorDescriptor(&dataTensor));
-        checkCUDNN(cudnnCreateTensorDescriptor(&conv1Tensor));
+        // Create the descriptors shared by all batch sizes
         checkCUDNN(cudnnCreateTensorDescriptor(&conv1BiasTensor));
-        checkCUDNN(cudnnCreateTensorDescriptor(&pool1Tensor));
-        checkCUDNN(cudnnCreateTensorDescriptor(&conv2Tensor));
         checkCUDNN(cudnnCreateTensorDescriptor(&conv2BiasTensor));
-        checkCUDNN(cudnnCreateTensorDescriptor(&pool2Tensor));
-        checkCUDNN(cudnnCreateTensorDescriptor(&fc1Tensor));
-        checkCUDNN(cudnnCreateTensorDescriptor(&fc2Tensor));
 
         checkCUDNN(cudnnCreateActivationDescriptor(&fc1Activation));
 
@@ -398,37 +853,11 @@ struct TrainingContext
                                                pool1.size, pool1.size,
                                                0, 0,
                                                pool1.stride, pool1.stride));
-        checkCUDNN(cudnnSetTensor4dDescriptor(pool2Tensor,
-                                              CUDNN_TENSOR_NCHW,
-                                              CUDNN_DATA_FLOAT,
-                                              batch_size, conv2.out_channels,
-                                              conv2.out_height / pool2.stride,
-                                              conv2.out_width / pool2.stride));
-
-        checkCUDNN(cudnnSetTensor4dDescriptor(fc1Tensor,
-                                              CUDNN_TENSOR_NCHW,
-                                              CUDNN_DATA_FLOAT,
-                                              batch_size, fc1.outputs, 1, 1));
-
-        checkCUDNN(cudnnSetTensor4dDescriptor(fc2Tensor,
-                                              CUDNN_TENSOR_NCHW,
-                                              CUDNN_DATA_FLOAT,
-                                              batch_size, fc2.outputs, 1, 1));
 
         checkCUDNN(cudnnSetActivationDescriptor(fc1Activation, CUDNN_ACTIVATION_RELU,
                                                 CUDNN_PROPAGATE_NAN, 0.0));
 
-
-        // Set convolution tensor sizes and compute workspace size
-        size_t workspace = 0;
-        workspace = std::max(workspace, SetFwdConvolutionTensors(conv1, dataTensor, conv1Tensor, conv1filterDesc, conv1Desc, conv1algo));
-        workspace = std::max(workspace, SetBwdConvolutionTensors(dataTensor, conv1Tensor, conv1filterDesc, conv1Desc, &conv1bwfalgo, nullptr));
-
-        workspace = std::max(workspace, SetFwdConvolutionTensors(conv2, pool1Tensor, conv2Tensor, conv2filterDesc, conv2Desc, conv2algo));
-        workspace = std::max(workspace, SetBwdConvolutionTensors(pool1Tensor, conv2Tensor, conv2filterDesc, conv2Desc, &conv2bwfalgo, &conv2bwdalgo));
-
-        // The workspace is allocated later (if necessary)
-        m_workspaceSize = workspace;
+        Reshape(batch_size);
     }
 
     ~TrainingContext()
@@ -437,15 +866,19 @@ struct TrainingContext
 
         checkCudaErrors(cublasDestroy(cublasHandle));
         checkCUDNN(cudnnDestroy(cudnnHandle));
-        checkCUDNN(cudnnDestroyTensorDescriptor(dataTensor));
-        checkCUDNN(cudnnDestroyTensorDescriptor(conv1Tensor));
+        for (auto& entry : m_plans)
+        {
+            BatchPlan& plan = entry.second;
+            checkCUDNN(cudnnDestroyTensorDescriptor(plan.dataTensor));
+            checkCUDNN(cudnnDestroyTensorDescriptor(plan.conv1Tensor));
+            checkCUDNN(cudnnDestroyTensorDescriptor(plan.pool1Tensor));
+            checkCUDNN(cudnnDestroyTensorDescriptor(plan.conv2Tensor));
+            checkCUDNN(cudnnDestroyTensorDescriptor(plan.pool2Tensor));
+            checkCUDNN(cudnnDestroyTensorDescriptor(plan.fc1Tensor));
+            checkCUDNN(cudnnDestroyTensorDescriptor(plan.fc2Tensor));
+        }
         checkCUDNN(cudnnDestroyTensorDescriptor(conv1BiasTensor));
-        checkCUDNN(cudnnDestroyTensorDescriptor(pool1Tensor));
-        checkCUDNN(cudnnDestroyTensorDescriptor(conv2Tensor));
         checkCUDNN(cudnnDestroyTensorDescriptor(conv2BiasTensor));
-        checkCUDNN(cudnnDestroyTensorDescriptor(pool2Tensor));
-        checkCUDNN(cudnnDestroyTensorDescriptor(fc1Tensor));
-        checkCUDNN(cudnnDestroyTensorDescriptor(fc2Tensor));
         checkCUDNN(cudnnDestroyActivationDescriptor(fc1Activation));
         checkCUDNN(cudnnDestroyFilterDescriptor(conv1filterDesc));
         checkCUDNN(cudnnDestroyFilterDescriptor(conv2filterDesc));
@@ -454,13 +887,80 @@ struct TrainingContext
         checkCUDNN(cudnnDestroyPoolingDescriptor(poolDesc));
     }
 
-    size_t SetFwdConvolutionTensors(ConvBiasLayer& conv, cudnnTensorDescriptor_t& srcTensorDesc, cudnnTensorDescriptor_t& dstTensorDesc,
+    /**
+     * Switches to "batch_size" (at most the batch size of the buffers passed
+     * to propagation), creating and caching its plan on first use and growing
+     * the workspace if the plan needs more.
+     */
+    void Reshape(int batch_size)
+    {
+        auto iter = m_plans.find(batch_size);
+        if (iter == m_plans.end())
+            iter = m_plans.insert(std::make_pair(batch_size, CreatePlan(batch_size))).first;
+        m_plan = &iter->second;
+        m_batchSize = batch_size;
+
+        if (m_plan->workspaceSize > m_workspace.Bytes())
+        {
+            checkCudaErrors(cudaSetDevice(m_gpuid));
+            m_workspace = Tensor(TENSOR_GPU, TENSOR_UINT8, { m_plan->workspaceSize });
+        }
+    }
+
+    BatchPlan CreatePlan(int batch_size)
+    {
+        BatchPlan plan;
+        checkCudaErrors(cudaSetDevice(m_gpuid));
+
+        checkCUDNN(cudnnCreateTensorDescriptor(&plan.dataTensor));
+        checkCUDNN(cudnnCreateTensorDescriptor(&plan.conv1Tensor));
+        checkCUDNN(cudnnCreateTensorDescriptor(&plan.pool1Tensor));
+        checkCUDNN(cudnnCreateTensorDescriptor(&plan.conv2Tensor));
+        checkCUDNN(cudnnCreateTensorDescriptor(&plan.pool2Tensor));
+        checkCUDNN(cudnnCreateTensorDescriptor(&plan.fc1Tensor));
+        checkCUDNN(cudnnCreateTensorDescriptor(&plan.fc2Tensor));
+
+        checkCUDNN(cudnnSetTensor4dDescriptor(plan.pool2Tensor,
+                                              CUDNN_TENSOR_NCHW,
+                                              CUDNN_DATA_FLOAT,
+                                              batch_size, ref_conv2.out_channels,
+                                              ref_conv2.out_height / ref_pool2.stride,
+                                              ref_conv2.out_width / ref_pool2.stride));
+
+        checkCUDNN(cudnnSetTensor4dDescriptor(plan.fc1Tensor,
+                                              CUDNN_TENSOR_NCHW,
+                                              CUDNN_DATA_FLOAT,
+                                              batch_size, ref_fc1.outputs, 1, 1));
+
+        checkCUDNN(cudnnSetTensor4dDescriptor(plan.fc2Tensor,
+                                              CUDNN_TENSOR_NCHW,
+                                              CUDNN_DATA_FLOAT,
+                                              batch_size, ref_fc2.outputs, 1, 1));
+
+        // Set convolution tensor sizes and compute workspace size
+        size_t workspace = 0;
+        workspace = std::max(workspace, SetFwdConvolutionTensors(ref_conv1, batch_size, plan.dataTensor, plan.conv1Tensor,
+                                                                 conv1filterDesc, conv1Desc, plan.conv1algo));
+        workspace = std::max(workspace, SetBwdConvolutionTensors(plan.dataTensor, plan.conv1Tensor, conv1filterDesc, conv1Desc,
+                                                                 &plan.conv1bwfalgo, nullptr));
+
+        workspace = std::max(workspace, SetFwdConvolutionTensors(ref_conv2, batch_size, plan.pool1Tensor, plan.conv2Tensor,
+                                                                 conv2filterDesc, conv2Desc, plan.conv2algo));
+        workspace = std::max(workspace, SetBwdConvolutionTensors(plan.pool1Tensor, plan.conv2Tensor, conv2filterDesc, conv2Desc,
+                                                                 &plan.conv2bwfalgo, &plan.conv2bwdalgo));
+        plan.workspaceSize = workspace;
+
+        return plan;
+    }
+
+    size_t SetFwdConvolutionTensors(ConvBiasLayer& conv, int batch_size, cudnnTensorDescriptor_t& srcTensorDesc,
+                                    cudnnTensorDescriptor_t& dstTensorDesc,
                                     cudnnFilterDescriptor_t& filterDesc, cudnnConvolutionDescriptor_t& convDesc, 
                                     cudnnConvolutionFwdAlgo_t& algo)
     {
         size_t sizeInBytes = 0;
 
-        int n = m_batchSize;
+        int n = batch_size;
         int c = conv.in_channels;
         int h = conv.in_height;
         int w = conv.in_width;
@@ -525,39 +1025,60 @@ struct TrainingContext
         return sizeInBytes;
     }
 
-    void ForwardPropagation(float *data, float *conv1, float *pool1, float *conv2, float *pool2, float *fc1, float *fc1relu,
-                            float *fc2, float *result,
-                            float *pconv1, float *pconv1bias, 
-                            float *pconv2, float *pconv2bias, 
-                            float *pfc1, float *pfc1bias,
-                            float *pfc2, float *pfc2bias, void *workspace, float *onevec)
+    /**
+     * Forward propagation. FC1's ReLU runs in place, so "fc1" holds the
+     * activations (post-ReLU) on return; no separate ReLU output buffer exists.
+     * With batch normalization, "fc1" keeps FC1's raw outputs (needed for
+     * backpropagation) and "fc1bn" holds the normalized activations instead.
+     * While training, normalization uses the batch statistics, saved to
+     * "bn1saved", and otherwise the running statistics. With dropout, training
+     * also applies a fresh dropout mask in the ReLU and stores the combined
+     * gates, one bit per activation, in "fc1drop".
+     */
+    void ForwardPropagation(LeNetBuffers& b, const LeNetParams& params, bool training)
     {        
         float alpha = 1.0f, beta = 0.0f;
+        if (b.data.Dim(0) < (size_t)m_batchSize)
+            FatalError("Batch buffers are smaller than the batch size");
+
+        float *data = b.data.Data<float>(), *conv1 = b.conv1.Data<float>(), *pool1 = b.pool1.Data<float>();
+        float *conv2 = b.conv2.Data<float>(), *pool2 = b.pool2.Data<float>(), *fc1 = b.fc1.Data<float>();
+        float *fc1bn = b.fc1bn.Data<float>(), *fc2 = b.fc2.Data<float>(), *result = b.fc2smax.Data<float>();
+        float *bn1saved = training ? b.bn1saved.Data<float>() : nullptr;
+        uint32_t *fc1drop = training ? b.fc1drop.Data<uint32_t>() : nullptr;
+        float *onevec = b.onevec.Data<float>();
+        void *workspace = m_workspace.Data<uint8_t>();
+
+        float *pconv1 = params[PARAM_CONV1].Data<float>(), *pconv1bias = params[PARAM_CONV1BIAS].Data<float>();
+        float *pconv2 = params[PARAM_CONV2].Data<float>(), *pconv2bias = params[PARAM_CONV2BIAS].Data<float>();
+        float *pfc1 = params[PARAM_FC1].Data<float>(), *pfc1bias = params[PARAM_FC1BIAS].Data<float>();
+        float *pfc2 = params[PARAM_FC2].Data<float>(), *pfc2bias = params[PARAM_FC2BIAS].Data<float>();
+        float *pbn1 = params[PARAM_BN1].Data<float>();
         checkCudaErrors(cudaSetDevice(m_gpuid));
 
         // Conv1 layer
-        checkCUDNN(cudnnConvolutionForward(cudnnHandle, &alpha, dataTensor,
+        checkCUDNN(cudnnConvolutionForward(cudnnHandle, &alpha, m_plan->dataTensor,
                                            data, conv1filterDesc, pconv1, conv1Desc, 
-                                           conv1algo, workspace, m_workspaceSize, &beta,
-                                           conv1Tensor, conv1));
+                                           m_plan->conv1algo, workspace, m_workspace.Bytes(), &beta,
+                                           m_plan->conv1Tensor, conv1));
         checkCUDNN(cudnnAddTensor(cudnnHandle, &alpha, conv1BiasTensor,
-                                  pconv1bias, &alpha, conv1Tensor, conv1));
+                                  pconv1bias, &alpha, m_plan->conv1Tensor, conv1));
 
         // Pool1 layer
-        checkCUDNN(cudnnPoolingForward(cudnnHandle, poolDesc, &alpha, conv1Tensor,
-                                       conv1, &beta, pool1Tensor, pool1));
+        checkCUDNN(cudnnPoolingForward(cudnnHandle, poolDesc, &alpha, m_plan->conv1Tensor,
+                                       conv1, &beta, m_plan->pool1Tensor, pool1));
 
         // Conv2 layer
-        checkCUDNN(cudnnConvolutionForward(cudnnHandle, &alpha, pool1Tensor,
+        checkCUDNN(cudnnConvolutionForward(cudnnHandle, &alpha, m_plan->pool1Tensor,
                                            pool1, conv2filterDesc, pconv2, conv2Desc, 
-                                           conv2algo, workspace, m_workspaceSize, &beta,
-                                           conv2Tensor, conv2));
+                                           m_plan->conv2algo, workspace, m_workspace.Bytes(), &beta,
+                                           m_plan->conv2Tensor, conv2));
         checkCUDNN(cudnnAddTensor(cudnnHandle, &alpha, conv2BiasTensor,
-                                  pconv2bias, &alpha, conv2Tensor, conv2));
+                                  pconv2bias, &alpha, m_plan->conv2Tensor, conv2));
 
         // Pool2 layer
-        checkCUDNN(cudnnPoolingForward(cudnnHandle, poolDesc, &alpha, conv2Tensor,
-                                       conv2, &beta, pool2Tensor, pool2));
+        checkCUDNN(cudnnPoolingForward(cudnnHandle, poolDesc, &alpha, m_plan->conv2Tensor,
+                                       conv2, &beta, m_plan->pool2Tensor, pool2));
 
         // FC1 layer
         // Forward propagate neurons using weights (fc1 = pfc1'*pool2)
@@ -577,17 +1098,36 @@ struct TrainingContext
                                     &alpha,
                                     fc1, ref_fc1.outputs));
 
-        // ReLU activation
-        checkCUDNN(cudnnActivationForward(cudnnHandle, fc1Activation, &alpha,
-                                          fc1Tensor, fc1, &beta, fc1Tensor, fc1relu));
+        // Batch normalization (statistics and normalization in one kernel)
+        float *act = fc1;
+        if (ref_bn1.IsActive())
+        {
+            if (bn1saved)
+                launch_BatchNormForwardTraining(fc1, fc1bn, pbn1, bn1saved, m_batchSize, ref_bn1.channels, ref_bn1.spatial,
+                                                ref_bn1.momentum, BATCHNORM_EPSILON, BW);
+            else
+                launch_BatchNormForwardInference(fc1, fc1bn, pbn1, m_batchSize, ref_bn1.channels, ref_bn1.spatial,
+                                                 BATCHNORM_EPSILON, BW);
+            act = fc1bn;
+        }
+
+        // ReLU activation (in place), fused with dropout while training
+        if (ref_drop1.IsActive() && fc1drop)
+        {
+            const int size = ref_fc1.outputs * m_batchSize;
+            launch_DropoutReluForward(act, fc1drop, size, ref_drop1.rate, ref_drop1.seed, ref_drop1.NextOffset(size), BW);
+        }
+        else
+            checkCUDNN(cudnnActivationForward(cudnnHandle, fc1Activation, &alpha,
+                                              m_plan->fc1Tensor, act, &beta, m_plan->fc1Tensor, act));
 
         // FC2 layer
-        // Forward propagate neurons using weights (fc2 = pfc2'*fc1relu)
+        // Forward propagate neurons using weights (fc2 = pfc2'*relu(fc1))
         checkCudaErrors(cublasSgemm(cublasHandle, CUBLAS_OP_T, CUBLAS_OP_N,
                                     ref_fc2.outputs, m_batchSize, ref_fc2.inputs,
                                     &alpha,
                                     pfc2, ref_fc2.inputs,
-                                    fc1relu, ref_fc2.inputs,
+                                    act, ref_fc2.inputs,
                                     &beta,
                                     fc2, ref_fc2.outputs));
         // Add bias using GEMM's "beta" (fc2 += pfc2bias*1_vec')
@@ -601,7 +1141,7 @@ struct TrainingContext
 
         // Softmax loss
         checkCUDNN(cudnnSoftmaxForward(cudnnHandle, CUDNN_SOFTMAX_ACCURATE, CUDNN_SOFTMAX_MODE_CHANNEL,
-                                       &alpha, fc2Tensor, fc2, &beta, fc2Tensor, result));
+                                       &alpha, m_plan->fc2Tensor, fc2, &beta, m_plan->fc2Tensor, result));
     }
 
     size_t SetBwdConvolutionTensors(cudnnTensorDescriptor_t& srcTensorDesc, cudnnTensorDescriptor_t& dstTensorDesc,
@@ -641,22 +1181,41 @@ struct TrainingContext
         return sizeInBytes;
     }
 
-    void Backpropagation(ConvBiasLayer& layer_conv1, MaxPoolLayer& layer_pool1, ConvBiasLayer& layer_conv2, MaxPoolLayer& layer_pool2,
-                         float *data, float *labels, float *conv1, float *pool1, float *conv2, float *pool2, float *fc1, float *fc1relu,
-                         float *fc2, float *fc2smax, float *dloss_data,
-                         float *pconv1, float *pconv1bias,
-                         float *pconv2, float *pconv2bias,
-                         float *pfc1, float *pfc1bias,
-                         float *pfc2, float *pfc2bias,
-                         float *gconv1, float *gconv1bias, float *dpool1,
-                         float *gconv2, float *gconv2bias, float *dconv2, float *dpool2,
-                         float *gfc1, float *gfc1bias, float *dfc1, float *dfc1relu,
-                         float *gfc2, float *gfc2bias, float *dfc2,
-                         void *workspace, float *onevec)
+    /**
+     * Backpropagation. "fc1" holds FC1's post-ReLU activations (see
+     * ForwardPropagation), and "dfc2" receives FC2's data gradient and is then
+     * turned into the gradient before the ReLU in place. With batch
+     * normalization the activations are in "fc1bn", and "dfc2" is carried on
+     * in place through the normalization to FC1's outputs. With dropout, the
+     * ReLU gradient comes from the bit-packed gates in "fc1drop".
+     */
+    void Backpropagation(LeNetBuffers& b, const LeNetParams& params, LeNetParams& grads)
     {    
         float alpha = 1.0f, beta = 0.0f;
+        if (b.data.Dim(0) < (size_t)m_batchSize)
+            FatalError("Batch buffers are smaller than the batch size");
+
+        float *data = b.data.Data<float>(), *conv1 = b.conv1.Data<float>(), *pool1 = b.pool1.Data<float>();
+        float *conv2 = b.conv2.Data<float>(), *pool2 = b.pool2.Data<float>(), *fc1 = b.fc1.Data<float>();
+        float *fc1bn = b.fc1bn.Data<float>(), *fc2smax = b.fc2smax.Data<float>(), *bn1saved = b.bn1saved.Data<float>();
+        const uint8_t *labels = b.labels.Data<uint8_t>();
+        const uint32_t *fc1drop = b.fc1drop.Data<uint32_t>();
+        float *dloss_data = b.dlossdata.Data<float>(), *dpool1 = b.dpool1.Data<float>(), *dconv2 = b.dconv2.Data<float>();
+        float *dpool2 = b.dpool2.Data<float>(), *dfc1 = b.dfc1.Data<float>(), *dfc2 = b.dfc2.Data<float>();
+        float *onevec = b.onevec.Data<float>();
+        void *workspace = m_workspace.Data<uint8_t>();
+
+        float *pconv2 = params[PARAM_CONV2].Data<float>(), *pfc1 = params[PARAM_FC1].Data<float>();
+        float *pfc2 = params[PARAM_FC2].Data<float>(), *pbn1 = params[PARAM_BN1].Data<float>();
+
+        float *gconv1 = grads[PARAM_CONV1].Data<float>(), *gconv1bias = grads[PARAM_CONV1BIAS].Data<float>();
+        float *gconv2 = grads[PARAM_CONV2].Data<float>(), *gconv2bias = grads[PARAM_CONV2BIAS].Data<float>();
+        float *gfc1 = grads[PARAM_FC1].Data<float>(), *gfc1bias = grads[PARAM_FC1BIAS].Data<float>();
+        float *gfc2 = grads[PARAM_FC2].Data<float>(), *gfc2bias = grads[PARAM_FC2BIAS].Data<float>();
+        float *gbn1 = grads[PARAM_BN1].Data<float>();
 
         float scalVal = 1.0f / static_cast<float>(m_batchSize);
+        float *act = ref_bn1.IsActive() ? fc1bn : fc1;
 
         checkCudaErrors(cudaSetDevice(m_gpuid));
 
@@ -670,9 +1229,9 @@ struct TrainingContext
         checkCudaErrors(cublasSscal(cublasHandle, ref_fc2.outputs * m_batchSize, &scalVal, dloss_data, 1));
 
         // FC2 layer
-        // Compute derivative with respect to weights: gfc2 = (fc1relu * dfc2smax')
+        // Compute derivative with respect to weights: gfc2 = (relu(fc1) * dfc2smax')
         checkCudaErrors(cublasSgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_T, ref_fc2.inputs, ref_fc2.outputs, m_batchSize,
-                                    &alpha, fc1relu, ref_fc2.inputs, dloss_data, ref_fc2.outputs, &beta, gfc2, ref_fc2.inputs));
+                                    &alpha, act, ref_fc2.inputs, dloss_data, ref_fc2.outputs, &beta, gfc2, ref_fc2.inputs));
         // Compute derivative with respect to bias: gfc2bias = dfc2smax * 1_vec
         checkCudaErrors(cublasSgemv(cublasHandle, CUBLAS_OP_N, ref_fc2.outputs, m_batchSize,
                                     &alpha, dloss_data, ref_fc2.outputs, onevec, 1, &beta, gfc2bias, 1));
@@ -680,214 +1239,112 @@ struct TrainingContext
         checkCudaErrors(cublasSgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, ref_fc2.inputs, m_batchSize, ref_fc2.outputs,
                                     &alpha, pfc2, ref_fc2.inputs, dloss_data, ref_fc2.outputs, &beta, dfc2, ref_fc2.inputs));
         
-        // ReLU activation
-        checkCUDNN(cudnnActivationBackward(cudnnHandle, fc1Activation, &alpha,
-                                           fc1Tensor, fc1relu, fc1Tensor, dfc2,
-                                           fc1Tensor, fc1, &beta, fc1Tensor, dfc1relu));
+        // ReLU activation (in place, from the sign of the output or the dropout gates)
+        if (ref_drop1.IsActive())
+            launch_DropoutReluBackward(dfc2, fc1drop, ref_fc1.outputs * m_batchSize, ref_drop1.rate, BW);
+        else
+            launch_ReluBackwardInPlace(act, dfc2, ref_fc1.outputs * m_batchSize, BW);
+
+        // Batch normalization (in place, from FC1's raw outputs)
+        if (ref_bn1.IsActive())
+            launch_BatchNormBackward(fc1, dfc2, pbn1, gbn1, bn1saved, m_batchSize, ref_bn1.channels, ref_bn1.spatial, BW);
 
         // FC1 layer
-        // Compute derivative with respect to weights: gfc1 = (pool2 * dfc1relu')
+        // Compute derivative with respect to weights: gfc1 = (pool2 * drelu')
         checkCudaErrors(cublasSgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_T, ref_fc1.inputs, ref_fc1.outputs, m_batchSize,
-                                    &alpha, pool2, ref_fc1.inputs, dfc1relu, ref_fc1.outputs, &beta, gfc1, ref_fc1.inputs));
-        // Compute derivative with respect to bias: gfc1bias = dfc1relu * 1_vec
+                                    &alpha, pool2, ref_fc1.inputs, dfc2, ref_fc1.outputs, &beta, gfc1, ref_fc1.inputs));
+        // Compute derivative with respect to bias: gfc1bias = drelu * 1_vec
         checkCudaErrors(cublasSgemv(cublasHandle, CUBLAS_OP_N, ref_fc1.outputs, m_batchSize,
-                                    &alpha, dfc1relu, ref_fc1.outputs, onevec, 1, &beta, gfc1bias, 1));
-        // Compute derivative with respect to data (for previous layer): pfc1*dfc1relu (800x500*500xN)
+                                    &alpha, dfc2, ref_fc1.outputs, onevec, 1, &beta, gfc1bias, 1));
+        // Compute derivative with respect to data (for previous layer): pfc1*drelu (800x500*500xN)
         checkCudaErrors(cublasSgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, ref_fc1.inputs, m_batchSize, ref_fc1.outputs,
-                                    &alpha, pfc1, ref_fc1.inputs, dfc1relu, ref_fc1.outputs, &beta, dfc1, ref_fc1.inputs));
+                                    &alpha, pfc1, ref_fc1.inputs, dfc2, ref_fc1.outputs, &beta, dfc1, ref_fc1.inputs));
 
         // Pool2 layer
         checkCUDNN(cudnnPoolingBackward(cudnnHandle, poolDesc, &alpha, 
-                                        pool2Tensor, pool2, pool2Tensor, dfc1,
-                                        conv2Tensor, conv2, &beta, conv2Tensor, dpool2));
+                                        m_plan->pool2Tensor, pool2, m_plan->pool2Tensor, dfc1,
+                                        m_plan->conv2Tensor, conv2, &beta, m_plan->conv2Tensor, dpool2));
         
         // Conv2 layer
-        checkCUDNN(cudnnConvolutionBackwardBias(cudnnHandle, &alpha, conv2Tensor,
+        checkCUDNN(cudnnConvolutionBackwardBias(cudnnHandle, &alpha, m_plan->conv2Tensor,
                                                 dpool2, &beta, conv2BiasTensor, gconv2bias));
 
         
-        checkCUDNN(cudnnConvolutionBackwardFilter(cudnnHandle, &alpha, pool1Tensor,
-                                                  pool1, conv2Tensor, dpool2, conv2Desc,
-                                                  conv2bwfalgo, workspace, m_workspaceSize,
+        checkCUDNN(cudnnConvolutionBackwardFilter(cudnnHandle, &alpha, m_plan->pool1Tensor,
+                                                  pool1, m_plan->conv2Tensor, dpool2, conv2Desc,
+                                                  m_plan->conv2bwfalgo, workspace, m_workspace.Bytes(),
                                                   &beta, conv2filterDesc, gconv2));
     
         checkCUDNN(cudnnConvolutionBackwardData(cudnnHandle, &alpha, conv2filterDesc,
-                                                pconv2, conv2Tensor, dpool2, conv2Desc, 
-                                                conv2bwdalgo, workspace, m_workspaceSize,
-                                                &beta, pool1Tensor, dconv2));
+                                                pconv2, m_plan->conv2Tensor, dpool2, conv2Desc, 
+                                                m_plan->conv2bwdalgo, workspace, m_workspace.Bytes(),
+                                                &beta, m_plan->pool1Tensor, dconv2));
         
         // Pool1 layer
         checkCUDNN(cudnnPoolingBackward(cudnnHandle, poolDesc, &alpha, 
-                                        pool1Tensor, pool1, pool1Tensor, dconv2,
-                                        conv1Tensor, conv1, &beta, conv1Tensor, dpool1));
+                                        m_plan->pool1Tensor, pool1, m_plan->pool1Tensor, dconv2,
+                                        m_plan->conv1Tensor, conv1, &beta, m_plan->conv1Tensor, dpool1));
         
         // Conv1 layer
-        checkCUDNN(cudnnConvolutionBackwardBias(cudnnHandle, &alpha, conv1Tensor,
+        checkCUDNN(cudnnConvolutionBackwardBias(cudnnHandle, &alpha, m_plan->conv1Tensor,
                                                 dpool1, &beta, conv1BiasTensor, gconv1bias));
         
-        checkCUDNN(cudnnConvolutionBackwardFilter(cudnnHandle, &alpha, dataTensor,
-                                                  data, conv1Tensor, dpool1, conv1Desc,
-                                                  conv1bwfalgo, workspace, m_workspaceSize,
+        checkCUDNN(cudnnConvolutionBackwardFilter(cudnnHandle, &alpha, m_plan->dataTensor,
+                                                  data, m_plan->conv1Tensor, dpool1, conv1Desc,
+                                                  m_plan->conv1bwfalgo, workspace, m_workspace.Bytes(),
                                                   &beta, conv1filterDesc, gconv1));
 
         // No need for convBackwardData because there are no more layers below
     }
 
-    void UpdateLocalWeights(float learning_rate, float rho,
-                       ConvBiasLayer& conv1, ConvBiasLayer& conv2,
-                       float *gpconv1, float *gpconv1bias,
-                       float *gpconv2, float *gpconv2bias,
-                       float *gpfc1, float *gpfc1bias,
-                       float *gpfc2, float *gpfc2bias,
-                       float *gdpconv1, float *gdpconv1bias,
-                       float *gdpconv2, float *gdpconv2bias,
-                       float *gdpfc1, float *gdpfc1bias,
-                       float *gdpfc2, float *gdpfc2bias,
-                       float *pconv1, float *pconv1bias,
-                       float *pconv2, float *pconv2bias,
-                       float *pfc1, float *pfc1bias,
-                       float *pfc2, float *pfc2bias,
-                       float *gconv1, float *gconv1bias,
-                       float *gconv2, float *gconv2bias,
-                       float *gfc1, float *gfc1bias,
-                       float *gfc2, float *gfc2bias)
+    /**
+     * Local EASGD step on every parameter: the elastic difference
+     * delta = learning_rate * rho * (local - center) is computed into "delta"
+     * (to be sent to the center), then the local weights move by -delta and by
+     * the gradient step.
+     * The batch-normalization running statistics have zero gradient, so they
+     * are only pulled towards the center.
+     */
+    void UpdateLocalWeights(float learning_rate, float rho, const LeNetParams& center, LeNetParams& delta,
+                            LeNetParams& local, const LeNetParams& grads)
     {    
         float alpha = -learning_rate;
 	float rho_alpha = -rho*alpha;
-        float minus_rho_alpha = rho_alpha;
+        float minus_rho_alpha = -rho_alpha;
         float minus_one = -1;
 
         checkCudaErrors(cudaSetDevice(m_gpuid));
 
-        // Conv1
-        checkCudaErrors(cudaMemset(gdpconv1, 0, sizeof(float) * conv1.pconv.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pconv.size()),
-				    &rho_alpha, pconv1, 1, gdpconv1, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pconv.size()),
-				    &minus_rho_alpha, gpconv1, 1, gdpconv1, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pconv.size()),
-				    &minus_one, gdpconv1, 1, pconv1, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pconv.size()),
-                                    &alpha, gpconv1, 1, pconv1, 1));
-
-	// Conv1 bias
-        checkCudaErrors(cudaMemset(gdpconv1bias, 0, sizeof(float) * conv1.pbias.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pbias.size()),
-				    &rho_alpha, pconv1bias, 1, gdpconv1bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pbias.size()),
-				    &minus_rho_alpha, gpconv1bias, 1, gdpconv1bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pbias.size()),
-				    &minus_one, gdpconv1bias, 1, pconv1bias, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pbias.size()),
-                                    &alpha, gconv1bias, 1, pconv1bias, 1));
-
-        // Conv2
-        checkCudaErrors(cudaMemset(gdpconv2, 0, sizeof(float) * conv2.pconv.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pconv.size()),
-				    &rho_alpha, pconv2, 1, gdpconv2, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pconv.size()),
-				    &minus_rho_alpha, gpconv2, 1, gdpconv2, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pconv.size()),
-				    &minus_one, gdpconv2, 1, pconv2, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pconv.size()),
-                                    &alpha, gconv2, 1, pconv2, 1));
-        // Conv2 bias
-        checkCudaErrors(cudaMemset(gdpconv2bias, 0, sizeof(float) * conv2.pbias.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pbias.size()),
-				    &rho_alpha, pconv2bias, 1, gdpconv2bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pbias.size()),
-				    &minus_rho_alpha, gpconv2, 1, gdpconv2bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pbias.size()),
-				    &minus_one, gdpconv2bias, 1, pconv2bias, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pbias.size()),
-                                    &alpha, gconv2bias, 1, pconv2bias, 1));
-
-        // Fully connected 1
-        checkCudaErrors(cudaMemset(gfc1, 0, sizeof(float) * ref_fc1.pneurons.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pneurons.size()),
-				    &rho_alpha, pfc1, 1, gdpfc1, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pneurons.size()),
-				    &minus_rho_alpha, gpfc1, 1, gdpfc1, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pneurons.size()),
-				    &minus_one, gdpfc1, 1, pfc1, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pneurons.size()),
-                                    &alpha, gfc1, 1, pfc1, 1));
-
-        // Fully connected 1 bias
-        checkCudaErrors(cudaMemset(gdpfc1bias, 0, sizeof(float) * ref_fc1.pbias.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pbias.size()),
-				    &rho_alpha, pfc1bias, 1, gdpfc1bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pbias.size()),
-				    &minus_rho_alpha, gpfc1bias, 1, gdpfc1bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pbias.size()),
-				    &minus_one, gdpfc1bias, 1, pfc1bias, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pbias.size()),
-                                    &alpha, gfc1bias, 1, pfc1bias, 1));
-
-        // Fully connected 2
-        checkCudaErrors(cudaMemset(gdpfc2, 0, sizeof(float) * ref_fc2.pneurons.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pneurons.size()),
-				    &rho_alpha, pfc2, 1, gdpfc2, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pneurons.size()),
-				    &minus_rho_alpha, gpfc2, 1, gdpfc2, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pneurons.size()),
-				    &minus_one, gdpfc2, 1, pfc2, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pneurons.size()),
-                                    &alpha, gfc2, 1, pfc2, 1));
-
-        // Fully connected 2 bias
-        checkCudaErrors(cudaMemset(gdpfc2bias, 0, sizeof(float) * ref_fc2.pbias.size()));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pbias.size()),
-				    &rho_alpha, pfc2bias, 1, gdpfc2bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pbias.size()),
-				    &minus_rho_alpha, gpfc2bias, 1, gdpfc2bias, 1));
-	checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pbias.size()),
-				    &minus_one, gdpfc2bias, 1, pfc2bias, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pbias.size()),
-                                    &alpha, gfc2bias, 1, pfc2bias, 1));
+        for (int i = 0; i < LENET_NUM_PARAMS; ++i)
+        {
+            if (local[i].Empty())
+                continue;
+            const int size = static_cast<int>(local[i].Count());
+            float *p = local[i].Data<float>(), *gdp = delta[i].Data<float>();
+
+            delta[i].Zero();
+            checkCudaErrors(cublasSaxpy(cublasHandle, size, &rho_alpha, p, 1, gdp, 1));
+            checkCudaErrors(cublasSaxpy(cublasHandle, size, &minus_rho_alpha, center[i].Data<float>(), 1, gdp, 1));
+            checkCudaErrors(cublasSaxpy(cublasHandle, size, &minus_one, gdp, 1, p, 1));
+            checkCudaErrors(cublasSaxpy(cublasHandle, size, &alpha, grads[i].Data<float>(), 1, p, 1));
+        }
     }
 
-
-    void UpdateGlobalWeights(float learning_rate,
-                       ConvBiasLayer& conv1, ConvBiasLayer& conv2,
-                       float *pconv1, float *pconv1bias,
-                       float *pconv2, float *pconv2bias,
-                       float *pfc1, float *pfc1bias,
-                       float *pfc2, float *pfc2bias,
-                       float *gconv1, float *gconv1bias,
-                       float *gconv2, float *gconv2bias,
-                       float *gfc1, float *gfc1bias,
-                       float *gfc2, float *gfc2bias)
+    /// Moves the center variable along the elastic difference received from a worker.
+    void UpdateGlobalWeights(float learning_rate, LeNetParams& center, const LeNetParams& delta)
     {
         float alpha = learning_rate;
 
         checkCudaErrors(cudaSetDevice(m_gpuid));
 
-        // Conv1
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pconv.size()),
-                                          &alpha, gconv1, 1, pconv1, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv1.pbias.size()),
-                                          &alpha, gconv1bias, 1, pconv1bias, 1));
-        
-        // Conv2
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pconv.size()),
-                                          &alpha, gconv2, 1, pconv2, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(conv2.pbias.size()),
-                                          &alpha, gconv2bias, 1, pconv2bias, 1));
-        
-        // Fully connected
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pneurons.size()),
-         				  &alpha, gfc1, 1, pfc1, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc1.pbias.size()),
-                                          &alpha, gfc1bias, 1, pfc1bias, 1));
-        	
-        // Fully connected 2
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pneurons.size()),
-                                          &alpha, gfc2, 1, pfc2, 1));
-        checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(ref_fc2.pbias.size()),
-                                          &alpha, gfc2bias, 1, pfc2bias, 1));
+        for (int i = 0; i < LENET_NUM_PARAMS; ++i)
+        {
+            if (center[i].Empty())
+                continue;
+            checkCudaErrors(cublasSaxpy(cublasHandle, static_cast<int>(center[i].Count()),
+                                        &alpha, delta[i].Data<float>(), 1, center[i].Data<float>(), 1));
+        }
     }
-        
 };
 
 
@@ -923,59 +1380,144 @@ int main(int argc, char **argv)
     gflags::ParseCommandLineFlags(&argc, &argv, true);
 #endif
 
-    size_t width, height, channels = 1;
-    size_t train_size, test_size, train_images_size;
-    float *train_images_float, *train_labels_float;
-    std::vector<uint8_t> train_images, train_labels;
-    std::vector<uint8_t> test_images, test_labels;
+    // Rank 0 neither draws the workers' mini-batches nor sees their updates in parameter-server mode
+    if (FLAGS_rma && (FLAGS_sampling != "uniform" || FLAGS_fc1_sparsity > 0 || !FLAGS_checkpoint_dir.empty()))
+    {
+        printf("ERROR: The RMA parameter server only supports uniform sampling, without pruning or checkpoints\n");
+        return 1;
+    }
+    if (FLAGS_fc1_sparsity > 0 && (FLAGS_prune_interval <= 0 || FLAGS_prune_end < FLAGS_prune_begin))
+    {
+        printf("ERROR: prune_interval must be positive and prune_end must not precede prune_begin\n");
+        return 1;
+    }
+    if (!(FLAGS_dropout >= 0.0 && FLAGS_dropout < 1.0))
+    {
+        printf("ERROR: dropout must be in [0, 1)\n");
+        return 1;
+    }
+
+    // Sizes are broadcast as MPI_INT, so the upper bytes must start out zeroed
+    size_t width = 0, height = 0, channels = 1, num_classes = 10;
+    size_t train_size = 0, test_size = 0, train_images_size = 0;
+    std::vector<float> train_images_float, test_images;
+    std::vector<uint8_t> train_labels, test_labels;
+    DatasetStats stats;
 
     if(rank == 0){
 
         // Open input data
         printf("Reading input data\n");
         
-        // Read dataset sizes
-        train_size = ReadUByteDataset(FLAGS_train_images.c_str(), FLAGS_train_labels.c_str(), nullptr, nullptr, width, height);
-        test_size = ReadUByteDataset(FLAGS_test_images.c_str(), FLAGS_test_labels.c_str(), nullptr, nullptr, width, height);
+        // Statistics for standardization are cached next to the training set
+        std::string train_sources = (FLAGS_dataset == "idx") ? FLAGS_train_images + "," + FLAGS_train_labels : FLAGS_train_images;
+        std::string stats_file = FLAGS_dataset_stats;
+        if (stats_file.empty())
+            stats_file = train_sources.substr(0, train_sources.find(',')) + ".stats";
+        bool have_stats = false;
+        if (FLAGS_standardize)
+        {
+            const uint64_t source_bytes = DatasetSourceBytes(train_sources);
+            have_stats = stats.Load(stats_file.c_str()) && stats.source_bytes == source_bytes;
+            stats.source_bytes = source_bytes;
+        }
+
+        // Read datasets of any IDX element type. Byte images are normalized to [0,1],
+        // float/double feature tensors are used as stored. Known statistics are applied
+        // in the same pass
+        size_t test_channels, test_width, test_height;
+        if (FLAGS_dataset == "idx")
+        {
+            train_size = ReadIdxDataset(FLAGS_train_images.c_str(), FLAGS_train_labels.c_str(),
+                                        train_images_float, train_labels, channels, width, height,
+                                        have_stats ? &stats : nullptr);
+        }
+        else if (FLAGS_dataset == "cifar10" || FLAGS_dataset == "cifar100")
+        {
+            num_classes = (FLAGS_dataset == "cifar10") ? 10 : 100;
+            train_size = ReadCifarDataset(FLAGS_train_images, (FLAGS_dataset == "cifar10") ? 1 : 2,
+                                          train_images_float, train_labels, channels, width, height,
+                                          have_stats ? &stats : nullptr);
+        }
+        else
+        {
+            printf("ERROR: Unknown dataset format %s\n", FLAGS_dataset.c_str());
+            return 1;
+        }
         if (train_size == 0)
-            return 1;        
+            return 1;
 
-    	train_images.resize(train_size * width * height * channels);
-	train_labels.resize(train_size);
-    	test_images.resize(test_size * width * height * channels);
-	test_labels.resize(test_size);
+        // Compute the statistics in one pass on the first run, and standardize in place
+        if (FLAGS_standardize && !have_stats)
+        {
+            printf("Computing dataset statistics\n");
+            stats.Compute(&train_images_float[0], &train_labels[0], train_size, channels, width * height);
+            stats.Apply(&train_images_float[0], train_size, channels, width * height);
+            if (stats.Save(stats_file.c_str()))
+                printf("Saved dataset statistics to %s\n", stats_file.c_str());
+        }
+        if (FLAGS_standardize)
+        {
+            for (size_t c = 0; c < channels; ++c)
+                printf("Channel %d: mean = %f, std = %f\n", (int)c, stats.mean[c], stats.stddev[c]);
+            printf("Label histogram:");
+            for (uint64_t count : stats.label_histogram)
+                printf(" %llu", (unsigned long long)count);
+            printf("\n");
+        }
 
-        // Read data from datasets
-        if (ReadUByteDataset(FLAGS_train_images.c_str(), FLAGS_train_labels.c_str(), &train_images[0], &train_labels[0], width, height) != train_size)
-            return 2;
-        if (ReadUByteDataset(FLAGS_test_images.c_str(), FLAGS_test_labels.c_str(), &test_images[0], &test_labels[0], width, height) != test_size)
+        if (FLAGS_dataset == "idx")
+        {
+            test_size = ReadIdxDataset(FLAGS_test_images.c_str(), FLAGS_test_labels.c_str(),
+                                       test_images, test_labels, test_channels, test_width, test_height,
+                                       FLAGS_standardize ? &stats : nullptr);
+        }
+        else
+        {
+            test_size = ReadCifarDataset(FLAGS_test_images, (FLAGS_dataset == "cifar10") ? 1 : 2,
+                                         test_images, test_labels, test_channels, test_width, test_height,
+                                         FLAGS_standardize ? &stats : nullptr);
+        }
+        if (test_size == 0)
+            return 3;
+        if (test_channels != channels || test_width != width || test_height != height)
+        {
+            printf("ERROR: Training and test image dimensions differ\n");
             return 3;
-        printf("width = %d, height = %d\n",width,height);
+        }
+
+        // IDX labels may be of any integer type up to 255, so the classes are 0 to the
+        // largest label of either set (which the loss and the evaluation index by)
+        if (FLAGS_dataset == "idx")
+            num_classes = std::max(*std::max_element(train_labels.begin(), train_labels.end()),
+                                   *std::max_element(test_labels.begin(), test_labels.end())) + 1;
+        printf("channels = %d, width = %d, height = %d, classes = %d\n", (int)channels, (int)width, (int)height,
+               (int)num_classes);
     
         printf("Done. Training dataset size: %d, Test dataset size: %d\n", (int)train_size, (int)test_size);
         printf("Batch size: %lld, iterations: %d\n", FLAGS_batch_size, FLAGS_iterations);
 
-	train_images_size = train_images.size();     
-    	train_images_float = (float*) malloc(sizeof(float)*train_images.size());
-	train_labels_float = (float*) malloc(sizeof(float)*train_size);
-
-	printf("Preparing dataset\n");
-        // Normalize training set to be in [0,1]
-        for (size_t i = 0; i < train_size * channels * width * height; ++i)
-            train_images_float[i] = (float)train_images[i] / 255.0f;
-        
-        for (size_t i = 0; i < train_size; ++i)
-            train_labels_float[i] = (float)train_labels[i];
-
+        train_images_size = train_images_float.size();
     }
 
 
     //Bcast dataset parameters
     MPI_Bcast(&height, 			1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&width,  			1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&channels, 		1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&num_classes, 		1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&train_size,  		1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&train_images_size,  	1, MPI_INT, 0, MPI_COMM_WORLD);
 
+    // In parameter-server mode, every worker draws its own mini-batches
+    if (FLAGS_rma)
+    {
+        train_images_float.resize(train_images_size);
+        train_labels.resize(train_size);
+        MPI_Bcast(train_images_float.data(), (int)train_images_size, MPI_FLOAT, 0, MPI_COMM_WORLD);
+        MPI_Bcast(train_labels.data(), (int)train_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    }
+
     // Choose GPU
     int num_gpus;
     checkCudaErrors(cudaGetDeviceCount(&num_gpus));
@@ -993,10 +1535,14 @@ int main(int argc, char **argv)
     MaxPoolLayer pool2(2, 2);
     FullyConnectedLayer fc1((conv2.out_channels*conv2.out_width*conv2.out_height) / (pool2.stride * pool2.stride), 
                             500);
-    FullyConnectedLayer fc2(fc1.outputs, 10);
+    BatchNormLayer bn1(FLAGS_batch_norm ? fc1.outputs : 0, 1, static_cast<float>(FLAGS_bn_momentum));
+    DropoutLayer drop1(static_cast<float>(FLAGS_dropout),
+                       (FLAGS_random_seed < 0 ? std::random_device()() : static_cast<unsigned int>(FLAGS_random_seed)) +
+                       0x9E3779B97F4A7C15ULL * rank);
+    FullyConnectedLayer fc2(fc1.outputs, (int)num_classes);
 
     // Initialize CUDNN/CUBLAS training context
-    TrainingContext context(FLAGS_gpu, FLAGS_batch_size, conv1, pool1, conv2, pool2, fc1, fc2);
+    TrainingContext context(FLAGS_gpu, FLAGS_batch_size, conv1, pool1, conv2, pool2, fc1, bn1, drop1, fc2);
     
     // Determine initial network structure
     bool bRet = true;
@@ -1006,6 +1552,8 @@ int main(int argc, char **argv)
       bRet &= conv2.FromFile("conv2");
       bRet &= fc1.FromFile("ip1");
       bRet &= fc2.FromFile("ip2");
+      if (bn1.IsActive())
+          bRet &= bn1.FromFile("bn1");
     }
     if (!bRet || !FLAGS_pretrained)
     {
@@ -1024,234 +1572,381 @@ int main(int argc, char **argv)
         std::uniform_real_distribution<> dfc2(-wfc2, wfc2);
 
         // Randomize network
-        for (auto&& iter : conv1.pconv)
-            iter = static_cast<float>(dconv1(gen));
-        for (auto&& iter : conv1.pbias)
-            iter = static_cast<float>(dconv1(gen));
-        for (auto&& iter : conv2.pconv)
-            iter = static_cast<float>(dconv2(gen));
-        for (auto&& iter : conv2.pbias)
-            iter = static_cast<float>(dconv2(gen));
-        for (auto&& iter : fc1.pneurons)
-            iter = static_cast<float>(dfc1(gen));
-        for (auto&& iter : fc1.pbias)
-            iter = static_cast<float>(dfc1(gen));
-        for (auto&& iter : fc2.pneurons)
-            iter = static_cast<float>(dfc2(gen));
-        for (auto&& iter : fc2.pbias)
-            iter = static_cast<float>(dfc2(gen));
+        auto randomize = [&gen](Tensor& tensor, std::uniform_real_distribution<>& dist)
+        {
+            float *values = tensor.Data<float>();
+            for (size_t i = 0; i < tensor.Count(); ++i)
+                values[i] = static_cast<float>(dist(gen));
+        };
+        randomize(conv1.pconv, dconv1);
+        randomize(conv1.pbias, dconv1);
+        randomize(conv2.pconv, dconv2);
+        randomize(conv2.pbias, dconv2);
+        randomize(fc1.pneurons, dfc1);
+        randomize(fc1.pbias, dfc1);
+        randomize(fc2.pneurons, dfc2);
+        randomize(fc2.pbias, dfc2);
+    }
+
+    // Views of the host weights held by the layers
+    LeNetParams h_params(conv1, conv2, fc1, bn1, fc2);
+    if (!FLAGS_resume.empty())
+    {
+        CheckpointStore store(FLAGS_checkpoint_dir, FLAGS_checkpoint_chunk);
+        if (!store.Load(FLAGS_resume, h_params.CheckpointTensors()))
+            return 6;
     }
     
     /////////////////////////////////////////////////////////////////////////////
-    // Create GPU data structures    
-
-    // Forward propagation data
-    float *d_data, *d_labels, *d_conv1, *d_pool1, *d_conv2, *d_pool2, *d_fc1, *d_fc1relu, *d_fc2, *d_fc2smax;
-    //                         Buffer    | Element       | N                   | C                  | H                                 | W
-    //-----------------------------------------------------------------------------------------------------------------------------------------
-    checkCudaErrors(cudaMalloc(&d_data,    sizeof(float) * context.m_batchSize * channels           * height                            * width));
-    checkCudaErrors(cudaMalloc(&d_labels,  sizeof(float) * context.m_batchSize * 1                  * 1                                 * 1));
-    checkCudaErrors(cudaMalloc(&d_conv1,   sizeof(float) * context.m_batchSize * conv1.out_channels * conv1.out_height                  * conv1.out_width));
-    checkCudaErrors(cudaMalloc(&d_pool1,   sizeof(float) * context.m_batchSize * conv1.out_channels * (conv1.out_height / pool1.stride) * (conv1.out_width / pool1.stride)));
-    checkCudaErrors(cudaMalloc(&d_conv2,   sizeof(float) * context.m_batchSize * conv2.out_channels * conv2.out_height                  * conv2.out_width));
-    checkCudaErrors(cudaMalloc(&d_pool2,   sizeof(float) * context.m_batchSize * conv2.out_channels * (conv2.out_height / pool2.stride) * (conv2.out_width / pool2.stride)));
-    checkCudaErrors(cudaMalloc(&d_fc1,     sizeof(float) * context.m_batchSize * fc1.outputs));    
-    checkCudaErrors(cudaMalloc(&d_fc1relu, sizeof(float) * context.m_batchSize * fc1.outputs));
-    checkCudaErrors(cudaMalloc(&d_fc2,     sizeof(float) * context.m_batchSize * fc2.outputs));
-    checkCudaErrors(cudaMalloc(&d_fc2smax, sizeof(float) * context.m_batchSize * fc2.outputs));    
-
-    //Local Network parameters
-    float *d_pconv1, *d_pconv1bias, *d_pconv2, *d_pconv2bias;
-    float *d_pfc1, *d_pfc1bias, *d_pfc2, *d_pfc2bias;
-    
-    checkCudaErrors(cudaMalloc(&d_pconv1,     sizeof(float) * conv1.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_pconv1bias, sizeof(float) * conv1.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_pconv2,     sizeof(float) * conv2.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_pconv2bias, sizeof(float) * conv2.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_pfc1,       sizeof(float) * fc1.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_pfc1bias,   sizeof(float) * fc1.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_pfc2,       sizeof(float) * fc2.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_pfc2bias,   sizeof(float) * fc2.pbias.size()));    
-    
-    //Global Network parameters
-    //Device objects
-    float *d_gpconv1, *d_gpconv1bias, *d_gpconv2, *d_gpconv2bias;
-    float *d_gpfc1, *d_gpfc1bias, *d_gpfc2, *d_gpfc2bias;
-    
-    checkCudaErrors(cudaMalloc(&d_gpconv1,     sizeof(float) * conv1.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_gpconv1bias, sizeof(float) * conv1.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gpconv2,     sizeof(float) * conv2.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_gpconv2bias, sizeof(float) * conv2.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gpfc1,       sizeof(float) * fc1.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_gpfc1bias,   sizeof(float) * fc1.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gpfc2,       sizeof(float) * fc2.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_gpfc2bias,   sizeof(float) * fc2.pbias.size()));    
-    
-    //Host objects
-    float* h_gpconv1	 = (float*)malloc(sizeof(float) * conv1.pconv.size());
-    float* h_gpconv1bias = (float*)malloc(sizeof(float) * conv1.pbias.size());
-    float* h_gpconv2	 = (float*)malloc(sizeof(float) * conv2.pconv.size());
-    float* h_gpconv2bias = (float*)malloc(sizeof(float) * conv2.pbias.size());
-    float* h_gpfc1	 = (float*)malloc(sizeof(float) * fc1.pneurons.size());
-    float* h_gpfc1bias	 = (float*)malloc(sizeof(float) * fc1.pbias.size());
-    float* h_gpfc2	 = (float*)malloc(sizeof(float) * fc2.pneurons.size());
-    float* h_gpfc2bias	 = (float*)malloc(sizeof(float) * fc2.pbias.size());    
-
-    //Global - Local offset network parameters
-    float *d_gdpconv1, *d_gdpconv1bias, *d_gdpconv2, *d_gdpconv2bias;
-    float *d_gdpfc1, *d_gdpfc1bias, *d_gdpfc2, *d_gdpfc2bias;
-    
-    checkCudaErrors(cudaMalloc(&d_gdpconv1,     sizeof(float) * conv1.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_gdpconv1bias, sizeof(float) * conv1.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gdpconv2,     sizeof(float) * conv2.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_gdpconv2bias, sizeof(float) * conv2.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gdpfc1,       sizeof(float) * fc1.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_gdpfc1bias,   sizeof(float) * fc1.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gdpfc2,       sizeof(float) * fc2.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_gdpfc2bias,   sizeof(float) * fc2.pbias.size()));    
-
-    //Host objects
-    float* h_gdpconv1		= (float*)malloc(sizeof(float) * conv1.pconv.size());
-    float* h_gdpconv1bias	= (float*)malloc(sizeof(float) * conv1.pbias.size());
-    float* h_gdpconv2		= (float*)malloc(sizeof(float) * conv2.pconv.size());
-    float* h_gdpconv2bias	= (float*)malloc(sizeof(float) * conv2.pbias.size());
-    float* h_gdpfc1	 	= (float*)malloc(sizeof(float) * fc1.pneurons.size());
-    float* h_gdpfc1bias	 	= (float*)malloc(sizeof(float) * fc1.pbias.size());
-    float* h_gdpfc2	 	= (float*)malloc(sizeof(float) * fc2.pneurons.size());
-    float* h_gdpfc2bias	 	= (float*)malloc(sizeof(float) * fc2.pbias.size());    
-
-    // Network parameter gradients
-    float *d_gconv1, *d_gconv1bias, *d_gconv2, *d_gconv2bias;
-    float *d_gfc1, *d_gfc1bias, *d_gfc2, *d_gfc2bias;
-    
-    checkCudaErrors(cudaMalloc(&d_gconv1,     sizeof(float) * conv1.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_gconv1bias, sizeof(float) * conv1.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gconv2,     sizeof(float) * conv2.pconv.size()));
-    checkCudaErrors(cudaMalloc(&d_gconv2bias, sizeof(float) * conv2.pbias.size()));
-    checkCudaErrors(cudaMalloc(&d_gfc1,       sizeof(float) * fc1.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_gfc1bias,   sizeof(float) * fc1.pbias.size()));    
-    checkCudaErrors(cudaMalloc(&d_gfc2,       sizeof(float) * fc2.pneurons.size()));
-    checkCudaErrors(cudaMalloc(&d_gfc2bias,   sizeof(float) * fc2.pbias.size()));
-    
-    // Differentials w.r.t. data
-    float *d_dpool1, *d_dpool2, *d_dconv2, *d_dfc1, *d_dfc1relu, *d_dfc2, *d_dfc2smax, *d_dlossdata;
-    //                         Buffer     | Element       | N                   | C                  | H                                 | W
-    //-----------------------------------------------------------------------------------------------------------------------------------------
-    checkCudaErrors(cudaMalloc(&d_dpool1,   sizeof(float) * context.m_batchSize * conv1.out_channels * conv1.out_height                  * conv1.out_width));
-    checkCudaErrors(cudaMalloc(&d_dpool2,   sizeof(float) * context.m_batchSize * conv2.out_channels * conv2.out_height                  * conv2.out_width));
-    checkCudaErrors(cudaMalloc(&d_dconv2,   sizeof(float) * context.m_batchSize * conv1.out_channels * (conv1.out_height / pool1.stride) * (conv1.out_width / pool1.stride)));
-    checkCudaErrors(cudaMalloc(&d_dfc1,     sizeof(float) * context.m_batchSize * fc1.inputs));
-    checkCudaErrors(cudaMalloc(&d_dfc1relu, sizeof(float) * context.m_batchSize * fc1.outputs));
-    checkCudaErrors(cudaMalloc(&d_dfc2,     sizeof(float) * context.m_batchSize * fc2.inputs));
-    checkCudaErrors(cudaMalloc(&d_dfc2smax, sizeof(float) * context.m_batchSize * fc2.outputs));
-    checkCudaErrors(cudaMalloc(&d_dlossdata,sizeof(float) * context.m_batchSize * fc2.outputs));
-    
-    // Temporary buffers and workspaces
-    float *d_onevec;
-    void *d_cudnn_workspace = nullptr;    
-    checkCudaErrors(cudaMalloc(&d_onevec, sizeof(float)* context.m_batchSize));
-    if (context.m_workspaceSize > 0)
-        checkCudaErrors(cudaMalloc(&d_cudnn_workspace, context.m_workspaceSize));    
+    // Create GPU data structures (freed with their tensors)
+
+    // Activations and data gradients of a batch
+    LeNetBuffers buffers(context.m_batchSize, channels, height, width, conv1, pool1, conv2, pool2, fc1, bn1, drop1, fc2);
+
+    // Local network parameters, the global network (center variable), the
+    // global - local offsets and the parameter gradients, and host copies of
+    // the global network and offsets for the exchange
+    LeNetParams d_params = h_params.Clone(TENSOR_GPU);
+    LeNetParams d_gparams = h_params.Clone(TENSOR_GPU);
+    LeNetParams d_gdparams = h_params.EmptyLike(TENSOR_GPU);
+    LeNetParams d_grads = h_params.EmptyLike(TENSOR_GPU);
+    LeNetParams h_gparams = h_params.EmptyLike(TENSOR_HOST);
+    LeNetParams h_gdparams = h_params.EmptyLike(TENSOR_HOST);
+
+    // FC1 pruning mask and compressed exchange buffer
+    Tensor d_fc1mask;
+    std::vector<float> fc1_packed;
+    if (FLAGS_fc1_sparsity > 0)
+        d_fc1mask = Tensor(TENSOR_GPU, TENSOR_UINT8, { fc1.pneurons.Count() });
+
+    // Checkpoints keep pruned weights at zero, so a resumed run recovers its mask from them
+    if (FLAGS_fc1_sparsity > 0 && !FLAGS_resume.empty())
+    {
+        fc1.mask.FromNonzeros(h_params[PARAM_FC1].Data<float>(), fc1.pneurons.Count());
+        if (fc1.mask.indices.size() < fc1.mask.size)
+        {
+            std::vector<uint8_t> mask_bytes;
+            fc1.mask.ToBytes(mask_bytes);
+            d_fc1mask.CopyFromHost(&mask_bytes[0]);
+            fc1_packed.resize(fc1.mask.indices.size());
+            printf("Resumed FC1 pruning mask: %d of %d weights kept\n", (int)fc1.mask.indices.size(), (int)fc1.mask.size);
+        }
+        else
+            fc1.mask = PruningMask();
+    }
 
     /////////////////////////////////////////////////////////////////////////////
 
-    // Copy initial local network to device
-    checkCudaErrors(cudaMemcpyAsync(d_pconv1, &conv1.pconv[0],     sizeof(float) * conv1.pconv.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_pconv1bias, &conv1.pbias[0], sizeof(float) * conv1.pbias.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_pconv2, &conv2.pconv[0],     sizeof(float) * conv2.pconv.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_pconv2bias, &conv2.pbias[0], sizeof(float) * conv2.pbias.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_pfc1, &fc1.pneurons[0],      sizeof(float) * fc1.pneurons.size(), cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_pfc1bias, &fc1.pbias[0],     sizeof(float) * fc1.pbias.size(),    cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_pfc2, &fc2.pneurons[0],      sizeof(float) * fc2.pneurons.size(), cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_pfc2bias, &fc2.pbias[0],     sizeof(float) * fc2.pbias.size(),    cudaMemcpyHostToDevice));
-    
-    // Copy initial global network to device
-    checkCudaErrors(cudaMemcpyAsync(d_gpconv1, &conv1.pconv[0],     sizeof(float) * conv1.pconv.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_gpconv1bias, &conv1.pbias[0], sizeof(float) * conv1.pbias.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_gpconv2, &conv2.pconv[0],     sizeof(float) * conv2.pconv.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_gpconv2bias, &conv2.pbias[0], sizeof(float) * conv2.pbias.size(),  cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_gpfc1, &fc1.pneurons[0],      sizeof(float) * fc1.pneurons.size(), cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_gpfc1bias, &fc1.pbias[0],     sizeof(float) * fc1.pbias.size(),    cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_gpfc2, &fc2.pneurons[0],      sizeof(float) * fc2.pneurons.size(), cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMemcpyAsync(d_gpfc2bias, &fc2.pbias[0],     sizeof(float) * fc2.pbias.size(),    cudaMemcpyHostToDevice));
-
     // Fill one-vector with ones
-    launch_FillOnes(context.m_batchSize, BW, d_onevec);
+    launch_FillOnes(context.m_batchSize, BW, buffers.onevec.Data<float>());
 
     // Objects to hold mini-batches
-    float*  train_images_mBatch_float = (float*) malloc(sizeof(float)*context.m_batchSize*train_images_size/train_size);
-    float*  train_labels_mBatch_float = (float*) malloc(sizeof(float)*context.m_batchSize);
+    Tensor train_images_mBatch(TENSOR_HOST, TENSOR_FLOAT, { (size_t)context.m_batchSize, channels, height, width });
+    Tensor train_labels_mBatch(TENSOR_HOST, TENSOR_UINT8, { (size_t)context.m_batchSize });
     int num_mBatch = floor(train_size/context.m_batchSize);
 
+    // Mini-batch sampling
+    SamplingMode sampling;
+    if (!ParseSamplingMode(FLAGS_sampling.c_str(), sampling))
+    {
+        printf("ERROR: Unknown sampling mode %s\n", FLAGS_sampling.c_str());
+        return 1;
+    }
+    const size_t sample_size = channels * width * height;
+    std::mt19937 sample_gen(FLAGS_random_seed < 0 ? std::random_device()() : static_cast<unsigned int>(FLAGS_random_seed));
+    ClassBalancedSampler balanced_sampler;
+    ImportanceSampler importance_sampler;
+    std::vector<std::vector<uint32_t>> batch_indices(n_proc, std::vector<uint32_t>(context.m_batchSize));
+    std::vector<float> batch_probs(context.m_batchSize * num_classes), batch_losses(context.m_batchSize);
+    if (rank == 0 && sampling != SAMPLE_UNIFORM)
+    {
+        if (sampling == SAMPLE_BALANCED)
+            balanced_sampler.Build(train_labels.data(), train_size);
+        else
+            importance_sampler.Build(train_size, pow(log((double)num_classes) + FLAGS_sampling_floor, FLAGS_sampling_alpha));
+    }
+
+    // The per-iteration messages have fixed sizes, so they run on persistent
+    // requests. Rank 0 stages each worker's mini-batch in its own buffers, and
+    // receives each worker's elastic differences into their own host copy, so
+    // that all transfers of an iteration can be in flight at once.
+    std::vector<Tensor> batch_images_out(n_proc), batch_labels_out(n_proc);
+    std::vector<LeNetParams> worker_deltas(n_proc);
+    std::vector<std::vector<float>> worker_fc1_packed(n_proc);
+    PersistentRequests batch_requests, delta_requests, weight_requests;
+    int deltas_per_worker = 0;
+    for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+        if (!h_params[p].Empty())
+            ++deltas_per_worker;
+
+    for (int i = 1; i < n_proc; i++)
+    {
+        if (rank == 0)
+        {
+            batch_images_out[i] = train_images_mBatch.EmptyLike(TENSOR_HOST);
+            batch_labels_out[i] = train_labels_mBatch.EmptyLike(TENSOR_HOST);
+            worker_deltas[i] = h_params.EmptyLike(TENSOR_HOST);
+            batch_requests.Send(batch_images_out[i].Data<float>(), batch_images_out[i].Count(), MPI_FLOAT, i, COMM_XDATA);
+            batch_requests.Send(batch_labels_out[i].Data<uint8_t>(), batch_labels_out[i].Count(), MPI_UNSIGNED_CHAR, i, COMM_XLABEL);
+        }
+        else if (rank == i)
+        {
+            batch_requests.Recv(train_images_mBatch.Data<float>(), train_images_mBatch.Count(), MPI_FLOAT, 0, COMM_XDATA);
+            batch_requests.Recv(train_labels_mBatch.Data<uint8_t>(), train_labels_mBatch.Count(), MPI_UNSIGNED_CHAR, 0, COMM_XLABEL);
+        }
+    }
+
+    // (Re-)creates the weight and delta exchanges, whose FC1 buffers change along with the pruning mask
+    auto setup_exchange = [&]()
+    {
+        delta_requests.Free();
+        weight_requests.Free();
+        for (int i = 1; i < n_proc; i++)
+        {
+            if (rank == 0)
+                worker_fc1_packed[i].resize(fc1_packed.size());
+            for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+            {
+                if (h_params[p].Empty())
+                    continue;
+                const bool packed = (p == PARAM_FC1 && fc1.mask.IsActive());
+                if (rank == 0)
+                {
+                    Tensor& tensor = worker_deltas[i][p];
+                    if (packed)
+                        delta_requests.Recv(worker_fc1_packed[i].data(), fc1_packed.size(), MPI_FLOAT, i, g_param_delta_tags[p]);
+                    else
+                        delta_requests.Recv(tensor.Data<float>(), tensor.Count(), MPI_FLOAT, i, g_param_delta_tags[p]);
+                }
+                else if (rank == i)
+                {
+                    Tensor& tensor = h_gdparams[p];
+                    if (packed)
+                        delta_requests.Send(fc1_packed.data(), fc1_packed.size(), MPI_FLOAT, 0, g_param_delta_tags[p]);
+                    else
+                        delta_requests.Send(tensor.Data<float>(), tensor.Count(), MPI_FLOAT, 0, g_param_delta_tags[p]);
+                }
+            }
+        }
+#if MPI_VERSION >= 4
+        for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+        {
+            Tensor& tensor = h_gparams[p];
+            if (tensor.Empty())
+                continue;
+            if (p == PARAM_FC1 && fc1.mask.IsActive())
+                weight_requests.Bcast(fc1_packed.data(), fc1_packed.size(), MPI_FLOAT);
+            else
+                weight_requests.Bcast(tensor.Data<float>(), tensor.Count(), MPI_FLOAT);
+        }
+#endif
+    };
+    setup_exchange();
+
+    // Parameter-server mode keeps the center variable in an MPI window instead
+    CenterWindow center;
+    if (FLAGS_rma)
+        center.Create(h_params, rank);
+
+    // Checkpoints hold the center variable, which only rank 0 keeps
+    std::unique_ptr<CheckpointStore> checkpoints;
+    std::vector<CheckpointTensor> checkpoint_tensors = h_gparams.CheckpointTensors();
+    if (rank == 0 && !FLAGS_checkpoint_dir.empty())
+        checkpoints.reset(new CheckpointStore(FLAGS_checkpoint_dir, FLAGS_checkpoint_chunk));
+
     printf("Training...\n");
 
     // Use SGD to train the network
     checkCudaErrors(cudaDeviceSynchronize());
     auto t1 = std::chrono::high_resolution_clock::now();
-    for (int iter = 0; iter < FLAGS_iterations; ++iter)
+    if (FLAGS_rma)
+    {
+        // Workers train against the window at their own pace; rank 0 only
+        // waits for them (inside MPI, which progresses the one-sided operations)
+        std::mt19937 batch_gen(sample_gen() + rank);
+        std::uniform_int_distribution<int> pick_batch(0, num_mBatch - 1);
+        for (int iter = 0; rank != 0 && iter < FLAGS_iterations; ++iter)
+        {
+            int rand_mbid = pick_batch(batch_gen);
+            memcpy(train_images_mBatch.Data<float>(), &train_images_float[rand_mbid * context.m_batchSize * sample_size],
+                   train_images_mBatch.Bytes());
+            memcpy(train_labels_mBatch.Data<uint8_t>(), &train_labels[rand_mbid * context.m_batchSize], context.m_batchSize);
+
+            buffers.data.CopyFrom(train_images_mBatch);
+            buffers.labels.CopyFrom(train_labels_mBatch);
+            context.ForwardPropagation(buffers, d_params, true);
+            context.Backpropagation(buffers, d_params, d_grads);
+
+            float learningRate = static_cast<float>(FLAGS_learning_rate * pow((1.0 + FLAGS_lr_gamma * iter), (-FLAGS_lr_power)));
+            float rho = 10.0;
+
+            center.Read(h_gparams);
+            d_gparams.CopyFrom(h_gparams);
+            context.UpdateLocalWeights(learningRate, rho, d_gparams, d_gdparams, d_params, d_grads);
+
+            // Move the center by learning_rate * delta, where delta = learning_rate * rho * (L-G),
+            // as UpdateGlobalWeights does on rank 0 without the window
+            h_gdparams.CopyFrom(d_gdparams);
+            for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+            {
+                float *delta = h_gdparams[p].Data<float>();
+                for (size_t i = 0; i < h_gdparams[p].Count(); ++i)
+                    delta[i] *= learningRate;
+            }
+            center.Accumulate(h_gdparams);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+
+        if (rank == 0)
+        {
+            center.Read(h_gparams);
+            d_gparams.CopyFrom(h_gparams);
+        }
+        center.Free();
+    }
+    for (int iter = 0; !FLAGS_rma && iter < FLAGS_iterations; ++iter)
     {
 	printf("In iteration %d\n",iter);
 
-	for(int i = 1; i <= rank; i++){
-	    int rand_mbid = rand() % num_mBatch;
-	    // Distribute Training images for mini-batches
-	    if(rank == 0){
-	        MPI_Send(&train_images_float[rand_mbid * context.m_batchSize * width*height*channels], context.m_batchSize * channels * width * height,
-			MPI_FLOAT, i, COMM_XDATA, MPI_COMM_WORLD);
-	        MPI_Send(&train_labels_float[rand_mbid * context.m_batchSize], context.m_batchSize, MPI_FLOAT, i, COMM_XLABEL, MPI_COMM_WORLD);
- 	    }
-
-	    if(rank == i){
-	    	MPI_Recv(train_images_mBatch_float, context.m_batchSize * channels * width * height, MPI_FLOAT, 0, COMM_XDATA, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-		MPI_Recv(train_labels_mBatch_float, context.m_batchSize, MPI_FLOAT, 0, COMM_XLABEL, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	// Distribute Training images for mini-batches. Rank 0 refills each
+	// worker's staging buffers once the previous iteration's sends from them
+	// have completed, then starts the sends to all workers at once.
+	if(rank == 0){
+	    batch_requests.Wait();
+	    for(int i = 1; i < n_proc; i++){
+	        float *images = batch_images_out[i].Data<float>();
+	        uint8_t *labels = batch_labels_out[i].Data<uint8_t>();
+	        if(sampling == SAMPLE_UNIFORM){
+	            int rand_mbid = rand() % num_mBatch;
+	            memcpy(images, &train_images_float[rand_mbid * context.m_batchSize * sample_size], batch_images_out[i].Bytes());
+	            memcpy(labels, &train_labels[rand_mbid * context.m_batchSize], context.m_batchSize);
+	        }
+	        else{
+	            // Gather the drawn samples into a contiguous batch
+	            std::vector<uint32_t>& indices = batch_indices[i];
+	            for (size_t b = 0; b < context.m_batchSize; ++b)
+	            {
+	                indices[b] = (sampling == SAMPLE_BALANCED) ? balanced_sampler.Sample(sample_gen) : importance_sampler.Sample(sample_gen);
+	                memcpy(&images[b * sample_size], &train_images_float[indices[b] * sample_size], sizeof(float) * sample_size);
+	                labels[b] = train_labels[indices[b]];
+	            }
+	        }
 	    }
 	}
+	batch_requests.Start();
+	if(rank != 0)
+	    batch_requests.Wait();
 
 	printf("Rank:%d Iter:%d Forward and Backward propogation \n",rank, iter);
 	//Forward and Backward propogation on all worker GPUs
 	if(rank != 0){
 
             // Prepare current batch on device
-            checkCudaErrors(cudaMemcpyAsync(d_data, &train_images_mBatch_float,
-                                            sizeof(float) * context.m_batchSize * channels * width * height, cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpyAsync(d_labels, &train_labels_float,
-                                            sizeof(float) * context.m_batchSize, cudaMemcpyHostToDevice));
+            buffers.data.CopyFrom(train_images_mBatch);
+            buffers.labels.CopyFrom(train_labels_mBatch);
             
             // Forward propagation
-            context.ForwardPropagation(d_data, d_conv1, d_pool1, d_conv2, d_pool2, d_fc1, d_fc1relu, d_fc2, d_fc2smax, 
-                                       d_pconv1, d_pconv1bias, d_pconv2, d_pconv2bias, d_pfc1, d_pfc1bias, d_pfc2, d_pfc2bias,
-                                       d_cudnn_workspace, d_onevec);
+            context.ForwardPropagation(buffers, d_params, true);
     
             // Backward propagation
-            context.Backpropagation(conv1, pool1, conv2, pool2,
-                                    d_data, d_labels, d_conv1, d_pool1, d_conv2, d_pool2, d_fc1, d_fc1relu, d_fc2, d_fc2smax, d_dlossdata,
-                                    d_pconv1, d_pconv1bias, d_pconv2, d_pconv2bias, d_pfc1, d_pfc1bias, d_pfc2, d_pfc2bias,
-                                    d_gconv1, d_gconv1bias, d_dpool1, d_gconv2, d_gconv2bias, d_dconv2, d_dpool2, d_gfc1, d_gfc1bias, 
-                                    d_dfc1, d_dfc1relu, d_gfc2, d_gfc2bias, d_dfc2, d_cudnn_workspace, d_onevec);
+            context.Backpropagation(buffers, d_params, d_grads);
+
+            // Report the loss of every sample to the importance sampler
+            if (sampling == SAMPLE_IMPORTANCE)
+            {
+                buffers.fc2smax.CopyToHost(&batch_probs[0]);
+                const uint8_t *labels = train_labels_mBatch.Data<uint8_t>();
+                for (size_t b = 0; b < context.m_batchSize; ++b)
+                    batch_losses[b] = -logf(std::max(batch_probs[b * num_classes + labels[b]], FLT_MIN));
+                MPI_Send(batch_losses.data(), context.m_batchSize, MPI_FLOAT, 0, COMM_XLOSS, MPI_COMM_WORLD);
+            }
         }
 
+	if(rank == 0 && sampling == SAMPLE_IMPORTANCE){
+	    for(int i = 1; i < n_proc; i++){
+	        MPI_Recv(batch_losses.data(), context.m_batchSize, MPI_FLOAT, i, COMM_XLOSS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	        for (size_t b = 0; b < context.m_batchSize; ++b)
+	            importance_sampler.Update(batch_indices[i][b], pow(batch_losses[b] + FLAGS_sampling_floor, FLAGS_sampling_alpha));
+	    }
+	    importance_sampler.Commit();
+	}
+
 	if(rank == 0){
 	    //Copy global weights from device
-            checkCudaErrors(cudaMemcpy(d_gpconv1,	h_gpconv1, sizeof(float) * conv1.pconv.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gpconv1bias, 	h_gpconv1bias, sizeof(float) * conv1.pbias.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gpconv2,	h_gpconv2, sizeof(float) * conv2.pconv.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gpconv2bias, 	h_gpconv2bias, sizeof(float) * conv2.pbias.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gpfc1,		h_gpfc1, sizeof(float) * fc1.pneurons.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gpfc1bias,   	h_gpfc1bias, sizeof(float) * fc1.pbias.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gpfc2,		h_gpfc2, sizeof(float) * fc2.pneurons.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gpfc2bias,   	h_gpfc2bias, sizeof(float) * fc2.pbias.size(), cudaMemcpyDeviceToHost));
+            h_gparams.CopyFrom(d_gparams);
+	}
+
+	// Prune FC1 on schedule, with the mask selected from the center variable. The
+	// last step is at prune_end, so the target sparsity is reached in any case
+	if (FLAGS_fc1_sparsity > 0 && iter >= FLAGS_prune_begin && iter <= FLAGS_prune_end &&
+	    ((iter - FLAGS_prune_begin) % FLAGS_prune_interval == 0 || iter == FLAGS_prune_end))
+	{
+	    unsigned int nnz = 0;
+	    if (rank == 0)
+	    {
+	        fc1.mask.Build(h_gparams[PARAM_FC1].Data<float>(), fc1.pneurons.Count(),
+	                       ScheduledSparsity(iter, FLAGS_fc1_sparsity, FLAGS_prune_begin, FLAGS_prune_end));
+	        nnz = static_cast<unsigned int>(fc1.mask.indices.size());
+	    }
+	    MPI_Bcast(&nnz, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+	    fc1.mask.size = fc1.pneurons.Count();
+	    fc1.mask.indices.resize(nnz);
+	    MPI_Bcast(fc1.mask.indices.data(), nnz, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+	    fc1_packed.resize(nnz);
+	    setup_exchange();
+
+	    std::vector<uint8_t> mask_bytes;
+	    fc1.mask.ToBytes(mask_bytes);
+	    d_fc1mask.CopyFromHost(&mask_bytes[0]);
+	    launch_ApplyPruningMask((rank == 0 ? d_gparams : d_params)[PARAM_FC1].Data<float>(), d_fc1mask.Data<uint8_t>(),
+	                            (int)fc1.pneurons.Count(), BW);
+
+	    // The host copy of the center is checkpointed and broadcast below, so it is pruned as well
+	    if (rank == 0)
+	        fc1.mask.Apply(h_gparams[PARAM_FC1].Data<float>());
+	}
+
+	if (checkpoints && iter % FLAGS_checkpoint_interval == 0)
+	{
+	    std::stringstream name;
+	    name << "iter" << std::setfill('0') << std::setw(7) << iter;
+	    size_t written = 0, total = 0;
+	    // A missed checkpoint is not fatal (and the workers wait for rank 0), so training goes on
+	    if (checkpoints->Save(name.str(), checkpoint_tensors, &written, &total))
+	        printf("Checkpoint %s: wrote %d of %d chunks\n", name.str().c_str(), (int)written, (int)total);
+	    else
+	        printf("ERROR: Could not save checkpoint %s, continuing training\n", name.str().c_str());
 	}
 
 	printf("Iter:%d Broadcasting global weghts\n",iter);
 	//Broadcasting Global weights to everyone
-	MPI_Bcast(h_gpconv1,		conv1.pconv.size(), 	MPI_FLOAT, 0, MPI_COMM_WORLD);
-	MPI_Bcast(h_gpconv1bias,	conv1.pbias.size(), 	MPI_FLOAT, 0, MPI_COMM_WORLD);
-	MPI_Bcast(h_gpconv2,		conv2.pconv.size(), 	MPI_FLOAT, 0, MPI_COMM_WORLD);
-	MPI_Bcast(h_gpconv2bias,	conv2.pbias.size(), 	MPI_FLOAT, 0, MPI_COMM_WORLD);
-	MPI_Bcast(h_gpfc1,		fc1.pneurons.size(),	MPI_FLOAT, 0, MPI_COMM_WORLD);
-	MPI_Bcast(h_gpfc1bias,		fc1.pbias.size(),	MPI_FLOAT, 0, MPI_COMM_WORLD);
-	MPI_Bcast(h_gpfc2,		fc2.pneurons.size(), 	MPI_FLOAT, 0, MPI_COMM_WORLD);
-	MPI_Bcast(h_gpfc2bias,		fc2.pbias.size(), 	MPI_FLOAT, 0, MPI_COMM_WORLD);
+#if MPI_VERSION >= 4
+	// Pruned weights are zero on every rank, so only the kept ones travel
+	if (rank == 0 && fc1.mask.IsActive())
+	    fc1.mask.Gather(h_gparams[PARAM_FC1].Data<float>(), fc1_packed.data());
+	weight_requests.StartInOrder();
+	weight_requests.Wait();
+	if (rank != 0 && fc1.mask.IsActive())
+	    fc1.mask.Scatter(fc1_packed.data(), h_gparams[PARAM_FC1].Data<float>());
+#else
+	for (int p = 0; p < LENET_NUM_PARAMS; ++p)
+	{
+	    Tensor& tensor = h_gparams[p];
+	    if (tensor.Empty())
+	        continue;
+	    if (p == PARAM_FC1 && fc1.mask.IsActive())
+	    {
+	        // Pruned weights are zero on every rank, so only the kept ones travel
+	        if (rank == 0)
+	            fc1.mask.Gather(tensor.Data<float>(), fc1_packed.data());
+	        MPI_Bcast(fc1_packed.data(),	fc1_packed.size(),	MPI_FLOAT, 0, MPI_COMM_WORLD);
+	        if (rank != 0)
+	            fc1.mask.Scatter(fc1_packed.data(), tensor.Data<float>());
+	    }
+	    else
+	        MPI_Bcast(tensor.Data<float>(),	tensor.Count(),		MPI_FLOAT, 0, MPI_COMM_WORLD);
+	}
+#endif
 
         // Compute learning rate
         float learningRate = static_cast<float>(FLAGS_learning_rate * pow((1.0 + FLAGS_lr_gamma * iter), (-FLAGS_lr_power)));
@@ -1260,76 +1955,48 @@ int main(int argc, char **argv)
     
 	printf("Iter:%d Update local weights \n",iter);
 	if(rank != 0){
-	    //Copy global weights from device
-            checkCudaErrors(cudaMemcpy(d_gpconv1,	h_gpconv1, sizeof(float) * conv1.pconv.size(),		cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpy(d_gpconv1bias, 	h_gpconv1bias, sizeof(float) * conv1.pbias.size(),	cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpy(d_gpconv2,	h_gpconv2, sizeof(float) * conv2.pconv.size(), 		cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpy(d_gpconv2bias, 	h_gpconv2bias, sizeof(float) * conv2.pbias.size(), 	cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpy(d_gpfc1,		h_gpfc1, sizeof(float) * fc1.pneurons.size(), 		cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpy(d_gpfc1bias,   	h_gpfc1bias, sizeof(float) * fc1.pbias.size(), 		cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpy(d_gpfc2,		h_gpfc2, sizeof(float) * fc2.pneurons.size(), 		cudaMemcpyHostToDevice));
-            checkCudaErrors(cudaMemcpy(d_gpfc2bias,   	h_gpfc2bias, sizeof(float) * fc2.pbias.size(), 		cudaMemcpyHostToDevice));	
+	    //Copy global weights to device
+            d_gparams.CopyFrom(h_gparams);
 
             // Update weights
-            context.UpdateLocalWeights(learningRate, rho, conv1, conv2,
-                                  d_gpconv1, d_gpconv1bias, d_gpconv2, d_gpconv2bias, d_gpfc1, d_gpfc1bias, d_gpfc2, d_gpfc2bias,
-                                  d_gdpconv1, d_gdpconv1bias, d_gdpconv2, d_gdpconv2bias, d_gdpfc1, d_gdpfc1bias, d_gdpfc2, d_gdpfc2bias,
-                                  d_pconv1, d_pconv1bias, d_pconv2, d_pconv2bias, d_pfc1, d_pfc1bias, d_pfc2, d_pfc2bias,
-                                  d_gconv1, d_gconv1bias, d_gconv2, d_gconv2bias, d_gfc1, d_gfc1bias, d_gfc2, d_gfc2bias);
+            context.UpdateLocalWeights(learningRate, rho, d_gparams, d_gdparams, d_params, d_grads);
+
+	    if (fc1.mask.IsActive())
+	        launch_ApplyPruningMask(d_params[PARAM_FC1].Data<float>(), d_fc1mask.Data<uint8_t>(), (int)fc1.pneurons.Count(), BW);
 
 	    //Copy rho(L-G) from device
-            checkCudaErrors(cudaMemcpy(d_gdpconv1,	h_gdpconv1, sizeof(float) * conv1.pconv.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gdpconv1bias, 	h_gdpconv1bias, sizeof(float) * conv1.pbias.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gdpconv2,	h_gdpconv2, sizeof(float) * conv2.pconv.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gdpconv2bias, 	h_gdpconv2bias, sizeof(float) * conv2.pbias.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gdpfc1,	h_gdpfc1, sizeof(float) * fc1.pneurons.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gdpfc1bias,   	h_gdpfc1bias, sizeof(float) * fc1.pbias.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gdpfc2,	h_gdpfc2, sizeof(float) * fc2.pneurons.size(), cudaMemcpyDeviceToHost));
-            checkCudaErrors(cudaMemcpy(d_gdpfc2bias,   	h_gdpfc2bias, sizeof(float) * fc2.pbias.size(), cudaMemcpyDeviceToHost));
-	}
+            h_gdparams.CopyFrom(d_gdparams);
+	    if (fc1.mask.IsActive())
+	        fc1.mask.Gather(h_gdparams[PARAM_FC1].Data<float>(), fc1_packed.data());
 
-	for(int i = 1; i <= rank; i++){
-	    if(rank == i){
-		//Send rho(L-G) to root from every processor
-	    	MPI_Send(h_gdpconv1,	conv1.pconv.size(), 	MPI_FLOAT, 0, COMM_GDCONV1,	MPI_COMM_WORLD);
-	    	MPI_Send(h_gdpconv1bias,conv1.pbias.size(), 	MPI_FLOAT, 0, COMM_GDCONV1BIAS,	MPI_COMM_WORLD);
-	    	MPI_Send(h_gdpconv2,	conv2.pconv.size(), 	MPI_FLOAT, 0, COMM_GDCONV2,	MPI_COMM_WORLD);
-	    	MPI_Send(h_gdpconv2bias,conv2.pbias.size(), 	MPI_FLOAT, 0, COMM_GDCONV2BIAS,	MPI_COMM_WORLD);
-	    	MPI_Send(h_gdpfc1,	fc1.pneurons.size(),	MPI_FLOAT, 0, COMM_GDFC1NEURON, MPI_COMM_WORLD);
-	    	MPI_Send(h_gdpfc1bias,	fc1.pbias.size(),	MPI_FLOAT, 0, COMM_GDFC1BIAS, 	MPI_COMM_WORLD);
-	    	MPI_Send(h_gdpfc2,	fc2.pneurons.size(), 	MPI_FLOAT, 0, COMM_GDFC2NEURON, MPI_COMM_WORLD);
-	    	MPI_Send(h_gdpfc2bias,	fc2.pbias.size(), 	MPI_FLOAT, 0, COMM_GDFC2BIAS, 	MPI_COMM_WORLD);
-	    }
-	    if(rank == 0){
-		//Recv rho(L-G) from every processor
-	    	MPI_Recv(h_gdpconv1,	conv1.pconv.size(), 	MPI_FLOAT, i, COMM_GDCONV1,	MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	    	MPI_Recv(h_gdpconv1bias,conv1.pbias.size(), 	MPI_FLOAT, i, COMM_GDCONV1BIAS,	MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	    	MPI_Recv(h_gdpconv2,	conv2.pconv.size(), 	MPI_FLOAT, i, COMM_GDCONV2,	MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	    	MPI_Recv(h_gdpconv2bias,conv2.pbias.size(), 	MPI_FLOAT, i, COMM_GDCONV2BIAS,	MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	    	MPI_Recv(h_gdpfc1,	fc1.pneurons.size(),	MPI_FLOAT, i, COMM_GDFC1NEURON, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	    	MPI_Recv(h_gdpfc1bias,	fc1.pbias.size(),	MPI_FLOAT, i, COMM_GDFC1BIAS, 	MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	    	MPI_Recv(h_gdpfc2,	fc2.pneurons.size(), 	MPI_FLOAT, i, COMM_GDFC2NEURON, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	    	MPI_Recv(h_gdpfc2bias,	fc2.pbias.size(), 	MPI_FLOAT, i, COMM_GDFC2BIAS, 	MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-	        //Copy rho(L-G) from device
-                checkCudaErrors(cudaMemcpy(d_gdpconv1,		h_gdpconv1, sizeof(float) * conv1.pconv.size(), 	cudaMemcpyHostToDevice));
-                checkCudaErrors(cudaMemcpy(d_gdpconv1bias, 	h_gdpconv1bias, sizeof(float) * conv1.pbias.size(), 	cudaMemcpyHostToDevice));
-                checkCudaErrors(cudaMemcpy(d_gdpconv2,		h_gdpconv2, sizeof(float) * conv2.pconv.size(), 	cudaMemcpyHostToDevice));
-                checkCudaErrors(cudaMemcpy(d_gdpconv2bias, 	h_gdpconv2bias, sizeof(float) * conv2.pbias.size(), 	cudaMemcpyHostToDevice));
-                checkCudaErrors(cudaMemcpy(d_gdpfc1,		h_gdpfc1, sizeof(float) * fc1.pneurons.size(), 		cudaMemcpyHostToDevice));
-                checkCudaErrors(cudaMemcpy(d_gdpfc1bias,   	h_gdpfc1bias, sizeof(float) * fc1.pbias.size(), 	cudaMemcpyHostToDevice));
-                checkCudaErrors(cudaMemcpy(d_gdpfc2,		h_gdpfc2, sizeof(float) * fc2.pneurons.size(), 		cudaMemcpyHostToDevice));
-                checkCudaErrors(cudaMemcpy(d_gdpfc2bias,   	h_gdpfc2bias, sizeof(float) * fc2.pbias.size(), 	cudaMemcpyHostToDevice));
+	    //Send rho(L-G) to root
+	    delta_requests.Start();
+	    delta_requests.Wait();
+	}
+	else{
+	    //Recv rho(L-G) from every worker, applying each worker's as soon as all of it has arrived
+	    delta_requests.Start();
+	    for(int i = 1; i < n_proc; i++){
+	        delta_requests.Wait((i - 1) * deltas_per_worker, deltas_per_worker);
+	        LeNetParams& deltas = worker_deltas[i];
+	        if (fc1.mask.IsActive())
+	            fc1.mask.Scatter(worker_fc1_packed[i].data(), deltas[PARAM_FC1].Data<float>());
+
+	        //Copy rho(L-G) to device
+                d_gdparams.CopyFrom(deltas);
 
                 // Update weights
-                context.UpdateGlobalWeights(learningRate, conv1, conv2,
-                                  d_gpconv1, d_gpconv1bias, d_gpconv2, d_gpconv2bias, d_gpfc1, d_gpfc1bias, d_gpfc2, d_gpfc2bias,
-                                  d_gdpconv1, d_gdpconv1bias, d_gdpconv2, d_gdpconv2bias, d_gdpfc1, d_gdpfc1bias, d_gdpfc2, d_gdpfc2bias);
+                context.UpdateGlobalWeights(learningRate, d_gparams, d_gdparams);
+                if (fc1.mask.IsActive())
+                    launch_ApplyPruningMask(d_gparams[PARAM_FC1].Data<float>(), d_fc1mask.Data<uint8_t>(), (int)fc1.pneurons.Count(), BW);
 	    }
-
 	}
 
     }
+    batch_requests.Wait();
+    batch_requests.Free();
+    delta_requests.Free();
+    weight_requests.Free();
     checkCudaErrors(cudaDeviceSynchronize());
     auto t2 = std::chrono::high_resolution_clock::now();
 
@@ -1337,15 +2004,8 @@ int main(int argc, char **argv)
     
     if (FLAGS_save_data)
     {
-        // Copy trained weights from GPU to CPU
-        checkCudaErrors(cudaMemcpy(&conv1.pconv[0], d_pconv1, sizeof(float) * conv1.pconv.size(), cudaMemcpyDeviceToHost));
-        checkCudaErrors(cudaMemcpy(&conv1.pbias[0], d_pconv1bias, sizeof(float) * conv1.pbias.size(), cudaMemcpyDeviceToHost));
-        checkCudaErrors(cudaMemcpy(&conv2.pconv[0], d_pconv2, sizeof(float) * conv2.pconv.size(), cudaMemcpyDeviceToHost));
-        checkCudaErrors(cudaMemcpy(&conv2.pbias[0], d_pconv2bias, sizeof(float) * conv2.pbias.size(), cudaMemcpyDeviceToHost));
-        checkCudaErrors(cudaMemcpy(&fc1.pneurons[0], d_pfc1, sizeof(float) * fc1.pneurons.size(), cudaMemcpyDeviceToHost));
-        checkCudaErrors(cudaMemcpy(&fc1.pbias[0], d_pfc1bias, sizeof(float) * fc1.pbias.size(), cudaMemcpyDeviceToHost));
-        checkCudaErrors(cudaMemcpy(&fc2.pneurons[0], d_pfc2, sizeof(float) * fc2.pneurons.size(), cudaMemcpyDeviceToHost));
-        checkCudaErrors(cudaMemcpy(&fc2.pbias[0], d_pfc2bias, sizeof(float) * fc2.pbias.size(), cudaMemcpyDeviceToHost));
+        // Copy trained weights from GPU to CPU (into the layers, through their views)
+        h_params.CopyFrom(d_params);
       
         // Now save data
         printf("Saving data to file\n");
@@ -1353,6 +2013,60 @@ int main(int argc, char **argv)
         conv2.ToFile("conv2");
         fc1.ToFile("ip1");
         fc2.ToFile("ip2");
+        if (bn1.IsActive())
+            bn1.ToFile("bn1");
+    }
+
+    if (rank == 0 && !FLAGS_export_model.empty())
+    {
+        PackedWeightType export_type;
+        if (!ParsePackedWeightType(FLAGS_export_type.c_str(), export_type))
+        {
+            printf("ERROR: Invalid export type %s\n", FLAGS_export_type.c_str());
+            return 5;
+        }
+
+        // Export the center variable, which holds the consensus model
+        h_params.CopyFrom(d_gparams);
+
+        // Fold the batch normalization into FC1, which precedes it
+        float *fc1_weights = fc1.pneurons.Data<float>(), *fc1_bias = fc1.pbias.Data<float>();
+        if (bn1.IsActive())
+            FoldBatchNorm(fc1_weights, fc1_bias, fc1.outputs, fc1.inputs, bn1.pparams.Data<float>());
+
+        // Fold the input standardization into conv1 (which has no padding), so that the
+        // exported model takes unstandardized images
+        if (FLAGS_standardize)
+        {
+            const int kernel = conv1.kernel_size * conv1.kernel_size;
+            float *conv1_bias = conv1.pbias.Data<float>();
+            for (int o = 0; o < conv1.out_channels; ++o)
+            {
+                for (int c = 0; c < conv1.in_channels; ++c)
+                {
+                    float *w = conv1.pconv.Data<float>() + (o * conv1.in_channels + c) * kernel;
+                    for (int k = 0; k < kernel; ++k)
+                    {
+                        conv1_bias[o] -= w[k] * stats.mean[c] / stats.stddev[c];
+                        w[k] /= stats.stddev[c];
+                    }
+                }
+            }
+        }
+
+        PackedLayerSource layers[PACKED_LENET_LAYERS] = {
+            { conv1.in_channels, conv1.out_channels, conv1.kernel_size, conv1.in_width, conv1.in_height,
+              conv1.pconv.Data<float>(), conv1.pbias.Data<float>() },
+            { conv2.in_channels, conv2.out_channels, conv2.kernel_size, conv2.in_width, conv2.in_height,
+              conv2.pconv.Data<float>(), conv2.pbias.Data<float>() },
+            { fc1.inputs, fc1.outputs, 1, 1, 1, fc1_weights, fc1_bias },
+            { fc2.inputs, fc2.outputs, 1, 1, 1, fc2.pneurons.Data<float>(), fc2.pbias.Data<float>() },
+        };
+
+        printf("Exporting inference model to %s\n", FLAGS_export_model.c_str());
+        if (!ExportPackedLeNet(FLAGS_export_model.c_str(), export_type, (int)channels, (int)width, (int)height,
+                               pool1.size, pool1.stride, layers))
+            return 5;
     }
     
 
@@ -1365,86 +2079,44 @@ int main(int argc, char **argv)
     // Test the resulting neural network's classification
     if (classifications > 0)
     {
-        // Initialize a TrainingContext structure for testing (different batch size)
-        TrainingContext test_context(FLAGS_gpu, 1, conv1, pool1, conv2, pool2, fc1, fc2);
-
-        // Ensure correct workspaceSize is allocated for testing
-        if (context.m_workspaceSize < test_context.m_workspaceSize)
-        {
-            checkCudaErrors(cudaFree(d_cudnn_workspace));
-            checkCudaErrors(cudaMalloc(&d_cudnn_workspace, test_context.m_workspaceSize));
-        }
+        // Classify in batches on the training context and buffers, reshaped to the
+        // evaluation batch size and to the partial final batch
+        int eval_batch = (int)context.m_batchSize;
+        if (FLAGS_eval_batch_size > 0 && FLAGS_eval_batch_size < eval_batch)
+            eval_batch = FLAGS_eval_batch_size;
+        std::vector<float> class_vec(eval_batch * num_classes);
 
         int num_errors = 0;
-        for (int i = 0; i < classifications; ++i)
+        for (int i = 0; i < classifications; i += eval_batch)
         {
-            std::vector<float> data(width * height);
-            // Normalize image to be in [0,1]
-            for (int j = 0; j < width * height; ++j)
-                data[j] = (float)test_images[i * width*height*channels + j] / 255.0f;
-
-            checkCudaErrors(cudaMemcpyAsync(d_data, &data[0], sizeof(float) * width * height, cudaMemcpyHostToDevice));
+            const int batch = std::min(eval_batch, classifications - i);
+            context.Reshape(batch);
+            buffers.data.Slice(0, batch).CopyFromHost(&test_images[i * sample_size]);
             
-            // Forward propagate test image
-            test_context.ForwardPropagation(d_data, d_conv1, d_pool1, d_conv2, d_pool2, d_fc1, d_fc1relu, d_fc2, d_fc2smax,
-                                            d_pconv1, d_pconv1bias, d_pconv2, d_pconv2bias, d_pfc1, d_pfc1bias,
-                                            d_pfc2, d_pfc2bias, d_cudnn_workspace, d_onevec);
-
-            // Perform classification
-            std::vector<float> class_vec(10);
+            // Forward propagate test images
+            context.ForwardPropagation(buffers, d_params, false);
 
             // Copy back result
-            checkCudaErrors(cudaMemcpy(&class_vec[0], d_fc2smax, sizeof(float) * 10, cudaMemcpyDeviceToHost));
+            buffers.fc2smax.Slice(0, batch).CopyToHost(&class_vec[0]);
 
             // Determine classification according to maximal response
-            int chosen = 0;
-            for (int id = 1; id < 10; ++id)
+            for (int b = 0; b < batch; ++b)
             {
-                if (class_vec[chosen] < class_vec[id]) chosen = id;
+                const float *response = &class_vec[b * num_classes];
+                int chosen = 0;
+                for (int id = 1; id < (int)num_classes; ++id)
+                {
+                    if (response[chosen] < response[id]) chosen = id;
+                }
+
+                if (chosen != test_labels[i + b])
+                    ++num_errors;
             }
-
-            if (chosen != test_labels[i])
-                ++num_errors;
         }
+        context.Reshape(FLAGS_batch_size);
         classification_error = (float)num_errors / (float)classifications;
-
         printf("Classification result: %.2f%% error (used %d images)\n", classification_error * 100.0f, (int)classifications);
     }
         
-    // Free data structures
-    checkCudaErrors(cudaFree(d_data));
-    checkCudaErrors(cudaFree(d_conv1));
-    checkCudaErrors(cudaFree(d_pool1));
-    checkCudaErrors(cudaFree(d_conv2));
-    checkCudaErrors(cudaFree(d_pool2));
-    checkCudaErrors(cudaFree(d_fc1));
-    checkCudaErrors(cudaFree(d_fc2));
-    checkCudaErrors(cudaFree(d_pconv1));
-    checkCudaErrors(cudaFree(d_pconv1bias));
-    checkCudaErrors(cudaFree(d_pconv2));
-    checkCudaErrors(cudaFree(d_pconv2bias));
-    checkCudaErrors(cudaFree(d_pfc1));
-    checkCudaErrors(cudaFree(d_pfc1bias));
-    checkCudaErrors(cudaFree(d_pfc2));
-    checkCudaErrors(cudaFree(d_pfc2bias));
-    checkCudaErrors(cudaFree(d_gconv1));
-    checkCudaErrors(cudaFree(d_gconv1bias));
-    checkCudaErrors(cudaFree(d_gconv2));
-    checkCudaErrors(cudaFree(d_gconv2bias));
-    checkCudaErrors(cudaFree(d_gfc1));
-    checkCudaErrors(cudaFree(d_gfc1bias));
-    checkCudaErrors(cudaFree(d_dfc1));
-    checkCudaErrors(cudaFree(d_gfc2));
-    checkCudaErrors(cudaFree(d_gfc2bias));
-    checkCudaErrors(cudaFree(d_dfc2));
-    checkCudaErrors(cudaFree(d_dpool1));
-    checkCudaErrors(cudaFree(d_dconv2));
-    checkCudaErrors(cudaFree(d_dpool2));    
-    checkCudaErrors(cudaFree(d_labels));
-    checkCudaErrors(cudaFree(d_dlossdata));
-    checkCudaErrors(cudaFree(d_onevec));
-    if (d_cudnn_workspace != nullptr)
-        checkCudaErrors(cudaFree(d_cudnn_workspace));
-
     return 0;
 }
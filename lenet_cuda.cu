@@ -1,4 +1,6 @@
+#include <cmath>
 #include <cstdio>
+#include <cstdint>
 
 static inline unsigned int RoundUp(unsigned int nominator, unsigned int denominator)
 {
@@ -24,29 +26,340 @@ __global__ void FillOnes(float *vec, int size)
  * Computes the backpropagation results of the Softmax loss for each result in a batch.
  * Uses the softmax values obtained from forward propagation to compute the difference.
  *
- * @param label The training batch label values.
+ * @param label The training batch label values (one class index per sample).
  * @param num_labels The number of possible labels.
  * @param batch_size The size of the trained batch.
  * @param diff The resulting gradient.
  */
-__global__ void SoftmaxLossBackprop(const float *label, int num_labels, int batch_size, float *diff)
+__global__ void SoftmaxLossBackprop(const uint8_t *label, int num_labels, int batch_size, float *diff)
 {
     int idx = blockIdx.x * blockDim.x + threadIdx.x;
     if (idx >= batch_size)
         return;
 
-    const int label_value = static_cast<int>(label[idx]);
+    const int label_value = label[idx];
 
     // For each item in the batch, decrease the result of the label's value by 1
     diff[idx * num_labels + label_value] -= 1.0f;
 }
 
+/**
+ * Zeroes the weights that a pruning mask removes.
+ *
+ * @param weights The weights to prune.
+ * @param mask Byte mask, nonzero for the weights that are kept.
+ * @param size The number of weights.
+ */
+__global__ void ApplyPruningMask(float *weights, const uint8_t *mask, int size)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= size)
+        return;
+
+    if (!mask[idx])
+        weights[idx] = 0.0f;
+}
+
+/**
+ * In-place ReLU backpropagation: zeroes the gradient wherever the ReLU output
+ * is zero. Only the output is needed (y > 0 exactly where x > 0), so the
+ * forward pass can overwrite its input and the gradient buffer of the layer
+ * above can be reused for the gradient below.
+ *
+ * @param y ReLU output from forward propagation.
+ * @param diff Gradient with respect to the output on entry, with respect to the input on exit.
+ * @param size Number of elements.
+ */
+__global__ void ReluBackwardInPlace(const float *y, float *diff, int size)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= size)
+        return;
+
+    if (y[idx] <= 0.0f)
+        diff[idx] = 0.0f;
+}
+
+/**
+ * Merges the Welford state (count, mean, M2) of another partition into "a".
+ */
+__device__ inline void WelfordMerge(float& count, float& mean, float& m2, float count_b, float mean_b, float m2_b)
+{
+    const float total = count + count_b;
+    if (total == 0.0f)
+        return;
+    const float delta = mean_b - mean;
+    mean += delta * count_b / total;
+    m2 += m2_b + delta * delta * count * count_b / total;
+    count = total;
+}
+
+/**
+ * Training-mode batch normalization of one channel per block, over a tensor
+ * laid out as [N][C][S]. Each thread gathers Welford statistics over a strided
+ * subset of the channel, the partial states are merged in shared memory, and
+ * the same block then normalizes the channel, so the input is read from
+ * global memory in a single kernel. Requires a power-of-two block size and
+ * 3 * blockDim.x floats of shared memory.
+ *
+ * @param x Input.
+ * @param y Output (may be equal to x).
+ * @param params Parameter buffer (see BatchNormParam); running statistics are updated.
+ * @param saved Output: batch mean and inverse standard deviation, 2 * C values.
+ * @param N The number of samples.
+ * @param C The number of channels.
+ * @param S The number of spatial elements per channel.
+ * @param momentum Weight of the batch statistics in the running statistics.
+ * @param epsilon Added to the variance.
+ */
+__global__ void BatchNormForwardTraining(const float *x, float *y, float *params, float *saved,
+                                         int N, int C, int S, float momentum, float epsilon)
+{
+    extern __shared__ float shared[];
+    float *s_count = shared, *s_mean = shared + blockDim.x, *s_m2 = shared + 2 * blockDim.x;
+    const int c = blockIdx.x, tid = threadIdx.x, M = N * S;
+
+    float count = 0.0f, mean = 0.0f, m2 = 0.0f;
+    for (int i = tid; i < M; i += blockDim.x)
+    {
+        const float v = x[((i / S) * C + c) * S + i % S];
+        count += 1.0f;
+        const float delta = v - mean;
+        mean += delta / count;
+        m2 += delta * (v - mean);
+    }
+    s_count[tid] = count;
+    s_mean[tid] = mean;
+    s_m2[tid] = m2;
+    __syncthreads();
+
+    for (int stride = blockDim.x / 2; stride > 0; stride >>= 1)
+    {
+        if (tid < stride)
+        {
+            WelfordMerge(s_count[tid], s_mean[tid], s_m2[tid],
+                         s_count[tid + stride], s_mean[tid + stride], s_m2[tid + stride]);
+        }
+        __syncthreads();
+    }
+
+    const float batch_mean = s_mean[0], var = s_m2[0] / M;
+    const float invstd = rsqrtf(var + epsilon);
+    const float scale = params[c] * invstd;
+    const float shift = params[C + c] - batch_mean * scale;
+    for (int i = tid; i < M; i += blockDim.x)
+    {
+        const int idx = ((i / S) * C + c) * S + i % S;
+        y[idx] = x[idx] * scale + shift;
+    }
+
+    if (tid == 0)
+    {
+        saved[c] = batch_mean;
+        saved[C + c] = invstd;
+        const float unbiased = (M > 1) ? s_m2[0] / (M - 1) : var;
+        params[2 * C + c] = (1.0f - momentum) * params[2 * C + c] + momentum * batch_mean;
+        params[3 * C + c] = (1.0f - momentum) * params[3 * C + c] + momentum * unbiased;
+    }
+}
+
+/**
+ * Inference-mode batch normalization with the running statistics.
+ *
+ * @param x Input.
+ * @param y Output (may be equal to x).
+ * @param params Parameter buffer (see BatchNormParam).
+ * @param C The number of channels.
+ * @param S The number of spatial elements per channel.
+ * @param size Number of elements (N * C * S).
+ * @param epsilon Added to the variance.
+ */
+__global__ void BatchNormForwardInference(const float *x, float *y, const float *params,
+                                          int C, int S, int size, float epsilon)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= size)
+        return;
+
+    const int c = (idx / S) % C;
+    const float scale = params[c] * rsqrtf(params[3 * C + c] + epsilon);
+    y[idx] = (x[idx] - params[2 * C + c]) * scale + params[C + c];
+}
+
+/**
+ * Batch-normalization backpropagation of one channel per block. The sums
+ * needed for both parameter gradients and the data gradient are reduced
+ * together, and the same block then writes the data gradient in place.
+ * Requires a power-of-two block size and 2 * blockDim.x floats of shared memory.
+ *
+ * @param x Input of the forward pass.
+ * @param diff Gradient with respect to the output on entry, with respect to the input on exit.
+ * @param params Parameter buffer.
+ * @param gparams Output: parameter gradients (zero for the running statistics).
+ * @param saved Batch statistics from BatchNormForwardTraining.
+ * @param N The number of samples.
+ * @param C The number of channels.
+ * @param S The number of spatial elements per channel.
+ */
+__global__ void BatchNormBackward(const float *x, float *diff, const float *params, float *gparams,
+                                  const float *saved, int N, int C, int S)
+{
+    extern __shared__ float shared[];
+    float *s_dy = shared, *s_dy_xhat = shared + blockDim.x;
+    const int c = blockIdx.x, tid = threadIdx.x, M = N * S;
+    const float mean = saved[c], invstd = saved[C + c];
+
+    float dy = 0.0f, dy_xhat = 0.0f;
+    for (int i = tid; i < M; i += blockDim.x)
+    {
+        const int idx = ((i / S) * C + c) * S + i % S;
+        dy += diff[idx];
+        dy_xhat += diff[idx] * (x[idx] - mean) * invstd;
+    }
+    s_dy[tid] = dy;
+    s_dy_xhat[tid] = dy_xhat;
+    __syncthreads();
+
+    for (int stride = blockDim.x / 2; stride > 0; stride >>= 1)
+    {
+        if (tid < stride)
+        {
+            s_dy[tid] += s_dy[tid + stride];
+            s_dy_xhat[tid] += s_dy_xhat[tid + stride];
+        }
+        __syncthreads();
+    }
+
+    const float dbeta = s_dy[0], dgamma = s_dy_xhat[0];
+    const float dscale = params[c] * invstd;
+    for (int i = tid; i < M; i += blockDim.x)
+    {
+        const int idx = ((i / S) * C + c) * S + i % S;
+        const float xhat = (x[idx] - mean) * invstd;
+        diff[idx] = dscale * (diff[idx] - (dbeta + xhat * dgamma) / M);
+    }
+
+    if (tid == 0)
+    {
+        gparams[c] = dgamma;
+        gparams[C + c] = dbeta;
+        gparams[2 * C + c] = 0.0f;
+        gparams[3 * C + c] = 0.0f;
+    }
+}
+
+/**
+ * Counter-based random number generator: a stateless hash of (key, counter),
+ * so any element of a random stream can be drawn independently of the others.
+ * Uses the SplitMix64 finalizer.
+ */
+__device__ inline uint32_t CounterHash(uint64_t key, uint64_t counter)
+{
+    uint64_t z = key + (counter + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+}
+
+/**
+ * Fused in-place ReLU and inverted dropout. Each element is kept with
+ * probability threshold / 2^32 and scaled by 1 / (1 - rate). The combined gate
+ * (kept and positive) of each element is stored as one bit; every warp packs
+ * its 32 gates into a single mask word with a ballot, so the block width must
+ * be a multiple of 32.
+ *
+ * @param x Input on entry, output on exit.
+ * @param mask Output: bit-packed gates, (size + 31) / 32 words.
+ * @param size Number of elements.
+ * @param threshold Keep threshold for the 32-bit random values.
+ * @param scale Scale of kept elements.
+ * @param key Random stream key.
+ * @param offset Position of the first element in the random stream.
+ */
+__global__ void DropoutReluForward(float *x, uint32_t *mask, int size, uint32_t threshold, float scale,
+                                   uint64_t key, uint64_t offset)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+
+    // Out-of-range lanes still take part in the ballot
+    bool pass = false;
+    if (idx < size)
+    {
+        const float v = x[idx];
+        pass = (v > 0.0f) && (CounterHash(key, offset + idx) < threshold);
+        x[idx] = pass ? v * scale : 0.0f;
+    }
+
+    const uint32_t bits = __ballot_sync(0xFFFFFFFFu, pass);
+    if ((threadIdx.x & 31) == 0 && idx < size)
+        mask[idx >> 5] = bits;
+}
+
+/**
+ * Backpropagation of DropoutReluForward: passes the gradient of gated
+ * elements, scaled, and zeroes the rest. Reads one bit per element instead of
+ * the activations.
+ *
+ * @param diff Gradient with respect to the output on entry, with respect to the input on exit.
+ * @param mask Bit-packed gates from DropoutReluForward.
+ * @param size Number of elements.
+ * @param scale Scale of kept elements.
+ */
+__global__ void DropoutReluBackward(float *diff, const uint32_t *mask, int size, float scale)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= size)
+        return;
+
+    diff[idx] = ((mask[idx >> 5] >> (idx & 31)) & 1) ? diff[idx] * scale : 0.0f;
+}
+
 void launch_FillOnes(int bs, int bw, float *vec)
 {
-    FillOnes<<<RoundUp(bs, bw), bw>>>(vec, bw);
+    FillOnes<<<RoundUp(bs, bw), bw>>>(vec, bs);
 }
 
-void launch_SoftmaxLossBackprop(const float *label, int num_labels, int batch_size, float *diff, int bw)
+void launch_SoftmaxLossBackprop(const uint8_t *label, int num_labels, int batch_size, float *diff, int bw)
 {
     SoftmaxLossBackprop<<<RoundUp(batch_size, bw), bw>>>(label, num_labels, batch_size, diff);
 }
+
+void launch_ApplyPruningMask(float *weights, const uint8_t *mask, int size, int bw)
+{
+    ApplyPruningMask<<<RoundUp(size, bw), bw>>>(weights, mask, size);
+}
+
+void launch_ReluBackwardInPlace(const float *y, float *diff, int size, int bw)
+{
+    ReluBackwardInPlace<<<RoundUp(size, bw), bw>>>(y, diff, size);
+}
+
+void launch_BatchNormForwardTraining(const float *x, float *y, float *params, float *saved,
+                                     int N, int C, int S, float momentum, float epsilon, int bw)
+{
+    BatchNormForwardTraining<<<C, bw, 3 * bw * sizeof(float)>>>(x, y, params, saved, N, C, S, momentum, epsilon);
+}
+
+void launch_BatchNormForwardInference(const float *x, float *y, const float *params,
+                                      int N, int C, int S, float epsilon, int bw)
+{
+    BatchNormForwardInference<<<RoundUp(N * C * S, bw), bw>>>(x, y, params, C, S, N * C * S, epsilon);
+}
+
+void launch_BatchNormBackward(const float *x, float *diff, const float *params, float *gparams,
+                              const float *saved, int N, int C, int S, int bw)
+{
+    BatchNormBackward<<<C, bw, 2 * bw * sizeof(float)>>>(x, diff, params, gparams, saved, N, C, S);
+}
+
+void launch_DropoutReluForward(float *x, uint32_t *mask, int size, float rate, uint64_t key, uint64_t offset, int bw)
+{
+    const double keep = 1.0 - rate;
+    const uint32_t threshold = static_cast<uint32_t>(fmin(keep * 4294967296.0, 4294967295.0));
+    DropoutReluForward<<<RoundUp(size, bw), bw>>>(x, mask, size, threshold, 1.0f / static_cast<float>(keep), key, offset);
+}
+
+void launch_DropoutReluBackward(float *diff, const uint32_t *mask, int size, float rate, int bw)
+{
+    DropoutReluBackward<<<RoundUp(size, bw), bw>>>(diff, mask, size, 1.0f / (1.0f - rate));
+}
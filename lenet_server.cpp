@@ -0,0 +1,482 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Local LeNet inference server with dynamic batching.
+ *
+ * Usage: lenetserver [serve|bench|latency]
+ *
+ * "serve" loads a packed model (see ExportPackedLeNet) and answers requests on a
+ * Unix domain socket. "bench" connects to a running server and reports throughput
+ * against latency for an increasing number of concurrent clients. "latency"
+ * compares the single-image latency of the packed model with the compile-time
+ * network of staticlenet.h, in-process.
+ *
+ * Protocol: upon connection, the server sends two uint32 values (bytes per image,
+ * number of classes). Each request is one uint8 image; each response is an int32
+ * class followed by the float softmax output.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cpudispatch.h"
+#include "inference.h"
+#include "readubyte.h"
+#include "staticlenet.h"
+
+#ifdef USE_GFLAGS
+    #include <gflags/gflags.h>
+
+    #ifndef _WIN32
+        #define gflags google
+    #endif
+#else
+    // Constant versions of gflags
+    #define DEFINE_int32(flag, default_value, description) const int FLAGS_##flag = (default_value)
+    #define DEFINE_string(flag, default_value, description) const std::string FLAGS_##flag ((default_value))
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Command-line flags
+
+DEFINE_string(socket, "lenet.sock", "Unix domain socket path");
+DEFINE_string(model, "lenet.lnet", "Packed inference model (written by trainlenet --export_model)");
+DEFINE_string(cpu_isa, "", "Instruction set of the host kernels: generic, avx2 or avx512 (default: best supported)");
+
+// Batching parameters
+DEFINE_int32(max_batch, 64, "Maximal number of requests per forward pass");
+DEFINE_int32(max_latency_us, 2000, "Maximal time the oldest request waits for a batch to fill up");
+
+// Benchmark parameters
+DEFINE_int32(clients, 64, "Maximal number of concurrent benchmark clients");
+DEFINE_int32(requests, 5000, "Number of requests per benchmark step");
+DEFINE_string(test_images, "t10k-images-idx3-ubyte", "Benchmark images filename (random images if missing)");
+DEFINE_string(test_labels, "t10k-labels-idx1-ubyte", "Benchmark labels filename");
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static bool ReadFully(int fd, void *buffer, size_t size)
+{
+    uint8_t *ptr = static_cast<uint8_t *>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = read(fd, ptr, size);
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool WriteFully(int fd, const void *buffer, size_t size)
+{
+    const uint8_t *ptr = static_cast<const uint8_t *>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = write(fd, ptr, size);
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Dynamic batching
+
+struct InferenceRequest
+{
+    const uint8_t *pixels;
+    float *probabilities;
+    int32_t label;
+    Clock::time_point arrival;
+    std::promise<void> done;
+};
+
+/**
+ * Coalesces concurrent single-image requests into batches. A batch is run as soon
+ * as it is full, or when its oldest request has waited for max_latency.
+ */
+struct BatchScheduler
+{
+    const PackedLeNet& model;
+    int max_batch;
+    std::chrono::microseconds max_latency;
+
+    std::mutex mutex;
+    std::condition_variable pending;
+    std::deque<InferenceRequest *> queue;
+
+    BatchScheduler(const PackedLeNet& model_, int max_batch_, int max_latency_us) :
+        model(model_), max_batch(max_batch_), max_latency(max_latency_us) {}
+
+    void Submit(InferenceRequest *request)
+    {
+        request->arrival = Clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(request);
+        if (queue.size() == 1 || (int)queue.size() >= max_batch)
+            pending.notify_one();
+    }
+
+    void Run()
+    {
+        const size_t input_size = model.InputSize();
+        const size_t classes = model.NumClasses();
+        std::vector<float> data(max_batch * input_size), result(max_batch * classes);
+        std::vector<float> workspace(model.WorkspaceSize(max_batch));
+        std::vector<InferenceRequest *> batch;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pending.wait(lock, [this] { return !queue.empty(); });
+                pending.wait_until(lock, queue.front()->arrival + max_latency,
+                                   [this] { return (int)queue.size() >= max_batch; });
+
+                size_t count = std::min(queue.size(), (size_t)max_batch);
+                batch.assign(queue.begin(), queue.begin() + count);
+                queue.erase(queue.begin(), queue.begin() + count);
+            }
+
+            // Normalize images to be in [0,1]
+            for (size_t i = 0; i < batch.size(); ++i)
+                for (size_t j = 0; j < input_size; ++j)
+                    data[i * input_size + j] = batch[i]->pixels[j] / 255.0f;
+
+            model.Forward(&data[0], (int)batch.size(), &result[0], &workspace[0]);
+
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                const float *row = &result[i * classes];
+                memcpy(batch[i]->probabilities, row, sizeof(float) * classes);
+                batch[i]->label = static_cast<int32_t>(std::max_element(row, row + classes) - row);
+                batch[i]->done.set_value();
+            }
+        }
+    }
+};
+
+static void ServeConnection(int fd, BatchScheduler *scheduler)
+{
+    const uint32_t shape[2] = { (uint32_t)scheduler->model.InputSize(), (uint32_t)scheduler->model.NumClasses() };
+    std::vector<uint8_t> pixels(shape[0]);
+    std::vector<uint8_t> response(sizeof(int32_t) + sizeof(float) * shape[1]);
+
+    if (WriteFully(fd, shape, sizeof(shape)))
+    {
+        while (ReadFully(fd, &pixels[0], pixels.size()))
+        {
+            InferenceRequest request;
+            request.pixels = &pixels[0];
+            request.probabilities = reinterpret_cast<float *>(&response[sizeof(int32_t)]);
+            std::future<void> done = request.done.get_future();
+
+            scheduler->Submit(&request);
+            done.wait();
+
+            memcpy(&response[0], &request.label, sizeof(int32_t));
+            if (!WriteFully(fd, &response[0], response.size()))
+                break;
+        }
+    }
+    close(fd);
+}
+
+static int Serve()
+{
+    PackedLeNet model;
+    if (!model.FromFile(FLAGS_model.c_str()))
+        return 1;
+    printf("Loaded model %s (%dx%dx%d input, %d classes)\n", FLAGS_model.c_str(), (int)model.header->channels,
+           (int)model.header->height, (int)model.header->width, (int)model.NumClasses());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, FLAGS_socket.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0)
+    {
+        printf("ERROR: Cannot listen on socket %s\n", FLAGS_socket.c_str());
+        return 2;
+    }
+
+    BatchScheduler scheduler(model, FLAGS_max_batch, FLAGS_max_latency_us);
+    std::thread batcher(&BatchScheduler::Run, &scheduler);
+    batcher.detach();
+
+    printf("Serving on %s (max batch %d, max latency %d us)\n", FLAGS_socket.c_str(),
+           FLAGS_max_batch, FLAGS_max_latency_us);
+    for (;;)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        std::thread(ServeConnection, fd, &scheduler).detach();
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Client benchmark
+
+static int Connect(uint32_t shape[2])
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, FLAGS_socket.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || !ReadFully(fd, shape, sizeof(uint32_t) * 2))
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Loads the test set if available (and of the right size), random images
+ * otherwise, and returns the number of images. "labels" stays empty for
+ * random images.
+ */
+static size_t LoadBenchmarkImages(size_t input_size, std::vector<uint8_t>& images, std::vector<uint8_t>& labels)
+{
+    size_t width, height;
+    size_t num_images = ReadUByteDataset(FLAGS_test_images.c_str(), FLAGS_test_labels.c_str(), nullptr, nullptr, width, height);
+    if (num_images > 0 && width * height == input_size)
+    {
+        images.resize(num_images * width * height);
+        labels.resize(num_images);
+        ReadUByteDataset(FLAGS_test_images.c_str(), FLAGS_test_labels.c_str(), &images[0], &labels[0], width, height);
+        return num_images;
+    }
+
+    printf("Benchmarking with random images\n");
+    num_images = 1024;
+    images.resize(num_images * input_size);
+    std::mt19937 gen(0);
+    for (auto&& iter : images)
+        iter = static_cast<uint8_t>(gen());
+    return num_images;
+}
+
+static int Benchmark()
+{
+    uint32_t shape[2];
+    int probe = Connect(shape);
+    if (probe < 0)
+    {
+        printf("ERROR: Cannot connect to %s\n", FLAGS_socket.c_str());
+        return 1;
+    }
+    close(probe);
+
+    std::vector<uint8_t> images, labels;
+    const size_t num_images = LoadBenchmarkImages(shape[0], images, labels);
+
+    printf("%8s %12s %10s %10s %10s\n", "clients", "images/s", "p50 ms", "p99 ms", "error");
+    for (int clients = 1; clients <= FLAGS_clients; clients *= 2)
+    {
+        const int per_client = std::max(1, FLAGS_requests / clients);
+        std::vector<std::vector<double>> latencies(clients);
+        std::vector<int> errors(clients, 0);
+        std::vector<std::thread> threads;
+
+        auto t1 = Clock::now();
+        for (int c = 0; c < clients; ++c)
+        {
+            threads.emplace_back([&, c]
+            {
+                uint32_t client_shape[2];
+                int fd = Connect(client_shape);
+                if (fd < 0)
+                    return;
+                std::vector<uint8_t> response(sizeof(int32_t) + sizeof(float) * shape[1]);
+                for (int r = 0; r < per_client; ++r)
+                {
+                    size_t id = ((size_t)c * per_client + r) % num_images;
+                    auto start = Clock::now();
+                    if (!WriteFully(fd, &images[id * shape[0]], shape[0]) || !ReadFully(fd, &response[0], response.size()))
+                        break;
+                    latencies[c].push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+
+                    int32_t label;
+                    memcpy(&label, &response[0], sizeof(label));
+                    if (!labels.empty() && label != labels[id])
+                        ++errors[c];
+                }
+                close(fd);
+            });
+        }
+        for (auto&& thread : threads)
+            thread.join();
+        auto t2 = Clock::now();
+
+        std::vector<double> all;
+        int num_errors = 0;
+        for (int c = 0; c < clients; ++c)
+        {
+            all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+            num_errors += errors[c];
+        }
+        if (all.empty())
+        {
+            printf("ERROR: No request completed\n");
+            return 2;
+        }
+        std::sort(all.begin(), all.end());
+        double seconds = std::chrono::duration<double>(t2 - t1).count();
+
+        printf("%8d %12.0f %10.3f %10.3f ", clients, all.size() / seconds,
+               all[all.size() / 2], all[std::min(all.size() - 1, all.size() * 99 / 100)]);
+        if (labels.empty())
+            printf("%10s\n", "n/a");
+        else
+            printf("%9.2f%%\n", 100.0 * num_errors / all.size());
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Single-image latency
+
+// Static storage, since the compile-time network holds all weights inline
+static StaticMnistLeNet g_static_model;
+static StaticMnistLeNet::Scratch g_static_scratch;
+
+// The compile-time network is inlined into one variant per instruction set
+CPU_MULTIVERSION(StaticLeNetForward, (const float *image, float *result),
+                 g_static_model.Forward(image, result, g_static_scratch))
+
+static double Percentile(std::vector<double>& values, size_t percent)
+{
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, values.size() * percent / 100)];
+}
+
+/**
+ * Compares the single-image latency of the packed model with the compile-time
+ * network (which must match its shapes), in-process and without batching.
+ */
+static int Latency()
+{
+    PackedLeNet model;
+    if (!model.FromFile(FLAGS_model.c_str()))
+        return 1;
+    if (!g_static_model.FromPacked(model))
+        return 2;
+
+    std::vector<uint8_t> images, labels;
+    const size_t num_images = LoadBenchmarkImages(StaticMnistLeNet::kInputSize, images, labels);
+    const int requests = std::max(1, FLAGS_requests);
+
+    std::vector<float> image(StaticMnistLeNet::kInputSize), packed(StaticMnistLeNet::kClasses), fixed(packed.size());
+    std::vector<float> workspace(model.WorkspaceSize(1));
+    std::vector<double> packed_ms, static_ms;
+    float max_diff = 0.0f;
+    int errors = 0;
+    for (int r = 0; r < requests; ++r)
+    {
+        const size_t id = (size_t)r % num_images;
+        for (size_t j = 0; j < image.size(); ++j)
+            image[j] = images[id * image.size() + j] / 255.0f;
+
+        auto t1 = Clock::now();
+        model.Forward(&image[0], 1, &packed[0], &workspace[0]);
+        auto t2 = Clock::now();
+        CPU_DISPATCH(StaticLeNetForward, (&image[0], &fixed[0]));
+        auto t3 = Clock::now();
+
+        packed_ms.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+        static_ms.push_back(std::chrono::duration<double, std::milli>(t3 - t2).count());
+        for (size_t c = 0; c < fixed.size(); ++c)
+            max_diff = std::max(max_diff, std::abs(fixed[c] - packed[c]));
+        if (!labels.empty() && std::max_element(fixed.begin(), fixed.end()) - fixed.begin() != labels[id])
+            ++errors;
+    }
+
+    printf("%-8s %10s %10s\n", "network", "p50 ms", "p99 ms");
+    printf("%-8s %10.4f %10.4f\n", "packed", Percentile(packed_ms, 50), Percentile(packed_ms, 99));
+    printf("%-8s %10.4f %10.4f\n", "static", Percentile(static_ms, 50), Percentile(static_ms, 99));
+    printf("Max difference: %g", max_diff);
+    if (!labels.empty())
+        printf(", static error: %.2f%%", 100.0 * errors / requests);
+    printf("\n");
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Main function
+
+int main(int argc, char **argv)
+{
+#ifdef USE_GFLAGS
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+    signal(SIGPIPE, SIG_IGN);
+
+    if (FLAGS_max_batch <= 0 || FLAGS_max_latency_us < 0)
+    {
+        printf("ERROR: max_batch must be positive and max_latency_us must not be negative\n");
+        return 1;
+    }
+
+    if (!FLAGS_cpu_isa.empty())
+    {
+        CpuIsa isa;
+        if (!ParseCpuIsa(FLAGS_cpu_isa.c_str(), isa))
+        {
+            printf("ERROR: Unknown instruction set %s\n", FLAGS_cpu_isa.c_str());
+            return 1;
+        }
+        if (!SetCpuIsa(isa))
+            return 1;
+    }
+    printf("Host kernels: %s (detected %s)\n", CpuIsaName(ActiveCpuIsa()), CpuIsaName(DetectCpuIsa()));
+
+    std::string mode = (argc > 1) ? argv[1] : "serve";
+    if (mode == "serve")
+        return Serve();
+    if (mode == "bench")
+        return Benchmark();
+    if (mode == "latency")
+        return Latency();
+
+    printf("Usage: %s [serve|bench|latency]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,82 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pbt.h"
+
+#include <cmath>
+
+#include <algorithm>
+#include <numeric>
+
+static int ClampBatchSize(int batch_size, const PbtConfig& config)
+{
+    return std::max(config.min_batch_size, std::min(config.max_batch_size, batch_size));
+}
+
+PbtHyperparameters PbtSample(const PbtHyperparameters& base, const PbtConfig& config, std::mt19937& gen)
+{
+    std::uniform_real_distribution<double> log_factor(-log(4.0), log(4.0));
+    std::uniform_real_distribution<double> power_offset(-0.25, 0.25);
+    std::uniform_int_distribution<int> batch_shift(-1, 1);
+
+    PbtHyperparameters hyper;
+    hyper.learning_rate = base.learning_rate * exp(log_factor(gen));
+    hyper.lr_gamma = base.lr_gamma * exp(log_factor(gen));
+    hyper.lr_power = std::max(0.05, base.lr_power + power_offset(gen));
+    const int shift = batch_shift(gen);
+    hyper.batch_size = ClampBatchSize(shift < 0 ? base.batch_size / 2 : base.batch_size << shift, config);
+    return hyper;
+}
+
+static void Perturb(PbtHyperparameters& hyper, const PbtConfig& config, std::mt19937& gen)
+{
+    std::bernoulli_distribution up(0.5);
+    auto factor = [&]() { return up(gen) ? 1.0 + config.perturb : 1.0 - config.perturb; };
+
+    hyper.learning_rate *= factor();
+    hyper.lr_gamma *= factor();
+    hyper.lr_power = std::max(0.05, hyper.lr_power * factor());
+    hyper.batch_size = ClampBatchSize((int)lround(hyper.batch_size * factor()), config);
+}
+
+std::vector<PbtReplacement> PbtExploitExplore(std::vector<PbtMember>& members, const PbtConfig& config,
+                                              std::mt19937& gen)
+{
+    std::vector<PbtReplacement> replacements;
+    const int size = (int)members.size();
+    if (size < 2)
+        return replacements;
+
+    // Rank the members, best first
+    std::vector<int> ranking(size);
+    std::iota(ranking.begin(), ranking.end(), 0);
+    std::stable_sort(ranking.begin(), ranking.end(),
+                     [&members](int a, int b) { return members[a].score < members[b].score; });
+
+    const int replaced = std::max(1, std::min(size / 2, (int)(config.fraction * size)));
+    std::uniform_int_distribution<int> pick(0, replaced - 1);
+    for (int i = 0; i < replaced; ++i)
+    {
+        const int target = ranking[size - 1 - i], source = ranking[pick(gen)];
+        PbtMember& member = members[target];
+
+        // Parameters are one flat buffer, so exploiting is a single copy
+        member.params = members[source].params;
+        member.hyper = members[source].hyper;
+        member.score = members[source].score;
+        ++member.generation;
+        Perturb(member.hyper, config, gen);
+
+        replacements.push_back({ target, source });
+    }
+    return replacements;
+}
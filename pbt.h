@@ -0,0 +1,85 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_PBT_H
+#define __CUDNN_TRAINING_PBT_H
+
+#include <random>
+#include <vector>
+
+/*
+ * Population-based training. A population of models trains concurrently;
+ * every so often, each member is scored, the worst members are replaced by
+ * copies of the best (weights and hyperparameters: "exploit"), and the
+ * copies' hyperparameters are perturbed ("explore"). The search over
+ * hyperparameters then happens within a single training run, instead of
+ * one full run per combination.
+ */
+
+/// Hyperparameters a member trains with, which explore perturbs.
+struct PbtHyperparameters
+{
+    double learning_rate, lr_gamma, lr_power;
+    int batch_size;
+};
+
+/// One member of a population.
+struct PbtMember
+{
+    /// The member's flat parameter buffer.
+    std::vector<float> params;
+
+    PbtHyperparameters hyper;
+
+    /// Score of the last evaluation (lower is better, e.g., a validation loss).
+    double score;
+
+    /// Number of times this member was replaced by a copy of another.
+    int generation;
+};
+
+struct PbtConfig
+{
+    /// Fraction of the population replaced in each round (at least one member).
+    double fraction;
+
+    /// Explore multiplies every hyperparameter by 1 - perturb or 1 + perturb.
+    double perturb;
+
+    /// Range of batch sizes explore may choose.
+    int min_batch_size, max_batch_size;
+};
+
+/// A replacement made by PbtExploitExplore.
+struct PbtReplacement
+{
+    int member, source;
+};
+
+/**
+ * Draws the hyperparameters of an initial member around "base": learning
+ * rate and gamma log-uniformly within a factor of 4, power uniformly within
+ * +-0.25, and the batch size from base / 2, base and base * 2.
+ */
+PbtHyperparameters PbtSample(const PbtHyperparameters& base, const PbtConfig& config, std::mt19937& gen);
+
+/**
+ * One exploit/explore round over members whose scores are up to date: each
+ * of the worst fraction of members is overwritten by a random member of the
+ * best fraction, and its copied hyperparameters are perturbed.
+ *
+ * @return The replacements made.
+ */
+std::vector<PbtReplacement> PbtExploitExplore(std::vector<PbtMember>& members, const PbtConfig& config,
+                                              std::mt19937& gen);
+
+#endif  // __CUDNN_TRAINING_PBT_H
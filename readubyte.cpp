@@ -11,20 +11,41 @@
  */
 
 #include "readubyte.h"
+#include "cpudispatch.h"
 
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <stdint.h>
 
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 #define UBYTE_IMAGE_MAGIC 2051
 #define UBYTE_LABEL_MAGIC 2049
 
 #ifdef _MSC_VER
     #define bswap(x) _byteswap_ulong(x)
+    #define bswap16(x) _byteswap_ushort(x)
+    #define bswap64(x) _byteswap_uint64(x)
 #else
     #define bswap(x) __builtin_bswap32(x)
+    #define bswap16(x) __builtin_bswap16(x)
+    #define bswap64(x) __builtin_bswap64(x)
 #endif
 
+// Maximal number of dimensions in an IDX file
+#define IDX_MAX_DIMS 16
+
 #pragma pack(push, 1)
 struct UByteImageDataset 
 {
@@ -159,3 +180,545 @@ size_t ReadUByteDataset(const char *image_filename, const char *label_filename,
 
     return image_header.length;
 }
+
+/**
+ * Converts "count" big-endian elements of "bytes" bytes each to host order, in
+ * place. Written as plain loops over fixed-width words so that the compiler
+ * turns them into vector shuffles.
+ */
+static void SwapElements(uint8_t *data, size_t count, size_t bytes)
+{
+    if (bytes == 2)
+    {
+        uint16_t *p = reinterpret_cast<uint16_t *>(data);
+        for (size_t i = 0; i < count; ++i)
+            p[i] = bswap16(p[i]);
+    }
+    else if (bytes == 4)
+    {
+        uint32_t *p = reinterpret_cast<uint32_t *>(data);
+        for (size_t i = 0; i < count; ++i)
+            p[i] = bswap(p[i]);
+    }
+    else if (bytes == 8)
+    {
+        uint64_t *p = reinterpret_cast<uint64_t *>(data);
+        for (size_t i = 0; i < count; ++i)
+            p[i] = bswap64(p[i]);
+    }
+}
+
+static bool IsBigEndianHost()
+{
+    const uint16_t one = 1;
+    return *reinterpret_cast<const uint8_t *>(&one) == 0;
+}
+
+IdxTensor::~IdxTensor()
+{
+#ifndef _WIN32
+    if (mapping)
+        munmap(mapping, mapping_size);
+#endif
+}
+
+size_t IdxTensor::ElementSize() const
+{
+    switch (type)
+    {
+    case IDX_UBYTE:
+    case IDX_BYTE:
+        return 1;
+    case IDX_SHORT:
+        return 2;
+    case IDX_INT:
+    case IDX_FLOAT:
+        return 4;
+    case IDX_DOUBLE:
+        return 8;
+    }
+    return 0;
+}
+
+size_t IdxTensor::NumElements() const
+{
+    size_t count = 1;
+    for (uint32_t dim : dims)
+        count *= dim;
+    return count;
+}
+
+bool IdxTensor::FromFile(const char *filename, bool map, bool header_only)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        printf("ERROR: Cannot open dataset %s\n", filename);
+        return false;
+    }
+
+    // Read and verify the magic number: two zero bytes, type code, number of dimensions
+    uint8_t magic[4];
+    if (fread(magic, 1, 4, fp) != 4 || magic[0] != 0 || magic[1] != 0 ||
+        magic[3] == 0 || magic[3] > IDX_MAX_DIMS)
+    {
+        printf("ERROR: Invalid dataset file %s (magic number)\n", filename);
+        fclose(fp);
+        return false;
+    }
+    type = static_cast<IdxDataType>(magic[2]);
+    if (ElementSize() == 0)
+    {
+        printf("ERROR: Invalid dataset file %s (unknown element type 0x%02X)\n", filename, magic[2]);
+        fclose(fp);
+        return false;
+    }
+
+    dims.resize(magic[3]);
+    if (fread(&dims[0], sizeof(uint32_t), dims.size(), fp) != dims.size())
+    {
+        printf("ERROR: Invalid dataset file %s (dimensions)\n", filename);
+        fclose(fp);
+        return false;
+    }
+    for (uint32_t& dim : dims)
+        dim = bswap(dim);
+
+    if (header_only)
+    {
+        fclose(fp);
+        return true;
+    }
+
+    const size_t offset = 4 + sizeof(uint32_t) * dims.size();
+    const size_t bytes = NumElements() * ElementSize();
+    const bool needs_swap = ElementSize() > 1 && !IsBigEndianHost();
+
+#ifndef _WIN32
+    // Elements that are already in host order are used straight from the mapping
+    if (map && !needs_swap)
+    {
+        struct stat st;
+        if (fstat(fileno(fp), &st) != 0 || static_cast<size_t>(st.st_size) < offset + bytes)
+        {
+            printf("ERROR: Invalid dataset file %s (partial dataset)\n", filename);
+            fclose(fp);
+            return false;
+        }
+        void *ptr = mmap(nullptr, offset + bytes, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        fclose(fp);
+        if (ptr == MAP_FAILED)
+        {
+            printf("ERROR: Cannot map dataset %s\n", filename);
+            return false;
+        }
+        mapping = ptr;
+        mapping_size = offset + bytes;
+        data = static_cast<const uint8_t *>(ptr) + offset;
+        return true;
+    }
+#endif
+
+    storage.resize(bytes);
+    if (bytes > 0 && fread(&storage[0], 1, bytes, fp) != bytes)
+    {
+        printf("ERROR: Invalid dataset file %s (partial dataset)\n", filename);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    if (needs_swap)
+        SwapElements(storage.data(), NumElements(), ElementSize());
+    data = storage.data();
+    return true;
+}
+
+template <typename T>
+static CPU_INLINE void ConvertToFloat(const void *data, size_t first, size_t count, float *out, float scale, float offset)
+{
+    const T *in = static_cast<const T *>(data) + first;
+    for (size_t i = 0; i < count; ++i)
+        out[i] = static_cast<float>(in[i]) * scale + offset;
+}
+
+// Conversion is compiled once per instruction set (see cpudispatch.h)
+static CPU_INLINE void ConvertAnyToFloat(IdxDataType type, const void *data, size_t first, size_t count,
+                                         float *out, float scale, float offset)
+{
+    switch (type)
+    {
+    case IDX_UBYTE:
+        ConvertToFloat<uint8_t>(data, first, count, out, scale, offset);
+        break;
+    case IDX_BYTE:
+        ConvertToFloat<int8_t>(data, first, count, out, scale, offset);
+        break;
+    case IDX_SHORT:
+        ConvertToFloat<int16_t>(data, first, count, out, scale, offset);
+        break;
+    case IDX_INT:
+        ConvertToFloat<int32_t>(data, first, count, out, scale, offset);
+        break;
+    case IDX_FLOAT:
+        ConvertToFloat<float>(data, first, count, out, scale, offset);
+        break;
+    case IDX_DOUBLE:
+        ConvertToFloat<double>(data, first, count, out, scale, offset);
+        break;
+    }
+}
+
+CPU_MULTIVERSION(ConvertIsa,
+                 (IdxDataType type, const void *data, size_t first, size_t count, float *out, float scale, float offset),
+                 ConvertAnyToFloat(type, data, first, count, out, scale, offset))
+
+void IdxTensor::ToFloat(size_t first, size_t count, float *out, float scale, float offset) const
+{
+    CPU_DISPATCH(ConvertIsa, (type, data, first, count, out, scale, offset));
+}
+
+size_t ReadIdxDataset(const char *image_filename, const char *label_filename,
+                      std::vector<float>& data, std::vector<uint8_t>& labels,
+                      size_t& channels, size_t& width, size_t& height,
+                      const DatasetStats *stats)
+{
+    IdxTensor images, label_tensor;
+    if (!images.FromFile(image_filename, true) || !label_tensor.FromFile(label_filename, true))
+        return 0;
+
+    // Verify datasets
+    if (images.dims.size() != 3 && images.dims.size() != 4)
+    {
+        printf("ERROR: Invalid dataset file (images must be DxHxW or DxCxHxW, got %d dimensions)\n",
+               (int)images.dims.size());
+        return 0;
+    }
+    if (label_tensor.dims.size() != 1 || label_tensor.type == IDX_FLOAT || label_tensor.type == IDX_DOUBLE)
+    {
+        printf("ERROR: Invalid dataset file (labels must be a 1-D integer tensor)\n");
+        return 0;
+    }
+    if (images.dims[0] != label_tensor.dims[0])
+    {
+        printf("ERROR: Dataset file mismatch (number of images does not match the number of labels)\n");
+        return 0;
+    }
+
+    // Output dimensions
+    const size_t length = images.dims[0];
+    const bool has_channels = images.dims.size() == 4;
+    channels = has_channels ? images.dims[1] : 1;
+    height = images.dims[has_channels ? 2 : 1];
+    width = images.dims[has_channels ? 3 : 2];
+
+    if (stats && stats->mean.size() != channels)
+    {
+        printf("ERROR: Dataset statistics do not match the number of channels\n");
+        return 0;
+    }
+
+    // Byte images are normalized to [0,1], other types are taken as stored features.
+    // With statistics, every channel is standardized in the same pass
+    const float base_scale = (images.type == IDX_UBYTE) ? 1.0f / 255.0f : 1.0f;
+    const size_t plane = width * height;
+    data.resize(images.NumElements());
+    if (!stats)
+        images.ToFloat(0, data.size(), data.data(), base_scale);
+    else
+    {
+        for (size_t i = 0; i < length * channels; ++i)
+        {
+            const size_t c = i % channels;
+            images.ToFloat(i * plane, plane, &data[i * plane], stats->Scale(c, base_scale), stats->Offset(c));
+        }
+    }
+
+    std::vector<float> label_values(length);
+    label_tensor.ToFloat(0, length, label_values.data(), 1.0f);
+    labels.resize(length);
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (label_values[i] < 0.0f || label_values[i] > 255.0f)
+        {
+            printf("ERROR: Invalid dataset file (label %d out of range)\n", (int)label_values[i]);
+            return 0;
+        }
+        labels[i] = static_cast<uint8_t>(label_values[i]);
+    }
+
+    return length;
+}
+
+/**
+ * Converts CIFAR records [first, last) of one file to floats and labels.
+ */
+static void ParseCifarRecords(const uint8_t *records, size_t first, size_t last, int label_bytes,
+                              const float *scale, const float *offset, float *data, uint8_t *labels)
+{
+    const size_t plane = CIFAR_WIDTH * CIFAR_HEIGHT;
+    const size_t image_size = CIFAR_CHANNELS * CIFAR_WIDTH * CIFAR_HEIGHT;
+    const size_t record_size = label_bytes + image_size;
+    for (size_t i = first; i < last; ++i)
+    {
+        const uint8_t *record = records + i * record_size;
+        labels[i] = record[label_bytes - 1];
+
+        const uint8_t *pixels = record + label_bytes;
+        float *image = data + i * image_size;
+        for (size_t c = 0; c < CIFAR_CHANNELS; ++c)
+            for (size_t j = c * plane; j < (c + 1) * plane; ++j)
+                image[j] = (float)pixels[j] * scale[c] + offset[c];
+    }
+}
+
+size_t ReadCifarDataset(const std::string& filenames, int label_bytes,
+                        std::vector<float>& data, std::vector<uint8_t>& labels,
+                        size_t& channels, size_t& width, size_t& height,
+                        const DatasetStats *stats)
+{
+    const size_t image_size = CIFAR_CHANNELS * CIFAR_WIDTH * CIFAR_HEIGHT;
+    const size_t record_size = label_bytes + image_size;
+    if (label_bytes != 1 && label_bytes != 2)
+    {
+        printf("ERROR: Invalid number of CIFAR label bytes (%d)\n", label_bytes);
+        return 0;
+    }
+
+    if (stats && stats->mean.size() != CIFAR_CHANNELS)
+    {
+        printf("ERROR: Dataset statistics do not match the number of channels\n");
+        return 0;
+    }
+
+    // Pixels are scaled to [0,1], or standardized with the statistics
+    float channel_scale[CIFAR_CHANNELS], channel_offset[CIFAR_CHANNELS];
+    for (size_t c = 0; c < CIFAR_CHANNELS; ++c)
+    {
+        channel_scale[c] = stats ? stats->Scale(c, 1.0f / 255.0f) : 1.0f / 255.0f;
+        channel_offset[c] = stats ? stats->Offset(c) : 0.0f;
+    }
+
+    channels = CIFAR_CHANNELS;
+    width = CIFAR_WIDTH;
+    height = CIFAR_HEIGHT;
+    data.clear();
+    labels.clear();
+
+    const unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::stringstream list(filenames);
+    std::string filename;
+    while (std::getline(list, filename, ','))
+    {
+        if (filename.empty())
+            continue;
+
+        FILE *fp = fopen(filename.c_str(), "rb");
+        if (!fp)
+        {
+            printf("ERROR: Cannot open dataset %s\n", filename.c_str());
+            return 0;
+        }
+        fseek(fp, 0, SEEK_END);
+        const size_t file_size = static_cast<size_t>(ftell(fp));
+        fseek(fp, 0, SEEK_SET);
+        if (file_size == 0 || file_size % record_size != 0)
+        {
+            printf("ERROR: Invalid dataset file %s (size is not a multiple of %d-byte records)\n",
+                   filename.c_str(), (int)record_size);
+            fclose(fp);
+            return 0;
+        }
+
+        // Records are parsed straight from the mapped file
+        const uint8_t *records = nullptr;
+        std::vector<uint8_t> storage;
+#ifndef _WIN32
+        void *mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (mapping != MAP_FAILED)
+        {
+            madvise(mapping, file_size, MADV_SEQUENTIAL);
+            records = static_cast<const uint8_t *>(mapping);
+        }
+#endif
+        if (!records)
+        {
+            storage.resize(file_size);
+            if (fread(&storage[0], 1, file_size, fp) != file_size)
+            {
+                printf("ERROR: Invalid dataset file %s (partial dataset)\n", filename.c_str());
+                fclose(fp);
+                return 0;
+            }
+            records = storage.data();
+        }
+        fclose(fp);
+
+        // Split the records of the file evenly among the threads
+        const size_t count = file_size / record_size, offset = labels.size();
+        data.resize((offset + count) * image_size);
+        labels.resize(offset + count);
+
+        std::vector<std::thread> threads;
+        const size_t per_thread = (count + num_threads - 1) / num_threads;
+        for (size_t first = 0; first < count; first += per_thread)
+        {
+            threads.emplace_back(ParseCifarRecords, records, first, std::min(count, first + per_thread),
+                                 label_bytes, channel_scale, channel_offset, &data[offset * image_size], &labels[offset]);
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+
+#ifndef _WIN32
+        if (storage.empty())
+            munmap(const_cast<uint8_t *>(records), file_size);
+#endif
+    }
+
+    if (labels.empty())
+        printf("ERROR: No CIFAR dataset files given\n");
+    return labels.size();
+}
+
+void DatasetStats::Compute(const float *data, const uint8_t *labels, size_t count, size_t channels, size_t plane)
+{
+    // Every thread accumulates sums over a range of images; partial sums are combined at the end
+    const size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::vector<double>> sums(num_threads, std::vector<double>(channels * 2, 0.0));
+    std::vector<std::vector<uint64_t>> histograms(num_threads, std::vector<uint64_t>(256, 0));
+
+    std::vector<std::thread> threads;
+    const size_t per_thread = (count + num_threads - 1) / num_threads;
+    for (size_t t = 0; t < num_threads && t * per_thread < count; ++t)
+    {
+        threads.emplace_back([&, t]
+        {
+            std::vector<double>& sum = sums[t];
+            for (size_t i = t * per_thread; i < std::min(count, (t + 1) * per_thread); ++i)
+            {
+                ++histograms[t][labels[i]];
+                for (size_t c = 0; c < channels; ++c)
+                {
+                    const float *pixels = data + (i * channels + c) * plane;
+                    double s = 0.0, s2 = 0.0;
+                    for (size_t j = 0; j < plane; ++j)
+                    {
+                        s += pixels[j];
+                        s2 += (double)pixels[j] * pixels[j];
+                    }
+                    sum[c * 2] += s;
+                    sum[c * 2 + 1] += s2;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    mean.assign(channels, 0.0f);
+    stddev.assign(channels, 1.0f);
+    label_histogram.assign(256, 0);
+    const double n = (double)count * plane;
+    for (size_t c = 0; c < channels; ++c)
+    {
+        double s = 0.0, s2 = 0.0;
+        for (size_t t = 0; t < num_threads; ++t)
+        {
+            s += sums[t][c * 2];
+            s2 += sums[t][c * 2 + 1];
+        }
+        const double m = s / n;
+        const double variance = std::max(s2 / n - m * m, 0.0);
+        mean[c] = (float)m;
+        stddev[c] = variance > 0.0 ? (float)sqrt(variance) : 1.0f;
+    }
+    for (size_t t = 0; t < num_threads; ++t)
+        for (size_t l = 0; l < 256; ++l)
+            label_histogram[l] += histograms[t][l];
+
+    // Trim the histogram to the largest label
+    while (!label_histogram.empty() && label_histogram.back() == 0)
+        label_histogram.pop_back();
+}
+
+void DatasetStats::Apply(float *data, size_t count, size_t channels, size_t plane) const
+{
+    for (size_t i = 0; i < count * channels; ++i)
+    {
+        const size_t c = i % channels;
+        const float scale = Scale(c, 1.0f), offset = Offset(c);
+        float *pixels = data + i * plane;
+        for (size_t j = 0; j < plane; ++j)
+            pixels[j] = pixels[j] * scale + offset;
+    }
+}
+
+#define DATASET_STATS_MAGIC "LENETSTATS"
+#define DATASET_STATS_VERSION 1
+
+bool DatasetStats::Load(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return false;
+
+    char magic[32];
+    int version = 0;
+    unsigned long long bytes = 0, num_channels = 0, num_labels = 0;
+    bool ok = fscanf(fp, "%31s %d", magic, &version) == 2 && !strcmp(magic, DATASET_STATS_MAGIC) &&
+              version == DATASET_STATS_VERSION &&
+              fscanf(fp, " source_bytes %llu channels %llu", &bytes, &num_channels) == 2;
+    source_bytes = bytes;
+    mean.resize(ok ? num_channels : 0);
+    stddev.resize(ok ? num_channels : 0);
+    for (size_t c = 0; ok && c < num_channels; ++c)
+        ok = fscanf(fp, "%f %f", &mean[c], &stddev[c]) == 2 && stddev[c] > 0.0f;
+    ok = ok && fscanf(fp, " labels %llu", &num_labels) == 1 && num_labels <= 256;
+    label_histogram.resize(ok ? num_labels : 0);
+    for (size_t l = 0; ok && l < num_labels; ++l)
+    {
+        unsigned long long value;
+        ok = fscanf(fp, "%llu", &value) == 1;
+        label_histogram[l] = value;
+    }
+    fclose(fp);
+    return ok;
+}
+
+bool DatasetStats::Save(const char *filename) const
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+    {
+        printf("ERROR: Cannot open file %s\n", filename);
+        return false;
+    }
+    fprintf(fp, "%s %d\n", DATASET_STATS_MAGIC, DATASET_STATS_VERSION);
+    fprintf(fp, "source_bytes %llu\nchannels %llu\n", (unsigned long long)source_bytes, (unsigned long long)mean.size());
+    for (size_t c = 0; c < mean.size(); ++c)
+        fprintf(fp, "%.9g %.9g\n", mean[c], stddev[c]);
+    fprintf(fp, "labels %llu\n", (unsigned long long)label_histogram.size());
+    for (uint64_t value : label_histogram)
+        fprintf(fp, "%llu\n", (unsigned long long)value);
+    return fclose(fp) == 0;
+}
+
+uint64_t DatasetSourceBytes(const std::string& filenames)
+{
+    uint64_t total = 0;
+    std::stringstream list(filenames);
+    std::string filename;
+    while (std::getline(list, filename, ','))
+    {
+        if (filename.empty())
+            continue;
+        FILE *fp = fopen(filename.c_str(), "rb");
+        if (!fp)
+            return 0;
+        fseek(fp, 0, SEEK_END);
+        total += (uint64_t)ftell(fp);
+        fclose(fp);
+    }
+    return total;
+}
@@ -15,6 +15,141 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <string>
+#include <vector>
+
+// CIFAR binary record layout: label byte(s) followed by 3x32x32 planar pixels
+#define CIFAR_CHANNELS 3
+#define CIFAR_WIDTH 32
+#define CIFAR_HEIGHT 32
+
+/**
+ * IDX element type codes (third byte of the magic number).
+ */
+enum IdxDataType
+{
+    IDX_UBYTE  = 0x08,
+    IDX_BYTE   = 0x09,
+    IDX_SHORT  = 0x0B,
+    IDX_INT    = 0x0C,
+    IDX_FLOAT  = 0x0D,
+    IDX_DOUBLE = 0x0E,
+};
+
+/**
+ * An N-dimensional tensor read from an IDX file. Multi-byte elements are
+ * converted from big-endian to host order when loaded. Single-byte tensors
+ * can instead be memory-mapped, in which case "data" points into the mapping.
+ */
+struct IdxTensor
+{
+    IdxDataType type;
+    std::vector<uint32_t> dims;
+    const void *data;
+
+    // Owned storage (when the file is read) or mapping (when mapped)
+    std::vector<uint8_t> storage;
+    void *mapping;
+    size_t mapping_size;
+
+    IdxTensor() : type(IDX_UBYTE), data(nullptr), mapping(nullptr), mapping_size(0) {}
+    ~IdxTensor();
+
+    // Disable copying
+    IdxTensor& operator=(const IdxTensor&) = delete;
+    IdxTensor(const IdxTensor&) = delete;
+
+    /**
+     * Reads an IDX file of any type and dimensionality.
+     *
+     * @param filename The IDX file.
+     * @param map Map the file instead of reading it, if no byte swapping is needed.
+     * @param header_only Only parse the type and dimensions.
+     * @return True on success.
+     */
+    bool FromFile(const char *filename, bool map = false, bool header_only = false);
+
+    /// Size of one element in bytes.
+    size_t ElementSize() const;
+
+    /// Total number of elements.
+    size_t NumElements() const;
+
+    /**
+     * Converts elements to float, as element * scale + offset.
+     *
+     * @param first Index of the first element to convert.
+     * @param count Number of elements to convert.
+     * @param out The output array.
+     * @param scale The factor applied to every element.
+     * @param offset The value added to every element after scaling.
+     */
+    void ToFloat(size_t first, size_t count, float *out, float scale, float offset = 0.0f) const;
+};
+
+/**
+ * Per-channel mean and standard deviation of a training set (of the values
+ * the loaders produce without standardization, i.e., [0,1] for byte images),
+ * and its label histogram. Passed to a loader, the statistics are applied in
+ * the same pass that converts the stored elements to float.
+ */
+struct DatasetStats
+{
+    std::vector<float> mean, stddev;
+    std::vector<uint64_t> label_histogram;
+
+    // Total size of the source files, to detect a stale cache
+    uint64_t source_bytes;
+
+    DatasetStats() : source_bytes(0) {}
+
+    /**
+     * Computes the statistics in one parallel pass over a loaded dataset.
+     *
+     * @param data The DxCxHxW dataset.
+     * @param labels The Dx1 labels.
+     * @param count The number of images (D).
+     * @param channels The number of channels (C).
+     * @param plane The number of pixels per channel (HxW).
+     */
+    void Compute(const float *data, const uint8_t *labels, size_t count, size_t channels, size_t plane);
+
+    /// Standardizes a loaded dataset in place, for data read without statistics.
+    void Apply(float *data, size_t count, size_t channels, size_t plane) const;
+
+    /// Scale and offset that standardize channel c of values read as value * base_scale.
+    float Scale(size_t c, float base_scale) const { return base_scale / stddev[c]; }
+    float Offset(size_t c) const { return -mean[c] / stddev[c]; }
+
+    bool Load(const char *filename);
+    bool Save(const char *filename) const;
+};
+
+/**
+ * Total size of a comma-separated list of files (0 if any is missing).
+ */
+uint64_t DatasetSourceBytes(const std::string& filenames);
+
+/**
+ * Reads an IDX image dataset and its labels. Images may be of any IDX type and
+ * of shape DxHxW or DxCxHxW; uint8 images are normalized to [0,1], other types
+ * are used as stored (e.g., preprocessed float features). Labels must be a 1-D
+ * integer tensor with values in [0,255].
+ *
+ * @param image_filename The dataset file containing the images.
+ * @param label_filename The dataset file containing the labels.
+ * @param data The output dataset, a DxCxHxW array (resized by the function).
+ * @param labels The Dx1 label array (resized by the function).
+ * @param channels The number of channels of each image.
+ * @param width The width of each image.
+ * @param height The height of each image.
+ * @param stats Optional statistics to standardize the images with.
+ * @return Number of images in dataset (0 on error).
+ */
+size_t ReadIdxDataset(const char *image_filename, const char *label_filename,
+                      std::vector<float>& data, std::vector<uint8_t>& labels,
+                      size_t& channels, size_t& width, size_t& height,
+                      const DatasetStats *stats = nullptr);
 
 /**
  * Obtains images and labels from a UByte dataset. If "data" and "labels" are null,
@@ -31,4 +166,26 @@
 size_t ReadUByteDataset(const char* image_filename, const char* label_filename, 
                         uint8_t *data, uint8_t *labels, size_t& width, size_t& height);
 
+/**
+ * Reads CIFAR-10 or CIFAR-100 binary batch files. Each record is one label byte
+ * (CIFAR-10) or a coarse and a fine label byte (CIFAR-100, of which the fine
+ * label is used), followed by a 3x32x32 image stored plane by plane, which is
+ * already the CxHxW layout of the network input. Files are memory-mapped and
+ * records are converted to [0,1] floats by several threads at once.
+ *
+ * @param filenames Comma-separated list of batch files (e.g., data_batch_1.bin,...).
+ * @param label_bytes Number of label bytes per record (1 for CIFAR-10, 2 for CIFAR-100).
+ * @param data The output dataset, a DxCxHxW array (resized by the function).
+ * @param labels The Dx1 label array (resized by the function).
+ * @param channels The number of channels of each image.
+ * @param width The width of each image.
+ * @param height The height of each image.
+ * @param stats Optional statistics to standardize the images with.
+ * @return Number of images in dataset (0 on error).
+ */
+size_t ReadCifarDataset(const std::string& filenames, int label_bytes,
+                        std::vector<float>& data, std::vector<uint8_t>& labels,
+                        size_t& channels, size_t& width, size_t& height,
+                        const DatasetStats *stats = nullptr);
+
 #endif  // __CUDNN_TRAINING_READUBYTE_H
@@ -0,0 +1,154 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sampler.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <numeric>
+
+bool ParseSamplingMode(const char *name, SamplingMode& mode)
+{
+    if (!strcmp(name, "uniform"))
+        mode = SAMPLE_UNIFORM;
+    else if (!strcmp(name, "balanced"))
+        mode = SAMPLE_BALANCED;
+    else if (!strcmp(name, "importance"))
+        mode = SAMPLE_IMPORTANCE;
+    else
+        return false;
+    return true;
+}
+
+void AliasTable::Build(const double *weights, size_t count)
+{
+    prob.resize(count);
+    alias.resize(count);
+
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i)
+        total += weights[i];
+
+    // Scale weights so that the average is 1 and split them into small and large
+    std::vector<double> scaled(count);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < count; ++i)
+    {
+        scaled[i] = weights[i] * count / total;
+        (scaled[i] < 1.0 ? small : large).push_back(static_cast<uint32_t>(i));
+    }
+
+    // Pair each small entry with a large one that fills the rest of its column
+    while (!small.empty() && !large.empty())
+    {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+
+        prob[s] = static_cast<float>(scaled[s]);
+        alias[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // The remaining entries are full columns (up to rounding)
+    for (uint32_t i : small)
+    {
+        prob[i] = 1.0f;
+        alias[i] = i;
+    }
+    for (uint32_t i : large)
+    {
+        prob[i] = 1.0f;
+        alias[i] = i;
+    }
+}
+
+uint32_t AliasTable::Sample(std::mt19937& gen) const
+{
+    std::uniform_int_distribution<uint32_t> column(0, static_cast<uint32_t>(prob.size() - 1));
+    std::uniform_real_distribution<float> coin(0.0f, 1.0f);
+
+    uint32_t i = column(gen);
+    return coin(gen) < prob[i] ? i : alias[i];
+}
+
+void ClassBalancedSampler::Build(const uint8_t *labels, size_t count)
+{
+    std::vector<std::vector<uint32_t>> by_label(256);
+    for (size_t i = 0; i < count; ++i)
+        by_label[labels[i]].push_back(static_cast<uint32_t>(i));
+
+    class_indices.clear();
+    for (std::vector<uint32_t>& indices : by_label)
+    {
+        if (!indices.empty())
+            class_indices.push_back(std::move(indices));
+    }
+}
+
+uint32_t ClassBalancedSampler::Sample(std::mt19937& gen) const
+{
+    std::uniform_int_distribution<size_t> pick_class(0, class_indices.size() - 1);
+    const std::vector<uint32_t>& indices = class_indices[pick_class(gen)];
+
+    std::uniform_int_distribution<size_t> pick_sample(0, indices.size() - 1);
+    return indices[pick_sample(gen)];
+}
+
+void ImportanceSampler::Build(size_t count, double initial_weight, size_t block_size_)
+{
+    block_size = block_size_;
+    weights.assign(count, initial_weight);
+
+    const size_t num_blocks = (count + block_size - 1) / block_size;
+    block_weights.assign(num_blocks, 0.0);
+    blocks.resize(num_blocks);
+    dirty.assign(num_blocks, 1);
+    Commit();
+}
+
+void ImportanceSampler::Update(uint32_t index, double weight)
+{
+    weights[index] = weight;
+    dirty[index / block_size] = 1;
+}
+
+void ImportanceSampler::Commit()
+{
+    bool changed = false;
+    for (size_t b = 0; b < blocks.size(); ++b)
+    {
+        if (!dirty[b])
+            continue;
+
+        const size_t first = b * block_size;
+        const size_t count = std::min(block_size, weights.size() - first);
+        blocks[b].Build(&weights[first], count);
+        block_weights[b] = std::accumulate(weights.begin() + first, weights.begin() + first + count, 0.0);
+        dirty[b] = 0;
+        changed = true;
+    }
+
+    if (changed)
+        top.Build(block_weights.data(), block_weights.size());
+}
+
+uint32_t ImportanceSampler::Sample(std::mt19937& gen) const
+{
+    const uint32_t b = top.Sample(gen);
+    return static_cast<uint32_t>(b * block_size) + blocks[b].Sample(gen);
+}
@@ -0,0 +1,109 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_SAMPLER_H
+#define __CUDNN_TRAINING_SAMPLER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <random>
+#include <vector>
+
+/**
+ * How training samples are drawn into mini-batches.
+ */
+enum SamplingMode
+{
+    SAMPLE_UNIFORM = 0,     // A uniformly chosen contiguous block of the dataset
+    SAMPLE_BALANCED = 1,    // Uniform class, then uniform sample within the class
+    SAMPLE_IMPORTANCE = 2,  // Proportional to a per-sample priority derived from its loss
+};
+
+/**
+ * Parses a sampling mode name ("uniform", "balanced" or "importance").
+ *
+ * @param name The mode name.
+ * @param mode The parsed mode.
+ * @return True if the name was recognized.
+ */
+bool ParseSamplingMode(const char *name, SamplingMode& mode);
+
+/**
+ * Walker/Vose alias table: O(count) construction, O(1) draws from a discrete
+ * distribution given by non-negative weights.
+ */
+struct AliasTable
+{
+    std::vector<float> prob;
+    std::vector<uint32_t> alias;
+
+    /// Builds the table from "count" weights, which must not all be zero.
+    void Build(const double *weights, size_t count);
+
+    /// Draws an index in [0, count).
+    uint32_t Sample(std::mt19937& gen) const;
+};
+
+/**
+ * Class-balanced sampler over a per-class index of the dataset, built once
+ * from the labels.
+ */
+struct ClassBalancedSampler
+{
+    std::vector<std::vector<uint32_t>> class_indices;
+
+    /// Groups the sample indices by label. Classes without samples are skipped.
+    void Build(const uint8_t *labels, size_t count);
+
+    /// Draws a sample index: a class uniformly, then a sample of that class uniformly.
+    uint32_t Sample(std::mt19937& gen) const;
+};
+
+/**
+ * Importance sampler with weights that change during training. Samples are
+ * split into blocks, each with its own alias table, and a top-level table
+ * picks the block. Updating a weight only marks its block dirty; Commit then
+ * rebuilds the dirty blocks and the (small) top-level table, so a batch of
+ * updates costs O(updated blocks * block_size + number of blocks) while draws
+ * remain O(1).
+ */
+struct ImportanceSampler
+{
+    size_t block_size;
+    std::vector<double> weights;
+    std::vector<double> block_weights;
+    std::vector<AliasTable> blocks;
+    std::vector<uint8_t> dirty;
+    AliasTable top;
+
+    ImportanceSampler() : block_size(0) {}
+
+    /**
+     * Initializes all samples with the same weight.
+     *
+     * @param count The number of samples.
+     * @param initial_weight The initial weight of every sample (positive).
+     * @param block_size_ The number of samples per block.
+     */
+    void Build(size_t count, double initial_weight, size_t block_size_ = 256);
+
+    /// Sets the weight of one sample. Takes effect after the next Commit.
+    void Update(uint32_t index, double weight);
+
+    /// Rebuilds the tables of blocks whose weights changed.
+    void Commit();
+
+    /// Draws a sample index with probability proportional to its weight.
+    uint32_t Sample(std::mt19937& gen) const;
+};
+
+#endif  // __CUDNN_TRAINING_SAMPLER_H
@@ -0,0 +1,166 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Shard reading benchmark.
+ *
+ * Usage: shardbench [--create_dir=DIR] [--shards=a,b,...] [shard ...]
+ *
+ * Reads every shard once with the io_uring backend (when available) and with the
+ * pread thread pool, and reports the achieved read bandwidth of each. Shards are
+ * given with "shards" or as arguments; without any, num_shards random shards of
+ * shard_mb MB are written to "create_dir" first (e.g., on a tmpfs or an NVMe
+ * mount), used as input and removed afterwards.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "shardreader.h"
+
+#ifdef USE_GFLAGS
+    #include <gflags/gflags.h>
+
+    #ifndef _WIN32
+        #define gflags google
+    #endif
+#else
+    // Constant versions of gflags
+    #define DEFINE_int32(flag, default_value, description) const int FLAGS_##flag = (default_value)
+    #define DEFINE_string(flag, default_value, description) const std::string FLAGS_##flag ((default_value))
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Command-line flags
+
+DEFINE_string(shards, "", "Comma-separated list of shard files to read");
+DEFINE_string(create_dir, "/tmp", "Directory in which to create test shards when no shards are given");
+DEFINE_int32(num_shards, 16, "Number of test shards to create");
+DEFINE_int32(shard_mb, 64, "Size of each test shard in MB");
+
+// Reader parameters
+DEFINE_int32(block_kb, 1024, "Size of each read in KB");
+DEFINE_int32(queue_depth, 32, "Number of reads in flight");
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static bool CreateShards(std::vector<std::string>& filenames)
+{
+    std::vector<uint64_t> block(1 << 17);
+    std::mt19937_64 gen(0);
+    const size_t blocks_per_shard = ((size_t)FLAGS_shard_mb << 20) / (block.size() * sizeof(uint64_t));
+
+    printf("Creating %d shards of %d MB in %s\n", FLAGS_num_shards, FLAGS_shard_mb, FLAGS_create_dir.c_str());
+    for (int s = 0; s < FLAGS_num_shards; ++s)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/shard%05d.bin", s);
+        filenames.push_back(FLAGS_create_dir + name);
+
+        FILE *fp = fopen(filenames.back().c_str(), "wb");
+        if (!fp)
+        {
+            printf("ERROR: Cannot open file %s\n", filenames.back().c_str());
+            return false;
+        }
+        for (size_t b = 0; b < blocks_per_shard; ++b)
+        {
+            for (auto&& iter : block)
+                iter = gen();
+            fwrite(&block[0], sizeof(uint64_t), block.size(), fp);
+        }
+        fclose(fp);
+    }
+    return true;
+}
+
+static bool RunBenchmark(const std::vector<std::string>& filenames, bool use_uring)
+{
+    ShardReader reader;
+    if (!reader.Open(filenames, (size_t)FLAGS_block_kb << 10, FLAGS_queue_depth, use_uring))
+        return false;
+    if (use_uring && !reader.UsesUring())
+        return true;
+
+    // Touch every byte, so that the data is actually consumed
+    uint64_t checksum = 0, bytes_read = 0;
+    auto t1 = Clock::now();
+    bool ok = reader.ReadAll([&](int, uint64_t, const uint8_t *data, size_t bytes)
+    {
+        uint64_t sum = 0;
+        for (size_t i = 0; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            sum ^= word;
+        }
+        checksum ^= sum;
+        bytes_read += bytes;
+    });
+    auto t2 = Clock::now();
+    if (!ok)
+        return false;
+
+    double seconds = std::chrono::duration<double>(t2 - t1).count();
+    printf("%-10s %12.2f GB/s (%.1f MB in %.3f s, checksum %016llx)\n", use_uring ? "io_uring" : "threads",
+           bytes_read / seconds / 1e9, bytes_read / 1e6, seconds, (unsigned long long)checksum);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Main function
+
+int main(int argc, char **argv)
+{
+#ifdef USE_GFLAGS
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+
+    std::vector<std::string> filenames;
+    std::stringstream list(FLAGS_shards);
+    std::string filename;
+    while (std::getline(list, filename, ','))
+    {
+        if (!filename.empty())
+            filenames.push_back(filename);
+    }
+    for (int i = 1; i < argc; ++i)
+    {
+        if (argv[i][0] != '-')
+            filenames.push_back(argv[i]);
+    }
+
+    // Without input shards, benchmark on freshly written ones
+    const bool created = filenames.empty();
+    if (created && !CreateShards(filenames))
+    {
+        printf("Usage: %s [--create_dir=DIR] [--shards=a,b,...] [shard ...]\n", argv[0]);
+        return 1;
+    }
+
+    printf("Reading %d shards, %d KB blocks, queue depth %d\n", (int)filenames.size(), FLAGS_block_kb, FLAGS_queue_depth);
+    bool ok = RunBenchmark(filenames, true) && RunBenchmark(filenames, false);
+
+    if (created)
+    {
+        for (const std::string& name : filenames)
+            remove(name.c_str());
+    }
+    return ok ? 0 : 2;
+}
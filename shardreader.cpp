@@ -0,0 +1,342 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "shardreader.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+    #include <linux/io_uring.h>
+    #include <sys/syscall.h>
+#endif
+
+static size_t RoundUpTo(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+ShardReader::~ShardReader()
+{
+#ifdef USE_IO_URING
+    if (sqes)
+        munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+#endif
+    for (int fd : fds)
+        close(fd);
+    for (uint8_t *buffer : buffers)
+        free(buffer);
+}
+
+bool ShardReader::Open(const std::vector<std::string>& filenames, size_t block_size_, int queue_depth_, bool use_uring)
+{
+    block_size = RoundUpTo(std::max(block_size_, (size_t)1), SHARD_ALIGNMENT);
+    queue_depth = std::max(queue_depth_, 1);
+
+    for (const std::string& filename : filenames)
+    {
+        // Bypass the page cache where possible (tmpfs and some file systems refuse O_DIRECT)
+        int fd = -1;
+#ifdef O_DIRECT
+        fd = open(filename.c_str(), O_RDONLY | O_DIRECT);
+#endif
+        if (fd < 0)
+            fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            printf("ERROR: Cannot open shard %s\n", filename.c_str());
+            return false;
+        }
+        fds.push_back(fd);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            printf("ERROR: Cannot stat shard %s\n", filename.c_str());
+            return false;
+        }
+        shard_sizes.push_back(st.st_size);
+    }
+
+    for (int i = 0; i < queue_depth; ++i)
+    {
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, SHARD_ALIGNMENT, block_size) != 0)
+        {
+            printf("ERROR: Cannot allocate shard buffers\n");
+            return false;
+        }
+        buffers.push_back(static_cast<uint8_t *>(buffer));
+    }
+
+    if (use_uring && !SetupUring())
+        printf("io_uring unavailable, reading shards with %d threads\n", queue_depth);
+    return true;
+}
+
+uint64_t ShardReader::TotalSize() const
+{
+    uint64_t total = 0;
+    for (uint64_t size : shard_sizes)
+        total += size;
+    return total;
+}
+
+bool ShardReader::ReadAll(const BlockCallback& consume)
+{
+    return UsesUring() ? ReadAllUring(consume) : ReadAllThreads(consume);
+}
+
+bool ShardReader::ReadAllThreads(const BlockCallback& consume)
+{
+    // Blocks are handed out in order through a shared counter
+    std::vector<std::pair<int, uint64_t>> blocks;
+    for (size_t s = 0; s < shard_sizes.size(); ++s)
+        for (uint64_t offset = 0; offset < shard_sizes[s]; offset += block_size)
+            blocks.push_back(std::make_pair((int)s, offset));
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    std::mutex consume_mutex;
+
+    auto worker = [&](uint8_t *buffer)
+    {
+        for (size_t b = next++; b < blocks.size() && ok; b = next++)
+        {
+            const int shard = blocks[b].first;
+            const uint64_t offset = blocks[b].second;
+            const size_t bytes = (size_t)std::min<uint64_t>(block_size, shard_sizes[shard] - offset);
+
+            ssize_t result = pread(fds[shard], buffer, RoundUpTo(bytes, SHARD_ALIGNMENT), offset);
+            if (result != (ssize_t)bytes)
+            {
+                printf("ERROR: Short read from shard %d at offset %llu\n", shard, (unsigned long long)offset);
+                ok = false;
+                return;
+            }
+            std::lock_guard<std::mutex> lock(consume_mutex);
+            consume(shard, offset, buffer, bytes);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < queue_depth; ++i)
+        threads.emplace_back(worker, buffers[i]);
+    for (std::thread& thread : threads)
+        thread.join();
+    return ok;
+}
+
+#ifdef USE_IO_URING
+
+// Ring access with the memory ordering the kernel expects
+#define RING_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static uint32_t *RingField(void *ring, uint32_t offset)
+{
+    return reinterpret_cast<uint32_t *>(static_cast<uint8_t *>(ring) + offset);
+}
+
+bool ShardReader::SetupUring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, queue_depth, &params);
+    if (fd < 0)
+        return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        sq_ring = nullptr;
+        close(fd);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else
+    {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+        {
+            cq_ring = nullptr;
+            close(fd);
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        sqes = nullptr;
+        close(fd);
+        return false;
+    }
+
+    // Register the buffers once, so reads skip the per-I/O page pinning
+    std::vector<struct iovec> iovecs(buffers.size());
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = block_size;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned)iovecs.size()) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    sq_tail_offset = params.sq_off.tail;
+    sq_mask_offset = params.sq_off.ring_mask;
+    sq_array_offset = params.sq_off.array;
+    cq_head_offset = params.cq_off.head;
+    cq_tail_offset = params.cq_off.tail;
+    cq_mask_offset = params.cq_off.ring_mask;
+    cqes_offset = params.cq_off.cqes;
+    ring_fd = fd;
+    return true;
+}
+
+bool ShardReader::ReadAllUring(const BlockCallback& consume)
+{
+    uint32_t *sq_tail = RingField(sq_ring, sq_tail_offset);
+    uint32_t *sq_array = RingField(sq_ring, sq_array_offset);
+    const uint32_t sq_mask = *RingField(sq_ring, sq_mask_offset);
+    uint32_t *cq_head = RingField(cq_ring, cq_head_offset);
+    uint32_t *cq_tail = RingField(cq_ring, cq_tail_offset);
+    const uint32_t cq_mask = *RingField(cq_ring, cq_mask_offset);
+    struct io_uring_cqe *cqes = reinterpret_cast<struct io_uring_cqe *>(static_cast<uint8_t *>(cq_ring) + cqes_offset);
+    struct io_uring_sqe *sqe_array = static_cast<struct io_uring_sqe *>(sqes);
+
+    // Position of the next block to read, and the block each buffer holds
+    size_t shard = 0;
+    uint64_t offset = 0;
+    std::vector<std::pair<int, uint64_t>> pending(buffers.size());
+    std::vector<size_t> expected(buffers.size());
+
+    auto queue_read = [&](int buffer) -> bool
+    {
+        while (shard < shard_sizes.size() && offset >= shard_sizes[shard])
+        {
+            ++shard;
+            offset = 0;
+        }
+        if (shard >= shard_sizes.size())
+            return false;
+
+        const size_t bytes = (size_t)std::min<uint64_t>(block_size, shard_sizes[shard] - offset);
+        pending[buffer] = std::make_pair((int)shard, offset);
+        expected[buffer] = bytes;
+
+        const uint32_t tail = *sq_tail;
+        const uint32_t index = tail & sq_mask;
+        struct io_uring_sqe *sqe = &sqe_array[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fds[shard];
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uint64_t>(buffers[buffer]);
+        sqe->len = (uint32_t)RoundUpTo(bytes, SHARD_ALIGNMENT);
+        sqe->buf_index = (uint16_t)buffer;
+        sqe->user_data = (uint64_t)buffer;
+        sq_array[index] = index;
+        RING_STORE_RELEASE(sq_tail, tail + 1);
+
+        offset += block_size;
+        return true;
+    };
+
+    // Fill the queue
+    unsigned int to_submit = 0, in_flight = 0;
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+        if (!queue_read((int)i))
+            break;
+        ++to_submit;
+    }
+
+    bool ok = true;
+    while (to_submit > 0 || in_flight > 0)
+    {
+        // Submit new reads and wait for at least one completion
+        int submitted = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (submitted < 0)
+        {
+            printf("ERROR: io_uring_enter failed\n");
+            return false;
+        }
+        in_flight += submitted;
+        to_submit -= submitted;
+
+        uint32_t head = *cq_head;
+        while (head != RING_LOAD_ACQUIRE(cq_tail))
+        {
+            const struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+            const int buffer = (int)cqe->user_data;
+            const int result = cqe->res;
+            RING_STORE_RELEASE(cq_head, ++head);
+            --in_flight;
+
+            if (result != (int)expected[buffer])
+            {
+                printf("ERROR: Short read from shard %d at offset %llu\n", pending[buffer].first,
+                       (unsigned long long)pending[buffer].second);
+                ok = false;
+                continue;
+            }
+            consume(pending[buffer].first, pending[buffer].second, buffers[buffer], expected[buffer]);
+
+            // Reuse the buffer for the next block
+            if (ok && queue_read(buffer))
+                ++to_submit;
+        }
+    }
+    return ok;
+}
+
+#else
+
+bool ShardReader::SetupUring()
+{
+    return false;
+}
+
+bool ShardReader::ReadAllUring(const BlockCallback& consume)
+{
+    return ReadAllThreads(consume);
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_SHARDREADER_H
+#define __CUDNN_TRAINING_SHARDREADER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Alignment of read buffers, offsets and sizes (required for O_DIRECT)
+#define SHARD_ALIGNMENT 4096
+
+/**
+ * Asynchronous reader for datasets split into many shard files. Every shard is
+ * read in fixed-size blocks, with up to queue_depth reads in flight, directly
+ * into a set of aligned buffers that are allocated (and, with io_uring,
+ * registered with the kernel) once. Files are opened with O_DIRECT when the
+ * file system supports it.
+ *
+ * The io_uring backend is used when the build has USE_IO_URING and the kernel
+ * supports it; otherwise queue_depth threads issue blocking pread calls.
+ */
+struct ShardReader
+{
+    /// Called for every completed block; the buffer is reused once it returns.
+    typedef std::function<void(int shard, uint64_t offset, const uint8_t *data, size_t bytes)> BlockCallback;
+
+    std::vector<int> fds;
+    std::vector<uint64_t> shard_sizes;
+    size_t block_size;
+    int queue_depth;
+
+    // One aligned buffer per outstanding read
+    std::vector<uint8_t *> buffers;
+
+    // io_uring state (ring_fd < 0 when the thread pool is used)
+    int ring_fd;
+    void *sq_ring, *cq_ring, *sqes;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // Offsets of the ring fields (from io_uring_params)
+    uint32_t sq_tail_offset, sq_mask_offset, sq_array_offset;
+    uint32_t cq_head_offset, cq_tail_offset, cq_mask_offset, cqes_offset;
+
+    ShardReader() : block_size(0), queue_depth(0), ring_fd(-1), sq_ring(nullptr), cq_ring(nullptr),
+                    sqes(nullptr), sq_ring_size(0), cq_ring_size(0), sqes_size(0),
+                    sq_tail_offset(0), sq_mask_offset(0), sq_array_offset(0),
+                    cq_head_offset(0), cq_tail_offset(0), cq_mask_offset(0), cqes_offset(0) {}
+    ~ShardReader();
+
+    // Disable copying
+    ShardReader& operator=(const ShardReader&) = delete;
+    ShardReader(const ShardReader&) = delete;
+
+    /**
+     * Opens the shards and sets up the buffers and (optionally) the ring.
+     *
+     * @param filenames The shard files.
+     * @param block_size_ Bytes per read (rounded up to SHARD_ALIGNMENT).
+     * @param queue_depth_ Number of reads in flight.
+     * @param use_uring Try to use io_uring (false forces the thread pool).
+     * @return True on success.
+     */
+    bool Open(const std::vector<std::string>& filenames, size_t block_size_, int queue_depth_, bool use_uring = true);
+
+    /// True if reads go through io_uring.
+    bool UsesUring() const { return ring_fd >= 0; }
+
+    /// Total size of all shards in bytes.
+    uint64_t TotalSize() const;
+
+    /**
+     * Reads every shard once. Blocks complete (and "consume" is called) in any
+     * order; calls are serialized, but with the thread pool they come from the
+     * worker threads.
+     *
+     * @param consume The block callback.
+     * @return True on success.
+     */
+    bool ReadAll(const BlockCallback& consume);
+
+    bool ReadAllUring(const BlockCallback& consume);
+    bool ReadAllThreads(const BlockCallback& consume);
+    bool SetupUring();
+};
+
+#endif  // __CUDNN_TRAINING_SHARDREADER_H
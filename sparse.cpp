@@ -0,0 +1,119 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sparse.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <algorithm>
+
+void CsrMatrix::FromDense(const float *dense, int rows_, int cols_)
+{
+    rows = rows_;
+    cols = cols_;
+    row_ptr.assign(1, 0);
+    col_idx.clear();
+    values.clear();
+
+    for (int r = 0; r < rows; ++r)
+    {
+        const float *row = dense + (size_t)r * cols;
+        for (int c = 0; c < cols; ++c)
+        {
+            if (row[c] != 0.0f)
+            {
+                col_idx.push_back(c);
+                values.push_back(row[c]);
+            }
+        }
+        row_ptr.push_back(static_cast<uint32_t>(values.size()));
+    }
+}
+
+void CsrMatrix::ToDense(float *dense) const
+{
+    memset(dense, 0, sizeof(float) * rows * cols);
+    for (int r = 0; r < rows; ++r)
+        for (uint32_t k = row_ptr[r]; k < row_ptr[r + 1]; ++k)
+            dense[(size_t)r * cols + col_idx[k]] = values[k];
+}
+
+void PruningMask::Build(const float *weights, size_t count, double sparsity)
+{
+    size = count;
+    size_t keep = count - static_cast<size_t>(std::min(std::max(sparsity, 0.0), 1.0) * count);
+
+    indices.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        indices[i] = static_cast<uint32_t>(i);
+
+    // Select the "keep" largest magnitudes, then restore memory order
+    if (keep < count)
+    {
+        std::nth_element(indices.begin(), indices.begin() + keep, indices.end(),
+                         [weights](uint32_t a, uint32_t b) { return fabsf(weights[a]) > fabsf(weights[b]); });
+        indices.resize(keep);
+        std::sort(indices.begin(), indices.end());
+    }
+}
+
+void PruningMask::FromNonzeros(const float *weights, size_t count)
+{
+    size = count;
+    indices.clear();
+    for (size_t i = 0; i < count; ++i)
+        if (weights[i] != 0.0f)
+            indices.push_back(static_cast<uint32_t>(i));
+}
+
+void PruningMask::ToBytes(std::vector<uint8_t>& bytes) const
+{
+    bytes.assign(size, 0);
+    for (uint32_t i : indices)
+        bytes[i] = 1;
+}
+
+void PruningMask::Gather(const float *dense, float *packed) const
+{
+    for (size_t k = 0; k < indices.size(); ++k)
+        packed[k] = dense[indices[k]];
+}
+
+void PruningMask::Scatter(const float *packed, float *dense) const
+{
+    memset(dense, 0, sizeof(float) * size);
+    for (size_t k = 0; k < indices.size(); ++k)
+        dense[indices[k]] = packed[k];
+}
+
+void PruningMask::Apply(float *dense) const
+{
+    size_t next = 0;
+    for (uint32_t i : indices)
+    {
+        memset(dense + next, 0, sizeof(float) * (i - next));
+        next = i + 1;
+    }
+    memset(dense + next, 0, sizeof(float) * (size - next));
+}
+
+double ScheduledSparsity(int iteration, double target, int begin, int end)
+{
+    if (iteration < begin)
+        return 0.0;
+    if (iteration >= end || end <= begin)
+        return target;
+
+    double remaining = 1.0 - static_cast<double>(iteration - begin) / (end - begin);
+    return target * (1.0 - remaining * remaining * remaining);
+}
@@ -0,0 +1,88 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_SPARSE_H
+#define __CUDNN_TRAINING_SPARSE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/**
+ * A sparse matrix in compressed sparse row (CSR) format.
+ */
+struct CsrMatrix
+{
+    int rows, cols;
+    std::vector<uint32_t> row_ptr;   // rows + 1 entries
+    std::vector<uint32_t> col_idx;   // nnz entries
+    std::vector<float> values;       // nnz entries
+
+    CsrMatrix() : rows(0), cols(0) {}
+
+    /// Builds the matrix from the nonzero entries of a row-major dense matrix.
+    void FromDense(const float *dense, int rows_, int cols_);
+
+    /// Writes the matrix to a row-major dense matrix.
+    void ToDense(float *dense) const;
+
+    size_t nnz() const { return values.size(); }
+};
+
+/**
+ * Magnitude-pruning mask over a flat weight buffer, stored as the sorted
+ * positions of the weights that are kept. The kept positions are all that
+ * needs to travel between ranks for a pruned layer.
+ */
+struct PruningMask
+{
+    size_t size;
+    std::vector<uint32_t> indices;
+
+    PruningMask() : size(0) {}
+
+    /// True once a mask has been built (an inactive mask keeps every weight).
+    bool IsActive() const { return size > 0; }
+
+    /**
+     * Keeps the (1 - sparsity) fraction of weights with the largest magnitude.
+     *
+     * @param weights The weights to prune.
+     * @param count The number of weights.
+     * @param sparsity The fraction of weights to prune, in [0,1].
+     */
+    void Build(const float *weights, size_t count, double sparsity);
+
+    /// Keeps the nonzero weights, e.g., to recover the mask of pruned weights loaded from a checkpoint.
+    void FromNonzeros(const float *weights, size_t count);
+
+    /// Builds a byte mask (1 for kept weights) of "size" entries.
+    void ToBytes(std::vector<uint8_t>& bytes) const;
+
+    /// Packs the kept weights of "dense" into indices.size() values.
+    void Gather(const float *dense, float *packed) const;
+
+    /// Unpacks indices.size() values into "dense", zeroing pruned weights.
+    void Scatter(const float *packed, float *dense) const;
+
+    /// Zeroes the pruned weights of "dense" in place.
+    void Apply(float *dense) const;
+};
+
+/**
+ * Gradual pruning schedule (Zhu & Gupta, 2017): sparsity rises from 0 at
+ * iteration "begin" to "target" at iteration "end" along a cubic curve, pruning
+ * quickly while redundant weights are plentiful and slowly near the target.
+ */
+double ScheduledSparsity(int iteration, double target, int begin, int end);
+
+#endif  // __CUDNN_TRAINING_SPARSE_H
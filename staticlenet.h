@@ -0,0 +1,421 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_STATICLENET_H
+#define __CUDNN_TRAINING_STATICLENET_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+
+#include "cpudispatch.h"
+#include "inference.h"
+
+/*
+ * Compile-time LeNet for single-image inference. Every layer shape is a
+ * template parameter, so all buffer sizes are constants, the scratch buffers
+ * of a forward pass are one statically sized, aligned struct, and the inner
+ * loops (kernel window, output-channel block and register tiles) have
+ * constant bounds and are unrolled at compile time. A forward pass neither
+ * allocates nor branches on data: partial output-channel blocks are computed
+ * into padding instead of being masked, and the pooling windows never cross
+ * the image border.
+ *
+ * The header only depends on the packed-model definitions in inference.h
+ * (and on inference.cpp only if FromPacked is used), so it can be embedded in
+ * other services as-is. Weights use the dense PACKED_BLOCK-wide panel layout
+ * of packed models, always as float. All kernels are CPU_INLINE, so callers
+ * built for a baseline target can compile Forward once per instruction set
+ * with CPU_MULTIVERSION (as lenetserver does).
+ */
+
+/*
+ * One PACKED_BLOCK-wide output-channel block. Fully unrolled loops leave the
+ * auto-vectorizer nothing to work with, so blocks are explicit vectors. On
+ * GCC and Clang, a block is two 16-byte vectors, which every x86-64 target
+ * handles natively (wider vector types are lowered to memory operations on
+ * targets without AVX); other compilers get a plain array.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+    typedef float StaticHalfVector __attribute__((vector_size(4 * sizeof(float))));
+
+    struct StaticVector
+    {
+        StaticHalfVector lo, hi;
+
+        CPU_INLINE float operator[](int j) const { return (j < 4) ? lo[j] : hi[j - 4]; }
+        CPU_INLINE StaticVector& operator+=(const StaticVector& other)
+        {
+            lo += other.lo;
+            hi += other.hi;
+            return *this;
+        }
+        CPU_INLINE StaticVector operator*(float x) const
+        {
+            StaticVector result;
+            result.lo = lo * x;
+            result.hi = hi * x;
+            return result;
+        }
+    };
+#else
+    struct StaticVector
+    {
+        float v[PACKED_BLOCK];
+
+        float operator[](int j) const { return v[j]; }
+        StaticVector& operator+=(const StaticVector& other)
+        {
+            for (int j = 0; j < PACKED_BLOCK; ++j)
+                v[j] += other.v[j];
+            return *this;
+        }
+        StaticVector operator*(float x) const
+        {
+            StaticVector result;
+            for (int j = 0; j < PACKED_BLOCK; ++j)
+                result.v[j] = v[j] * x;
+            return result;
+        }
+    };
+#endif
+
+static_assert(sizeof(StaticVector) == PACKED_BLOCK * sizeof(float), "a vector must hold one block");
+
+static CPU_INLINE StaticVector StaticLoad(const float *src)
+{
+    StaticVector result;
+    memcpy(&result, src, sizeof(result));
+    return result;
+}
+
+/// Calls f(Begin), ..., f(End - 1), unrolled at compile time.
+template <int Begin, int End>
+struct StaticUnroll
+{
+    template <typename F>
+    static CPU_INLINE void Run(const F& f)
+    {
+        f(Begin);
+        StaticUnroll<Begin + 1, End>::Run(f);
+    }
+};
+
+template <int End>
+struct StaticUnroll<End, End>
+{
+    template <typename F>
+    static CPU_INLINE void Run(const F&) {}
+};
+
+/// Number of PACKED_BLOCK-wide output-channel panels for "outputs" channels.
+constexpr int StaticBlocks(int outputs) { return (outputs + PACKED_BLOCK - 1) / PACKED_BLOCK; }
+
+/// Largest of 4, 2 and 1 that divides "value".
+constexpr int StaticTile(int value) { return (value % 4 == 0) ? 4 : ((value % 2 == 0) ? 2 : 1); }
+
+/**
+ * Valid, unit-stride convolution of one C x H x W image into O planes (padded
+ * to whole panels) of (H - K + 1) x (W - K + 1) pixels. Neighboring output
+ * pixels of a row are computed together, so that each weight load feeds
+ * several independent accumulators.
+ */
+template <int C, int H, int W, int O, int K>
+struct StaticConvLayer
+{
+    static constexpr int kOutHeight = H - K + 1, kOutWidth = W - K + 1;
+    static constexpr int kFanIn = C * K * K;
+    static constexpr int kBlocks = StaticBlocks(O);
+    static constexpr int kPixels = StaticTile(kOutWidth);
+
+    /// Output floats, including the padding planes of the last panel.
+    static constexpr int kOutSize = kBlocks * PACKED_BLOCK * kOutHeight * kOutWidth;
+
+    alignas(PACKED_ALIGNMENT) float weights[kBlocks * kFanIn * PACKED_BLOCK];
+    alignas(PACKED_ALIGNMENT) float bias[kBlocks * PACKED_BLOCK];
+
+    CPU_INLINE void Forward(const float *in, float *out) const
+    {
+        for (int ob = 0; ob < kBlocks; ++ob)
+        {
+            const float *panel = weights + ob * kFanIn * PACKED_BLOCK;
+            const float *b = bias + ob * PACKED_BLOCK;
+            float *dst = out + ob * PACKED_BLOCK * kOutHeight * kOutWidth;
+            for (int oy = 0; oy < kOutHeight; ++oy)
+            {
+                for (int ox = 0; ox < kOutWidth; ox += kPixels)
+                {
+                    StaticVector acc[kPixels];
+                    StaticUnroll<0, kPixels>::Run([&](int p) { acc[p] = StaticLoad(b); });
+
+                    for (int c = 0; c < C; ++c)
+                    {
+                        const float *src = in + (c * H + oy) * W + ox;
+                        const float *wc = panel + c * K * K * PACKED_BLOCK;
+                        StaticUnroll<0, K * K>::Run([&](int k)
+                        {
+                            const StaticVector w = StaticLoad(wc + k * PACKED_BLOCK);
+                            const float *xk = src + k / K * W + k % K;
+                            StaticUnroll<0, kPixels>::Run([&](int p) { acc[p] += w * xk[p]; });
+                        });
+                    }
+
+                    for (int j = 0; j < PACKED_BLOCK; ++j)
+                        for (int p = 0; p < kPixels; ++p)
+                            dst[(j * kOutHeight + oy) * kOutWidth + ox + p] = acc[p][j];
+                }
+            }
+        }
+    }
+};
+
+/**
+ * Max pooling of P planes of H x W. Windows that would cross the border are
+ * rejected at compile time, so every window has exactly Size x Size inputs.
+ */
+template <int P, int H, int W, int Size, int Stride>
+struct StaticMaxPoolLayer
+{
+    static constexpr int kOutHeight = H / Stride, kOutWidth = W / Stride;
+    static constexpr int kOutSize = P * kOutHeight * kOutWidth;
+
+    static_assert((kOutHeight - 1) * Stride + Size <= H && (kOutWidth - 1) * Stride + Size <= W,
+                  "pooling windows must lie within the input");
+
+    static CPU_INLINE void Forward(const float *in, float *out)
+    {
+        for (int p = 0; p < P; ++p)
+        {
+            for (int oy = 0; oy < kOutHeight; ++oy)
+            {
+                for (int ox = 0; ox < kOutWidth; ++ox)
+                {
+                    const float *src = in + (p * H + oy * Stride) * W + ox * Stride;
+                    float value = src[0];
+                    StaticUnroll<1, Size * Size>::Run([&](int k) { value = std::max(value, src[k / Size * W + k % Size]); });
+                    out[(p * kOutHeight + oy) * kOutWidth + ox] = value;
+                }
+            }
+        }
+    }
+};
+
+/**
+ * Fully-connected layer of one sample, with an optional ReLU. The output is
+ * padded to whole panels. The reduction is split over kChains interleaved
+ * partial sums, so that consecutive multiply-adds do not wait on each other.
+ */
+template <int Inputs, int Outputs, bool Relu>
+struct StaticFullyConnectedLayer
+{
+    static constexpr int kBlocks = StaticBlocks(Outputs);
+    static constexpr int kOutSize = kBlocks * PACKED_BLOCK;
+    static constexpr int kChains = StaticTile(Inputs);
+
+    alignas(PACKED_ALIGNMENT) float weights[kBlocks * Inputs * PACKED_BLOCK];
+    alignas(PACKED_ALIGNMENT) float bias[kBlocks * PACKED_BLOCK];
+
+    CPU_INLINE void Forward(const float *in, float *out) const
+    {
+        for (int ob = 0; ob < kBlocks; ++ob)
+        {
+            const float *panel = weights + ob * Inputs * PACKED_BLOCK;
+            StaticVector acc[kChains] = {};
+            for (int i = 0; i < Inputs; i += kChains)
+            {
+                StaticUnroll<0, kChains>::Run([&](int c)
+                {
+                    acc[c] += StaticLoad(panel + (i + c) * PACKED_BLOCK) * in[i + c];
+                });
+            }
+
+            for (int j = 0; j < PACKED_BLOCK; ++j)
+            {
+                float value = bias[ob * PACKED_BLOCK + j];
+                for (int c = 0; c < kChains; ++c)
+                    value += acc[c][j];
+                out[ob * PACKED_BLOCK + j] = Relu ? std::max(value, 0.0f) : value;
+            }
+        }
+    }
+};
+
+/**
+ * LeNet (conv, max-pool, conv, max-pool, fully-connected + ReLU,
+ * fully-connected, softmax) with every shape fixed at compile time.
+ */
+template <int Channels, int Height, int Width, int Conv1, int Conv2, int Fc1, int Classes,
+          int Kernel = 5, int PoolSize = 2, int PoolStride = 2>
+struct StaticLeNet
+{
+    typedef StaticConvLayer<Channels, Height, Width, Conv1, Kernel> Conv1Layer;
+    typedef StaticMaxPoolLayer<Conv1, Conv1Layer::kOutHeight, Conv1Layer::kOutWidth, PoolSize, PoolStride> Pool1Layer;
+    typedef StaticConvLayer<Conv1, Pool1Layer::kOutHeight, Pool1Layer::kOutWidth, Conv2, Kernel> Conv2Layer;
+    typedef StaticMaxPoolLayer<Conv2, Conv2Layer::kOutHeight, Conv2Layer::kOutWidth, PoolSize, PoolStride> Pool2Layer;
+    typedef StaticFullyConnectedLayer<Pool2Layer::kOutSize, Fc1, true> Fc1Layer;
+    typedef StaticFullyConnectedLayer<Fc1, Classes, false> Fc2Layer;
+
+    static constexpr int kInputSize = Channels * Height * Width;
+    static constexpr int kClasses = Classes;
+
+    /**
+     * Intermediate activations of one forward pass. Keep it in static,
+     * thread-local or aligned heap storage: it is too large for small stacks.
+     */
+    struct Scratch
+    {
+        alignas(PACKED_ALIGNMENT) float conv1[Conv1Layer::kOutSize];
+        alignas(PACKED_ALIGNMENT) float pool1[Pool1Layer::kOutSize];
+        alignas(PACKED_ALIGNMENT) float conv2[Conv2Layer::kOutSize];
+        alignas(PACKED_ALIGNMENT) float pool2[Pool2Layer::kOutSize];
+        alignas(PACKED_ALIGNMENT) float fc1[Fc1Layer::kOutSize];
+        alignas(PACKED_ALIGNMENT) float fc2[Fc2Layer::kOutSize];
+    };
+
+    Conv1Layer conv1;
+    Conv2Layer conv2;
+    Fc1Layer fc1;
+    Fc2Layer fc2;
+
+    /**
+     * Runs a forward pass of one image.
+     *
+     * @param image Input image, CHW, normalized as during training.
+     * @param result Softmax output, kClasses values.
+     * @param scratch Activations of the pass.
+     */
+    CPU_INLINE void Forward(const float *image, float *result, Scratch& scratch) const
+    {
+        conv1.Forward(image, scratch.conv1);
+        Pool1Layer::Forward(scratch.conv1, scratch.pool1);
+        conv2.Forward(scratch.pool1, scratch.conv2);
+        Pool2Layer::Forward(scratch.conv2, scratch.pool2);
+        fc1.Forward(scratch.pool2, scratch.fc1);
+        fc2.Forward(scratch.fc1, scratch.fc2);
+
+        const float *logits = scratch.fc2;
+        float maxval = logits[0];
+        StaticUnroll<1, Classes>::Run([&](int c) { maxval = std::max(maxval, logits[c]); });
+        float sum = 0.0f;
+        StaticUnroll<0, Classes>::Run([&](int c) { result[c] = expf(logits[c] - maxval); sum += result[c]; });
+        const float inv = 1.0f / sum;
+        StaticUnroll<0, Classes>::Run([&](int c) { result[c] *= inv; });
+    }
+
+    /**
+     * Copies the weights of a packed model with exactly these shapes. Other
+     * weight types are dequantized and CSR layers are expanded, so the static
+     * network always runs dense float kernels.
+     *
+     * @param model The packed model.
+     * @return False if the model's shapes differ from the template parameters.
+     */
+    bool FromPacked(const PackedLeNet& model)
+    {
+        const PackedLeNetHeader& h = *model.header;
+        if (h.channels != Channels || h.height != Height || h.width != Width ||
+            h.pool_size != PoolSize || h.pool_stride != PoolStride ||
+            !MatchLayer(h.layers[0], Channels, Conv1, Kernel, Width, Height) ||
+            !MatchLayer(h.layers[1], Conv1, Conv2, Kernel, Pool1Layer::kOutWidth, Pool1Layer::kOutHeight) ||
+            !MatchLayer(h.layers[2], Pool2Layer::kOutSize, Fc1, 1, 1, 1) ||
+            !MatchLayer(h.layers[3], Fc1, Classes, 1, 1, 1))
+        {
+            printf("ERROR: Packed model shapes do not match the static network\n");
+            return false;
+        }
+
+        UnpackLayer(model, h.layers[0], conv1.weights, conv1.bias);
+        UnpackLayer(model, h.layers[1], conv2.weights, conv2.bias);
+        UnpackLayer(model, h.layers[2], fc1.weights, fc1.bias);
+        UnpackLayer(model, h.layers[3], fc2.weights, fc2.bias);
+        return true;
+    }
+
+private:
+    static bool MatchLayer(const PackedLayerHeader& layer, int inputs, int outputs, int kernel_size,
+                           int in_width, int in_height)
+    {
+        return (int)layer.inputs == inputs && (int)layer.outputs == outputs && (int)layer.kernel_size == kernel_size &&
+               (int)layer.in_width == in_width && (int)layer.in_height == in_height;
+    }
+
+    static float LoadWeight(const uint8_t *weights, uint32_t type, size_t index)
+    {
+        switch (type)
+        {
+        case PACKED_BFLOAT16:
+        {
+            uint16_t w;
+            memcpy(&w, weights + index * sizeof(uint16_t), sizeof(w));
+            const uint32_t bits = (uint32_t)w << 16;
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        case PACKED_INT8:
+            return static_cast<float>(reinterpret_cast<const int8_t *>(weights)[index]);
+        default:
+        {
+            float value;
+            memcpy(&value, weights + index * sizeof(float), sizeof(value));
+            return value;
+        }
+        }
+    }
+
+    /// Writes a layer into dense float panels, zeroing the padding outputs.
+    static void UnpackLayer(const PackedLeNet& model, const PackedLayerHeader& layer, float *weights, float *bias)
+    {
+        const uint8_t *base = model.mapping;
+        const uint8_t *packed = base + layer.weights_offset;
+        const float *pbias = reinterpret_cast<const float *>(base + layer.bias_offset);
+        const float *scale = layer.scale_offset ? reinterpret_cast<const float *>(base + layer.scale_offset) : nullptr;
+        const int O = layer.outputs;
+        const size_t fan_in = (size_t)layer.inputs * layer.kernel_size * layer.kernel_size;
+        const size_t padded = (size_t)StaticBlocks(O) * PACKED_BLOCK;
+
+        memset(weights, 0, sizeof(float) * padded * fan_in);
+        memset(bias, 0, sizeof(float) * padded);
+        auto dst = [&](int o, size_t i) -> float& { return weights[((size_t)(o / PACKED_BLOCK) * fan_in + i) * PACKED_BLOCK + o % PACKED_BLOCK]; };
+
+        if (layer.format == PACKED_CSR)
+        {
+            const uint32_t *row_ptr = reinterpret_cast<const uint32_t *>(base + layer.index_offset);
+            const uint32_t *col_idx = row_ptr + O + 1;
+            for (int o = 0; o < O; ++o)
+                for (uint32_t k = row_ptr[o]; k < row_ptr[o + 1]; ++k)
+                    dst(o, col_idx[k]) = LoadWeight(packed, model.header->weight_type, k);
+        }
+        else
+        {
+            // Same panel layout as the packed model
+            for (size_t k = 0; k < padded * fan_in; ++k)
+                weights[k] = LoadWeight(packed, model.header->weight_type, k);
+        }
+
+        for (int o = 0; o < O; ++o)
+        {
+            bias[o] = pbias[o];
+            if (scale)
+                for (size_t i = 0; i < fan_in; ++i)
+                    dst(o, i) *= scale[o];
+        }
+    }
+};
+
+/// The MNIST LeNet that trainlenet trains and exports.
+typedef StaticLeNet<1, 28, 28, 20, 50, 500, 10> StaticMnistLeNet;
+
+#endif  // __CUDNN_TRAINING_STATICLENET_H
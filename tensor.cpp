@@ -0,0 +1,312 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "tensor.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <utility>
+
+#include <cuda_runtime.h>
+
+#ifdef _WIN32
+    #include <malloc.h>
+#endif
+
+// Exits on a failed CUDA call; tensors never continue with a broken buffer
+#define checkTensorCuda(call, what) do {                                           \
+    cudaError_t _status = (call);                                                  \
+    if (_status != cudaSuccess) {                                                  \
+        printf("ERROR: %s failed (Cuda failure: %d)\n", (what), (int)_status);     \
+        exit(1);                                                                   \
+    }                                                                              \
+} while(0)
+
+size_t TensorTypeSize(TensorType type)
+{
+    switch (type)
+    {
+    case TENSOR_UINT8:
+        return sizeof(uint8_t);
+    case TENSOR_UINT32:
+        return sizeof(uint32_t);
+    default:
+        return sizeof(float);
+    }
+}
+
+const char *TensorTypeName(TensorType type)
+{
+    switch (type)
+    {
+    case TENSOR_UINT8:
+        return "uint8";
+    case TENSOR_UINT32:
+        return "uint32";
+    default:
+        return "float";
+    }
+}
+
+Tensor::Tensor() : m_device(TENSOR_HOST), m_type(TENSOR_FLOAT), m_rank(0), m_count(0), m_data(nullptr), m_owner(true)
+{
+}
+
+Tensor::Tensor(TensorDevice device, TensorType type, std::initializer_list<size_t> shape) :
+    m_device(device), m_type(type), m_rank((int)shape.size()), m_count(1), m_data(nullptr), m_owner(true)
+{
+    if (shape.size() > TENSOR_MAX_DIMS)
+    {
+        printf("ERROR: Tensors have at most %d dimensions (got %d)\n", TENSOR_MAX_DIMS, (int)shape.size());
+        exit(1);
+    }
+
+    // Row-major strides, the last dimension being contiguous
+    int i = 0;
+    for (size_t dim : shape)
+        m_shape[i++] = dim;
+    for (i = m_rank - 1; i >= 0; --i)
+    {
+        m_strides[i] = m_count;
+        m_count *= m_shape[i];
+    }
+    Allocate();
+}
+
+Tensor::~Tensor()
+{
+    Release();
+}
+
+Tensor::Tensor(Tensor&& other) : Tensor()
+{
+    *this = std::move(other);
+}
+
+Tensor& Tensor::operator=(Tensor&& other)
+{
+    if (this != &other)
+    {
+        Release();
+        m_device = other.m_device;
+        m_type = other.m_type;
+        m_rank = other.m_rank;
+        memcpy(m_shape, other.m_shape, sizeof(m_shape));
+        memcpy(m_strides, other.m_strides, sizeof(m_strides));
+        m_count = other.m_count;
+        m_data = other.m_data;
+        m_owner = other.m_owner;
+
+        // Leave the source empty, so that it frees nothing
+        other.m_rank = 0;
+        other.m_count = 0;
+        other.m_data = nullptr;
+        other.m_owner = true;
+    }
+    return *this;
+}
+
+void Tensor::Allocate()
+{
+    if (m_count == 0)
+        return;
+
+    const size_t bytes = Bytes();
+    if (m_device == TENSOR_GPU)
+    {
+        // cudaMalloc returns storage aligned to at least 256 bytes
+        checkTensorCuda(cudaMalloc(&m_data, bytes), "GPU tensor allocation");
+        return;
+    }
+
+#ifdef _WIN32
+    m_data = _aligned_malloc(bytes, TENSOR_ALIGNMENT);
+#else
+    if (posix_memalign(&m_data, TENSOR_ALIGNMENT, bytes) != 0)
+        m_data = nullptr;
+#endif
+    if (!m_data)
+    {
+        printf("ERROR: Cannot allocate %llu bytes of host memory for a tensor\n", (unsigned long long)bytes);
+        exit(1);
+    }
+}
+
+void Tensor::Release()
+{
+    if (m_owner && m_data)
+    {
+        if (m_device == TENSOR_GPU)
+            cudaFree(m_data);
+        else
+        {
+#ifdef _WIN32
+            _aligned_free(m_data);
+#else
+            free(m_data);
+#endif
+        }
+    }
+    m_data = nullptr;
+}
+
+void Tensor::CheckType(TensorType type) const
+{
+    if (type != m_type)
+    {
+        printf("ERROR: Accessing a %s tensor as %s\n", TensorTypeName(m_type), TensorTypeName(type));
+        exit(1);
+    }
+}
+
+Tensor Tensor::EmptyLike(TensorDevice device) const
+{
+    Tensor result;
+    result.m_device = device;
+    result.m_type = m_type;
+    result.m_rank = m_rank;
+    memcpy(result.m_shape, m_shape, sizeof(m_shape));
+    memcpy(result.m_strides, m_strides, sizeof(m_strides));
+    result.m_count = m_count;
+    result.Allocate();
+    return result;
+}
+
+Tensor Tensor::Clone(TensorDevice device) const
+{
+    Tensor result = EmptyLike(device);
+    result.CopyFrom(*this);
+    return result;
+}
+
+Tensor Tensor::View() const
+{
+    Tensor result;
+    result.m_device = m_device;
+    result.m_type = m_type;
+    result.m_rank = m_rank;
+    memcpy(result.m_shape, m_shape, sizeof(m_shape));
+    memcpy(result.m_strides, m_strides, sizeof(m_strides));
+    result.m_count = m_count;
+    result.m_data = m_data;
+    result.m_owner = false;
+    return result;
+}
+
+Tensor Tensor::View(size_t offset, std::initializer_list<size_t> shape) const
+{
+    Tensor result;
+    result.m_device = m_device;
+    result.m_type = m_type;
+    result.m_rank = (int)shape.size();
+    if (shape.size() > TENSOR_MAX_DIMS)
+    {
+        printf("ERROR: Tensors have at most %d dimensions (got %d)\n", TENSOR_MAX_DIMS, (int)shape.size());
+        exit(1);
+    }
+
+    int i = 0;
+    for (size_t dim : shape)
+        result.m_shape[i++] = dim;
+    result.m_count = 1;
+    for (i = result.m_rank - 1; i >= 0; --i)
+    {
+        result.m_strides[i] = result.m_count;
+        result.m_count *= result.m_shape[i];
+    }
+    if (offset > m_count || result.m_count > m_count - offset)
+    {
+        printf("ERROR: View of %llu elements at offset %llu exceeds a tensor of %llu elements\n",
+               (unsigned long long)result.m_count, (unsigned long long)offset, (unsigned long long)m_count);
+        exit(1);
+    }
+
+    result.m_data = m_data ? static_cast<char *>(m_data) + offset * TensorTypeSize(m_type) : nullptr;
+    result.m_owner = false;
+    return result;
+}
+
+Tensor Tensor::Slice(size_t begin, size_t end) const
+{
+    if (m_rank == 0 || begin > end || end > m_shape[0])
+    {
+        printf("ERROR: Slice [%llu, %llu) is out of range\n", (unsigned long long)begin, (unsigned long long)end);
+        exit(1);
+    }
+
+    Tensor result = View();
+    result.m_shape[0] = end - begin;
+    result.m_count = (end - begin) * m_strides[0];
+    result.m_data = m_data ? static_cast<char *>(m_data) + begin * m_strides[0] * TensorTypeSize(m_type) : nullptr;
+    return result;
+}
+
+bool Tensor::IsAligned(size_t alignment) const
+{
+    return reinterpret_cast<uintptr_t>(m_data) % alignment == 0;
+}
+
+void Tensor::CopyFrom(const Tensor& src)
+{
+    if (src.m_type != m_type || src.m_count != m_count)
+    {
+        printf("ERROR: Copying a %s tensor of %llu elements into a %s tensor of %llu elements\n",
+               TensorTypeName(src.m_type), (unsigned long long)src.m_count,
+               TensorTypeName(m_type), (unsigned long long)m_count);
+        exit(1);
+    }
+    if (m_count == 0 || src.m_data == m_data)
+        return;
+
+    cudaMemcpyKind kind;
+    if (src.m_device == TENSOR_GPU)
+        kind = (m_device == TENSOR_GPU) ? cudaMemcpyDeviceToDevice : cudaMemcpyDeviceToHost;
+    else
+        kind = (m_device == TENSOR_GPU) ? cudaMemcpyHostToDevice : cudaMemcpyHostToHost;
+
+    if (kind == cudaMemcpyHostToHost)
+        memcpy(m_data, src.m_data, Bytes());
+    else
+        checkTensorCuda(cudaMemcpy(m_data, src.m_data, Bytes(), kind), "Tensor copy");
+}
+
+void Tensor::CopyFromHost(const void *src)
+{
+    if (m_count == 0)
+        return;
+    if (m_device == TENSOR_GPU)
+        checkTensorCuda(cudaMemcpy(m_data, src, Bytes(), cudaMemcpyHostToDevice), "Tensor upload");
+    else
+        memcpy(m_data, src, Bytes());
+}
+
+void Tensor::CopyToHost(void *dst) const
+{
+    if (m_count == 0)
+        return;
+    if (m_device == TENSOR_GPU)
+        checkTensorCuda(cudaMemcpy(dst, m_data, Bytes(), cudaMemcpyDeviceToHost), "Tensor download");
+    else
+        memcpy(dst, m_data, Bytes());
+}
+
+void Tensor::Zero()
+{
+    if (m_count == 0)
+        return;
+    if (m_device == TENSOR_GPU)
+        checkTensorCuda(cudaMemset(m_data, 0, Bytes()), "Tensor clear");
+    else
+        memset(m_data, 0, Bytes());
+}
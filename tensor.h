@@ -0,0 +1,149 @@
+/*
+ * This code is released into the public domain.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CUDNN_TRAINING_TENSOR_H
+#define __CUDNN_TRAINING_TENSOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+/// Alignment of owned host storage in bytes: a cache line, and the widest SIMD register
+#define TENSOR_ALIGNMENT 64
+
+/// Maximum number of dimensions of a tensor
+#define TENSOR_MAX_DIMS 4
+
+/// Memory a tensor lives in.
+enum TensorDevice
+{
+    TENSOR_HOST = 0,
+    TENSOR_GPU = 1,
+};
+
+/// Element type of a tensor.
+enum TensorType
+{
+    TENSOR_FLOAT = 0,
+    TENSOR_UINT8 = 1,
+    TENSOR_UINT32 = 2,
+};
+
+/// Returns the size of an element of "type" in bytes.
+size_t TensorTypeSize(TensorType type);
+
+/// Returns a printable name of "type".
+const char *TensorTypeName(TensorType type);
+
+/// Maps a C++ element type to its TensorType.
+template<typename T> struct TensorTypeOf;
+template<> struct TensorTypeOf<float>    { static const TensorType value = TENSOR_FLOAT; };
+template<> struct TensorTypeOf<uint8_t>  { static const TensorType value = TENSOR_UINT8; };
+template<> struct TensorTypeOf<uint32_t> { static const TensorType value = TENSOR_UINT32; };
+
+/**
+ * A dense, row-major tensor of up to TENSOR_MAX_DIMS dimensions in host or
+ * GPU memory.
+ *
+ * A tensor either owns its storage, which is freed with it, or is a view of
+ * (part of) another tensor's storage, which must outlive the view. Tensors
+ * are move-only, so every buffer has exactly one owner and no copy can free
+ * it twice. Owned host storage starts on a TENSOR_ALIGNMENT boundary, so SIMD
+ * kernels may use aligned loads on it; IsAligned() tells whether a view keeps
+ * that guarantee.
+ *
+ * Allocation failures and misuse (element type mismatches, out-of-range views,
+ * copies between tensors of different sizes) are fatal: they print an error
+ * and exit, rather than leaving a null or mis-sized buffer behind.
+ */
+class Tensor
+{
+public:
+    /// An empty tensor (no elements, no storage).
+    Tensor();
+
+    /// Allocates an uninitialized tensor of the given shape (outermost dimension first).
+    Tensor(TensorDevice device, TensorType type, std::initializer_list<size_t> shape);
+
+    ~Tensor();
+
+    Tensor(Tensor&& other);
+    Tensor& operator=(Tensor&& other);
+
+    // Disable copying (use CopyFrom)
+    Tensor(const Tensor&) = delete;
+    Tensor& operator=(const Tensor&) = delete;
+
+    /// Allocates an uninitialized tensor with the type and shape of this one on "device".
+    Tensor EmptyLike(TensorDevice device) const;
+
+    /// Allocates a copy of this tensor on "device".
+    Tensor Clone(TensorDevice device) const;
+
+    /// Returns a non-owning view of the whole tensor.
+    Tensor View() const;
+
+    /**
+     * Returns a non-owning view of "count(shape)" consecutive elements,
+     * starting "offset" elements into this tensor.
+     */
+    Tensor View(size_t offset, std::initializer_list<size_t> shape) const;
+
+    /// Returns a non-owning view of entries [begin, end) of the outermost dimension.
+    Tensor Slice(size_t begin, size_t end) const;
+
+    TensorDevice Device() const { return m_device; }
+    TensorType Type() const { return m_type; }
+    int Rank() const { return m_rank; }
+    size_t Dim(int i) const { return m_shape[i]; }
+    size_t Stride(int i) const { return m_strides[i]; }
+    size_t Count() const { return m_count; }
+    size_t Bytes() const { return m_count * TensorTypeSize(m_type); }
+    bool Empty() const { return m_count == 0; }
+    bool IsView() const { return !m_owner; }
+
+    /// Returns true if the data starts on an "alignment"-byte boundary.
+    bool IsAligned(size_t alignment = TENSOR_ALIGNMENT) const;
+
+    /// Returns the elements, which must be of type T.
+    template<typename T>
+    T *Data() const
+    {
+        CheckType(TensorTypeOf<T>::value);
+        return static_cast<T *>(m_data);
+    }
+
+    /// Copies "src", which must have the same type and element count, between any devices.
+    void CopyFrom(const Tensor& src);
+
+    /// Copies Count() elements from/to host memory.
+    void CopyFromHost(const void *src);
+    void CopyToHost(void *dst) const;
+
+    /// Sets all elements to zero.
+    void Zero();
+
+private:
+    void Allocate();
+    void Release();
+    void CheckType(TensorType type) const;
+
+    TensorDevice m_device;
+    TensorType m_type;
+    int m_rank;
+    size_t m_shape[TENSOR_MAX_DIMS], m_strides[TENSOR_MAX_DIMS];
+    size_t m_count;
+    void *m_data;
+    bool m_owner;
+};
+
+#endif  // __CUDNN_TRAINING_TENSOR_H